@@ -0,0 +1,306 @@
+#define _GNU_SOURCE    // recvmmsg/sendmmsg
+#include "batch_io.h"
+#include <errno.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+
+#define CONTROL_SIZE CMSG_SPACE(sizeof(int))
+
+int dgram_batch_init(dgram_batch_t *b, size_t capacity, size_t buf_size) {
+    memset(b, 0, sizeof(*b));
+    b->capacity = capacity;
+    b->buf_size = buf_size;
+    b->data = malloc(capacity * buf_size);
+    b->msgs = calloc(capacity, sizeof(*b->msgs));
+    b->iovs = calloc(capacity, sizeof(*b->iovs));
+    b->addrs = calloc(capacity, sizeof(*b->addrs));
+    b->control = calloc(capacity, CONTROL_SIZE);
+    b->pkts = calloc(capacity, sizeof(*b->pkts));
+    b->pkt_data = calloc(capacity, sizeof(*b->pkt_data));
+    b->pkt_len = calloc(capacity, sizeof(*b->pkt_len));
+    b->pkt_addr = calloc(capacity, sizeof(*b->pkt_addr));
+    if (!b->data || !b->msgs || !b->iovs || !b->addrs || !b->control || !b->pkts || !b->pkt_data || !b->pkt_len || !b->pkt_addr) {
+        dgram_batch_free(b);
+        return -1;
+    }
+    return 0;
+}
+
+void dgram_batch_free(dgram_batch_t *b) {
+    free(b->data);
+    free(b->msgs);
+    free(b->iovs);
+    free(b->addrs);
+    free(b->control);
+    free(b->pkts);
+    free(b->pkt_data);
+    free(b->pkt_len);
+    free(b->pkt_addr);
+    memset(b, 0, sizeof(*b));
+}
+
+int dgram_batch_enable_gso(dgram_batch_t *b, int sock) {
+    // Setting a zero segment size is a no-op that fails on kernels
+    // without UDP GSO, so it doubles as a probe
+    int zero = 0;
+    if (setsockopt(sock, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) < 0) {
+        return -1;
+    }
+    b->gso = true;
+    return 0;
+}
+
+int dgram_batch_enable_gro(dgram_batch_t *b, int sock) {
+    size_t packets = b->capacity * GSO_MAX_SEGMENTS;
+    uint8_t *data = malloc(b->capacity * GRO_BUFFER_SIZE);
+    uint8_t **pkt_data = calloc(packets, sizeof(*pkt_data));
+    size_t *pkt_len = calloc(packets, sizeof(*pkt_len));
+    struct sockaddr_in **pkt_addr = calloc(packets, sizeof(*pkt_addr));
+    int one = 1;
+
+    if (!data || !pkt_data || !pkt_len || !pkt_addr || setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+        free(data);
+        free(pkt_data);
+        free(pkt_len);
+        free(pkt_addr);
+        return -1;
+    }
+
+    free(b->data);
+    free(b->pkt_data);
+    free(b->pkt_len);
+    free(b->pkt_addr);
+    b->data = data;
+    b->buf_size = GRO_BUFFER_SIZE;
+    b->pkt_data = pkt_data;
+    b->pkt_len = pkt_len;
+    b->pkt_addr = pkt_addr;
+    b->gro = true;
+    return 0;
+}
+
+size_t dgram_gro_segment_size(struct msghdr *msg) {
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(c), sizeof(size));
+            return size > 0 ? (size_t)size : 0;
+        }
+    }
+    return 0;
+}
+
+int dgram_batch_recv(int sock, dgram_batch_t *b, batch_stats_t *stats) {
+    uint8_t *buf;
+    for (size_t i = 0; i < b->capacity; i++) {
+        buf = b->data + i * b->buf_size;
+        b->iovs[i].iov_base = buf;
+        b->iovs[i].iov_len = b->buf_size;
+        memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+        if (b->gro) {
+            b->msgs[i].msg_hdr.msg_control = b->control + i * CONTROL_SIZE;
+            b->msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+        }
+    }
+
+    b->count = 0;
+    b->nmsgs = 0;
+    int n;
+    do {
+        // A connected socket reports an ICMP "fragmentation needed" for
+        // an earlier send on the next call; path MTU probing does without
+        n = recvmmsg(sock, b->msgs, b->capacity, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EMSGSIZE);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    b->nmsgs = n;
+
+    // Split coalesced datagrams back into the packets the peer sent
+    for (int i = 0; i < n; i++) {
+        size_t len = b->msgs[i].msg_len;
+        size_t seg = b->gro ? dgram_gro_segment_size(&b->msgs[i].msg_hdr) : 0;
+        if (seg == 0 || seg >= len) seg = len;
+
+        buf = b->data + i * b->buf_size;
+        size_t segments = 0;
+        for (size_t off = 0; off < len; off += seg) {
+            b->pkt_data[b->count] = buf + off;
+            b->pkt_len[b->count] = len - off < seg ? len - off : seg;
+            b->pkt_addr[b->count] = &b->addrs[i];
+            b->count++;
+            segments++;
+        }
+        if (stats && segments > 1) {
+            metric_add(&stats->super_buffers, 1);
+            metric_add(&stats->segments, segments);
+        }
+    }
+
+    if (stats && n > 0) {
+        metric_add(&stats->calls, 1);
+        metric_add(&stats->packets, b->count);
+    }
+    return (int)b->count;
+}
+
+uint8_t *dgram_batch_next(dgram_batch_t *b) {
+    return b->count < b->capacity ? b->data + b->count * b->buf_size : NULL;
+}
+
+static void queue_iov(dgram_batch_t *b, uint8_t *data, size_t len, const struct sockaddr_in *addr) {
+    size_t i = b->count++;
+    b->iovs[i].iov_base = data;
+    b->iovs[i].iov_len = len;
+    if (addr) {
+        b->addrs[i] = *addr;
+    } else {
+        b->addrs[i].sin_family = AF_UNSPEC;
+    }
+}
+
+void dgram_batch_commit(dgram_batch_t *b, size_t len, const struct sockaddr_in *addr) {
+    b->pkts[b->count] = NULL;
+    queue_iov(b, b->data + b->count * b->buf_size, len, addr);
+}
+
+int dgram_batch_queue(dgram_batch_t *b, pktbuf_t *pkt, const struct sockaddr_in *addr) {
+    if (b->count == b->capacity) return -1;
+    pktbuf_ref(pkt);
+    b->pkts[b->count] = pkt;
+    queue_iov(b, pkt->data, pkt->len, addr);
+    return 0;
+}
+
+// Drop the references held by queued packet buffers and empty the batch
+static void release_queued(dgram_batch_t *b) {
+    for (size_t i = 0; i < b->count; i++) {
+        if (b->pkts[i]) pktbuf_put(b->pkts[i]);
+    }
+    b->count = 0;
+}
+
+static bool same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_family == b->sin_family && a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// Build the sendmmsg vector for queued datagrams [first, count). With GSO,
+// a run of datagrams to one peer where all but the last have the same
+// length becomes a single message with a UDP_SEGMENT control message.
+// first_of[m] records the first datagram of message m.
+static size_t build_messages(dgram_batch_t *b, size_t first, size_t *first_of) {
+    size_t nmsgs = 0;
+    size_t i = first;
+    while (i < b->count) {
+        size_t seg = b->iovs[i].iov_len;
+        size_t total = seg;
+        size_t j = i + 1;
+        if (b->gso) {
+            while (j < b->count && j - i < GSO_MAX_SEGMENTS && same_peer(&b->addrs[j], &b->addrs[i])
+                   && b->iovs[j].iov_len <= seg && total + b->iovs[j].iov_len <= GSO_MAX_BYTES) {
+                total += b->iovs[j].iov_len;
+                j++;
+                if (b->iovs[j - 1].iov_len < seg) break;    // a short segment ends the run
+            }
+        }
+
+        struct msghdr *h = &b->msgs[nmsgs].msg_hdr;
+        memset(h, 0, sizeof(*h));
+        h->msg_iov = &b->iovs[i];
+        h->msg_iovlen = j - i;
+        if (b->addrs[i].sin_family != AF_UNSPEC) {
+            h->msg_name = &b->addrs[i];
+            h->msg_namelen = sizeof(b->addrs[i]);
+        }
+        if (j - i > 1) {
+            char *control = b->control + nmsgs * CONTROL_SIZE;
+            memset(control, 0, CONTROL_SIZE);
+            h->msg_control = control;
+            h->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            struct cmsghdr *c = CMSG_FIRSTHDR(h);
+            c->cmsg_level = SOL_UDP;
+            c->cmsg_type = UDP_SEGMENT;
+            c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gso_size = (uint16_t)seg;
+            memcpy(CMSG_DATA(c), &gso_size, sizeof(gso_size));
+        }
+        first_of[nmsgs++] = i;
+        i = j;
+    }
+    first_of[nmsgs] = b->count;
+    return nmsgs;
+}
+
+int dgram_batch_flush(int sock, dgram_batch_t *b, batch_stats_t *stats) {
+    size_t first_of[MAX_BATCH_SIZE + 1];
+    size_t done = 0;    // datagrams sent so far
+    int unreachable = 0;
+
+    while (done < b->count) {
+        size_t nmsgs = build_messages(b, done, first_of);
+        int n = sendmmsg(sock, b->msgs, nmsgs, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (b->gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+                // The device or path refused segmentation offload
+                log_warn("UDP GSO rejected (%s), falling back to single datagrams\n", strerror(errno));
+                b->gso = false;
+                continue;
+            }
+            if (errno == EMSGSIZE) {
+                // Larger than the interface now allows: drop it (path MTU
+                // probing notices) and send the rest
+                done = first_of[1];
+                continue;
+            }
+            if (errno == ENETUNREACH || errno == EHOSTUNREACH || errno == ENETDOWN || errno == EADDRNOTAVAIL) {
+                // No route to this one's destination (or from our address):
+                // the others may go elsewhere, or another way
+                unreachable = errno;
+                done = first_of[1];
+                continue;
+            }
+            release_queued(b);
+            return -1;
+        }
+
+        size_t sent = first_of[n] - done;
+        if (stats) {
+            metric_add(&stats->calls, 1);
+            metric_add(&stats->packets, sent);
+            for (int m = 0; m < n; m++) {
+                size_t segments = first_of[m + 1] - first_of[m];
+                if (segments > 1) {
+                    metric_add(&stats->super_buffers, 1);
+                    metric_add(&stats->segments, segments);
+                }
+            }
+        }
+        done += sent;
+    }
+
+    size_t total = b->count;
+    release_queued(b);
+    if (unreachable) {
+        errno = unreachable;
+        return -1;
+    }
+    return (int)total;
+}
+
+double batch_stats_average(const batch_stats_t *stats) {
+    uint64_t calls = metric_get(&stats->calls);
+    return calls ? (double)metric_get(&stats->packets) / calls : 0.0;
+}
+
+double batch_stats_segments(const batch_stats_t *stats) {
+    uint64_t super_buffers = metric_get(&stats->super_buffers);
+    return super_buffers ? (double)metric_get(&stats->segments) / super_buffers : 0.0;
+}
@@ -0,0 +1,105 @@
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "metrics.h"
+#include "pktbuf.h"
+
+#define DEFAULT_BATCH_SIZE 32    // datagrams per recvmmsg/sendmmsg
+#define MAX_BATCH_SIZE 1024
+
+// UDP offload limits (see UDP_MAX_SEGMENTS in the kernel)
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
+#define GRO_BUFFER_SIZE 65535
+
+// A set of datagram buffers sent or received with one syscall.
+//
+// Send side: each queued datagram has its own slot, length and peer
+// address, or references a pktbuf_t that is released after the flush.
+// With GSO enabled, flush() merges runs of equal-sized datagrams to the
+// same peer into one UDP_SEGMENT super-buffer.
+//
+// Receive side: with GRO enabled each slot may hold several coalesced
+// datagrams; recv() splits them so callers always see single packets.
+typedef struct {
+    size_t capacity;
+    size_t count;          // tx: datagrams queued; rx: packets after GRO split
+    size_t nmsgs;          // rx: datagrams returned by recvmmsg
+    size_t buf_size;
+    uint8_t *data;         // capacity * buf_size bytes
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_in *addrs;
+    char *control;         // per-message cmsg space for UDP_SEGMENT/UDP_GRO
+    pktbuf_t **pkts;       // tx: packet buffer queued in each slot, or NULL
+
+    // Packet view of a received batch
+    uint8_t **pkt_data;
+    size_t *pkt_len;
+    struct sockaddr_in **pkt_addr;
+
+    bool gso;
+    bool gro;
+} dgram_batch_t;
+
+int dgram_batch_init(dgram_batch_t *b, size_t capacity, size_t buf_size);
+void dgram_batch_free(dgram_batch_t *b);
+
+// Turn on UDP_SEGMENT for flushes of this batch. Returns -1 (and leaves
+// GSO off) if the kernel or socket does not support it.
+int dgram_batch_enable_gso(dgram_batch_t *b, int sock);
+
+// Turn on UDP_GRO on the socket and grow slots to hold coalesced
+// datagrams. Returns -1 (and leaves GRO off) if unsupported.
+int dgram_batch_enable_gro(dgram_batch_t *b, int sock);
+
+// Receive up to capacity datagrams without blocking. Returns the number
+// of packets available (0 if none were waiting) or -1 on error.
+int dgram_batch_recv(int sock, dgram_batch_t *b, batch_stats_t *stats);
+
+static inline uint8_t *dgram_batch_pkt(const dgram_batch_t *b, size_t i) {
+    return b->pkt_data[i];
+}
+
+static inline size_t dgram_batch_pkt_len(const dgram_batch_t *b, size_t i) {
+    return b->pkt_len[i];
+}
+
+static inline struct sockaddr_in *dgram_batch_pkt_addr(const dgram_batch_t *b, size_t i) {
+    return b->pkt_addr[i];
+}
+
+// Segment size the kernel reported (UDP_GRO cmsg) for a coalesced
+// datagram received with msg, or 0
+size_t dgram_gro_segment_size(struct msghdr *msg);
+
+// True if the last recv filled every slot, i.e. more may be waiting
+static inline bool dgram_batch_recv_full(const dgram_batch_t *b) {
+    return b->nmsgs == b->capacity;
+}
+
+// Queue the next free slot for sending. addr may be NULL on a connected
+// socket. Returns the slot buffer to fill, or NULL if the batch is full.
+uint8_t *dgram_batch_next(dgram_batch_t *b);
+void dgram_batch_commit(dgram_batch_t *b, size_t len, const struct sockaddr_in *addr);
+
+// Queue a datagram sent straight from pkt, taking a reference that the
+// flush drops. pkt must be pool owned. Returns -1 if the batch is full.
+int dgram_batch_queue(dgram_batch_t *b, pktbuf_t *pkt, const struct sockaddr_in *addr);
+
+// Send every queued datagram, retrying partial sendmmsg results, and
+// empty the batch. Falls back to plain datagrams if GSO is refused, and
+// drops those the interface MTU no longer allows. Those with no route
+// are dropped too, the rest sent, and then -1 returned with the error.
+// Returns the number of datagrams sent or -1 on error.
+int dgram_batch_flush(int sock, dgram_batch_t *b, batch_stats_t *stats);
+
+double batch_stats_average(const batch_stats_t *stats);
+double batch_stats_segments(const batch_stats_t *stats);
+
+#endif
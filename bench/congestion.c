@@ -0,0 +1,172 @@
+// Congestion control on an emulated link. A sender with unlimited data
+// and a receiver run in one process on a virtual clock, connected by a
+// bottleneck with a given rate, round-trip time, drop-tail queue and
+// random loss. The receiver acknowledges from its replay window through
+// encoded ACK frames, exactly as the tunnel endpoints do, and the sender
+// runs the tunnel's loss recovery, pacer and congestion controller.
+//
+// Reports goodput, link drops, queueing delay and the final window for
+// each controller in each scenario.
+//
+// Usage: bench/congestion [seconds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../recovery.h"
+
+#define MSS 1400
+#define MAX_IN_TRANSIT 65536    // packets and ACKs on the wire at once
+
+typedef struct {
+    const char *name;
+    double rate_mbit;
+    double rtt_ms;
+    double queue_bdp;           // bottleneck buffer, in bandwidth-delay products
+    double loss;                // random loss probability per data packet
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    { "100 Mbit/s, 20 ms, 1 BDP buffer", 100, 20, 1, 0 },
+    { "100 Mbit/s, 20 ms, 1 BDP buffer, 1% loss", 100, 20, 1, 0.01 },
+    { "10 Mbit/s, 100 ms, 0.2 BDP buffer, 0.1% loss", 10, 100, 0.2, 0.001 },
+    { "1 Gbit/s, 2 ms, 4 BDP buffer", 1000, 2, 4, 0 },
+};
+
+typedef struct {
+    uint64_t pn;
+    uint64_t sent_ns;
+    uint64_t arrive_ns;
+} data_t;
+
+typedef struct {
+    uint8_t frame[FRAME_ACK_MAX];
+    size_t len;
+    uint64_t arrive_ns;
+} ack_t;
+
+typedef struct {
+    uint64_t goodput_bytes;
+    uint64_t dropped, random_lost, sent;
+    double queue_delay_ns;      // summed over delivered packets
+    uint64_t delivered;
+} result_t;
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static double random_unit(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void run(const scenario_t *s, const congestion_ops_t *ops, uint64_t duration_ns, result_t *res, recovery_t *r) {
+    static data_t data[MAX_IN_TRANSIT];
+    static ack_t acks[MAX_IN_TRANSIT];
+    size_t data_head = 0, data_count = 0, ack_head = 0, ack_count = 0;
+
+    double bytes_per_ns = s->rate_mbit * 1e6 / 8 / 1e9;
+    uint64_t one_way_ns = (uint64_t)(s->rtt_ms * 1e6 / 2);
+    uint64_t queue_limit = (uint64_t)(s->queue_bdp * bytes_per_ns * s->rtt_ms * 1e6);
+    if (queue_limit < 2 * MSS) queue_limit = 2 * MSS;
+
+    replay_window_t window;
+    ack_state_t ack_state = {0};
+    replay_init(&window);
+    recovery_init(r, ops, MSS);
+    memset(res, 0, sizeof(*res));
+
+    uint64_t now = 0, link_free_ns = 0, next_pn = 1, retry_ns = 0;
+    while (now < duration_ns) {
+        // Sender: as much as the window and the pacer allow
+        while (now >= retry_ns && recovery_can_send(r, MSS, now, &retry_ns)) {
+            recovery_on_sent(r, next_pn, MSS, now, true);
+            res->sent++;
+            uint64_t pn = next_pn++;
+            if (random_unit() < s->loss) {
+                res->random_lost++;
+                continue;
+            }
+            // Drop-tail bottleneck: the queue is what the link has yet to send
+            uint64_t start = link_free_ns > now ? link_free_ns : now;
+            if ((start - now) * bytes_per_ns + MSS > queue_limit || data_count == MAX_IN_TRANSIT) {
+                res->dropped++;
+                continue;
+            }
+            link_free_ns = start + (uint64_t)(MSS / bytes_per_ns);
+            data[(data_head + data_count++) % MAX_IN_TRANSIT] = (data_t){ pn, now, link_free_ns + one_way_ns };
+        }
+
+        // Receiver: packets arriving now, acknowledged as the tunnel does
+        while (data_count > 0 && data[data_head].arrive_ns <= now) {
+            data_t *d = &data[data_head];
+            data_head = (data_head + 1) % MAX_IN_TRANSIT;
+            data_count--;
+            bool largest = !window.initialized || d->pn > window.largest;
+            if (!replay_update(&window, d->pn)) continue;
+            ack_state_on_received(&ack_state, true, largest, now);
+            res->goodput_bytes += MSS;
+            res->delivered++;
+            res->queue_delay_ns += now - d->sent_ns - one_way_ns - (uint64_t)(MSS / bytes_per_ns);
+        }
+        uint64_t ack_due = ack_state_due(&ack_state);
+        if (ack_due && ack_due <= now && ack_count < MAX_IN_TRANSIT) {
+            ack_t *a = &acks[(ack_head + ack_count) % MAX_IN_TRANSIT];
+            a->len = ack_state_take(&ack_state, &window, now, a->frame, sizeof(a->frame));
+            a->arrive_ns = now + one_way_ns;
+            if (a->len > 0) ack_count++;
+            ack_due = ack_state_due(&ack_state);
+        }
+
+        // Sender: ACKs arriving now, parsed off the wire
+        while (ack_count > 0 && acks[ack_head].arrive_ns <= now) {
+            ack_t *a = &acks[ack_head];
+            ack_head = (ack_head + 1) % MAX_IN_TRANSIT;
+            ack_count--;
+            size_t off = 0;
+            frame_t frame;
+            ack_frame_t ack;
+            if (frame_next(a->frame, a->len, &off, &frame) == 1 && frame_decode_ack(&frame, &ack) == 0) {
+                recovery_on_ack(r, &ack, now);
+                retry_ns = 0;
+            }
+        }
+
+        // Jump to the next thing that happens
+        uint64_t next = duration_ns;
+        if (retry_ns > now && retry_ns < next) next = retry_ns;
+        if (retry_ns <= now) next = now;
+        if (data_count > 0 && data[data_head].arrive_ns < next) next = data[data_head].arrive_ns;
+        if (ack_count > 0 && acks[ack_head].arrive_ns < next) next = acks[ack_head].arrive_ns;
+        if (ack_due && ack_due < next) next = ack_due;
+        now = next > now ? next : now + 1;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 10;
+    if (seconds <= 0) {
+        fprintf(stderr, "Usage: %s [seconds]\n", argv[0]);
+        return 1;
+    }
+    uint64_t duration_ns = (uint64_t)(seconds * 1e9);
+    const congestion_ops_t *controllers[] = { &congestion_newreno, &congestion_bbr };
+
+    printf("%.0f s per run, %d byte datagrams\n", seconds, MSS);
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        const scenario_t *s = &scenarios[i];
+        printf("\n%s\n", s->name);
+        printf("  %-8s %10s %8s %8s %10s %10s %10s\n", "cc", "goodput", "util", "drops", "queue", "srtt", "cwnd");
+        for (size_t j = 0; j < sizeof(controllers) / sizeof(controllers[0]); j++) {
+            result_t res;
+            recovery_t r;
+            run(s, controllers[j], duration_ns, &res, &r);
+            double mbit = res.goodput_bytes * 8 / seconds / 1e6;
+            printf("  %-8s %5.1f Mbit/s %7.1f%% %7.2f%% %7.2f ms %7.2f ms %7.1f KB\n", controllers[j]->name, mbit,
+                100 * mbit / s->rate_mbit, res.sent ? 100.0 * res.dropped / res.sent : 0.0,
+                res.delivered ? res.queue_delay_ns / res.delivered / 1e6 : 0.0, r.smoothed_rtt_ns / 1e6, r.cc.cwnd / 1e3);
+            recovery_free(&r);
+        }
+    }
+    return 0;
+}
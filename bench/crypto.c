@@ -0,0 +1,145 @@
+// AEAD engines for the tunnel keys (see crypto.h): bytes per cycle and
+// Gbit/s for each engine and packet size, sealing one packet per call,
+// sealing batches the way the send path does (crypto_seal_batch over a
+// sendmmsg batch of distinct buffers) and opening. Packets carry an
+// 11-byte header as associated data, like the client's (connection ID
+// and a 2-byte packet number).
+//
+// Cycles are TSC ticks on x86, so they track wall time rather than the
+// core clock; on other CPUs only Gbit/s is reported.
+//
+// Usage: bench/crypto [megabytes per case]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <picotls/openssl.h>
+#ifdef HAVE_FUSION
+#include <picotls/fusion.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+#include "../crypto.h"
+
+#define BATCH 32
+#define HEADER_LEN 11
+#define TAG_MAX 16
+
+typedef struct {
+    const char *name;
+    ptls_aead_algorithm_t *aead;
+    ptls_hash_algorithm_t *hash;
+    bool fusion;
+} engine_t;
+
+static const engine_t engines[] = {
+    { "openssl aes128gcm", &ptls_openssl_aes128gcm, &ptls_openssl_sha256, false },
+    { "openssl aes256gcm", &ptls_openssl_aes256gcm, &ptls_openssl_sha384, false },
+#ifdef PTLS_OPENSSL_HAVE_CHACHA20_POLY1305
+    { "openssl chacha20", &ptls_openssl_chacha20poly1305, &ptls_openssl_sha256, false },
+#endif
+#ifdef HAVE_FUSION
+    { "fusion aes128gcm", &ptls_fusion_aes128gcm, &ptls_openssl_sha256, true },
+    { "fusion aes256gcm", &ptls_fusion_aes256gcm, &ptls_openssl_sha384, true },
+#endif
+};
+
+static const size_t sizes[] = { 64, 256, 576, 1280, 1452 };
+
+typedef enum { SEAL, SEAL_BATCH, OPEN } op_t;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long cycles(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Run one case over about total bytes of packets; reports bytes per
+// cycle and Gbit/s of cleartext
+static void run(const engine_t *e, size_t size, op_t op, size_t total, double *bytes_per_cycle, double *gbit) {
+    uint8_t secret[PTLS_MAX_DIGEST_SIZE] = {1};
+    ptls_aead_context_t *enc = ptls_aead_new(e->aead, e->hash, 1, secret, "vpn ");
+    ptls_aead_context_t *dec = ptls_aead_new(e->aead, e->hash, 0, secret, "vpn ");
+    size_t slot = HEADER_LEN + size + TAG_MAX;
+    uint8_t *bufs = calloc(BATCH, slot);
+    uint8_t *sealed = calloc(BATCH, slot);
+    uint8_t *out = malloc(slot);
+    crypto_seal_t ops[BATCH];
+
+    // Ciphertexts to open, one per slot
+    for (size_t i = 0; i < BATCH; i++) {
+        uint8_t *p = sealed + i * slot;
+        memset(p, (int)i, HEADER_LEN + size);
+        ptls_aead_encrypt(enc, p + HEADER_LEN, p + HEADER_LEN, size, i, p, HEADER_LEN);
+    }
+
+    size_t rounds = total / (size * BATCH) + 1, failed = 0;
+    uint64_t pn = 0;
+    double start_ns = now_ns();
+    unsigned long long start = cycles();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < BATCH; i++, pn++) {
+            uint8_t *p = bufs + i * slot;
+            if (op == SEAL) {
+                ptls_aead_encrypt(enc, p + HEADER_LEN, p + HEADER_LEN, size, pn, p, HEADER_LEN);
+            } else if (op == SEAL_BATCH) {
+                ops[i] = (crypto_seal_t){ enc, p + HEADER_LEN, size, pn, p, HEADER_LEN };
+            } else {
+                uint8_t *s = sealed + i * slot;
+                if (ptls_aead_decrypt(dec, out, s + HEADER_LEN, size + e->aead->tag_size, i, s, HEADER_LEN) != size) failed++;
+            }
+        }
+        if (op == SEAL_BATCH) crypto_seal_batch(ops, BATCH);
+    }
+    unsigned long long elapsed = cycles() - start;
+    double bytes = (double)rounds * BATCH * size;
+    *gbit = bytes * 8 / (now_ns() - start_ns);
+    *bytes_per_cycle = elapsed ? bytes / elapsed : 0;
+    if (failed) fprintf(stderr, "%s: %zu packets failed\n", e->name, failed);
+
+    free(out);
+    free(sealed);
+    free(bufs);
+    ptls_aead_free(enc);
+    ptls_aead_free(dec);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [megabytes per case]\n", argv[0]);
+        return 1;
+    }
+    size_t total = (argc > 1 ? strtoul(argv[1], NULL, 10) : 256) << 20;
+    printf("CPU: AES %s, fusion %s; tunnel suites in order:", crypto_cpu_has_aes() ? "yes" : "no",
+           crypto_fusion_available() ? "yes" : "no");
+    for (ptls_cipher_suite_t **s = crypto_cipher_suites(); *s; s++) {
+        printf(" %s (%s)", (*s)->name, crypto_engine_name(crypto_aead(*s)));
+    }
+    printf("\n%zu MB per case, batches of %d packets%s\n\n", total >> 20, BATCH, cycles() ? "" : ", no cycle counter");
+
+    printf("%-18s %6s %20s %20s %20s\n", "engine", "bytes", "seal", "seal batch", "open");
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        const engine_t *e = &engines[i];
+        if (e->fusion && !crypto_fusion_available()) continue;
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            printf("%-18s %6zu", e->name, sizes[j]);
+            for (op_t op = SEAL; op <= OPEN; op++) {
+                double per_cycle, gbit;
+                run(e, sizes[j], op, total, &per_cycle, &gbit);
+                printf("   %5.2f B/c %5.1f Gb/s", per_cycle, gbit);
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,396 @@
+// TCP through the tunnel over a lossy link, without FEC and with it. The
+// tunnel's FEC sender and receiver run on a virtual clock with real
+// payloads: each inner packet goes out as a source (and joins a group),
+// repairs follow once a group is full or has been open an eighth of the
+// RTT, and the receiver rebuilds what it can. Its loss reports reach the
+// sender a one-way delay later, which picks the code from them.
+//
+// The link carries RATE_MBIT with the tunnel's queue of QUEUE_PACKETS in
+// front, and drops each datagram at the given rate on the way; packets
+// the full queue drops never get a packet number, so FEC does not take
+// them for losses on the link. Behind the tunnel,
+// one TCP-like sender (Reno: slow start, then one packet more per round
+// trip, half the window on a loss) sends bulk data. It detects loss as
+// RACK does: a packet is lost once one sent after it was acknowledged
+// and a quarter of the RTT has passed since it should have been, and
+// all that is outstanding times out after RTO_NS without an ACK. ACKs
+// come back over a lossless path.
+//
+// Reports, for each loss rate with FEC off and adaptive: goodput, how
+// long data took from its first send to in-order delivery at the 50th
+// and 99th percentile, the datagrams lost and not rebuilt, TCP
+// retransmissions, repair bytes against source bytes, and the code in
+// use at the end.
+//
+// Usage: bench/fec [seconds]
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../fec.h"
+#include "../frame.h"
+
+#define RATE_MBIT 50
+#define ONE_WAY_NS 20000000ULL
+#define RTT_NS (2 * ONE_WAY_NS)
+#define STEP_NS 20000ULL              // one event loop wakeup
+#define WARMUP_NS 2000000000ULL
+#define QUEUE_PACKETS 256             // about a round trip at RATE_MBIT
+#define INNER_LEN 1200                // TCP segment, headers included
+#define MAX_PAYLOAD (INNER_LEN + FEC_OVERHEAD)
+#define OVERHEAD 57                   // IP, UDP, tunnel header and AEAD tag on the wire
+#define RTO_NS 200000000ULL
+#define RACK_STEP_NS 1000000ULL       // how often RACK looks without new ACKs
+#define WIRE 4096                     // datagrams on the way, at most
+#define EVENTS 65536
+
+static const double losses[] = { 0, 0.01, 0.05, 0.10 };
+
+// A tunnel datagram: a source carrying an inner packet, or a repair
+typedef struct {
+    uint64_t arrive_ns;
+    uint64_t pn;
+    bool repair, tagged, lost;        // tagged: a source in a group
+    size_t len;
+    uint8_t data[MAX_PAYLOAD];
+} datagram_t;
+
+// ACKs and loss reports on their way back to the sender
+typedef struct {
+    uint64_t due_ns;
+    uint64_t id;                      // transmission acknowledged
+    bool report;
+    uint8_t frame[FRAME_FEC_LEN];
+} event_t;
+
+typedef struct {
+    uint32_t *ns;
+    size_t count, cap;
+} samples_t;
+
+// The inner sender's transmissions, and its view of them
+typedef struct {
+    uint64_t seq, sent_ns;
+    enum { OUTSTANDING, ACKED, LOST } state;
+} transmission_t;
+
+// Inner packets wait for the link in the tunnel's queue, and are dropped
+// there when it is full, before they get a packet number (as the
+// coalescer drops them); repairs go ahead of them
+static uint64_t backlog[QUEUE_PACKETS];
+static size_t backlog_head, backlog_count;
+static datagram_t repairs[FEC_MAX_REPAIRS];
+static size_t nrepairs, next_repair;
+static datagram_t wire[WIRE];         // on the way
+static size_t wire_head, wire_count;
+static uint64_t link_free_ns;
+static event_t events[EVENTS];
+static size_t event_head, event_count;
+
+static transmission_t *tx;
+static size_t ntx, tx_cap, first_outstanding;
+static uint64_t *retransmit, *first_sent_ns;
+static uint8_t *delivered;
+static size_t nretransmit, retransmit_cap, seq_cap, delivered_cap;
+static samples_t latency;
+
+static void record(samples_t *s, uint64_t ns) {
+    if (s->count == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 65536;
+        s->ns = realloc(s->ns, s->cap * sizeof(*s->ns));
+    }
+    s->ns[s->count++] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(samples_t *s, double p) {
+    if (s->count == 0) return 0;
+    size_t i = (size_t)(p * s->count);
+    return s->ns[i < s->count ? i : s->count - 1] / 1e6;
+}
+
+static void *grow(void *p, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap) return p;
+    size_t old = *cap;
+    while (*cap < need) *cap = *cap ? 2 * *cap : 65536;
+    p = realloc(p, *cap * size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset((uint8_t *)p + old * size, 0, (*cap - old) * size);
+    return p;
+}
+
+static void push_event(event_t e) {
+    if (event_count < EVENTS) events[(event_head + event_count++) % EVENTS] = e;
+}
+
+typedef struct {
+    double loss;
+    fec_tx_t *fec_tx;                 // NULL with FEC off
+    fec_rx_t *fec_rx;
+    fec_stats_t stats;
+    uint64_t pn;
+    uint64_t source_bytes, repair_bytes, sources, lost_sources;
+} tunnel_t;
+
+// A datagram onto the link, which the caller found free: numbered, and
+// on its way unless the link loses it
+static datagram_t *transmit(tunnel_t *t, size_t len, uint64_t now_ns) {
+    datagram_t *d = &wire[(wire_head + wire_count++) % WIRE];
+    d->pn = ++t->pn;
+    d->len = len;
+    link_free_ns = (link_free_ns > now_ns ? link_free_ns : now_ns) + (uint64_t)((len + OVERHEAD) * 8e3 / RATE_MBIT);
+    d->arrive_ns = link_free_ns + ONE_WAY_NS;
+    d->lost = (double)rand() / RAND_MAX < t->loss;
+    return d;
+}
+
+// The open group's repairs, to go out next
+static void take_repairs(tunnel_t *t, uint64_t now_ns) {
+    unsigned n = fec_tx_repairs(t->fec_tx);
+    nrepairs = next_repair = 0;
+    for (unsigned row = 0; row < n; row++) {
+        datagram_t *d = &repairs[nrepairs++];
+        d->len = fec_tx_repair(t->fec_tx, row, d->data, sizeof(d->data), &t->stats);
+        if (now_ns >= WARMUP_NS) t->repair_bytes += d->len;
+    }
+    fec_tx_close(t->fec_tx);
+}
+
+// An inner packet from the sender into the tunnel's queue
+static void tunnel_send(uint64_t id) {
+    if (backlog_count < QUEUE_PACKETS) backlog[(backlog_head + backlog_count++) % QUEUE_PACKETS] = id;
+}
+
+// The next inner packet in the queue as a source datagram (it starts
+// with a STREAM frame's type, as tunnel payloads do), and the group's
+// repairs if that filled it
+static void send_source(tunnel_t *t, uint64_t now_ns) {
+    uint64_t id = backlog[backlog_head];
+    backlog_head = (backlog_head + 1) % QUEUE_PACKETS;
+    backlog_count--;
+    uint8_t base[PKTBUF_HEADROOM + MAX_PAYLOAD];
+    pktbuf_t pkt = { .base = base, .data = base + PKTBUF_HEADROOM, .size = sizeof(base) };
+    memset(pkt.data, 0xab, INNER_LEN);
+    pkt.data[0] = FRAME_STREAM;
+    memcpy(pkt.data + 1, &id, 8);
+    pkt.len = INNER_LEN;
+    bool source = t->fec_tx && fec_tx_source(t->fec_tx, &pkt, t->pn + 1, MAX_PAYLOAD, now_ns, &t->stats);
+    datagram_t *d = transmit(t, pkt.len, now_ns);
+    memcpy(d->data, pkt.data, pkt.len);
+    d->repair = false;
+    d->tagged = source;
+    if (now_ns >= WARMUP_NS) {
+        t->sources++;
+        t->source_bytes += pkt.len;
+    }
+    if (source && fec_tx_due(t->fec_tx, RTT_NS) <= now_ns) take_repairs(t, now_ns);
+}
+
+// An inner packet reaches TUN at the far end: acknowledge it, and move
+// the in-order point
+static void deliver(const uint8_t *inner, uint64_t now_ns, uint64_t *next_inorder, uint64_t *goodput_bytes) {
+    uint64_t id;
+    memcpy(&id, inner + 1, 8);
+    push_event((event_t){ .due_ns = now_ns + ONE_WAY_NS, .id = id });
+    uint64_t seq = tx[id].seq;
+    delivered[seq] = 1;
+    while (*next_inorder < delivered_cap && delivered[*next_inorder]) {
+        if (now_ns >= WARMUP_NS) {
+            record(&latency, now_ns - first_sent_ns[*next_inorder]);
+            *goodput_bytes += INNER_LEN;
+        }
+        (*next_inorder)++;
+    }
+}
+
+// Datagrams onto the link while it is free, repairs first, and off it
+// once they arrive
+static void run_link(tunnel_t *t, uint64_t now_ns, uint64_t *next_inorder, uint64_t *goodput_bytes) {
+    for (;;) {
+        // Repairs of a group that has been open long enough
+        uint64_t due = t->fec_tx && next_repair == nrepairs ? fec_tx_due(t->fec_tx, RTT_NS) : 0;
+        if (due != 0 && due <= now_ns) take_repairs(t, now_ns);
+        if (link_free_ns > now_ns || wire_count == WIRE) break;
+        if (next_repair < nrepairs) {
+            datagram_t *r = &repairs[next_repair++];
+            datagram_t *d = transmit(t, r->len, now_ns);
+            memcpy(d->data, r->data, r->len);
+            d->repair = true;
+            d->tagged = false;
+        } else if (backlog_count > 0) {
+            send_source(t, now_ns);
+        } else {
+            break;
+        }
+    }
+    while (wire_count > 0 && wire[wire_head].arrive_ns <= now_ns) {
+        datagram_t *d = &wire[wire_head];
+        wire_head = (wire_head + 1) % WIRE;
+        wire_count--;
+        if (d->lost) {
+            if (!d->repair && now_ns >= WARMUP_NS) t->lost_sources++;
+            continue;
+        }
+        bool rebuilt = t->fec_rx && fec_rx_on_packet(t->fec_rx, d->pn, d->data, d->len);
+        if (d->repair) {
+            size_t off = 0;
+            frame_t f;
+            if (frame_next(d->data, d->len, &off, &f) == 1 && fec_rx_on_repair(t->fec_rx, &f, &t->stats)) rebuilt = true;
+        } else {
+            deliver(d->data + (d->tagged ? FRAME_FEC_SOURCE_LEN : 0), now_ns, next_inorder, goodput_bytes);
+        }
+        if (rebuilt) {
+            uint8_t out[MAX_PAYLOAD];
+            uint64_t pn;
+            size_t len;
+            while ((len = fec_rx_take(t->fec_rx, &pn, out, sizeof(out))) > 0) {
+                if (now_ns >= WARMUP_NS && t->lost_sources > 0) {
+                    metric_add(&t->stats.recovered, 1);
+                    t->lost_sources--;
+                }
+                deliver(out + FRAME_FEC_SOURCE_LEN, now_ns, next_inorder, goodput_bytes);
+            }
+        }
+    }
+    if (t->fec_rx) {
+        event_t e = { .due_ns = now_ns + ONE_WAY_NS, .report = true };
+        if (fec_rx_take_report(t->fec_rx, now_ns, e.frame, sizeof(e.frame)) > 0) push_event(e);
+    }
+}
+
+static void run(double loss, bool fec, uint64_t duration_ns) {
+    tunnel_t t = { .loss = loss };
+    if (fec) {
+        t.fec_tx = fec_tx_new(MAX_PAYLOAD);
+        t.fec_rx = fec_rx_new(MAX_PAYLOAD);
+        if (!t.fec_tx || !t.fec_rx) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    srand(1);
+    backlog_head = backlog_count = nrepairs = next_repair = 0;
+    wire_head = wire_count = 0;
+    link_free_ns = 0;
+    event_head = event_count = 0;
+    ntx = first_outstanding = nretransmit = 0;
+    if (delivered) memset(delivered, 0, delivered_cap);
+    latency.count = 0;
+
+    double cwnd = 2, ssthresh = 1e9;
+    uint64_t inflight = 0, next_seq = 0, next_inorder = 0, goodput_bytes = 0, retransmissions = 0;
+    uint64_t rtt_ns = RTT_NS, rack_sent_ns = 0, recovery_until_ns = 0, last_ack_ns = 0, rack_ns = 0;
+    for (uint64_t now = STEP_NS; now < duration_ns; now += STEP_NS) {
+        // ACKs and reports due by now
+        bool acked = false;
+        while (event_count > 0 && events[event_head].due_ns <= now) {
+            event_t *e = &events[event_head];
+            event_head = (event_head + 1) % EVENTS;
+            event_count--;
+            if (e->report) {
+                size_t off = 0;
+                frame_t f;
+                if (frame_next(e->frame, sizeof(e->frame), &off, &f) == 1) fec_tx_on_report(t.fec_tx, &f);
+                continue;
+            }
+            transmission_t *x = &tx[e->id];
+            last_ack_ns = now;
+            if (x->state != OUTSTANDING) continue;
+            x->state = ACKED;
+            inflight--;
+            acked = true;
+            rtt_ns = now - x->sent_ns;
+            if (x->sent_ns > rack_sent_ns) rack_sent_ns = x->sent_ns;
+            if (now >= recovery_until_ns) cwnd += cwnd < ssthresh ? 1 : 1 / cwnd;
+        }
+
+        // RACK: lost if sent before one acknowledged, and overdue by a
+        // quarter of the RTT
+        if (acked || now >= rack_ns) {
+            rack_ns = now + RACK_STEP_NS;
+            bool lost = false;
+            for (size_t i = first_outstanding; i < ntx && tx[i].sent_ns < rack_sent_ns; i++) {
+                if (tx[i].state != OUTSTANDING || now < tx[i].sent_ns + rtt_ns + rtt_ns / 4) continue;
+                tx[i].state = LOST;
+                inflight--;
+                retransmit = grow(retransmit, &retransmit_cap, nretransmit + 1, sizeof(*retransmit));
+                retransmit[nretransmit++] = tx[i].seq;
+                lost = true;
+            }
+            if (lost && now >= recovery_until_ns) {
+                cwnd = ssthresh = cwnd / 2 > 2 ? cwnd / 2 : 2;
+                recovery_until_ns = now + rtt_ns;
+            }
+            while (first_outstanding < ntx && tx[first_outstanding].state != OUTSTANDING) first_outstanding++;
+        }
+        // Nothing heard for too long: everything outstanding is lost
+        if (inflight > 0 && now - last_ack_ns > RTO_NS) {
+            for (size_t i = first_outstanding; i < ntx; i++) {
+                if (tx[i].state != OUTSTANDING) continue;
+                tx[i].state = LOST;
+                retransmit = grow(retransmit, &retransmit_cap, nretransmit + 1, sizeof(*retransmit));
+                retransmit[nretransmit++] = tx[i].seq;
+            }
+            first_outstanding = ntx;
+            inflight = 0;
+            ssthresh = cwnd / 2 > 2 ? cwnd / 2 : 2;
+            cwnd = 2;
+            last_ack_ns = now;
+        }
+
+        // As much as the window allows, retransmissions first
+        while (inflight < (uint64_t)cwnd) {
+            uint64_t seq;
+            if (nretransmit > 0) {
+                seq = retransmit[0];
+                memmove(retransmit, retransmit + 1, --nretransmit * sizeof(*retransmit));
+                if (now >= WARMUP_NS) retransmissions++;
+            } else {
+                seq = next_seq++;
+                first_sent_ns = grow(first_sent_ns, &seq_cap, next_seq, sizeof(*first_sent_ns));
+                delivered = grow(delivered, &delivered_cap, next_seq, 1);
+                first_sent_ns[seq] = now;
+            }
+            tx = grow(tx, &tx_cap, ntx + 1, sizeof(*tx));
+            tx[ntx] = (transmission_t){ seq, now, OUTSTANDING };
+            tunnel_send(ntx++);
+            inflight++;
+        }
+        run_link(&t, now, &next_inorder, &goodput_bytes);
+    }
+
+    qsort(latency.ns, latency.count, sizeof(*latency.ns), compare_u32);
+    double seconds = (duration_ns - WARMUP_NS) / 1e9;
+    char code[16] = "-";
+    if (fec && t.fec_tx->r > 0) snprintf(code, sizeof(code), "%u/%u", t.fec_tx->r, t.fec_tx->k);
+    printf("%5.0f%% %-9s %8.1f %8.1f %8.1f %8.3f%% %8llu %8.1f%% %6s\n", loss * 100, fec ? "adaptive" : "off",
+        goodput_bytes * 8 / seconds / 1e6, percentile_ms(&latency, 0.5), percentile_ms(&latency, 0.99),
+        t.sources ? 100.0 * t.lost_sources / t.sources : 0, (unsigned long long)retransmissions,
+        t.source_bytes ? 100.0 * t.repair_bytes / t.source_bytes : 0, code);
+    fec_tx_free(t.fec_tx);
+    fec_rx_free(t.fec_rx);
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 20;
+    if (seconds <= WARMUP_NS / 1e9) {
+        fprintf(stderr, "Usage: %s [seconds, more than %.0f]\n", argv[0], WARMUP_NS / 1e9);
+        return 1;
+    }
+    printf("%.0f s per run, %d Mbit/s, %.0f ms round trip, %d-packet queue; latency in ms from first send to in-order delivery, after %.0f s of warmup\n\n",
+        seconds, RATE_MBIT, RTT_NS / 1e6, QUEUE_PACKETS, WARMUP_NS / 1e9);
+    printf("%6s %-9s %8s %8s %8s %9s %8s %9s %6s\n", "loss", "FEC", "Mbit/s", "p50", "p99", "residual", "retrans",
+        "repairs", "r/k");
+    for (size_t l = 0; l < sizeof(losses) / sizeof(losses[0]); l++) {
+        run(losses[l], false, (uint64_t)(seconds * 1e9));
+        run(losses[l], true, (uint64_t)(seconds * 1e9));
+    }
+    return 0;
+}
@@ -0,0 +1,225 @@
+// The coalescer's per-peer queues on emulated links. One worker's
+// coalescer runs on a virtual clock with its real scheduler; its send
+// callback stands in for the congestion controller and pacer, letting
+// each peer's datagrams out at the rate of that peer's path. Behind the
+// tunnel, TCP-like senders (Reno: slow start, then one packet more per
+// round trip, half the window on a loss) keep the bulk peers' queues
+// full, and interactive flows send a small packet every 10 ms:
+//
+//   peer 0      bulk download and an interactive session (e.g. SSH)
+//   peers 1-3   bulk downloads
+//   peer 4      interactive only
+//
+// Reports, with CoDel off (the queue fills to its limit before anything
+// is dropped) and on: bulk goodput, how long packets waited in the
+// coalescer at the 50th and 99th percentile for each kind of traffic,
+// and the packets dropped for a full queue and by CoDel.
+//
+// Usage: bench/fq [seconds]
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../coalesce.h"
+#include "../frame.h"
+
+#define PEERS 5
+#define RATE_MBIT 20              // each peer's path
+#define RTT_NS 20000000ULL
+#define STEP_NS 10000ULL          // one event loop wakeup
+#define WARMUP_NS 2000000000ULL
+#define MAX_DATAGRAM 1452
+#define OVERHEAD 28               // IP and UDP headers on the wire
+#define BULK_LEN 1280
+#define INTERACTIVE_LEN 100
+#define INTERACTIVE_GAP_NS 10000000ULL
+#define STREAM_BULK 1
+#define STREAM_INTERACTIVE 2
+#define ACKS 65536
+
+enum { BULK, INTERACTIVE_WITH_BULK, INTERACTIVE_ALONE, KINDS };
+
+// Packets the sender hears about one round trip after they left the
+// coalescer
+typedef struct {
+    uint64_t due_ns;
+    uint32_t acked, lost;
+} ack_t;
+
+typedef struct {
+    bool bulk, interactive;
+    uint64_t link_free_ns;
+    double cwnd, ssthresh;
+    uint64_t inflight, next_seq, expected_seq;
+    uint64_t recovery_until_ns, last_ack_ns;
+    ack_t acks[ACKS];
+    size_t ack_head, ack_count;
+    uint64_t next_interactive_ns;
+    uint64_t delivered_bytes;
+} peer_t;
+
+typedef struct {
+    uint32_t *ns;
+    size_t count, cap;
+} samples_t;
+
+static peer_t peers[PEERS];
+static samples_t waits[KINDS];
+
+static void record(samples_t *s, uint64_t ns) {
+    if (s->count == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 65536;
+        s->ns = realloc(s->ns, s->cap * sizeof(*s->ns));
+    }
+    s->ns[s->count++] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(samples_t *s, double p) {
+    if (s->count == 0) return 0;
+    size_t i = (size_t)(p * s->count);
+    return s->ns[i < s->count ? i : s->count - 1] / 1e6;
+}
+
+static void push_ack(peer_t *p, uint64_t due_ns, uint32_t acked, uint32_t lost) {
+    if (p->ack_count < ACKS) p->acks[(p->ack_head + p->ack_count++) % ACKS] = (ack_t){ due_ns, acked, lost };
+}
+
+// The peer's path: one datagram at a time at RATE_MBIT. Each frame
+// carries the time it was read and, for bulk, its sequence number.
+static coalesce_result_t send_datagram(void *arg, coalesce_slot_t *slot, coalesce_datagram_t *d, uint64_t now_ns, uint64_t *retry_ns) {
+    peer_t *p = &peers[slot->key - 1];
+    if (now_ns < p->link_free_ns) {
+        *retry_ns = p->link_free_ns;
+        return COALESCE_BLOCKED;
+    }
+    p->link_free_ns = now_ns + (uint64_t)((d->pkt->len + OVERHEAD) * 8e3 / RATE_MBIT);
+
+    size_t off = 0;
+    frame_t f;
+    while (frame_next(d->pkt->data, d->pkt->len, &off, &f) == 1) {
+        uint64_t read_ns, seq;
+        memcpy(&read_ns, f.data, 8);
+        memcpy(&seq, f.data + 8, 8);
+        if (f.stream_id == STREAM_INTERACTIVE) {
+            if (now_ns >= WARMUP_NS) record(&waits[p->bulk ? INTERACTIVE_WITH_BULK : INTERACTIVE_ALONE], now_ns - read_ns);
+            continue;
+        }
+        if (now_ns >= WARMUP_NS) {
+            record(&waits[BULK], now_ns - read_ns);
+            p->delivered_bytes += f.len;
+        }
+        // Packets dropped in the queue show up as a gap
+        uint32_t lost = seq > p->expected_seq ? (uint32_t)(seq - p->expected_seq) : 0;
+        if (seq >= p->expected_seq) p->expected_seq = seq + 1;
+        push_ack(p, now_ns + RTT_NS, 1, lost);
+    }
+    return COALESCE_SENT;
+}
+
+static void add_packet(coalescer_t *c, pktbuf_pool_t *pool, size_t peer, int stream_id, size_t len, uint64_t seq, uint64_t now_ns) {
+    pktbuf_t *pkt = pktbuf_alloc(pool);
+    if (!pkt) return;
+    memset(pkt->data, 0, len);
+    memcpy(pkt->data, &now_ns, 8);
+    memcpy(pkt->data + 8, &seq, 8);
+    pkt->len = len;
+    coalesce_add(c, peer + 1, 1, FRAME_STREAM, stream_id, pkt, MAX_DATAGRAM, now_ns);
+    pktbuf_put(pkt);
+}
+
+// The bulk sender: acknowledgements and losses due by now, then as many
+// packets as its window allows
+static void run_sender(coalescer_t *c, pktbuf_pool_t *pool, size_t i, uint64_t now_ns) {
+    peer_t *p = &peers[i];
+    while (p->ack_count > 0 && p->acks[p->ack_head].due_ns <= now_ns) {
+        ack_t *a = &p->acks[p->ack_head];
+        p->ack_head = (p->ack_head + 1) % ACKS;
+        p->ack_count--;
+        uint64_t done = a->acked + a->lost;
+        p->inflight = p->inflight > done ? p->inflight - done : 0;
+        p->last_ack_ns = now_ns;
+        if (a->lost && now_ns >= p->recovery_until_ns) {
+            p->cwnd = p->ssthresh = p->cwnd / 2 > 2 ? p->cwnd / 2 : 2;
+            p->recovery_until_ns = now_ns + RTT_NS;
+        } else if (!a->lost) {
+            p->cwnd += p->cwnd < p->ssthresh ? a->acked : a->acked / p->cwnd;
+        }
+    }
+    // Losses at the tail leave no gap behind them: time out
+    if (p->inflight > 0 && now_ns - p->last_ack_ns > 10 * RTT_NS) {
+        p->inflight = 0;
+        p->ssthresh = p->cwnd / 2 > 2 ? p->cwnd / 2 : 2;
+        p->cwnd = 2;
+        p->expected_seq = p->next_seq;
+        p->last_ack_ns = now_ns;
+    }
+    while (p->inflight < (uint64_t)p->cwnd) {
+        add_packet(c, pool, i, STREAM_BULK, BULK_LEN, p->next_seq++, now_ns);
+        p->inflight++;
+    }
+}
+
+static void run(bool codel, uint64_t duration_ns) {
+    pktbuf_pool_t pool;
+    coalescer_t c;
+    if (pktbuf_pool_init(&pool, PEERS * COALESCE_QUEUE * 2, PKTBUF_HEADROOM + MAX_DATAGRAM + PKTBUF_TAILROOM) != 0 ||
+        coalesce_init(&c, 64, MAX_DATAGRAM, 0, &pool, send_datagram, NULL) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if (!codel) c.codel_target_ns = 0;
+    memset(peers, 0, sizeof(peers));
+    for (size_t i = 0; i < PEERS; i++) {
+        peers[i].bulk = i < 4;
+        peers[i].interactive = i == 0 || i == 4;
+        peers[i].cwnd = 2;
+        peers[i].ssthresh = 1e9;
+        peers[i].next_interactive_ns = i * 1000000;
+    }
+    for (int k = 0; k < KINDS; k++) waits[k].count = 0;
+
+    for (uint64_t now = 0; now < duration_ns; now += STEP_NS) {
+        for (size_t i = 0; i < PEERS; i++) {
+            peer_t *p = &peers[i];
+            if (p->interactive && now >= p->next_interactive_ns) {
+                add_packet(&c, &pool, i, STREAM_INTERACTIVE, INTERACTIVE_LEN, 0, now);
+                p->next_interactive_ns += INTERACTIVE_GAP_NS;
+            }
+            if (p->bulk) run_sender(&c, &pool, i, now);
+        }
+        coalesce_flush(&c, now);
+    }
+
+    uint64_t delivered = 0;
+    for (size_t i = 0; i < PEERS; i++) delivered += peers[i].delivered_bytes;
+    for (int k = 0; k < KINDS; k++) qsort(waits[k].ns, waits[k].count, sizeof(*waits[k].ns), compare_u32);
+    double seconds = (duration_ns - WARMUP_NS) / 1e9;
+    printf("%-6s %8.1f Mbit/s %8.1f %8.1f %8.1f %8.1f %8.2f %8.2f %8llu %8llu\n", codel ? "on" : "off",
+        delivered * 8 / seconds / 1e6 / 4, percentile_ms(&waits[BULK], 0.5), percentile_ms(&waits[BULK], 0.99),
+        percentile_ms(&waits[INTERACTIVE_WITH_BULK], 0.5), percentile_ms(&waits[INTERACTIVE_WITH_BULK], 0.99),
+        percentile_ms(&waits[INTERACTIVE_ALONE], 0.5), percentile_ms(&waits[INTERACTIVE_ALONE], 0.99),
+        (unsigned long long)metric_get(&c.stats.dropped), (unsigned long long)metric_get(&c.stats.aqm_dropped));
+    coalesce_free(&c);
+    pktbuf_pool_free(&pool);
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 20;
+    if (seconds <= WARMUP_NS / 1e9) {
+        fprintf(stderr, "Usage: %s [seconds, more than %.0f]\n", argv[0], WARMUP_NS / 1e9);
+        return 1;
+    }
+    printf("%.0f s per run, %d Mbit/s per peer, %.0f ms round trip; waits in ms, after %.0f s of warmup\n\n",
+        seconds, RATE_MBIT, RTT_NS / 1e6, WARMUP_NS / 1e9);
+    printf("%-6s %15s %17s %17s %17s %17s\n", "CoDel", "bulk goodput", "bulk wait", "interactive+bulk",
+        "interactive", "dropped");
+    printf("%-6s %15s %8s %8s %8s %8s %8s %8s %8s %8s\n", "", "per peer", "p50", "p99", "p50", "p99", "p50", "p99", "full", "CoDel");
+    run(false, (uint64_t)(seconds * 1e9));
+    run(true, (uint64_t)(seconds * 1e9));
+    return 0;
+}
@@ -0,0 +1,249 @@
+// Header compression on synthetic flows. Each flow's packets go through
+// a compressor, a lossy channel and a decompressor; the decompressor's
+// requests for full headers reach the compressor a round trip
+// (RTT_PACKETS packets) later, as they would on the tunnel. Every packet
+// rebuilt is compared with the original.
+//
+//   tcp_data   bulk TCP over IPv4: 1448-byte segments with timestamps
+//   tcp_ack    the ACKs of that transfer, one per two segments
+//   udp        a voice call over IPv4: 160 bytes every 20 ms
+//   udp6       a game over IPv6: 60-byte updates
+//
+// Reports, for each flow at each loss pattern: frame and headers per
+// packet as they were and as sent, the bytes saved, the packets the
+// receiver could not rebuild (lost ones aside) and full headers sent, and
+// the nanoseconds per packet to compress and to rebuild (which copies the
+// payload), less what reading the clock costs.
+//
+// Usage: bench/hdrcomp [packets per run]
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../frame.h"
+#include "../hdrcomp.h"
+
+#define RTT_PACKETS 32            // packets sent before a request for a full header arrives
+#define STREAM_ID 0x40000001      // the flow's stream, as the client numbers them
+#define BUF_SIZE 2048
+
+typedef enum { TCP_DATA, TCP_ACK, UDP, UDP6, FLOWS } flow_kind_t;
+
+static const char *const flow_names[FLOWS] = { "tcp_data", "tcp_ack", "udp", "udp6" };
+
+typedef struct {
+    const char *name;
+    double rate;                  // packets lost
+    unsigned burst;               // in a row, each time
+} loss_t;
+
+static const loss_t losses[] = {
+    { "none", 0, 1 },
+    { "1%", 0.01, 1 },
+    { "5%", 0.05, 1 },
+    { "1%, 20 in a row", 0.01, 20 },
+};
+
+typedef struct {
+    flow_kind_t kind;
+    uint32_t seq, ack, tsval, tsecr;
+    uint16_t ip_id;
+    unsigned n;
+} flow_t;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// What timing nothing costs, taken off each measurement
+static double clock_ns;
+
+static void calibrate(void) {
+    double total = 0;
+    for (int i = 0; i < 100000; i++) {
+        double t = now_ns();
+        total += now_ns() - t;
+    }
+    clock_ns = total / 100000;
+}
+
+static void put16(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v >> 16);
+    put16(p + 2, v);
+}
+
+static void ipv4_header(uint8_t *ip, size_t total, uint16_t id, uint8_t proto) {
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    put16(ip + 2, (uint32_t)total);
+    put16(ip + 4, id);
+    ip[6] = 0x40;                 // DF
+    ip[8] = 64;
+    ip[9] = proto;
+    static const uint8_t addrs[8] = { 10, 8, 0, 2, 10, 8, 0, 1 };
+    memcpy(ip + 12, addrs, 8);
+    uint32_t sum = 0;
+    for (int i = 0; i < 20; i += 2) sum += ip[i] << 8 | ip[i + 1];
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    put16(ip + 10, ~sum & 0xffff);
+}
+
+// The flow's next packet into buf; returns its length
+static size_t next_packet(flow_t *f, uint8_t *buf) {
+    f->n++;
+    size_t len;
+    uint8_t *l4;
+    switch (f->kind) {
+    case TCP_DATA:
+    case TCP_ACK: {
+        size_t payload = f->kind == TCP_DATA ? 1448 : 0;
+        len = 20 + 32 + payload;
+        ipv4_header(buf, len, f->ip_id++, 6);
+        l4 = buf + 20;
+        memset(l4, 0, 32);
+        put16(l4, f->kind == TCP_DATA ? 443 : 51000);
+        put16(l4 + 2, f->kind == TCP_DATA ? 51000 : 443);
+        put32(l4 + 4, f->seq);
+        put32(l4 + 8, f->ack);
+        l4[12] = 8 << 4;
+        l4[13] = payload ? 0x18 : 0x10;
+        put16(l4 + 14, 502 + (f->n % 64 == 0));     // the window moves now and then
+        put16(l4 + 16, rand() & 0xffff);            // checksum
+        static const uint8_t ts[4] = { 1, 1, 8, 10 };
+        memcpy(l4 + 20, ts, 4);
+        // A millisecond clock, with a packet every 10 us on the data side
+        if (f->n % (f->kind == TCP_DATA ? 100 : 50) == 0) f->tsval++, f->tsecr++;
+        put32(l4 + 24, f->tsval);
+        put32(l4 + 28, f->tsecr);
+        memset(l4 + 32, 0xab, payload);
+        if (f->kind == TCP_DATA) f->seq += 1448;
+        else f->ack += 2 * 1448;
+        break;
+    }
+    case UDP:
+        len = 20 + 8 + 160;
+        ipv4_header(buf, len, f->ip_id++, 17);
+        l4 = buf + 20;
+        put16(l4, 40000);
+        put16(l4 + 2, 40002);
+        put16(l4 + 4, 8 + 160);
+        put16(l4 + 6, rand() & 0xffff);
+        memset(l4 + 8, f->n & 0xff, 160);
+        break;
+    default:
+        len = 40 + 8 + 60;
+        memset(buf, 0, 40);
+        buf[0] = 0x60;
+        put16(buf + 4, 8 + 60);
+        buf[6] = 17;
+        buf[7] = 64;
+        buf[8] = buf[24] = 0xfd;
+        buf[39] = 1;
+        buf[23] = 2;
+        l4 = buf + 40;
+        put16(l4, 27015);
+        put16(l4 + 2, 27015);
+        put16(l4 + 4, 8 + 60);
+        put16(l4 + 6, rand() & 0xffff);
+        memset(l4 + 8, f->n & 0xff, 60);
+        break;
+    }
+    return len;
+}
+
+static void run(flow_kind_t kind, const loss_t *loss, unsigned packets) {
+    static hdrcomp_tx_t tx;
+    static hdrcomp_rx_t rx;
+    static hdrcomp_stats_t stats;
+    memset(&tx, 0, sizeof(tx));
+    memset(&rx, 0, sizeof(rx));
+    memset(&stats, 0, sizeof(stats));
+    flow_t flow = { .kind = kind, .seq = 0xfffe0000, .ack = 0x7fff0000, .tsval = 1000, .tsecr = 900, .ip_id = 0xff00 };
+    srand(1);
+
+    uint8_t base[PKTBUF_HEADROOM + BUF_SIZE], original[BUF_SIZE], out[BUF_SIZE];
+    struct { unsigned due; uint8_t context; } requests[HDRCOMP_CONTEXTS];
+    size_t nrequests = 0;
+    unsigned lost_left = 0, failed = 0, wrong = 0;
+    double compress_ns = 0, rebuild_ns = 0;
+    unsigned rebuilt = 0;
+    for (unsigned i = 0; i < packets; i++) {
+        while (nrequests > 0 && requests[0].due <= i) {
+            hdrcomp_on_resync(&tx, requests[0].context, &stats);
+            memmove(requests, requests + 1, --nrequests * sizeof(requests[0]));
+        }
+
+        pktbuf_t pkt = { .base = base, .data = base + PKTBUF_HEADROOM, .size = sizeof(base) };
+        pkt.len = next_packet(&flow, pkt.data);
+        memcpy(original, pkt.data, pkt.len);
+        size_t plain_len = pkt.len;
+        uint8_t context;
+        double t = now_ns();
+        int type = hdrcomp_compress(&tx, &pkt, frame_header_length(FRAME_STREAM, STREAM_ID, pkt.len), &context, &stats);
+        compress_ns += now_ns() - t - clock_ns;
+
+        if (lost_left == 0 && (double)rand() / RAND_MAX < loss->rate / loss->burst) lost_left = loss->burst;
+        if (lost_left > 0) {
+            lost_left--;
+            continue;
+        }
+
+        size_t len = 0;
+        t = now_ns();
+        if (type == FRAME_HC_FULL) {
+            if (hdrcomp_full(&rx, context, pkt.data, pkt.len) == 0) {
+                memcpy(out, pkt.data, pkt.len);
+                len = pkt.len;
+            }
+        } else if (type == FRAME_HC) {
+            len = hdrcomp_decompress(&rx, context, pkt.data, pkt.len, out, sizeof(out));
+        }
+        rebuild_ns += now_ns() - t - clock_ns;
+        rebuilt++;
+        if (len == 0) {
+            failed++;
+        } else if (len != plain_len || memcmp(out, original, len) != 0) {
+            wrong++;
+        }
+
+        uint8_t frames[FRAME_HC_RESYNC_LEN * HDRCOMP_CONTEXTS];
+        size_t n = hdrcomp_take_resync(&rx, frames, sizeof(frames));
+        for (size_t off = 0; off < n && nrequests < HDRCOMP_CONTEXTS; off += FRAME_HC_RESYNC_LEN) {
+            requests[nrequests].due = i + RTT_PACKETS;
+            requests[nrequests++].context = frames[off + 1];
+        }
+    }
+
+    double plain = (double)metric_get(&stats.plain_bytes[kind == TCP_DATA ? HDRCOMP_TCP_DATA : kind == TCP_ACK ? HDRCOMP_TCP_ACK : HDRCOMP_UDP]);
+    double sent = 0;
+    for (int c = 0; c < HDRCOMP_CLASSES; c++) sent += metric_get(&stats.sent_bytes[c]);
+    printf("%-9s %-16s %8.1f %8.1f %8.1f %8u %8llu %8.1f %8.1f%s\n", flow_names[kind], loss->name, plain / packets,
+        sent / packets, (plain - sent) / packets, failed, (unsigned long long)metric_get(&stats.full),
+        compress_ns / packets, rebuilt ? rebuild_ns / rebuilt : 0, wrong ? "  REBUILT WRONG" : "");
+    if (wrong) exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned packets = argc > 1 ? (unsigned)atoi(argv[1]) : 200000;
+    if (packets == 0) {
+        fprintf(stderr, "Usage: %s [packets per run]\n", argv[0]);
+        return 1;
+    }
+    calibrate();
+    printf("%u packets per run, full headers asked for arrive %d packets later; bytes are frame and headers per packet\n\n",
+        packets, RTT_PACKETS);
+    printf("%-9s %-16s %8s %8s %8s %8s %8s %8s %8s\n", "flow", "loss", "plain", "sent", "saved", "failed", "full",
+        "comp ns", "dec ns");
+    for (int k = 0; k < FLOWS; k++) {
+        for (size_t l = 0; l < sizeof(losses) / sizeof(losses[0]); l++) run(k, &losses[l], packets);
+    }
+    return 0;
+}
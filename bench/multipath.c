@@ -0,0 +1,319 @@
+// Multipath scheduling on two emulated links. A sender with unlimited
+// data spreads datagrams over both with the tunnel's multipath state:
+// per-path loss recovery, congestion control and pacing, the scheduler,
+// failure detection and PINGs. The receiver acknowledges from one replay
+// window through encoded ACK frames, sent back on the path the last
+// packet came on, and puts the data back in order through the tunnel's
+// reorder buffer. Everything runs in one process on a virtual clock.
+//
+// Each link is a drop-tail bottleneck with its own rate, one-way delay
+// and buffer; ACKs come back without loss or queueing. In the failover
+// scenario the first link starts dropping everything, both ways, half
+// way through the run.
+//
+// Reports, for the first path alone and for each scheduler over both:
+// goodput, each path's share of the datagrams that arrived, how long
+// data took from its send to in-order delivery at the 50th and 99th
+// percentile, the packets the reorder buffer held and the gaps it gave
+// up on, the longest time nothing was delivered after the first second,
+// and the paths taken out of use.
+//
+// Usage: bench/multipath [seconds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../multipath.h"
+
+#define MSS 1200
+#define PING_SIZE 40
+#define PATHS 2
+#define MAX_IN_TRANSIT 65536    // datagrams or ACKs on one link at once
+#define PN_RING (1 << 20)       // send times kept, by packet number
+#define WARMUP_NS 1000000000ULL
+
+typedef struct {
+    double rate_mbit;
+    double one_way_ms;
+    double queue_bdp;           // buffer, in bandwidth-delay products of the link
+} link_config_t;
+
+typedef struct {
+    const char *name;
+    link_config_t links[PATHS];
+    bool fail;                  // the first link goes dark half way through
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    { "50 Mbit/s 10 ms + 20 Mbit/s 40 ms", { { 50, 10, 1 }, { 20, 40, 1 } }, false },
+    { "50 Mbit/s 10 ms + 50 Mbit/s 30 ms", { { 50, 10, 1 }, { 50, 30, 1 } }, false },
+    { "50 Mbit/s 10 ms + 20 Mbit/s 40 ms, the first fails", { { 50, 10, 1 }, { 20, 40, 1 } }, true },
+};
+
+typedef struct {
+    uint64_t pn;
+    uint64_t arrive_ns;
+    bool data;
+} datagram_t;
+
+typedef struct {
+    uint8_t frame[FRAME_ACK_MAX];
+    size_t len;
+    uint64_t arrive_ns;
+} ack_t;
+
+typedef struct {
+    double bytes_per_ns;
+    uint64_t one_way_ns;
+    uint64_t queue_limit;       // bytes
+    uint64_t free_ns;           // when the bottleneck has sent what it holds
+    datagram_t *data;
+    size_t data_head, data_count;
+    ack_t *acks;
+    size_t ack_head, ack_count;
+    uint64_t received;          // data datagrams that arrived on it
+} link_t;
+
+typedef struct {
+    uint32_t *us;
+    size_t count, cap;
+} samples_t;
+
+typedef struct {
+    uint64_t goodput_bytes;
+    uint64_t received[PATHS];
+    samples_t delays;
+    uint64_t last_delivery_ns, longest_stall_ns;
+    uint64_t failovers;
+    mp_reorder_stats_t reorder;
+} result_t;
+
+static uint64_t sent_ns[PN_RING];
+static uint8_t payload[MSS];
+static size_t payload_len;
+static const uint8_t ping[] = { FRAME_PING };
+
+static bool link_dark(const scenario_t *s, unsigned i, uint64_t now, uint64_t duration_ns) {
+    return s->fail && i == 0 && now >= duration_ns / 2;
+}
+
+static void transmit(link_t *l, bool dark, uint64_t pn, size_t size, bool data, uint64_t now) {
+    if (dark) return;
+    uint64_t start = l->free_ns > now ? l->free_ns : now;
+    if ((start - now) * l->bytes_per_ns + size > l->queue_limit || l->data_count == MAX_IN_TRANSIT) return;
+    l->free_ns = start + (uint64_t)(size / l->bytes_per_ns);
+    l->data[(l->data_head + l->data_count++) % MAX_IN_TRANSIT] = (datagram_t){ pn, l->free_ns + l->one_way_ns, data };
+}
+
+static void sample(samples_t *s, uint64_t ns) {
+    if (s->count == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 65536;
+        s->us = realloc(s->us, s->cap * sizeof(*s->us));
+        if (!s->us) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->us[s->count++] = (uint32_t)(ns / 1000);
+}
+
+static void deliver(result_t *res, uint64_t pn, uint64_t now) {
+    res->goodput_bytes += MSS;
+    sample(&res->delays, now - sent_ns[pn % PN_RING]);
+    if (res->last_delivery_ns >= WARMUP_NS && now - res->last_delivery_ns > res->longest_stall_ns) {
+        res->longest_stall_ns = now - res->last_delivery_ns;
+    }
+    res->last_delivery_ns = now;
+}
+
+static void run(const scenario_t *s, unsigned npaths, mp_scheduler_t scheduler, uint64_t duration_ns, link_t *links, result_t *res) {
+    memset(res, 0, sizeof(*res));
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    mp_t mp;
+    mp_init(&mp, &congestion_newreno, scheduler);
+    for (unsigned i = 0; i < PATHS; i++) {
+        const link_config_t *c = &s->links[i];
+        link_t *l = &links[i];
+        l->bytes_per_ns = c->rate_mbit * 1e6 / 8 / 1e9;
+        l->one_way_ns = (uint64_t)(c->one_way_ms * 1e6);
+        l->queue_limit = (uint64_t)(c->queue_bdp * l->bytes_per_ns * 2 * l->one_way_ns);
+        if (l->queue_limit < 2 * MSS) l->queue_limit = 2 * MSS;
+        l->free_ns = l->data_head = l->data_count = l->ack_head = l->ack_count = l->received = 0;
+        // At the PMTUD base, so there is no search to run
+        if (i < npaths && mp_path_open(&mp, i, &addr, PMTUD_BASE) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    mp_reorder_t *reorder = mp_reorder_new(MSS);
+    static uint8_t out[MSS];
+    if (!reorder) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    replay_window_t window;
+    ack_state_t ack_state = {0};
+    replay_init(&window);
+    uint64_t now = 0, next_pn = 1, retry_ns = 0;
+    unsigned ack_path = 0;
+    while (now < duration_ns) {
+        // Sender: failures, PINGs, then as much data as the windows and
+        // pacers allow
+        res->failovers += __builtin_popcount(mp_check(&mp, now));
+        unsigned pings = mp_pings_due(&mp, now);
+        for (unsigned i = 0; i < npaths; i++) {
+            if (!(pings & 1u << i)) continue;
+            uint64_t pn = next_pn++;
+            mp_on_sent(&mp.paths[i], pn, PING_SIZE, now, true);
+            transmit(&links[i], link_dark(s, i, now, duration_ns), pn, PING_SIZE, false, now);
+        }
+        mp_path_t *p;
+        while (now >= retry_ns && (p = mp_select(&mp, MSS, now, &retry_ns))) {
+            unsigned i = p - mp.paths;
+            uint64_t pn = next_pn++;
+            sent_ns[pn % PN_RING] = now;
+            mp_on_sent(p, pn, MSS, now, true);
+            transmit(&links[i], link_dark(s, i, now, duration_ns), pn, MSS, true, now);
+        }
+
+        // Receiver: datagrams arriving now, in arrival order across the
+        // links, through the reorder buffer as every packet is
+        for (;;) {
+            int first = -1;
+            for (unsigned i = 0; i < PATHS; i++) {
+                link_t *l = &links[i];
+                if (l->data_count == 0 || l->data[l->data_head].arrive_ns > now) continue;
+                if (first < 0 || l->data[l->data_head].arrive_ns < links[first].data[links[first].data_head].arrive_ns) first = i;
+            }
+            if (first < 0) break;
+            link_t *l = &links[first];
+            datagram_t d = l->data[l->data_head];
+            l->data_head = (l->data_head + 1) % MAX_IN_TRANSIT;
+            l->data_count--;
+            bool largest = !window.initialized || d.pn > window.largest;
+            if (!replay_update(&window, d.pn)) continue;
+            ack_state_on_received(&ack_state, true, largest, now);
+            ack_path = first;
+            if (d.data) res->received[first]++;
+            bool held = d.data ? mp_reorder_hold(reorder, first, d.pn, payload, payload_len, now, &res->reorder)
+                               : mp_reorder_hold(reorder, first, d.pn, ping, sizeof(ping), now, &res->reorder);
+            if (!held && d.data) deliver(res, d.pn, now);
+        }
+        uint64_t pn;
+        while (mp_reorder_pop(reorder, now, &pn, out, sizeof(out), &res->reorder) > 0) {
+            deliver(res, pn, now);
+        }
+        uint64_t ack_due = ack_state_due(&ack_state);
+        if (ack_due && ack_due <= now) {
+            unsigned i = mp_ack_path(&mp, ack_path) - mp.paths;
+            link_t *l = &links[i];
+            ack_t a;
+            a.len = ack_state_take(&ack_state, &window, now, a.frame, sizeof(a.frame));
+            a.arrive_ns = now + l->one_way_ns;
+            if (a.len > 0 && !link_dark(s, i, now, duration_ns) && l->ack_count < MAX_IN_TRANSIT) {
+                l->acks[(l->ack_head + l->ack_count++) % MAX_IN_TRANSIT] = a;
+            }
+            ack_due = ack_state_due(&ack_state);
+        }
+
+        // Sender: ACKs arriving now, parsed off the wire
+        for (unsigned i = 0; i < PATHS; i++) {
+            link_t *l = &links[i];
+            while (l->ack_count > 0 && l->acks[l->ack_head].arrive_ns <= now) {
+                ack_t *a = &l->acks[l->ack_head];
+                l->ack_head = (l->ack_head + 1) % MAX_IN_TRANSIT;
+                l->ack_count--;
+                size_t off = 0;
+                frame_t frame;
+                ack_frame_t ack;
+                bool mtu_changed = false;
+                if (frame_next(a->frame, a->len, &off, &frame) == 1 && frame_decode_ack(&frame, &ack) == 0) {
+                    mp_on_ack(&mp, &ack, now, &mtu_changed);
+                    retry_ns = 0;
+                }
+            }
+        }
+
+        // Jump to the next thing that happens
+        uint64_t next = duration_ns;
+        if (retry_ns > now && retry_ns < next) next = retry_ns;
+        if (retry_ns <= now) next = now;
+        for (unsigned i = 0; i < PATHS; i++) {
+            link_t *l = &links[i];
+            if (l->data_count > 0 && l->data[l->data_head].arrive_ns < next) next = l->data[l->data_head].arrive_ns;
+            if (l->ack_count > 0 && l->acks[l->ack_head].arrive_ns < next) next = l->acks[l->ack_head].arrive_ns;
+        }
+        uint64_t due[] = { ack_due, mp_reorder_due(reorder), mp_next_due(&mp) };
+        for (size_t k = 0; k < sizeof(due) / sizeof(due[0]); k++) {
+            if (due[k] && due[k] < next) next = due[k];
+        }
+        now = next > now ? next : now + 1;
+    }
+    // Nothing delivered since counts as well
+    if (res->last_delivery_ns >= WARMUP_NS && duration_ns - res->last_delivery_ns > res->longest_stall_ns) {
+        res->longest_stall_ns = duration_ns - res->last_delivery_ns;
+    }
+    mp_reorder_free(reorder);
+    mp_free(&mp);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(samples_t *s, double q) {
+    if (s->count == 0) return 0;
+    return s->us[(size_t)(q * (s->count - 1))] / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 10;
+    if (seconds <= 0) {
+        fprintf(stderr, "Usage: %s [seconds]\n", argv[0]);
+        return 1;
+    }
+    uint64_t duration_ns = (uint64_t)(seconds * 1e9);
+    link_t links[PATHS];
+    for (unsigned i = 0; i < PATHS; i++) {
+        links[i].data = malloc(MAX_IN_TRANSIT * sizeof(*links[i].data));
+        links[i].acks = malloc(MAX_IN_TRANSIT * sizeof(*links[i].acks));
+        if (!links[i].data || !links[i].acks) {
+            perror("malloc");
+            return 1;
+        }
+    }
+    // Datagrams carry one inner packet, as a DATAGRAM frame
+    payload_len = frame_encode_header(payload, FRAME_DATAGRAM, 0, MSS - FRAME_HEADER_MAX);
+    payload_len += MSS - FRAME_HEADER_MAX;
+
+    printf("%.0f s per run, %d byte datagrams, newreno\n", seconds, MSS);
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        const scenario_t *s = &scenarios[i];
+        printf("\n%s\n", s->name);
+        printf("  %-12s %12s %7s %7s %9s %9s %7s %6s %9s %5s\n", "scheduler", "goodput", "path 0", "path 1", "p50", "p99", "held", "gaps",
+            "stall", "down");
+        struct {
+            const char *name;
+            unsigned npaths;
+            mp_scheduler_t scheduler;
+        } runs[] = { { "path 0 only", 1, MP_MINRTT }, { "minrtt", 2, MP_MINRTT }, { "wrr", 2, MP_WRR } };
+        for (size_t j = 0; j < sizeof(runs) / sizeof(runs[0]); j++) {
+            result_t res;
+            run(s, runs[j].npaths, runs[j].scheduler, duration_ns, links, &res);
+            uint64_t received = res.received[0] + res.received[1];
+            qsort(res.delays.us, res.delays.count, sizeof(*res.delays.us), compare_u32);
+            printf("  %-12s %5.1f Mbit/s %6.1f%% %6.1f%% %6.2f ms %6.2f ms %6.2f%% %6llu %6.1f ms %5llu\n", runs[j].name,
+                res.goodput_bytes * 8 / seconds / 1e6, received ? 100.0 * res.received[0] / received : 0.0,
+                received ? 100.0 * res.received[1] / received : 0.0, percentile_ms(&res.delays, 0.5), percentile_ms(&res.delays, 0.99),
+                received ? 100.0 * metric_get(&res.reorder.held) / received : 0.0, (unsigned long long)metric_get(&res.reorder.gaps_skipped),
+                res.longest_stall_ns / 1e6, (unsigned long long)res.failovers);
+            free(res.delays.us);
+        }
+    }
+    for (unsigned i = 0; i < PATHS; i++) {
+        free(links[i].data);
+        free(links[i].acks);
+    }
+    return 0;
+}
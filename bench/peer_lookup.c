@@ -0,0 +1,100 @@
+// Microbenchmark: per-packet peer lookup cost at different peer counts.
+// Compares the peer table against the old mutex + linear scan over a
+// fixed slot array that server.c used before.
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../peer_table.h"
+
+#define LOOKUPS 2000000
+
+typedef struct {
+    struct sockaddr_in addr;
+    bool active;
+} slot_t;
+
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct sockaddr_in make_addr(size_t i) {
+    struct sockaddr_in a = {0};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(0x0a000000 + (uint32_t)(i / 50000));
+    a.sin_port = htons(1024 + i % 50000);
+    return a;
+}
+
+static slot_t *linear_find(slot_t *slots, size_t n, const struct sockaddr_in *addr) {
+    pthread_mutex_lock(&slots_mutex);
+    for (size_t i = 0; i < n; i++) {
+        if (slots[i].active && slots[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && slots[i].addr.sin_port == addr->sin_port) {
+            pthread_mutex_unlock(&slots_mutex);
+            return &slots[i];
+        }
+    }
+    pthread_mutex_unlock(&slots_mutex);
+    return NULL;
+}
+
+static void run(size_t peers) {
+    struct sockaddr_in *addrs = malloc(peers * sizeof(*addrs));
+    size_t *order = malloc(LOOKUPS * sizeof(*order));
+    peer_table_t *t = peer_table_new(peers, NULL);
+    uint64_t seed = 88172645463325252ULL;
+
+    for (size_t i = 0; i < peers; i++) {
+        addrs[i] = make_addr(i);
+        peer_table_insert(t, peer_key_from_addr(&addrs[i]), &addrs[i]);
+    }
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        order[i] = seed % peers;
+    }
+
+    // Peer table: lock-free read section around every lookup, as server.c does
+    size_t found = 0;
+    double start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        peer_table_read_lock(t);
+        found += peer_table_lookup(t, peer_key_from_addr(&addrs[order[i]])) != NULL;
+        peer_table_read_unlock(t);
+    }
+    double table_ns = (now_ns() - start) / LOOKUPS;
+
+    // Linear scan: only as many lookups as needed for a stable average
+    slot_t *slots = calloc(peers, sizeof(*slots));
+    for (size_t i = 0; i < peers; i++) {
+        slots[i].addr = addrs[i];
+        slots[i].active = true;
+    }
+    size_t scans = peers > 10000 ? 2000 : LOOKUPS / 10;
+    start = now_ns();
+    for (size_t i = 0; i < scans; i++) {
+        found += linear_find(slots, peers, &addrs[order[i]]) != NULL;
+    }
+    double linear_ns = (now_ns() - start) / scans;
+
+    printf("%8zu peers: table %8.1f ns/lookup   linear %10.1f ns/lookup   (%zu hits)\n", peers, table_ns, linear_ns, found);
+
+    free(slots);
+    peer_table_free(t);
+    free(order);
+    free(addrs);
+}
+
+int main(void) {
+    size_t sizes[] = { 10, 1000, 100000 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        run(sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+// Microbenchmark: per-peer idle timers on the timer wheel against the
+// full sweep server.c used before (every 60 s, look at each peer's last
+// activity). Peers are separate allocations reached through a table of
+// pointers, like the streams. For each peer count it reports the cost of
+// arming, re-arming and cancelling a timer, and the longest the loop is
+// held up at once over 10 simulated minutes: one wheel advance per
+// millisecond (a cascade moves the timers of a whole upper-level slot),
+// or one sweep. Ticks are given at the 99.99th percentile, which
+// cascades reach, as well as the maximum, which is mostly the scheduler.
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../timer_wheel.h"
+
+#define MINUTES 10
+#define CHECK_MS (60 * 1000)     // how often each peer is looked at
+#define TIMEOUT_MS (300 * 1000)
+#define TICKS (MINUTES * 60 * 1000)
+
+typedef struct {
+    wheel_timer_t timer;
+    uint64_t last_activity;
+    bool live;
+    char state[448];         // the rest of a stream's state
+} peer_t;
+
+static timer_wheel_t wheel;
+static uint64_t expired;
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Like the server's stream timer: expire the peer, or look again later
+static void on_timer(void *arg) {
+    peer_t *p = arg;
+    if (wheel.now - p->last_activity >= TIMEOUT_MS) {
+        p->live = false;
+        expired++;
+        return;
+    }
+    timer_wheel_arm(&wheel, &p->timer, wheel.now + CHECK_MS);
+}
+
+// Some peers go quiet and expire; the others keep talking
+static void touch(peer_t **peers, size_t n, uint64_t now) {
+    for (size_t i = 0; i < n; i += 7) {
+        if (peers[i]->live) peers[i]->last_activity = now;
+    }
+}
+
+static void run(size_t n) {
+    // Allocated in a shuffled order so that neighbours in the table are
+    // not neighbours in memory
+    peer_t **peers = calloc(n, sizeof(*peers));
+    for (size_t i = 0; i < n; i++) peers[i] = malloc(sizeof(peer_t));
+    srand(1);
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = rand() % (i + 1);
+        peer_t *p = peers[i];
+        peers[i] = peers[j];
+        peers[j] = p;
+    }
+    timer_wheel_init(&wheel, 0);
+    expired = 0;
+
+    double start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        peers[i]->live = true;
+        wheel_timer_init(&peers[i]->timer, on_timer, peers[i]);
+        timer_wheel_arm(&wheel, &peers[i]->timer, 1 + (i * 7919) % CHECK_MS);    // spread over a minute
+    }
+    double arm_ns = (now_ns() - start) / n;
+
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) timer_wheel_arm(&wheel, &peers[i]->timer, 1 + (i * 104729) % CHECK_MS);
+    double rearm_ns = (now_ns() - start) / n;
+
+    double *ticks = malloc(TICKS * sizeof(*ticks));
+    double total_ns = 0;
+    for (uint64_t ms = 1; ms <= TICKS; ms++) {
+        if (ms % 1000 == 0) touch(peers, n, ms);
+        double t = now_ns();
+        timer_wheel_advance(&wheel, ms);
+        ticks[ms - 1] = now_ns() - t;
+        total_ns += ticks[ms - 1];
+    }
+    qsort(ticks, TICKS, sizeof(*ticks), compare_double);
+    uint64_t wheel_expired = expired;
+
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) timer_wheel_cancel(&wheel, &peers[i]->timer);
+    double cancel_ns = (now_ns() - start) / n;
+
+    // The same peers and activity, swept instead
+    for (size_t i = 0; i < n; i++) {
+        peers[i]->live = true;
+        peers[i]->last_activity = 0;
+    }
+    uint64_t sweep_expired = 0;
+    double sweep_worst_ns = 0;
+    for (uint64_t ms = 1000; ms <= TICKS; ms += 1000) {
+        touch(peers, n, ms);
+        if (ms % CHECK_MS) continue;
+        double t = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            if (peers[i]->live && ms - peers[i]->last_activity >= TIMEOUT_MS) {
+                peers[i]->live = false;
+                sweep_expired++;
+            }
+        }
+        t = now_ns() - t;
+        if (t > sweep_worst_ns) sweep_worst_ns = t;
+    }
+
+    printf("%8zu %9.1f %9.1f %9.1f %12.2f %12.1f %12.1f %12.1f %9llu %9llu\n", n, arm_ns, rearm_ns, cancel_ns,
+        total_ns / TICKS / 1e3, ticks[TICKS - TICKS / 10000] / 1e3, ticks[TICKS - 1] / 1e3, sweep_worst_ns / 1e3,
+        (unsigned long long)wheel_expired, (unsigned long long)sweep_expired);
+    free(ticks);
+    for (size_t i = 0; i < n; i++) free(peers[i]);
+    free(peers);
+}
+
+int main(void) {
+    printf("%d simulated minutes, each peer checked every %d s, idle timeout %d s\n\n", MINUTES, CHECK_MS / 1000, TIMEOUT_MS / 1000);
+    printf("%8s %9s %9s %9s %12s %12s %12s %12s %9s %9s\n", "peers", "arm ns", "rearm ns", "cancel ns",
+        "tick avg us", "tick p9999", "tick max us", "sweep us", "expired", "swept");
+    static const size_t counts[] = { 1000, 10000, 100000, 1000000 };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) run(counts[i]);
+    return 0;
+}
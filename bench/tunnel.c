@@ -0,0 +1,546 @@
+// The whole tunnel on loopback. The server and client daemons run as
+// child processes talking UDP over 127.0.0.1, each with a socketpair
+// (or a pair of packet-mode pipes) in place of its TUN device, see
+// tun.h. This process holds the other ends: it writes IPv4/UDP packets
+// into one daemon and reads them back out of the other, so every
+// packet crosses the full data plane twice (TUN read, seal, send,
+// receive, open, TUN write) without root or a real device.
+//
+// Each packet carries its sequence number and send time in its last 16
+// bytes. A case runs traffic for a warmup period and then measures for
+// a fixed time; packets sent in the measured window count towards the
+// result, arriving up to a short drain after it. Reported per case, as
+// one JSON line on stdout:
+//
+//  mpps, gbps       inner IP packets and bytes delivered per second
+//  loss             share of the window's packets that never arrived
+//  p50/p99/p999_us  one-way latency through both daemons
+//  cpu_s_per_gb     CPU time of both daemons per GB delivered
+//
+// Sizes are fixed, IMIX (7:4:1 of 44, 576 and 1280 bytes) or the IPv4
+// packets of a pcap file, readdressed to the tunnel. Packets stay
+// within 1280 bytes, the smallest TUN MTU the daemons use, so nothing
+// depends on how far path MTU discovery has got.
+//
+// With -i, an interactive flow of 64-byte packets at the given rate
+// runs alongside each case, through the same peers in the same
+// direction, so it waits in the same queues as the bulk traffic. Its
+// packets are marked in their stamp and reported on their own as
+// interactive_p50_us and interactive_p99_us.
+//
+// With -B, results are compared with a baseline file of earlier output:
+// a case whose Mpps falls, or whose p99 latency rises, by more than the
+// threshold is reported and the exit status is 1.
+//
+// The client presents the same certificate as the server, so the pair
+// given with -C and -k must be self-signed.
+//
+// Usage: bench/tunnel -C cert.pem -k key.pem [-b socket|pipe]
+//        [-s 64|512|1280|SIZE|imix|pcap:FILE] [-d up|down|both] [-f flows]
+//        [-r pps] [-t seconds] [-W warmup_seconds] [-w server_workers]
+//        [-i pps] [-x bin_dir] [-B baseline.jsonl] [-T threshold_percent]
+#define _GNU_SOURCE    // pipe2, O_DIRECT
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../pcap_file.h"
+
+#define MIN_PACKET 44                // IPv4 + UDP headers and the stamp
+#define MAX_PACKET 1280
+#define STAMP_LEN 16
+#define IO_TIMEOUT_MS 100
+#define PROBE_INTERVAL_NS 10000000ULL
+#define PROBE_TIMEOUT_NS 5000000000ULL
+#define DRAIN_NS 200000000ULL
+#define PACE_SLEEP_NS 50000
+#define INTERACTIVE_MARK (1ULL << 63)    // in the sequence number of -i packets
+
+// Inner addresses: the client side is 10.8.0.2, the server side 10.8.0.1
+static const uint8_t client_ip[4] = { 10, 8, 0, 2 };
+static const uint8_t server_ip[4] = { 10, 8, 0, 1 };
+
+static const size_t suite[] = { 64, 512, 1280, 0 };    // 0: IMIX
+static const size_t imix[] = { 44, 576, 44, 44, 576, 44, 1280, 44, 576, 44, 44, 576 };
+
+typedef struct {
+    pid_t pid;
+    int inject;                      // we write packets into the daemon here
+    int collect;                     // and read what it writes to its TUN here
+} daemon_t;
+
+typedef struct {
+    const char *name;                // as reported: "64", "imix", "pcap:FILE"
+    size_t fixed;                    // packet size, or 0
+    const pcap_file_t *pcap;         // replayed instead of sizes if set
+} traffic_t;
+
+typedef struct run {
+    const traffic_t *traffic;
+    bool down;
+    int inject, collect;
+    unsigned flows;
+    double rate;                     // packets per second, 0 for as fast as possible
+    uint64_t start_ns, window_ns, end_ns;    // window: [window_ns, end_ns)
+
+    uint64_t mark;                   // INTERACTIVE_MARK for the -i flow
+    struct run *interactive;         // where the receiver puts marked packets, or NULL
+
+    // Sender
+    uint64_t sent;                   // in the window
+    // Receiver
+    _Atomic bool stop;
+    uint64_t received, received_bytes;
+    uint32_t *latency;               // ns, per packet received
+    size_t latency_count, latency_cap;
+} run_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static uint16_t ip_checksum(const uint8_t *hdr, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) sum += hdr[i] << 8 | hdr[i + 1];
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+// Build packet seq of the traffic into buf; returns its length
+static size_t build_packet(const run_t *r, uint64_t seq, uint8_t *buf) {
+    const traffic_t *t = r->traffic;
+    const uint8_t *src = r->down ? server_ip : client_ip;
+    const uint8_t *dst = r->down ? client_ip : server_ip;
+    size_t len;
+    if (t->pcap) {
+        // An IPv4 packet from the file, readdressed and cut or padded to
+        // fit; its own protocol and ports stay as they were
+        const pcap_packet_t *p = &t->pcap->packets[seq % t->pcap->count];
+        size_t ihl = (p->data[0] & 0x0f) * 4;
+        len = p->len;
+        if (len > MAX_PACKET) len = MAX_PACKET;
+        if (len < ihl + STAMP_LEN) len = ihl + STAMP_LEN;
+        if (len < MIN_PACKET) len = MIN_PACKET;
+        memset(buf, 0, len);
+        memcpy(buf, p->data, p->len < len ? p->len : len);
+    } else {
+        len = t->fixed ? t->fixed : imix[seq % (sizeof(imix) / sizeof(imix[0]))];
+        memset(buf, 0, 28);
+        buf[0] = 0x45;
+        buf[8] = 64;                 // TTL
+        buf[9] = 17;                 // UDP
+        put16(buf + 20, 10000 + seq % r->flows);
+        put16(buf + 22, 9);          // discard
+        put16(buf + 24, len - 20);
+    }
+    put16(buf + 2, len);
+    put16(buf + 10, 0);
+    memcpy(buf + 12, src, 4);
+    memcpy(buf + 16, dst, 4);
+    put16(buf + 10, ip_checksum(buf, (buf[0] & 0x0f) * 4));
+    return len;
+}
+
+static void stamp(uint8_t *buf, size_t len, uint64_t seq, uint64_t ns) {
+    memcpy(buf + len - STAMP_LEN, &seq, 8);
+    memcpy(buf + len - STAMP_LEN + 8, &ns, 8);
+}
+
+// Write one packet, waiting for room; false if the daemon stopped reading
+static bool put_packet(int fd, const uint8_t *buf, size_t len) {
+    for (;;) {
+        if (write(fd, buf, len) == (ssize_t)len) return true;
+        if (errno != EAGAIN && errno != EINTR) return false;
+        struct pollfd p = { fd, POLLOUT, 0 };
+        if (poll(&p, 1, IO_TIMEOUT_MS) == 0) return false;
+    }
+}
+
+static void *sender_main(void *arg) {
+    run_t *r = arg;
+    uint8_t buf[MAX_PACKET];
+    uint64_t seq = 0;
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= r->end_ns) break;
+        // Send what the rate allows by now, then sleep a little
+        uint64_t due = r->rate > 0 ? (uint64_t)((now - r->start_ns) * r->rate / 1e9) + 1 : seq + 64;
+        if (seq >= due) {
+            sleep_until(now + PACE_SLEEP_NS);
+            continue;
+        }
+        while (seq < due) {
+            size_t len = build_packet(r, seq, buf);
+            uint64_t ns = now_ns();
+            stamp(buf, len, seq | r->mark, ns);
+            if (!put_packet(r->inject, buf, len)) {
+                if (ns >= r->end_ns) break;
+                continue;    // queue full for a while: try again
+            }
+            if (ns >= r->window_ns && ns < r->end_ns) r->sent++;
+            seq++;
+        }
+    }
+    return NULL;
+}
+
+static void *receiver_main(void *arg) {
+    run_t *bulk = arg;
+    uint8_t buf[65536];
+    while (!atomic_load(&bulk->stop)) {
+        ssize_t n = read(bulk->collect, buf, sizeof(buf));
+        if (n < 0) {
+            struct pollfd p = { bulk->collect, POLLIN, 0 };
+            poll(&p, 1, IO_TIMEOUT_MS);
+            continue;
+        }
+        uint64_t now = now_ns(), seq, sent_ns;
+        if (n < MIN_PACKET) continue;
+        memcpy(&seq, buf + n - STAMP_LEN, 8);
+        memcpy(&sent_ns, buf + n - 8, 8);
+        run_t *r = seq & INTERACTIVE_MARK && bulk->interactive ? bulk->interactive : bulk;
+        if (sent_ns < r->window_ns || sent_ns >= r->end_ns || sent_ns > now) continue;
+        r->received++;
+        r->received_bytes += n;
+        if (r->latency_count == r->latency_cap) {
+            size_t cap = r->latency_cap ? 2 * r->latency_cap : 65536;
+            uint32_t *grown = realloc(r->latency, cap * sizeof(*grown));
+            if (!grown) continue;
+            r->latency = grown;
+            r->latency_cap = cap;
+        }
+        uint64_t latency = now - sent_ns;
+        r->latency[r->latency_count++] = latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+    }
+    return NULL;
+}
+
+static void drain(int fd) {
+    uint8_t buf[65536];
+    while (read(fd, buf, sizeof(buf)) >= 0) {
+    }
+}
+
+// Send small packets from one daemon until one comes out of the other:
+// the handshake is done and, going down, the server has learned the
+// client's inner address from it
+static bool probe(int inject, int collect, bool down) {
+    traffic_t t = { "probe", MIN_PACKET, NULL };
+    run_t r = { .traffic = &t, .down = down, .flows = 1 };
+    uint8_t buf[MAX_PACKET], in[65536];
+    uint64_t deadline = now_ns() + PROBE_TIMEOUT_NS;
+    for (uint64_t seq = 0; now_ns() < deadline; seq++) {
+        size_t len = build_packet(&r, seq, buf);
+        stamp(buf, len, seq, now_ns());
+        put_packet(inject, buf, len);
+        uint64_t next = now_ns() + PROBE_INTERVAL_NS;
+        while (now_ns() < next) {
+            if (read(collect, in, sizeof(in)) >= MIN_PACKET) return true;
+            struct pollfd p = { collect, POLLIN, 0 };
+            poll(&p, 1, 1);
+        }
+    }
+    return false;
+}
+
+// utime + stime of a process, in seconds
+static double cpu_seconds(pid_t pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    const char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (p) sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint32_t *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t i = (size_t)(p * n);
+    return sorted[i < n ? i : n - 1] / 1e3;
+}
+
+// Start a daemon with its end of the TUN backend at fds[0] (and fds[1]
+// for pipes), which are close-on-exec everywhere else
+static pid_t spawn(char *const argv[], const int *fds, int nfds) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    for (int i = 0; i < nfds; i++) fcntl(fds[i], F_SETFD, 0);
+    dup2(STDERR_FILENO, STDOUT_FILENO);    // keep stdout for the results
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+}
+
+// The TUN backend of one daemon: our two ends, its spec and its fds
+static int make_backend(bool pipes, daemon_t *d, char *spec, size_t spec_len, int fds[2]) {
+    if (!pipes) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, sv) != 0) return -1;
+        d->inject = d->collect = sv[0];
+        fds[0] = sv[1];
+        // Blocking on the daemon's side, as it would find a TUN device
+        fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) & ~O_NONBLOCK);
+        snprintf(spec, spec_len, "socket:%d", sv[1]);
+        return 1;
+    }
+    int in[2], out[2];
+    if (pipe2(in, O_DIRECT | O_CLOEXEC) != 0 || pipe2(out, O_DIRECT | O_CLOEXEC) != 0) return -1;
+    d->inject = in[1];
+    d->collect = out[0];
+    fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL) | O_NONBLOCK);
+    fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+    fds[0] = in[0];
+    fds[1] = out[1];
+    snprintf(spec, spec_len, "pipe:%d,%d", in[0], out[1]);
+    return 2;
+}
+
+static void close_daemon_ends(const int *fds, int nfds) {
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+}
+
+typedef struct {
+    char key[256];                   // the fields that identify the case
+    double mpps, p99_us;
+} result_t;
+
+// Run one case, with the -i flow if interactive_rate is set, and print
+// its JSON line
+static bool run_case(const traffic_t *t, bool down, daemon_t *server, daemon_t *client, const char *backend,
+                     unsigned flows, double rate, double interactive_rate, double seconds, double warmup, result_t *res) {
+    run_t r = { .traffic = t, .down = down, .flows = flows, .rate = rate };
+    r.inject = down ? server->inject : client->inject;
+    r.collect = down ? client->collect : server->collect;
+    drain(server->collect);
+    drain(client->collect);
+
+    r.start_ns = now_ns();
+    r.window_ns = r.start_ns + (uint64_t)(warmup * 1e9);
+    r.end_ns = r.window_ns + (uint64_t)(seconds * 1e9);
+
+    traffic_t small = { "interactive", 64, NULL };
+    run_t ir = r;
+    ir.traffic = &small;
+    ir.flows = 1;
+    ir.rate = interactive_rate;
+    ir.mark = INTERACTIVE_MARK;
+    if (interactive_rate > 0) r.interactive = &ir;
+
+    pthread_t sender, receiver, interactive_sender;
+    pthread_create(&receiver, NULL, receiver_main, &r);
+    pthread_create(&sender, NULL, sender_main, &r);
+    if (r.interactive) pthread_create(&interactive_sender, NULL, sender_main, &ir);
+
+    sleep_until(r.window_ns);
+    double cpu = cpu_seconds(server->pid) + cpu_seconds(client->pid);
+    sleep_until(r.end_ns);
+    cpu = cpu_seconds(server->pid) + cpu_seconds(client->pid) - cpu;
+    pthread_join(sender, NULL);
+    if (r.interactive) pthread_join(interactive_sender, NULL);
+    sleep_until(r.end_ns + DRAIN_NS);
+    atomic_store(&r.stop, true);
+    pthread_join(receiver, NULL);
+
+    qsort(r.latency, r.latency_count, sizeof(*r.latency), compare_u32);
+    double gb = r.received_bytes / 1e9;
+    int n = snprintf(res->key, sizeof(res->key), "\"case\":\"%s\",\"direction\":\"%s\",\"backend\":\"%s\",\"flows\":%u,\"rate_pps\":%.0f",
+                     t->name, down ? "down" : "up", backend, flows, rate);
+    if (r.interactive) snprintf(res->key + n, sizeof(res->key) - n, ",\"interactive_pps\":%.0f", interactive_rate);
+    res->mpps = r.received / seconds / 1e6;
+    res->p99_us = percentile_us(r.latency, r.latency_count, 0.99);
+    printf("{%s,\"seconds\":%g,\"sent\":%llu,\"received\":%llu,\"loss\":%.6f,\"mpps\":%.4f,\"gbps\":%.4f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"cpu_s_per_gb\":%.3f",
+           res->key, seconds, (unsigned long long)r.sent, (unsigned long long)r.received,
+           r.sent ? 1.0 - (double)r.received / r.sent : 0.0, res->mpps, gb * 8 / seconds,
+           percentile_us(r.latency, r.latency_count, 0.5), res->p99_us,
+           percentile_us(r.latency, r.latency_count, 0.999), gb > 0 ? cpu / gb : 0.0);
+    if (r.interactive) {
+        qsort(ir.latency, ir.latency_count, sizeof(*ir.latency), compare_u32);
+        printf(",\"interactive_loss\":%.6f,\"interactive_p50_us\":%.1f,\"interactive_p99_us\":%.1f",
+               ir.sent ? 1.0 - (double)ir.received / ir.sent : 0.0, percentile_us(ir.latency, ir.latency_count, 0.5),
+               percentile_us(ir.latency, ir.latency_count, 0.99));
+    }
+    printf("}\n");
+    fflush(stdout);
+    free(r.latency);
+    free(ir.latency);
+    return r.received > 0;
+}
+
+// Compare with the baseline line of the same case, if there is one
+static bool regressed(const result_t *res, const char *baseline, double threshold) {
+    FILE *f = fopen(baseline, "r");
+    if (!f) {
+        perror(baseline);
+        return true;
+    }
+    char line[1024];
+    bool worse = false;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strstr(line, res->key)) continue;
+        const char *mpps = strstr(line, "\"mpps\":"), *p99 = strstr(line, "\"p99_us\":");
+        if (!mpps || !p99) break;
+        double base_mpps = strtod(mpps + 7, NULL), base_p99 = strtod(p99 + 9, NULL);
+        if (res->mpps < base_mpps * (1 - threshold)) {
+            fprintf(stderr, "Regression {%s}: %.4f Mpps, baseline %.4f\n", res->key, res->mpps, base_mpps);
+            worse = true;
+        }
+        if (base_p99 > 0 && res->p99_us > base_p99 * (1 + threshold)) {
+            fprintf(stderr, "Regression {%s}: p99 %.1f us, baseline %.1f\n", res->key, res->p99_us, base_p99);
+            worse = true;
+        }
+        break;
+    }
+    fclose(f);
+    return worse;
+}
+
+int main(int argc, char *argv[]) {
+    const char *cert = NULL, *key = NULL, *backend = "socket", *size = NULL, *direction = "both";
+    const char *baseline = NULL, *bin_dir = ".", *workers = "1";
+    unsigned flows = 1;
+    double rate = 0, interactive_rate = 0, seconds = 3, warmup = 1, threshold = 0.1;
+    int opt;
+    while ((opt = getopt(argc, argv, "C:k:b:s:d:f:r:t:W:w:i:x:B:T:")) != -1) {
+        switch (opt) {
+        case 'C': cert = optarg; break;
+        case 'k': key = optarg; break;
+        case 'b': backend = optarg; break;
+        case 's': size = optarg; break;
+        case 'd': direction = optarg; break;
+        case 'f': flows = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 't': seconds = atof(optarg); break;
+        case 'W': warmup = atof(optarg); break;
+        case 'w': workers = optarg; break;
+        case 'i': interactive_rate = atof(optarg); break;
+        case 'x': bin_dir = optarg; break;
+        case 'B': baseline = optarg; break;
+        case 'T': threshold = atof(optarg) / 100; break;
+        default: cert = NULL; optind = argc; break;
+        }
+    }
+    bool pipes = strcmp(backend, "pipe") == 0;
+    bool up = strcmp(direction, "down") != 0, down = strcmp(direction, "up") != 0;
+    bool known = strcmp(direction, "up") == 0 || strcmp(direction, "down") == 0 || strcmp(direction, "both") == 0;
+    if (!cert || !key || (!pipes && strcmp(backend, "socket") != 0) || !known || flows == 0 || seconds <= 0 || interactive_rate < 0) {
+        fprintf(stderr, "Usage: %s -C cert.pem -k key.pem [-b socket|pipe] [-s 64|512|1280|SIZE|imix|pcap:FILE] "
+                "[-d up|down|both] [-f flows] [-r pps] [-t seconds] [-W warmup_seconds] [-w server_workers] "
+                "[-i pps] [-x bin_dir] [-B baseline.jsonl] [-T threshold_percent]\n", argv[0]);
+        return 2;
+    }
+
+    // The cases: one size, or the suite
+    traffic_t cases[sizeof(suite) / sizeof(suite[0])];
+    char names[sizeof(suite) / sizeof(suite[0])][16];
+    size_t ncases = 0;
+    pcap_file_t pcap = {0};
+    if (!size) {
+        for (size_t i = 0; i < sizeof(suite) / sizeof(suite[0]); i++) {
+            snprintf(names[i], sizeof(names[i]), "%zu", suite[i]);
+            cases[ncases++] = (traffic_t){ suite[i] ? names[i] : "imix", suite[i], NULL };
+        }
+    } else if (strcmp(size, "imix") == 0) {
+        cases[ncases++] = (traffic_t){ "imix", 0, NULL };
+    } else if (strncmp(size, "pcap:", 5) == 0) {
+        if (pcap_file_load(&pcap, size + 5) != 0) return 2;
+        // Only IPv4 packets can be readdressed to the tunnel
+        size_t kept = 0;
+        for (size_t i = 0; i < pcap.count; i++) {
+            if (pcap.packets[i].data[0] >> 4 == 4) pcap.packets[kept++] = pcap.packets[i];
+        }
+        pcap.count = kept;
+        if (kept == 0) {
+            fprintf(stderr, "%s: no IPv4 packets\n", size + 5);
+            return 2;
+        }
+        cases[ncases++] = (traffic_t){ size, 0, &pcap };
+    } else {
+        size_t fixed = strtoul(size, NULL, 10);
+        if (fixed < MIN_PACKET || fixed > MAX_PACKET) {
+            fprintf(stderr, "Packet sizes are %d to %d bytes\n", MIN_PACKET, MAX_PACKET);
+            return 2;
+        }
+        cases[ncases++] = (traffic_t){ size, fixed, NULL };
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    daemon_t server, client;
+    char server_spec[64], client_spec[64], server_bin[4096], client_bin[4096];
+    int server_fds[2], client_fds[2];
+    int nserver = make_backend(pipes, &server, server_spec, sizeof(server_spec), server_fds);
+    int nclient = make_backend(pipes, &client, client_spec, sizeof(client_spec), client_fds);
+    if (nserver < 0 || nclient < 0) {
+        perror("TUN backend");
+        return 2;
+    }
+    snprintf(server_bin, sizeof(server_bin), "%s/server", bin_dir);
+    snprintf(client_bin, sizeof(client_bin), "%s/client", bin_dir);
+    // The server trusts the client's certificate because it is its own
+    char *server_argv[] = { server_bin, "-C", (char *)cert, "-k", (char *)key, "-V", (char *)cert,
+                            "-w", (char *)workers, "-L", "error", "-T", server_spec, NULL };
+    char *client_argv[] = { client_bin, "-c", (char *)cert, "-k", (char *)key, "-I",
+                            "-L", "error", "-s", "127.0.0.1", client_spec, NULL };
+    server.pid = spawn(server_argv, server_fds, nserver);
+    usleep(200000);    // let it bind before the client's first Initial
+    client.pid = spawn(client_argv, client_fds, nclient);
+    close_daemon_ends(server_fds, nserver);
+    close_daemon_ends(client_fds, nclient);
+
+    int status = 0;
+    if (!probe(client.inject, server.collect, false) || (down && !probe(server.inject, client.collect, true))) {
+        fprintf(stderr, "No packets through the tunnel after %llu s\n", PROBE_TIMEOUT_NS / 1000000000ULL);
+        status = 2;
+    }
+    for (size_t i = 0; i < ncases && status != 2; i++) {
+        for (int d = 0; d < 2; d++) {
+            if (!(d ? down : up)) continue;
+            result_t res;
+            if (!run_case(&cases[i], d, &server, &client, backend, flows, rate, interactive_rate, seconds, warmup, &res)) {
+                fprintf(stderr, "No packets delivered {%s}\n", res.key);
+                status = 1;
+            }
+            if (baseline && regressed(&res, baseline, threshold)) status = 1;
+        }
+    }
+
+    kill(server.pid, SIGTERM);
+    kill(client.pid, SIGTERM);
+    waitpid(server.pid, NULL, 0);
+    waitpid(client.pid, NULL, 0);
+    pcap_file_free(&pcap);
+    return status;
+}
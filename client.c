@@ -9,292 +9,1418 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <linux/if_tun.h>	// TUN Interface
-#include <net/if.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include "packet.h"
+#include "replay.h"
+#include "batch_io.h"
+#include "event.h"
+#include "handshake.h"
+#include "flow.h"
+#include "frame.h"
+#include "coalesce.h"
+#include "hdrcomp.h"
+#include "fec.h"
+#include "multipath.h"
+#include "recovery.h"
+#include "vnet.h"
+#include "tun.h"
+#include "crypto.h"
+#include "pmtud.h"
+#include "log.h"
+#include "metrics.h"
+#include <errno.h>
 
 #define PORT 8080
-#define BUFFER_SIZE 2048
-#define MAX_STREAMS 1024
+#define MAX_FLOWS 4096	// inner flows with their own stream ID
+#define FLOW_TIMEOUT 300	// seconds before an idle flow's stream is dropped
+#define DEFAULT_KEEPALIVE 25	// seconds without sending before a PING (-P)
 
-uint8_t key[32] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
-                   0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
-                   0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
-                   0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20};
+// For outgoing packets
+static uint64_t outgoing_packet_number = CLIENT_INITIAL_PN;
+// Largest packet number received from server + 1
+static uint64_t expected_packet_number = SERVER_INITIAL_PN;
+// Accepted/reordered packet numbers from server
+static replay_window_t incoming_replay;
 
-static int global_stream_id = 0;
-pthread_mutex_t stream_id_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Data plane counters, batch sizes and stage latencies, written by the
+// loop thread only (see metrics.h)
+static metrics_t metrics;
 
-// For outgoing packets
-static uint64_t outgoing_packet_number = 1000;
-// For incoming packets from server
-static uint64_t incoming_packet_number = 2000;
+struct client;
 
-// Stream tracking
+// One of our paths to the server: a socket of its own, bound to a local
+// address or interface (-p) and connected to where the server is
+// reached on it. The first carries the handshake.
 typedef struct {
-	int stream_id;
-	bool active;
-	time_t last_activity;
-} client_stream_t;
+	struct client *client;
+	unsigned index;
+	int sock_fd;
+	const char *local;	// address or interface bound to, NULL for any
+	struct sockaddr_in server_addr;
+	size_t max_datagram;	// what its route allows
+	uint64_t rebinds;	// times the socket moved to a new local port
+	bool rebind_due;	// sends fail for want of our local address
+	uint8_t path_response[FRAME_TOKEN_LEN];	// challenge data to echo to the server
+	bool path_response_due;
+	dgram_batch_t rx, tx;
+} client_path_t;
 
-static client_stream_t active_streams[MAX_STREAMS];
+// Tunnel endpoints and per-direction state driven by the event loop
+typedef struct client {
+	client_path_t paths[MP_MAX_PATHS];
+	unsigned npaths;
+	uint64_t cid;	// connection ID the server issued, 0 until it has
+	unsigned keepalive_ms;	// PING when nothing was sent for this long, 0 for never
+	uint64_t last_sent_ms;	// event_loop_now_ms of the last flush
+	event_timer_t keepalive;
+	tun_t tun;	// the TUN device, or another backend
+	size_t tun_mtu;	// as last set
+	bool tun_offload;	// super-packets cut up in userspace, writes merged
+	handshake_config_t tls;
+	handshake_t hs;
+	ptls_aead_context_t *encrypt_aead;	// session keys, once the handshake completes
+	ptls_aead_context_t *decrypt_aead;
+	ptls_aead_context_t *early_aead;	// 0-RTT key while resuming
+	uint64_t early_packets;
+	flow_table_t flows;	// inner flow -> stream ID, loop thread only
+	uint64_t unmapped_packets;	// sent on stream 0 because the flow table was full
+	coalescer_t coalesce;	// TUN packets waiting for their datagram
+	hdrcomp_tx_t hc_tx;	// header compression of our packets, per session
+	hdrcomp_rx_t hc_rx;	// and of the server's
+	hdrcomp_stats_t hc_stats;
+	fec_tx_t *fec_tx;	// repairs for our packets, with -X, per session
+	fec_rx_t *fec_rx;	// and the server's loss rate and repairs
+	fec_stats_t fec_stats;
+	const congestion_ops_t *congestion;
+	mp_t mp;	// our packets to the server on each path, per session
+	mp_reorder_t *reorder;	// the server's packets, with several paths
+	mp_reorder_stats_t reorder_stats;
+	ack_state_t ack;	// server packets not yet acknowledged
+	unsigned ack_path;	// the last ack-eliciting one came on it
+	crypto_seal_t *seals;	// datagrams in the paths' tx still to be sealed
+	size_t nseals;
+	event_loop_t *loop;
+} client_t;
 
-int open_tun_device(char *dev) {
-	struct ifreq ifr;
-	int fd, err;
-	
-	if ((fd = open("/dev/net/tun", O_RDWR)) < 0) {
-		perror("Opening /dev/net/tun");
-		return fd;
+// Rebuild the IP packet of a HC frame from the server and write it to
+// TUN. If its context is out of step, the server is asked for a full
+// header with our next packet.
+static void write_decompressed(client_t *c, const frame_t *frame) {
+	pktbuf_t *out = pktbuf_alloc(event_loop_pool(c->loop));
+	if (!out) {
+		metrics_drop(&metrics, METRICS_DROP_NO_BUFFER);
+		return;
+	}
+	out->len = hdrcomp_decompress(&c->hc_rx, frame->context, frame->data, frame->len, out->data, pktbuf_tailroom(out));
+	if (out->len == 0) {
+		log_limited(LOG_LEVEL_WARN, "Compressed packet from server on unknown context %02x\n", frame->context);
+		metrics_drop(&metrics, METRICS_DROP_CONTEXT);
+	} else {
+		event_write(c->loop, c->tun.write_fd, out);
+		metric_add(&metrics.tun_tx_packets, 1);
+		metric_add(&metrics.tun_tx_bytes, out->len);
+	}
+	pktbuf_put(out);
+}
+
+// Write the IP packet of a data frame (STREAM, DATAGRAM, HC or HC_FULL)
+// from the server to TUN. pkt is the buffer the frame sits in.
+static void deliver_frame(client_t *c, pktbuf_t *pkt, const frame_t *frame) {
+	log_debug("Received server response on stream %d | Payload length: %zu\n", frame->stream_id, frame->len);
+
+	if (frame->stream_id != 0 && !flow_stream_active(&c->flows, frame->stream_id)) {
+		log_limited(LOG_LEVEL_WARN, "Warning: Received data for unknown stream ID: %d\n", frame->stream_id);
 	}
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+
+	// A compressed packet is rebuilt into a buffer of its own; a full
+	// header sets up its context and goes on like the rest
+	if (frame->type == FRAME_HC) {
+		write_decompressed(c, frame);
+		return;
+	}
+	if (frame->type == FRAME_HC_FULL && hdrcomp_full(&c->hc_rx, frame->context, frame->data, frame->len) != 0) {
+		log_limited(LOG_LEVEL_WARN, "Malformed full header from server\n");
+		metrics_drop(&metrics, METRICS_DROP_MALFORMED);
+		return;
+	}
+
+	// Write the frame's IP packet to TUN from where it was decrypted
+	pkt->data = frame->data;
+	pkt->len = frame->len;
+	event_write(c->loop, c->tun.write_fd, pkt);
+	metric_add(&metrics.tun_tx_packets, 1);
+	metric_add(&metrics.tun_tx_bytes, frame->len);
+}
+
+// Deliver the data frames of a payload from the server that comes later
+// than its packet did (rebuilt by FEC, or held for reordering) to TUN.
+// Its other frames were about the past by now. Returns true if it had
+// any.
+static bool deliver_data(client_t *c, pktbuf_t *pkt) {
+	uint8_t *payload = pkt->data;
+	size_t len = pkt->len;
+	bool delivered = false;
+	size_t off = 0;
+	frame_t frame;
+	while (frame_next(payload, len, &off, &frame) > 0) {
+		if (frame.type == FRAME_STREAM || frame.type == FRAME_DATAGRAM || frame.type == FRAME_HC || frame.type == FRAME_HC_FULL) {
+			deliver_frame(c, pkt, &frame);
+			delivered = true;
+		}
+	}
+	return delivered;
+}
+
+// Deliver the packets FEC rebuilt from the server's repairs as if they
+// had arrived: into the replay window, which drops those that did in
+// the end and has the others acknowledged, and their data frames to
+// TUN. Returns true if any were delivered.
+static bool deliver_rebuilt(client_t *c) {
+	bool delivered = false;
+	for (;;) {
+		pktbuf_t *pkt = pktbuf_alloc(event_loop_pool(c->loop));
+		if (!pkt) {
+			metrics_drop(&metrics, METRICS_DROP_NO_BUFFER);
+			return delivered;
+		}
+		uint64_t pn;
+		size_t len = fec_rx_take(c->fec_rx, &pn, pkt->data, pktbuf_tailroom(pkt));
+		if (len == 0) {
+			pktbuf_put(pkt);
+			return delivered;
+		}
+		if (replay_update(&incoming_replay, pn)) {
+			metric_add(&c->fec_stats.recovered, 1);
+			pkt->len = len;
+			if (deliver_data(c, pkt)) delivered = true;
+		}
+		pktbuf_put(pkt);
+	}
+}
+
+// Deliver what the reorder buffer lets go by now
+static void deliver_reordered(client_t *c, uint64_t now_ns) {
+	for (;;) {
+		pktbuf_t *pkt = pktbuf_alloc(event_loop_pool(c->loop));
+		if (!pkt) {
+			metrics_drop(&metrics, METRICS_DROP_NO_BUFFER);
+			return;
+		}
+		uint64_t pn;
+		size_t len = mp_reorder_pop(c->reorder, now_ns, &pn, pkt->data, pktbuf_tailroom(pkt), &c->reorder_stats);
+		if (len == 0) {
+			pktbuf_put(pkt);
+			return;
+		}
+		pkt->len = len;
+		deliver_data(c, pkt);
+		pktbuf_put(pkt);
+	}
+}
+
+// Datagram bytes kept free for FEC, with -X (see fec.h), and for naming
+// the path, with several
+static size_t frame_overhead(const client_t *c) {
+	return (c->fec_tx ? FEC_OVERHEAD : 0) + (c->npaths > 1 ? FRAME_MP_PATH_LEN : 0);
+}
+
+// The most that an ACK, requests for full headers and our loss rate may
+// add to a datagram with room to spare. It is set aside before a path is
+// picked, so the window and pacer approve the datagram as it goes out.
+static size_t extras_reserve(client_t *c, size_t room) {
+	size_t n = (ack_state_due(&c->ack) ? FRAME_ACK_MAX : 0) + FRAME_HC_RESYNC_LEN * HDRCOMP_CONTEXTS + (c->fec_rx ? FRAME_FEC_LEN : 0);
+	return n < room ? n : room;
+}
+
+// The path the scheduler's state p belongs to
+static client_path_t *client_path(client_t *c, const mp_path_t *p) {
+	return &c->paths[p - c->mp.paths];
+}
+
+// Name the path in a packet going out on one other than the first: an
+// MP_PATH frame in front of its frames, where FEC puts its FEC_SOURCE
+// frame in front of both
+static void tag_path(const client_path_t *path, pktbuf_t *pkt) {
+	if (path->index == 0) return;
+	uint8_t *frame = pktbuf_push(pkt, FRAME_MP_PATH_LEN);
+	frame[0] = FRAME_MP_PATH;
+	frame[1] = (uint8_t)path->index;
+}
+
+// Encrypt the frames of one datagram in place as packet pn: the
+// cleartext header goes into the headroom and the AEAD tag into the
+// tailroom.
+void seal_packet(ptls_aead_context_t *encrypt_aead, pktbuf_t *pkt, uint64_t cid, uint64_t pn, size_t pn_len, bool zero_rtt) {
+	uint8_t *plain = pkt->data;
+	size_t plain_len = pkt->len;
 	
-	if (*dev) {
-		strncpy(ifr.ifr_name, dev, IFNAMSIZ);
+	// Cleartext header with our connection ID, if we have one, and the
+	// packet number truncated to what the server needs, given what it
+	// has acknowledged
+	uint8_t *hdr = pktbuf_push(pkt, packet_header_length(cid, pn_len));
+	size_t hdr_len = packet_encode_header(hdr, cid, pn, pn_len);
+	if (zero_rtt) {
+		packet_mark_zero_rtt(hdr);
+	}
+
+	// Encrypt packet, authenticating the header as associated data
+	pkt->len = hdr_len + ptls_aead_encrypt(encrypt_aead, plain, plain, plain_len, pn, hdr, hdr_len);
+}
+
+// Seal the datagrams queued since the last flush in one pass, timing
+// the average per datagram. Runs before each flush, and before a key
+// they may use is freed.
+static void seal_datagrams(client_t *c) {
+	if (c->nseals == 0) return;
+	uint64_t start_ns = event_clock_ns();
+	crypto_seal_batch(c->seals, c->nseals);
+	metrics_observe(&metrics.stages[METRICS_STAGE_CRYPT], (event_clock_ns() - start_ns) / c->nseals);
+	c->nseals = 0;
+}
+
+// Follow the confirmed path MTUs: each is its congestion controller's
+// packet size, and the smallest of the paths in use bounds the TUN MTU.
+// The TUN MTU is raised once the searches complete, but lowered at once
+// when a path shrinks.
+static void path_mtu_changed(client_t *c) {
+	for (unsigned i = 0; i < c->mp.count; i++) {
+		mp_path_t *p = &c->mp.paths[i];
+		if (p->state != MP_PATH_UNUSED) p->recovery.cc.mss = p->pmtud.plpmtu;
+	}
+	size_t plpmtu = mp_mtu(&c->mp);
+	size_t mtu = pmtud_tun_mtu(plpmtu - frame_overhead(c));
+	if (mtu == c->tun_mtu || (mtu > c->tun_mtu && !mp_mtu_confirmed(&c->mp))) return;
+	if (tun_set_mtu(&c->tun, mtu) != 0) {
+		log_error("Setting the MTU of %s to %zu: %s\n", c->tun.name, mtu, strerror(errno));
+	} else {
+		log_info("Path MTU %zu bytes, %s MTU set to %zu\n", plpmtu, c->tun.name, mtu);
+	}
+	c->tun_mtu = mtu;
+}
+
+// Open our other paths once the server has issued a connection ID, by
+// which it finds the session on them
+static void open_paths(client_t *c) {
+	for (unsigned i = 1; i < c->npaths; i++) {
+		client_path_t *path = &c->paths[i];
+		if (mp_path_open_at(&c->mp, i)) continue;
+		if (mp_path_open(&c->mp, i, &path->server_addr, path->max_datagram) != 0) {
+			log_error("Out of memory opening path %u\n", i);
+			continue;
+		}
+		log_info("Path %u to %s opened, probing it\n", i, log_addr(&path->server_addr));
+	}
+}
+
+// Authenticate, replay-check and deliver one datagram from the server,
+// which came on path. It is decrypted in place and each frame's IP
+// packet written to TUN from there.
+void handle_server_packet(client_path_t *path, pktbuf_t *pkt) {
+	client_t *c = path->client;
+	uint8_t *buffer = pkt->data;
+	size_t bytes_received = pkt->len;
+	metric_add(&metrics.rx_packets, 1);
+	metric_add(&metrics.rx_bytes, bytes_received);
+	uint64_t start_ns = metrics_timed(&metrics) ? event_clock_ns() : 0;	// 0: not timed
+	if (!c->decrypt_aead) {
+		log_limited(LOG_LEVEL_WARN, "Server packet before the handshake completed\n");
+		metrics_drop(&metrics, METRICS_DROP_NO_SESSION);
+		return;
+	}
+	packet_header_t hdr;
+	if (packet_decode_header(buffer, bytes_received, expected_packet_number, &hdr) != 0 || hdr.zero_rtt) {
+		log_limited(LOG_LEVEL_WARN, "Malformed header from server\n");
+		metrics_drop(&metrics, METRICS_DROP_MALFORMED);
+		return;
 	}
+	if (!replay_check(&incoming_replay, hdr.packet_number)) {
+		log_limited(LOG_LEVEL_WARN, "Replayed or stale server packet %llu\n", (unsigned long long)hdr.packet_number);
+		metrics_drop(&metrics, METRICS_DROP_REPLAY);
+		return;
+	}
+
+	// Decrypt the packet in place
+	uint8_t *decrypted = buffer + hdr.header_len;
+	uint64_t crypt_ns = start_ns ? event_clock_ns() : 0;
+	size_t dec_len = ptls_aead_decrypt(c->decrypt_aead, decrypted, buffer + hdr.header_len, bytes_received - hdr.header_len, hdr.packet_number, buffer, hdr.header_len);
+	if (start_ns) metrics_observe(&metrics.stages[METRICS_STAGE_CRYPT], event_clock_ns() - crypt_ns);
 	
-	if ((err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
-		perror("ioctl(TUNSETIFF)");
-		close(fd);
-		return err;
-	}
-	printf("TUN device %s opened\n", ifr.ifr_name);
-	strcpy(dev, ifr.ifr_name);
-	return fd;
-}
-
-// Keep track of the stream ID for multiplexing
-int allocate_client_stream_id() {
-	pthread_mutex_lock(&stream_id_mutex);
-	int id = ++global_stream_id;
-	pthread_mutex_unlock(&stream_id_mutex);
-	register_stream(id);
-	return id;
-}
-
-// Register a new stream
-void register_stream(int stream_id) {
-	pthread_mutex_lock(&stream_id_mutex);
-	// Find free slot
-	for (int i = 0; i < MAX_STREAMS; i++) {
-		if (!active_streams[i].active) {
-			active_streams[i].stream_id = stream_id;
-			active_streams[i].active = true;
-			active_streams[i].last_activity = time(NULL);
-			pthread_mutex_unlock(&stream_id_mutex);
-			return;
+	if (dec_len == SIZE_MAX) {
+		log_limited(LOG_LEVEL_WARN, "Failed to decrypt server message\n");
+		metrics_drop(&metrics, METRICS_DROP_DECRYPT);
+		return;
+	}
+
+	// A lost or reordered datagram no longer desynchronises the session
+	replay_update(&incoming_replay, hdr.packet_number);
+	bool largest = hdr.packet_number >= expected_packet_number;
+	if (largest) {
+		expected_packet_number = hdr.packet_number + 1;
+	}
+	bool rebuilt = c->fec_rx && fec_rx_on_packet(c->fec_rx, hdr.packet_number, decrypted, dec_len);
+
+	// With several paths, data that overtook a packet on another path
+	// waits for it in the reorder buffer
+	uint64_t now_ns = event_clock_ns();
+	bool held = c->reorder && mp_reorder_hold(c->reorder, path->index, hdr.packet_number, decrypted, dec_len, now_ns, &c->reorder_stats);
+	bool ack_eliciting = false;
+	size_t off = 0;
+	frame_t frame;
+	int more;
+	while ((more = frame_next(decrypted, dec_len, &off, &frame)) > 0) {
+		// Acknowledgements of what we sent; they may open the window
+		if (frame.type == FRAME_ACK) {
+			ack_frame_t ack;
+			if (frame_decode_ack(&frame, &ack) != 0) {
+				log_limited(LOG_LEVEL_WARN, "Invalid ACK frame from server\n");
+				metrics_drop(&metrics, METRICS_DROP_MALFORMED);
+				continue;
+			}
+			bool confirmed = false;
+			unsigned up = mp_on_ack(&c->mp, &ack, now_ns, &confirmed);
+			for (unsigned i = 0; i < MP_MAX_PATHS; i++) {
+				if (up & 1u << i) log_info("Path %u in use\n", i);
+			}
+			if (confirmed || up) {
+				path_mtu_changed(c);
+			}
+			coalesce_retry(&c->coalesce, 0);
+			continue;
+		}
+		// Path MTU probe: only asks for an acknowledgement
+		if (frame.type == FRAME_PING) {
+			ack_eliciting = true;
+			continue;
+		}
+		// Connection ID to put in our headers from now on, so that the
+		// server keeps the session when our address changes
+		if (frame.type == FRAME_NEW_CONNECTION_ID) {
+			uint64_t cid = 0;
+			for (size_t i = 0; i < FRAME_TOKEN_LEN; i++) {
+				cid = (cid << 8) | frame.data[i];
+			}
+			if (cid != 0 && cid != c->cid) {
+				log_info("Server issued connection ID %016llx\n", (unsigned long long)cid);
+				c->cid = cid;
+				open_paths(c);
+			}
+			continue;
+		}
+		// The server checks that we are where this came to: echo the
+		// data, from here, at the end of the wakeup
+		if (frame.type == FRAME_PATH_CHALLENGE) {
+			memcpy(path->path_response, frame.data, FRAME_TOKEN_LEN);
+			path->path_response_due = true;
+			continue;
+		}
+		if (frame.type == FRAME_PATH_RESPONSE || frame.type == FRAME_MP_PATH) {
+			continue;
+		}
+		// The server could not rebuild our packets on a context
+		if (frame.type == FRAME_HC_RESYNC) {
+			hdrcomp_on_resync(&c->hc_tx, frame.context, &c->hc_stats);
+			continue;
+		}
+		// The server's loss rate, which has us send repairs; a source's
+		// tag was taken in above
+		if (frame.type == FRAME_FEC) {
+			if (c->fec_tx) {
+				if (c->fec_tx->peer_loss < 0) log_info("Server takes FEC repairs\n");
+				fec_tx_on_report(c->fec_tx, &frame);
+			}
+			continue;
+		}
+		if (frame.type == FRAME_FEC_SOURCE) {
+			continue;
+		}
+		ack_eliciting = true;
+		if (frame.type == FRAME_REPAIR) {
+			if (c->fec_rx && fec_rx_on_repair(c->fec_rx, &frame, &c->fec_stats)) rebuilt = true;
+			continue;
+		}
+		if (!held) deliver_frame(c, pkt, &frame);
+	}
+	if (more < 0) {
+		log_limited(LOG_LEVEL_WARN, "Malformed frame from server\n");
+		metrics_drop(&metrics, METRICS_DROP_MALFORMED);
+	}
+	if (rebuilt && deliver_rebuilt(c)) ack_eliciting = true;
+	if (c->reorder && !held) deliver_reordered(c, now_ns);
+	if (start_ns) metrics_observe(&metrics.stages[METRICS_STAGE_RECV_TO_TUN], event_clock_ns() - start_ns);
+	ack_state_on_received(&c->ack, ack_eliciting, largest, now_ns);
+	if (ack_eliciting) c->ack_path = path->index;
+}
+
+// Begin a session with the server. With a saved ticket it is resumed,
+// and TUN packets go out as 0-RTT from the first flight on.
+static int start_handshake(client_t *c) {
+	if (c->hs.started_ns) {
+		handshake_free(&c->hs);
+		seal_datagrams(c);
+		ptls_aead_context_t **keys[] = { &c->encrypt_aead, &c->decrypt_aead, &c->early_aead };
+		for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+			if (*keys[i]) ptls_aead_free(*keys[i]);
+			*keys[i] = NULL;
+		}
+	}
+	// Packet numbers, congestion state and the connection ID start over
+	// with each session; the other paths wait for the new ID
+	c->cid = 0;
+	for (unsigned i = 0; i < c->npaths; i++) {
+		c->paths[i].path_response_due = false;
+	}
+	outgoing_packet_number = CLIENT_INITIAL_PN;
+	expected_packet_number = SERVER_INITIAL_PN;
+	replay_init(&incoming_replay);
+	memset(&c->ack, 0, sizeof(c->ack));
+	memset(&c->hc_tx, 0, sizeof(c->hc_tx));
+	memset(&c->hc_rx, 0, sizeof(c->hc_rx));
+	if (c->fec_tx) {
+		fec_tx_reset(c->fec_tx);
+		fec_rx_reset(c->fec_rx);
+	}
+	mp_new_session(&c->mp);
+	for (unsigned i = 1; i < c->mp.count; i++) {
+		mp_path_close(&c->mp, i);
+	}
+	if (c->reorder) mp_reorder_reset(c->reorder);
+	c->early_packets = 0;
+
+	if (handshake_start(&c->hs, &c->tls, false) != 0) {
+		return -1;
+	}
+	if (c->hs.max_early_data > 0) {
+		tunnel_secret_t early;
+		if (handshake_export(&c->hs, HANDSHAKE_LABEL_EARLY, true, &early) == 0) {
+			c->early_aead = tunnel_secret_aead(&early, true);
+			ptls_clear_memory(&early, sizeof(early));
+		}
+	}
+	log_info("%s\n", c->early_aead ? "Resuming session with 0-RTT" : c->tls.ticket_len > 0 ? "Resuming session" : "Starting handshake");
+	return handshake_send(&c->hs, c->paths[0].sock_fd, NULL, PACKET_INITIAL, false);
+}
+
+// Switch to the session keys once the handshake has completed
+static void session_ready(client_t *c) {
+	tunnel_secret_t tx, rx;
+	if (handshake_export(&c->hs, HANDSHAKE_LABEL_CLIENT, false, &tx) != 0 || handshake_export(&c->hs, HANDSHAKE_LABEL_SERVER, false, &rx) != 0) {
+		log_error("Failed to export session keys\n");
+		return;
+	}
+	c->encrypt_aead = tunnel_secret_aead(&tx, true);
+	c->decrypt_aead = tunnel_secret_aead(&rx, false);
+	const ptls_cipher_suite_t *suite = tx.suite;
+	ptls_clear_memory(&tx, sizeof(tx));
+	ptls_clear_memory(&rx, sizeof(rx));
+	if (c->early_aead) {
+		seal_datagrams(c);
+		ptls_aead_free(c->early_aead);
+		c->early_aead = NULL;
+	}
+
+	char early[64] = "";
+	if (c->hs.props.client.early_data_acceptance == PTLS_EARLY_DATA_ACCEPTED) {
+		snprintf(early, sizeof(early), ", 0-RTT accepted (%llu packets)", (unsigned long long)c->early_packets);
+	} else if (c->early_packets > 0) {
+		snprintf(early, sizeof(early), ", 0-RTT rejected (%llu packets lost)", (unsigned long long)c->early_packets);
+		// The server will never acknowledge them: start with an empty window
+		mp_new_session(&c->mp);
+	}
+	log_info("Handshake complete (%s) in %.2f ms%s, %s (%s)\n", c->hs.resumed ? "resumed" : "full",
+		(c->hs.completed_ns - c->hs.started_ns) / 1e6, early, suite->name, crypto_engine_name(c->encrypt_aead->algo));
+}
+
+// Feed the server's handshake bytes and send ours in reply
+static void handle_handshake_packet(client_t *c, pktbuf_t *pkt) {
+	handshake_t *hs = &c->hs;
+	// The TLS state stays until the server's session ticket has come too;
+	// until then we keep retransmitting, and the server resends it
+	if (packet_type(pkt->data[0]) == PACKET_DONE) {
+		if (!hs->confirmed && handshake_done_received(hs, pkt->data, pkt->len)) {
+			hs->confirmed = true;
+			handshake_finish(hs);
+		}
+		return;
+	}
+
+	uint32_t offset;
+	const uint8_t *data;
+	size_t len;
+	if (handshake_parse(pkt->data, pkt->len, &offset, &data, &len) != 0 || packet_type(pkt->data[0]) != PACKET_HANDSHAKE) {
+		log_limited(LOG_LEVEL_WARN, "Unexpected handshake packet from server\n");
+		metrics_drop(&metrics, METRICS_DROP_MALFORMED);
+		return;
+	}
+	bool repeated;
+	if (handshake_input(hs, offset, data, len, &repeated) != 0) {
+		if (!hs->complete) {
+			log_warn("Handshake with server failed, starting over\n");
+			start_handshake(c);
+		}
+		return;
+	}
+	handshake_send(hs, c->paths[0].sock_fd, NULL, PACKET_INITIAL, false);
+	if (hs->complete && !c->encrypt_aead) {
+		session_ready(c);
+	}
+}
+
+// Event loop callbacks; a socket's is its path
+static void on_server_datagram(void *arg, pktbuf_t *pkt, struct sockaddr_in *from) {
+	client_path_t *path = arg;
+	if (pkt->len > 0 && packet_is_handshake(pkt->data[0])) {
+		handle_handshake_packet(path->client, pkt);
+		return;
+	}
+	handle_server_packet(path, pkt);
+}
+
+static void on_tun_packet(void *arg, pktbuf_t *pkt, struct sockaddr_in *from) {
+	client_t *c = arg;
+	metric_add(&metrics.tun_rx_packets, 1);
+	metric_add(&metrics.tun_rx_bytes, pkt->len);
+
+	// Session key, or the early key while a resumption is under way
+	if (!c->encrypt_aead && !c->early_aead) {
+		log_limited(LOG_LEVEL_WARN, "No session with the server yet, dropping TUN packet\n");
+		metrics_drop(&metrics, METRICS_DROP_NO_SESSION);
+		return;
+	}
+
+	// Every packet of an inner flow goes on that flow's stream, unless
+	// its headers can be compressed
+	flow_key_t key;
+	int stream_id = 0;
+	if (flow_key_from_packet(pkt->data, pkt->len, &key) == 0) {
+		stream_id = flow_stream_id(&c->flows, &key, event_loop_now_ms(c->loop) / 1000);
+	}
+	if (stream_id == 0) c->unmapped_packets++;
+	int type = stream_id ? FRAME_STREAM : FRAME_DATAGRAM;
+	uint32_t id = (uint32_t)stream_id;
+	uint8_t context;
+	int compressed = hdrcomp_compress(&c->hc_tx, pkt, frame_header_length(type, id, pkt->len), &context, &c->hc_stats);
+	if (compressed) {
+		type = compressed;
+		id = context;
+	}
+
+	// Framed into the datagram being built; it is sealed once full, at
+	// the end of the wakeup or at its deadline
+	if (coalesce_add(&c->coalesce, 0, 0, type, id, pkt, mp_mtu(&c->mp) - frame_overhead(c), event_clock_ns()) != 0) {
+		log_limited(LOG_LEVEL_WARN, "No packet buffer, dropping TUN packet\n");
+		metrics_drop(&metrics, METRICS_DROP_NO_BUFFER);
+		if (compressed) hdrcomp_on_dropped(&c->hc_tx, context);
+	}
+}
+
+// A send on a path failed. If our local address went away (we roamed,
+// or its interface went down), the other paths take over at once, and
+// a session with a connection ID can carry on from another address.
+static void send_failed(client_t *c, client_path_t *path) {
+	int err = errno;
+	log_limited(LOG_LEVEL_ERROR, "send failed on path %u: %s\n", path->index, strerror(err));
+	if (err != EADDRNOTAVAIL && err != EINVAL && err != ENETUNREACH && err != ENETDOWN) return;
+	if (mp_path_down(&c->mp, path->index)) {
+		log_info("Path %u failed, %u left in use\n", path->index, mp_active(&c->mp));
+		path_mtu_changed(c);
+	}
+	if (c->cid) path->rebind_due = true;
+}
+
+// Send what the paths' batches hold. A flush is one syscall per path for
+// many packets, so every one is timed.
+static void flush_datagrams(client_t *c) {
+	seal_datagrams(c);
+	for (unsigned i = 0; i < c->npaths; i++) {
+		client_path_t *path = &c->paths[i];
+		if (path->tx.count == 0) continue;
+		uint64_t start_ns = event_clock_ns();
+		c->last_sent_ms = event_loop_now_ms(c->loop);
+		if (dgram_batch_flush(path->sock_fd, &path->tx, &metrics.tx_batch) < 0) {
+			send_failed(c, path);
+		}
+		metrics_observe(&metrics.stages[METRICS_STAGE_SEND], event_clock_ns() - start_ns);
+	}
+}
+
+// Queue the frames of one datagram as packet pn on path, making room in
+// its send batch first. The cleartext header goes into the headroom now;
+// the frames are encrypted in place, with the AEAD tag in the tailroom,
+// with the rest of the batches when they are flushed.
+static void queue_datagram(client_t *c, client_path_t *path, ptls_aead_context_t *aead, pktbuf_t *pkt, uint64_t pn, size_t pn_len, bool zero_rtt) {
+	if (path->tx.count == path->tx.capacity) flush_datagrams(c);
+	uint8_t *plain = pkt->data;
+	size_t plain_len = pkt->len;
+	uint8_t *hdr = pktbuf_push(pkt, packet_header_length(c->cid, pn_len));
+	size_t hdr_len = packet_encode_header(hdr, c->cid, pn, pn_len);
+	if (zero_rtt) {
+		packet_mark_zero_rtt(hdr);
+	}
+	c->seals[c->nseals++] = (crypto_seal_t){ aead, plain, plain_len, pn, hdr, hdr_len };
+	pkt->len = hdr_len + plain_len + aead->algo->tag_size;
+	metric_add(&metrics.tx_packets, 1);
+	metric_add(&metrics.tx_bytes, pkt->len);
+	dgram_batch_queue(&path->tx, pkt, NULL);
+}
+
+// Send the repairs of the open FEC group on path and close it. They
+// count as in flight, but go out whatever the congestion window says: a
+// window full of sources must not hold back what rebuilds them.
+static void send_repairs(client_t *c, client_path_t *path, ptls_aead_context_t *aead, uint64_t now_ns) {
+	size_t tag_len = aead->algo->tag_size;
+	unsigned count = fec_tx_repairs(c->fec_tx);
+	for (unsigned row = 0; row < count; row++) {
+		pktbuf_t *pkt = pktbuf_alloc(event_loop_pool(c->loop));
+		if (!pkt) break;
+		pkt->len = fec_tx_repair(c->fec_tx, row, pkt->data, pktbuf_tailroom(pkt) - tag_len, &c->fec_stats);
+		if (pkt->len == 0) {
+			pktbuf_put(pkt);
+			break;
+		}
+		tag_path(path, pkt);
+		uint64_t pn = outgoing_packet_number++;
+		size_t pn_len = mp_pn_length(&c->mp, pn);
+		mp_on_sent(&c->mp.paths[path->index], pn, packet_header_length(c->cid, pn_len) + pkt->len + tag_len, now_ns, true);
+		queue_datagram(c, path, aead, pkt, pn, pn_len, aead == c->early_aead);
+		pktbuf_put(pkt);
+	}
+	fec_tx_close(c->fec_tx);
+}
+
+// Seal the coalesced frames with the key in use now and queue the
+// datagram on the path the scheduler picks, if one's congestion window
+// and pacer allow it. An ACK for the server, requests for full headers
+// and our loss rate ride along if there is room. With FEC on, the
+// datagram joins a group, whose repairs follow once it is full or (see
+// on_round_end) has been open long enough.
+static coalesce_result_t send_coalesced(void *arg, coalesce_slot_t *slot, coalesce_datagram_t *d, uint64_t now_ns, uint64_t *retry_ns) {
+	client_t *c = arg;
+	pktbuf_t *pkt = d->pkt;
+	ptls_aead_context_t *aead = c->encrypt_aead ? c->encrypt_aead : c->early_aead;
+	if (!aead) {
+		log_limited(LOG_LEVEL_WARN, "Session lost with %zu packets queued, dropping them\n", d->frames);
+		metric_add(&metrics.drops[METRICS_DROP_EXPIRED], d->frames);
+		return COALESCE_DROPPED;
+	}
+	size_t tag_len = aead->algo->tag_size;
+	// A source leaves room for its FEC_SOURCE frame and its repairs
+	size_t max_payload = mp_mtu(&c->mp) - PACKET_HEADER_MAX - tag_len;
+	size_t fill = max_payload - frame_overhead(c);
+	size_t room = pktbuf_tailroom(pkt) - tag_len;
+	if (pkt->len + room > fill) {
+		room = pkt->len < fill ? fill - pkt->len : 0;
+	}
+	room = extras_reserve(c, room);
+	size_t frames = (c->fec_tx ? FRAME_FEC_SOURCE_LEN : 0) + (c->npaths > 1 ? FRAME_MP_PATH_LEN : 0);
+	mp_path_t *p = mp_select(&c->mp, PACKET_HEADER_MAX + pkt->len + room + frames + tag_len, now_ns, retry_ns);
+	if (!p) {
+		return COALESCE_BLOCKED;
+	}
+	client_path_t *path = client_path(c, p);
+	size_t extra = ack_state_take(&c->ack, &incoming_replay, now_ns, pkt->data + pkt->len, room);
+	extra += hdrcomp_take_resync(&c->hc_rx, pkt->data + pkt->len + extra, room - extra);
+	if (c->fec_rx) extra += fec_rx_take_report(c->fec_rx, now_ns, pkt->data + pkt->len + extra, room - extra);
+	pkt->len += extra;
+	tag_path(path, pkt);
+
+	bool zero_rtt = aead == c->early_aead;
+	uint64_t pn = outgoing_packet_number++;
+	size_t pn_len = mp_pn_length(&c->mp, pn);
+	bool source = c->fec_tx && fec_tx_source(c->fec_tx, pkt, pn, max_payload, now_ns, &c->fec_stats);
+	mp_on_sent(p, pn, packet_header_length(c->cid, pn_len) + pkt->len + tag_len, now_ns, true);
+
+	// On sampled datagrams, time how long their frames waited since the
+	// TUN read (on average)
+	if (metrics_timed(&metrics)) {
+		metrics_observe(&metrics.stages[METRICS_STAGE_TUN_READ], event_clock_ns() - d->arrival_sum_ns / d->frames);
+	}
+	queue_datagram(c, path, aead, pkt, pn, pn_len, zero_rtt);
+	if (zero_rtt) c->early_packets += d->frames;
+	if (source && fec_tx_due(c->fec_tx, mp_rtt(&c->mp)) <= now_ns) send_repairs(c, path, aead, now_ns);
+	return COALESCE_SENT;
+}
+
+// Send a packet carrying only an ACK frame (and requests for full
+// headers, and our loss rate) on the path the server last asked for one
+// on. It is not acknowledged itself, so it is neither tracked nor held
+// back by the window.
+static void send_ack(client_t *c, uint64_t now_ns) {
+	pktbuf_t *pkt = c->encrypt_aead ? pktbuf_alloc(event_loop_pool(c->loop)) : NULL;
+	if (!pkt) return;
+	pkt->len = ack_state_take(&c->ack, &incoming_replay, now_ns, pkt->data, FRAME_ACK_MAX);
+	pkt->len += hdrcomp_take_resync(&c->hc_rx, pkt->data + pkt->len, FRAME_HC_RESYNC_LEN * HDRCOMP_CONTEXTS);
+	if (c->fec_rx) pkt->len += fec_rx_take_report(c->fec_rx, now_ns, pkt->data + pkt->len, FRAME_FEC_LEN);
+	if (pkt->len > 0) {
+		mp_path_t *p = mp_ack_path(&c->mp, c->ack_path);
+		client_path_t *path = client_path(c, p);
+		tag_path(path, pkt);
+		uint64_t pn = outgoing_packet_number++;
+		size_t pn_len = mp_pn_length(&c->mp, pn);
+		mp_on_sent(p, pn, packet_header_length(c->cid, pn_len) + pkt->len + c->encrypt_aead->algo->tag_size, now_ns, false);
+		queue_datagram(c, path, c->encrypt_aead, pkt, pn, pn_len, false);
+	}
+	pktbuf_put(pkt);
+}
+
+// Echo a PATH_CHALLENGE from the server in a packet of its own, on the
+// path it came on. Like a bare ACK it is not acknowledged, so not
+// tracked; if it is lost, the server challenges again.
+static void send_path_response(client_t *c, client_path_t *path, uint64_t now_ns) {
+	path->path_response_due = false;
+	pktbuf_t *pkt = c->encrypt_aead ? pktbuf_alloc(event_loop_pool(c->loop)) : NULL;
+	if (!pkt) return;
+	pkt->len = frame_encode_token(pkt->data, FRAME_PATH_RESPONSE, path->path_response);
+	tag_path(path, pkt);
+	uint64_t pn = outgoing_packet_number++;
+	size_t pn_len = mp_pn_length(&c->mp, pn);
+	mp_on_sent(&c->mp.paths[path->index], pn, packet_header_length(c->cid, pn_len) + pkt->len + c->encrypt_aead->algo->tag_size, now_ns, false);
+	queue_datagram(c, path, c->encrypt_aead, pkt, pn, pn_len, false);
+	pktbuf_put(pkt);
+}
+
+// Send a PING on path in a packet of its own, right away. Tracked, it
+// counts as in flight there, so that its acknowledgement brings the path
+// into use or shows it still works (see mp_pings_due); otherwise all it
+// has to do is reach the server.
+static void send_ping(client_t *c, client_path_t *path, bool tracked) {
+	pktbuf_t *pkt = c->encrypt_aead ? pktbuf_alloc(event_loop_pool(c->loop)) : NULL;
+	if (!pkt) return;
+	uint64_t now_ns = event_clock_ns();
+	pkt->data[0] = FRAME_PING;
+	pkt->len = 1;
+	tag_path(path, pkt);
+	uint64_t pn = outgoing_packet_number++;
+	size_t pn_len = mp_pn_length(&c->mp, pn);
+	mp_on_sent(&c->mp.paths[path->index], pn, packet_header_length(c->cid, pn_len) + pkt->len + c->encrypt_aead->algo->tag_size, now_ns, tracked);
+	queue_datagram(c, path, c->encrypt_aead, pkt, pn, pn_len, false);
+	pktbuf_put(pkt);
+	flush_datagrams(c);
+}
+
+// Move a path's socket to a new local port, and to a new local address
+// if the route to the server changed, by connecting it again. The server
+// keeps the session by its connection ID and follows us once we answer
+// its challenge; a PING tells it at once rather than with our next
+// packet. Runs with nothing queued to send.
+static void rebind_socket(client_t *c, client_path_t *path, const char *why) {
+	path->rebind_due = false;
+	struct sockaddr unspec = { .sa_family = AF_UNSPEC };
+	if (connect(path->sock_fd, &unspec, sizeof(unspec)) < 0 || connect(path->sock_fd, (struct sockaddr *)&path->server_addr, sizeof(path->server_addr)) < 0) {
+		log_limited(LOG_LEVEL_ERROR, "Reconnecting the socket of path %u: %s\n", path->index, strerror(errno));
+		return;
+	}
+	path->rebinds++;
+	send_ping(c, path, false);
+	struct sockaddr_in local;
+	socklen_t local_len = sizeof(local);
+	if (getsockname(path->sock_fd, (struct sockaddr *)&local, &local_len) == 0) {
+		log_info("Path %u moved to local address %s (%s)\n", path->index, log_addr(&local), why);
+	}
+}
+
+// Send a path MTU probe of the given size on path: a PING frame padded
+// out to it. It goes out on its own rather than in the batch, so that a
+// size the local interface refuses (EMSGSIZE) fails alone.
+static void send_probe(client_t *c, client_path_t *path, size_t size, uint64_t now_ns) {
+	pktbuf_t *pkt = pktbuf_alloc(event_loop_pool(c->loop));
+	if (!pkt) return;
+	mp_path_t *p = &c->mp.paths[path->index];
+	tag_path(path, pkt);
+	uint64_t pn = outgoing_packet_number++;
+	size_t pn_len = mp_pn_length(&c->mp, pn);
+	size_t padding = size - packet_header_length(c->cid, pn_len) - c->encrypt_aead->algo->tag_size - pkt->len;
+	memset(pkt->data + pkt->len, FRAME_PADDING, padding);
+	pkt->data[pkt->len] = FRAME_PING;
+	pkt->len += padding;
+	mp_on_sent(p, pn, size, now_ns, false);
+	bool refused = false;
+	seal_packet(c->encrypt_aead, pkt, c->cid, pn, pn_len, false);
+	if (send(path->sock_fd, pkt->data, pkt->len, 0) < 0) {
+		refused = errno == EMSGSIZE;
+	} else {
+		metric_add(&metrics.tx_packets, 1);
+		metric_add(&metrics.tx_bytes, pkt->len);
+	}
+	pmtud_on_probe_sent(&p->pmtud, pn, !refused, now_ns);
+	pktbuf_put(pkt);
+}
+
+// Seal the datagrams that are due, send a bare ACK if one is due and
+// data did not take it along, and the repairs of a FEC group that has
+// been open long enough, deliver held packets whose gap was waited for
+// long enough, and send what this wakeup queued. Then look after the
+// paths: take those that failed out of use, and send the PINGs and path
+// MTU probes that are due. Also runs as the coalescing, pacing, ACK,
+// repair, reorder and path deadline when no packets arrive.
+static void on_round_end(void *arg) {
+	client_t *c = arg;
+	uint64_t now_ns = event_clock_ns();
+	coalesce_flush(&c->coalesce, now_ns);
+	uint64_t ack_due = ack_state_due(&c->ack);
+	if (ack_due && ack_due <= now_ns) {
+		send_ack(c, now_ns);
+		ack_due = ack_state_due(&c->ack);
+	}
+	uint64_t repair_due = c->fec_tx ? fec_tx_due(c->fec_tx, mp_rtt(&c->mp)) : 0;
+	if (repair_due && repair_due <= now_ns) {
+		ptls_aead_context_t *aead = c->encrypt_aead ? c->encrypt_aead : c->early_aead;
+		if (aead) send_repairs(c, client_path(c, mp_fastest(&c->mp)), aead, now_ns);
+		else fec_tx_close(c->fec_tx);
+		repair_due = 0;
+	}
+	uint64_t reorder_due = c->reorder ? mp_reorder_due(c->reorder) : 0;
+	if (reorder_due && reorder_due <= now_ns) {
+		deliver_reordered(c, now_ns);
+		reorder_due = mp_reorder_due(c->reorder);
+	}
+	for (unsigned i = 0; i < c->npaths; i++) {
+		if (c->paths[i].path_response_due) send_path_response(c, &c->paths[i], now_ns);
+	}
+	flush_datagrams(c);
+	for (unsigned i = 0; i < c->npaths; i++) {
+		if (c->paths[i].rebind_due) rebind_socket(c, &c->paths[i], "local address lost");
+	}
+	// Failed paths, PINGs and path MTU probes, once there are session keys
+	uint64_t probe_due = 0;
+	if (c->encrypt_aead) {
+		unsigned down = mp_check(&c->mp, now_ns);
+		for (unsigned i = 0; i < MP_MAX_PATHS; i++) {
+			if (down & 1u << i) log_info("Path %u failed, %u left in use\n", i, mp_active(&c->mp));
 		}
+		unsigned pings = mp_pings_due(&c->mp, now_ns);
+		for (unsigned i = 0; i < c->mp.count; i++) {
+			mp_path_t *p = &c->mp.paths[i];
+			size_t probe = p->state == MP_PATH_ACTIVE ? pmtud_probe_size(&p->pmtud, &p->recovery, now_ns) : 0;
+			if (probe) send_probe(c, &c->paths[i], probe, now_ns);
+			else if (pings & 1u << i) send_ping(c, &c->paths[i], true);
+		}
+		path_mtu_changed(c);
+		probe_due = mp_next_due(&c->mp);
 	}
-	fprintf(stderr, "Error: No free slots for new stream\n");
-	pthread_mutex_unlock(&stream_id_mutex);
+	uint64_t due = coalesce_next_deadline(&c->coalesce);
+	if (ack_due && (due == 0 || ack_due < due)) due = ack_due;
+	if (probe_due && (due == 0 || probe_due < due)) due = probe_due;
+	if (repair_due && (due == 0 || repair_due < due)) due = repair_due;
+	if (reorder_due && (due == 0 || reorder_due < due)) due = reorder_due;
+	event_set_deadline(c->loop, due, on_round_end, c);
 }
-// Check if a stream is active
-bool is_stream_active(int stream_id) {
-	pthread_mutex_lock(&stream_id_mutex);
-	for (int i = 0; i < MAX_STREAMS; i++) {
-		if (active_streams[i].active && active_streams[i].stream_id == stream_id) {
-			pthread_mutex_unlock(&stream_id_mutex);
-			return true;
+
+// Resend our handshake bytes until the server confirms them, backing off
+static void on_handshake_timer(void *arg) {
+	client_t *c = arg;
+	handshake_t *hs = &c->hs;
+	if (hs->confirmed) return;
+
+	unsigned shift = hs->retransmits < 5 ? hs->retransmits : 5;
+	uint64_t timeout_ms = (uint64_t)HANDSHAKE_RETRANSMIT_MS << shift;
+	if (timeout_ms > HANDSHAKE_MAX_BACKOFF_MS) timeout_ms = HANDSHAKE_MAX_BACKOFF_MS;
+	if (handshake_clock_ns() - hs->last_sent_ns < timeout_ms * 1000000) return;
+
+	hs->retransmits++;
+	if (hs->retransmits == 5) {
+		log_warn("No answer from server yet, still trying\n");
+	}
+	handshake_send(hs, c->paths[0].sock_fd, NULL, PACKET_INITIAL, true);
+}
+
+// Change local port every so often (-R), as a NAT rebinding would, on
+// every path
+static void on_rebind_timer(void *arg) {
+	client_t *c = arg;
+	if (c->cid && c->encrypt_aead) {
+		flush_datagrams(c);
+		for (unsigned i = 0; i < c->npaths; i++) {
+			if (mp_path_open_at(&c->mp, i)) rebind_socket(c, &c->paths[i], "-R");
 		}
 	}
-	pthread_mutex_unlock(&stream_id_mutex);
-	return false;
 }
 
-// Clean up streams that haven't been active for a while
-void cleanup_old_streams(int timeout_seconds) {
-	time_t now = time(NULL);
-	pthread_mutex_lock(&stream_id_mutex);
-	for (int i = 0; i < MAX_STREAMS; i++) {
-		if (active_streams[i].active && (now - active_streams[i].last_activity > timeout_seconds)) {
-			printf("Cleaning up inactive stream ID: %d (inactive for %ld seconds)\n", active_streams[i].stream_id, now - active_streams[i].last_activity);
-			active_streams[i].active = false;
+// Keep the session, and the NAT mapping in front of us, alive while the
+// tunnel is quiet (-P): a PING once nothing was sent for keepalive_ms.
+// Sends do not touch the timer; it looks at when the last one went out
+// and sleeps until the interval after it.
+static void on_keepalive_timer(void *arg) {
+	client_t *c = arg;
+	uint64_t now_ms = event_loop_now_ms(c->loop);
+	if (c->encrypt_aead && now_ms - c->last_sent_ms >= c->keepalive_ms) {
+		flush_datagrams(c);
+		send_ping(c, client_path(c, mp_fastest(&c->mp)), false);
+		log_debug("Keepalive sent\n");
+	}
+	uint64_t due = c->last_sent_ms + c->keepalive_ms;
+	event_timer_arm(c->loop, &c->keepalive, due > now_ms ? due : now_ms + c->keepalive_ms);
+}
+
+// Periodic flow expiry and batching report
+static void on_cleanup_timer(void *arg) {
+	client_t *c = arg;
+	size_t expired = flow_table_expire(&c->flows, event_loop_now_ms(c->loop) / 1000, FLOW_TIMEOUT);
+	log_info("Flows: %zu active, %zu expired, %llu packets without a flow stream\n", c->flows.count, expired,
+		(unsigned long long)c->unmapped_packets);
+	log_info("Batching: socket packets per wakeup avg %.1f, sendmmsg avg %.1f, TUN packets per wakeup avg %.1f, %llu wakeups\n",
+		batch_stats_average(&metrics.rx_batch), batch_stats_average(&metrics.tx_batch), batch_stats_average(&metrics.tun_batch),
+		(unsigned long long)event_loop_wakeups(c->loop));
+	log_info("Offload: GSO %llu super-buffers (avg %.1f segments), GRO %llu super-buffers (avg %.1f segments)\n",
+		(unsigned long long)metric_get(&metrics.tx_batch.super_buffers), batch_stats_segments(&metrics.tx_batch),
+		(unsigned long long)metric_get(&metrics.rx_batch.super_buffers), batch_stats_segments(&metrics.rx_batch));
+	if (c->tun_offload) {
+		log_info("TUN offload: %llu super-packets read (avg %.1f segments), %llu merged writes (avg %.1f segments)\n",
+			(unsigned long long)metric_get(&metrics.tun_batch.super_buffers), batch_stats_segments(&metrics.tun_batch),
+			(unsigned long long)metric_get(&metrics.tun_write_batch.super_buffers), batch_stats_segments(&metrics.tun_write_batch));
+	}
+	log_info("Payload copies: %llu for %llu packets\n", (unsigned long long)event_loop_pool(c->loop)->copies,
+		(unsigned long long)(metric_get(&metrics.rx_batch.packets) + metric_get(&metrics.tun_batch.packets)));
+	log_info("Coalescing: %.2f packets per datagram (%llu datagrams), %.1f us average added latency, %llu packets dropped queueing, %llu by CoDel\n",
+		coalesce_frames_per_datagram(&c->coalesce.stats), (unsigned long long)metric_get(&c->coalesce.stats.datagrams),
+		coalesce_average_hold_us(&c->coalesce.stats), (unsigned long long)metric_get(&c->coalesce.stats.dropped),
+		(unsigned long long)metric_get(&c->coalesce.stats.aqm_dropped));
+	const hdrcomp_stats_t *h = &c->hc_stats;
+	log_info("Header compression: %.1f bytes saved per TCP ACK (%llu), %.1f per TCP data packet (%llu), %.1f per UDP packet (%llu), %llu not compressible, %llu full headers, %llu asked for\n",
+		hdrcomp_saved_per_packet(h, HDRCOMP_TCP_ACK), (unsigned long long)metric_get(&h->packets[HDRCOMP_TCP_ACK]),
+		hdrcomp_saved_per_packet(h, HDRCOMP_TCP_DATA), (unsigned long long)metric_get(&h->packets[HDRCOMP_TCP_DATA]),
+		hdrcomp_saved_per_packet(h, HDRCOMP_UDP), (unsigned long long)metric_get(&h->packets[HDRCOMP_UDP]),
+		(unsigned long long)metric_get(&h->packets[HDRCOMP_PLAIN]), (unsigned long long)metric_get(&h->full),
+		(unsigned long long)metric_get(&h->resyncs));
+	if (c->fec_tx) {
+		const fec_stats_t *f = &c->fec_stats;
+		log_info("FEC: %llu packets sent in groups, %llu repairs sent, %llu received, %llu lost packets rebuilt, %.2f%% of the server's packets lost on the way\n",
+			(unsigned long long)metric_get(&f->sources), (unsigned long long)metric_get(&f->repairs_sent),
+			(unsigned long long)metric_get(&f->repairs_received), (unsigned long long)metric_get(&f->recovered),
+			fec_rx_loss(c->fec_rx) * 100);
+	}
+	uint64_t rebinds = 0;
+	for (unsigned i = 0; i < c->npaths; i++) {
+		rebinds += c->paths[i].rebinds;
+		const mp_path_t *path = &c->mp.paths[i];
+		if (i >= c->mp.count || path->state == MP_PATH_UNUSED) continue;
+		// The first path keeps the log lines it had before there were others
+		char name[64] = "";
+		if (c->npaths > 1) {
+			snprintf(name, sizeof(name), " path %u (%s, %s, %llu failovers)", i, log_addr(&path->addr), mp_path_state_name(path->state),
+				(unsigned long long)path->failovers);
 		}
+		const recovery_t *r = &path->recovery;
+		log_info("Congestion%s (%s): srtt %.2f ms, min RTT %.2f ms, cwnd %llu bytes, %llu in flight, %llu sent, %llu lost, pacing %.1f Mbit/s\n",
+			name, r->cc.ops->name, r->smoothed_rtt_ns / 1e6, r->min_rtt_ns / 1e6, (unsigned long long)r->cc.cwnd,
+			(unsigned long long)r->bytes_in_flight, (unsigned long long)r->sent_packets, (unsigned long long)r->lost_packets,
+			r->cc.pacing_rate * 8 / 1e6);
+		const pmtud_t *p = &path->pmtud;
+		log_info("Path MTU%s: %zu bytes (%s, up to %zu), %llu probes sent, %llu lost, %s MTU %zu\n", name, p->plpmtu,
+			p->state == PMTUD_COMPLETE ? "confirmed" : "searching", p->max, (unsigned long long)p->probes_sent,
+			(unsigned long long)p->probes_lost, c->tun.name, c->tun_mtu);
+	}
+	if (c->reorder) {
+		const mp_reorder_stats_t *o = &c->reorder_stats;
+		log_info("Reordering: %llu packets held, %llu gaps given up on, %llu packets later still, hold time %.2f ms\n",
+			(unsigned long long)metric_get(&o->held), (unsigned long long)metric_get(&o->gaps_skipped),
+			(unsigned long long)metric_get(&o->late), c->reorder->hold_ns / 1e6);
+	}
+	log_info("Session: %s, %llu 0-RTT packets sent, connection ID %016llx, %llu local port changes\n",
+		!c->encrypt_aead ? "handshaking" : c->hs.resumed ? "resumed" : "full handshake", (unsigned long long)c->early_packets,
+		(unsigned long long)c->cid, (unsigned long long)rebinds);
+}
+
+// Prometheus output for the metrics socket (-m)
+static void render_metrics(FILE *out, void *arg) {
+	client_t *c = arg;
+	const metrics_t *sets[] = { &metrics };
+	const char *labels[] = { "" };
+	metrics_render(out, sets, labels, 1);
+	metrics_family(out, "tunnel_coalesced_datagrams_total", "counter", "Datagrams sealed from coalesced TUN packets");
+	metrics_sample(out, "tunnel_coalesced_datagrams_total", "", metric_get(&c->coalesce.stats.datagrams));
+	metrics_family(out, "tunnel_coalesced_frames_total", "counter", "TUN packets carried in those datagrams");
+	metrics_sample(out, "tunnel_coalesced_frames_total", "", metric_get(&c->coalesce.stats.frames));
+	metrics_family(out, "tunnel_coalesce_dropped_total", "counter", "TUN packets dropped for a full coalescing queue");
+	metrics_sample(out, "tunnel_coalesce_dropped_total", "", metric_get(&c->coalesce.stats.dropped));
+	metrics_family(out, "tunnel_coalesce_codel_dropped_total", "counter", "TUN packets dropped by CoDel for waiting too long");
+	metrics_sample(out, "tunnel_coalesce_codel_dropped_total", "", metric_get(&c->coalesce.stats.aqm_dropped));
+	const hdrcomp_stats_t *sets_hc[] = { &c->hc_stats };
+	hdrcomp_render(out, sets_hc, labels, 1);
+	const fec_stats_t *sets_fec[] = { &c->fec_stats };
+	fec_render(out, sets_fec, labels, 1);
+	mp_render(out, &c->mp, "");
+	if (c->reorder) {
+		const mp_reorder_stats_t *sets_reorder[] = { &c->reorder_stats };
+		mp_reorder_render(out, sets_reorder, labels, 1);
+	}
+}
+
+// Create the socket of path i: bound to local, an IPv4 address or an
+// interface name (NULL or "any" for neither), and connected to the
+// server at server_ip. Its datagrams are at most max_datagram bytes, or
+// what its route allows.
+static int open_path_socket(client_t *c, unsigned i, const char *local, const char *server_ip, size_t max_datagram) {
+	client_path_t *path = &c->paths[i];
+	path->client = c;
+	path->index = i;
+	path->local = local && strcmp(local, "any") != 0 && *local ? local : NULL;
+	path->server_addr.sin_family = AF_INET;
+	path->server_addr.sin_port = htons(PORT);
+	if (inet_pton(AF_INET, server_ip, &path->server_addr.sin_addr) <= 0) {
+		log_error("Invalid server IP address: %s\n", server_ip);
+		return -1;
 	}
-	pthread_mutex_unlock(&stream_id_mutex);
+	path->sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (path->sock_fd < 0) {
+		log_errno("Socket creation failed");
+		return -1;
+	}
+	if (path->local) {
+		// An address keeps its binding when the port changes (-R); an
+		// interface takes the route through it whatever the table says
+		struct sockaddr_in addr = { .sin_family = AF_INET };
+		if (inet_pton(AF_INET, path->local, &addr.sin_addr) == 1) {
+			if (bind(path->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+				log_error("Binding path %u to %s: %s\n", i, path->local, strerror(errno));
+				return -1;
+			}
+		} else if (setsockopt(path->sock_fd, SOL_SOCKET, SO_BINDTODEVICE, path->local, strlen(path->local)) < 0) {
+			log_error("Binding path %u to interface %s: %s\n", i, path->local, strerror(errno));
+			return -1;
+		}
+	}
+	if (connect(path->sock_fd, (struct sockaddr *)&path->server_addr, sizeof(path->server_addr)) < 0) {
+		log_errno("Connection failed");
+		return -1;
+	}
+	if (pmtud_socket_init(path->sock_fd) != 0) {
+		log_errno("Setting IP_MTU_DISCOVER");
+	}
+	path->max_datagram = pmtud_route_max(path->sock_fd, max_datagram);
+	if (c->npaths > 1) {
+		log_info("Path %u: from %s to %s\n", i, path->local ? path->local : "any", server_ip);
+	}
+	return 0;
 }
 
 int main(int argc, char *argv[]) {
-	int sock_fd, tun_fd;
-	char server_ip_addr[] = "127.0.0.1";
-	// Automatically set to tun1 but allow for user to input TUN device they're using
-	char tun_device[IFNAMSIZ] = "tun1";
-	if(argc >= 2){
-		strncpy(tun_device, argv[1], IFNAMSIZ);
-		tun_device[IFNAMSIZ - 1] = '\0';
+	client_t c = {0};
+	const char *server_ip_addr = "127.0.0.1";
+	// Automatically set to tun1 but allow for user to input TUN device
+	// (or other backend, see tun.h) they're using
+	const char *tun_spec = "tun1";
+	size_t batch_size = DEFAULT_BATCH_SIZE;
+	bool udp_offload = true;
+	event_backend_t backend = EVENT_BACKEND_AUTO;
+	const char *cert_file = NULL;
+	const char *key_file = NULL;
+	const char *ca_file = NULL;
+	const char *server_name = NULL;
+	bool insecure = false;
+	const char *ticket_file = NULL;
+	const char *metrics_path = NULL;
+	uint64_t coalesce_deadline_ns = 0;
+	size_t link_mtu = PMTUD_DEFAULT_MTU;
+	crypto_cipher_t cipher = CRYPTO_CIPHER_AUTO;
+	unsigned rebind_seconds = 0;
+	unsigned keepalive_seconds = DEFAULT_KEEPALIVE;
+	bool fec = false;
+	const char *path_locals[MP_MAX_PATHS] = {0};
+	const char *path_servers[MP_MAX_PATHS] = {0};
+	mp_scheduler_t scheduler = MP_MINRTT;
+	c.congestion = &congestion_newreno;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:ge:c:k:C:N:It:F:K:OM:s:L:m:A:R:P:Xp:S:")) != -1) {
+		switch (opt) {
+		case 'b':
+			batch_size = strtoul(optarg, NULL, 10);
+			if (batch_size == 0 || batch_size > MAX_BATCH_SIZE) {
+				fprintf(stderr, "Batch size must be between 1 and %d\n", MAX_BATCH_SIZE);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'g':
+			udp_offload = false;
+			break;
+		case 'e':
+			if (event_backend_parse(optarg, &backend) != 0) {
+				fprintf(stderr, "Unknown event backend: %s (use auto, epoll or io_uring)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'c':
+			cert_file = optarg;
+			break;
+		case 'k':
+			key_file = optarg;
+			break;
+		case 'C':
+			ca_file = optarg;
+			break;
+		case 'N':
+			server_name = optarg;
+			break;
+		case 'I':
+			insecure = true;
+			break;
+		case 't':
+			ticket_file = optarg;
+			break;
+		case 'F':
+			coalesce_deadline_ns = strtoull(optarg, NULL, 10) * 1000;
+			break;
+		case 'K':
+			c.congestion = congestion_find(optarg);
+			if (!c.congestion) {
+				fprintf(stderr, "Unknown congestion controller: %s (use newreno or bbr)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'O':
+			c.tun_offload = true;
+			break;
+		case 'M':
+			link_mtu = strtoul(optarg, NULL, 10);
+			if (link_mtu < PMTUD_MIN_MTU || link_mtu > PMTUD_MAX_MTU) {
+				fprintf(stderr, "Link MTU must be between %d and %d\n", PMTUD_MIN_MTU, PMTUD_MAX_MTU);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			server_ip_addr = optarg;
+			break;
+		case 'L':
+			if (log_level_parse(optarg, &log_level) != 0) {
+				fprintf(stderr, "Unknown log level: %s (use error, warn, info or debug)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 'A':
+			if (crypto_cipher_parse(optarg, &cipher) != 0) {
+				fprintf(stderr, "Unknown cipher: %s (use auto, aes128gcm, aes256gcm or chacha20)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'R':
+			rebind_seconds = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			keepalive_seconds = strtoul(optarg, NULL, 10);
+			break;
+		case 'X':
+			fec = true;
+			break;
+		case 'p': {
+			if (c.npaths == MP_MAX_PATHS) {
+				fprintf(stderr, "At most %d paths\n", MP_MAX_PATHS);
+				exit(EXIT_FAILURE);
+			}
+			// LOCAL[,SERVER]: the server address defaults to -s
+			char *comma = strchr(optarg, ',');
+			if (comma) {
+				*comma = '\0';
+				path_servers[c.npaths] = comma + 1;
+			}
+			path_locals[c.npaths++] = optarg;
+			break;
+		}
+		case 'S':
+			if (mp_scheduler_parse(optarg, &scheduler) != 0) {
+				fprintf(stderr, "Unknown scheduler: %s (use minrtt or wrr)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s -c cert.pem -k key.pem -C ca.pem|-I [-N server_name] [-t ticket_file] [-b batch_size] [-g] [-e backend] [-F flush_usec] [-K newreno|bbr] [-O] [-M mtu] [-s server_ip] [-L level] [-m metrics_socket] [-A cipher] [-R rebind_sec] [-P keepalive_sec] [-X] [-p local[,server]]... [-S minrtt|wrr] [tun_device | backend:arg]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
 	}
-	struct sockaddr_in server_addr;
-	
-	// Initialize all streams as inactive
-	memset(active_streams, 0, sizeof(active_streams));
-	
-	// Create UDP socket
-	sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sock_fd < 0) {
-		perror("Socket creation failed");
+	if (optind < argc) {
+		tun_spec = argv[optind];
+	}
+	if (!cert_file || !key_file) {
+		fprintf(stderr, "The client needs a certificate and its private key (-c cert.pem -k key.pem)\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!ca_file && !insecure) {
+		fprintf(stderr, "The client needs the certificate the server is verified against (-C ca.pem), or -I to not verify it\n");
 		exit(EXIT_FAILURE);
 	}
+	// Without -p, one path to -s from any local address
+	if (c.npaths == 0) {
+		c.npaths = 1;
+	}
+	for (unsigned i = 0; i < c.npaths; i++) {
+		if (!path_servers[i]) path_servers[i] = server_ip_addr;
+	}
+	mp_init(&c.mp, c.congestion, scheduler);
 	
-	memset(&server_addr, 0, sizeof(server_addr));
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(PORT);
-	if (inet_pton(AF_INET, server_ip_addr, &server_addr.sin_addr) <= 0) {
-		perror("Invalid server IP address");
-		close(sock_fd);
+	// Streams are assigned per inner flow
+	if (flow_table_init(&c.flows, MAX_FLOWS) != 0) {
+		log_error("Failed to allocate flow table\n");
 		exit(EXIT_FAILURE);
 	}
+	replay_init(&incoming_replay);
 	
-	tun_fd = open_tun_device(tun_device);
-	if (tun_fd < 0) {
-		fprintf(stderr, "failed to open tun");
-		close(sock_fd);
+	if (tun_open(&c.tun, tun_spec, false, c.tun_offload) != 0) {
+		log_error("Failed to open %s\n", tun_spec);
 		exit(EXIT_FAILURE);
 	}
+	log_info("TUN %s opened\n", c.tun.name);
+	if (c.tun_offload) {
+		bool uso = false;
+		if (vnet_enable(c.tun.read_fd, &uso) != 0) {
+			exit(EXIT_FAILURE);
+		}
+		log_info("TUN offload enabled: TSO%s\n", uso ? " and USO" : " (no USO in this kernel)");
+	}
 	
-	if (connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-		perror("Connection failed");
+	// Datagrams are never fragmented; probes find the size that gets
+	// through, up to what each route's link allows
+	size_t max_datagram = link_mtu - PMTUD_UDP_OVERHEAD;
+	for (unsigned i = 0; i < c.npaths; i++) {
+		if (open_path_socket(&c, i, path_locals[i], path_servers[i], max_datagram) != 0) {
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (mp_path_open(&c.mp, 0, &c.paths[0].server_addr, c.paths[0].max_datagram) != 0) {
+		log_error("Failed to allocate path state\n");
 		exit(EXIT_FAILURE);
 	}
-	// Initialize PicoTLS
-	ptls_cipher_suite_t *suite = ptls_openssl_cipher_suites[0];
-    
-	// Create AEAD contexts for both directions
-	ptls_aead_context_t *encrypt_aead = ptls_aead_new(suite->aead, suite->hash, 1, key, "key-label");
-	ptls_aead_context_t *decrypt_aead = ptls_aead_new(suite->aead, suite->hash, 0, key, "key-label");
-        
-	if (encrypt_aead == NULL || decrypt_aead == NULL) {
-		fprintf(stderr, "Failed to create AEAD contexts");
-		close(sock_fd);
+	// Packets that take different paths are put back in order
+	if (c.npaths > 1) {
+		c.reorder = mp_reorder_new(max_datagram);
+		if (!c.reorder) {
+			log_error("Failed to allocate the reorder buffer\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	// With FEC asked for, every datagram keeps room for it from the start
+	if (fec) {
+		c.fec_tx = fec_tx_new(max_datagram);
+		c.fec_rx = fec_rx_new(max_datagram);
+		if (!c.fec_tx || !c.fec_rx) {
+			log_error("Failed to allocate FEC state\n");
+			exit(EXIT_FAILURE);
+		}
+		log_info("FEC asked for, %d bytes of each datagram kept for it\n", FEC_OVERHEAD);
+	}
+	c.tun_mtu = pmtud_tun_mtu(PMTUD_BASE - frame_overhead(&c));
+	if (tun_set_mtu(&c.tun, c.tun_mtu) != 0) {
+		log_error("Setting the MTU of %s to %zu: %s\n", c.tun.name, c.tun_mtu, strerror(errno));
+	}
+	const pmtud_t *pmtud = &c.mp.paths[0].pmtud;
+	log_info("Path MTU discovery: %zu to %zu byte datagrams, %s MTU %zu\n", pmtud->plpmtu, pmtud->max, c.tun.name, c.tun_mtu);
+	// Initialize PicoTLS; the session keys come from the handshake, in
+	// the suite the server picks from our list
+	crypto_set_cipher(cipher);
+	// The server is known by the name in its certificate, which defaults
+	// to the address the handshake goes to
+	if (handshake_client_config(&c.tls, cert_file, key_file, insecure ? NULL : ca_file,
+			server_name ? server_name : path_servers[0], ticket_file) != 0) {
 		exit(EXIT_FAILURE);
 	}
-	
-	printf("Client initialized with key: \n");
-	for (int i = 0; i < 32; i++) {
-		printf("%02x", key[i]);
+	if (insecure) {
+		log_warn("Warning: server certificate is not verified (-I)\n");
 	}
-	printf("\n");
 
-	// Make socket non-blocking
-	int flags = fcntl(sock_fd, F_GETFL, 0);
-	fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK);
-	
-	// Timer for stream cleanup
-	time_t last_cleanup = time(NULL);
-	
-	while (1) {
-		fd_set readfds;
-		FD_ZERO(&readfds);
-		FD_SET(tun_fd, &readfds);
-		FD_SET(sock_fd, &readfds);
-		int max_fd = (tun_fd > sock_fd) ? tun_fd : sock_fd;
-		
-		// Set timeout for select to allow periodic cleanup
-		struct timeval tv;
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-		
-		int activity = select(max_fd + 1, &readfds, NULL, NULL, &tv);
-		if (activity < 0) {
-			perror("select error");
-			break;
+	// Datagram batches for recvmmsg/sendmmsg, per path; a round may seal
+	// a full batch for each
+	c.seals = calloc(batch_size * c.npaths, sizeof(*c.seals));
+	if (!c.seals) {
+		log_error("Failed to allocate packet batches\n");
+		exit(EXIT_FAILURE);
+	}
+	bool gro = false;
+	for (unsigned i = 0; i < c.npaths; i++) {
+		client_path_t *path = &c.paths[i];
+		if (dgram_batch_init(&path->rx, batch_size, max_datagram) != 0 || dgram_batch_init(&path->tx, batch_size, max_datagram + PACKET_MAX_OVERHEAD) != 0) {
+			log_error("Failed to allocate packet batches\n");
+			exit(EXIT_FAILURE);
 		}
-		
-		// Periodic stream cleanup
-		time_t now = time(NULL);
-		if (now - last_cleanup > 60) { // Every minute
-			cleanup_old_streams(300); // 5-minute timeout
-			last_cleanup = now;
-		}
-		
-		if (FD_ISSET(tun_fd, &readfds)) {
-			uint8_t tun_buffer[BUFFER_SIZE];
-			int bytes_read = read(tun_fd, tun_buffer, sizeof(tun_buffer));
-			if (bytes_read <= 0) {
-				perror("Reading from tun error");
-				continue;
-			}
-			printf("Read %d bytes from TUN\n", bytes_read);
-
-			int stream_id = allocate_client_stream_id();
-			
-			// Wrap with QUIC-like stream header
-			uint8_t plain[BUFFER_SIZE];
-			memcpy(plain, &stream_id, sizeof(int));
-			memcpy(plain + sizeof(int), &bytes_read, sizeof(int));
-			memcpy(plain + 2 * sizeof(int), tun_buffer, bytes_read);
-			size_t plain_len = 2 * sizeof(int) + bytes_read;
-			
-			uint8_t encrypted[BUFFER_SIZE];
-			// Encrypt packet
-			size_t encrypted_len = ptls_aead_encrypt(encrypt_aead, encrypted, plain, plain_len, outgoing_packet_number++, NULL, 0);
-			
-			if (encrypted_len == 0) {
-				fprintf(stderr, "Failed to encrypt message\n");
-				continue;
-			}
-			// Send packet
-			if (send(sock_fd, encrypted, encrypted_len, 0) < 0) {
-				perror("send failed");
-				continue;
-			}
-			printf("Client sent encrypted message (stream %d, %d bytes IP payload)\n", stream_id, bytes_read);
-		}
-		
-		// Handle packets from socket
-		if (FD_ISSET(sock_fd, &readfds)) {
-			uint8_t buffer[BUFFER_SIZE];
-			int bytes_received = recv(sock_fd, buffer, sizeof(buffer), 0);
-			
-			if (bytes_received > 0) {
-				printf("Received %d bytes from server\n", bytes_received);
-				// Decrypt the packet
-				uint8_t decrypted[BUFFER_SIZE];
-				size_t dec_len = ptls_aead_decrypt(decrypt_aead, decrypted, buffer, bytes_received, incoming_packet_number++, NULL, 0);
-				
-				if (dec_len == SIZE_MAX) {
-					fprintf(stderr, "Failed to decrypt server message\n");
-					continue;
-				}
-				if (dec_len < 2 * sizeof(int)) {
-					fprintf(stderr, "Decrypted server data too short (%zu bytes)\n", dec_len);
-					continue;
-				}
-				
-				// Extract stream ID and payload length
-				int stream_id, length;
-				memcpy(&stream_id, decrypted, sizeof(int));
-				memcpy(&length, decrypted + sizeof(int), sizeof(int));
-				
-				if (length < 0 || dec_len < 2 * sizeof(int) + (size_t)length) {
-					fprintf(stderr, "Invalid server payload length: %d (decrypted_len: %zu)\n", length, dec_len);
-					continue;
-				}
-				printf("Received server response on stream %d | Payload length: %d\n", stream_id, length);
-				
-				if (!is_stream_active(stream_id)) {
-					fprintf(stderr, "Warning: Received data for unknown stream ID: %d\n", stream_id);
-				}
-                
-				// Extract and write the payload to TUN
-				uint8_t payload[BUFFER_SIZE];
-				memcpy(payload, decrypted + 2 * sizeof(int), length);
-				int written = write(tun_fd, payload, length);
-				
-				if (written != length) {
-					fprintf(stderr, "Incomplete write to TUN: %d/%d\n", written, length);
-				} else {
-					printf("Wrote %d bytes from server to TUN device\n", written);
-				}
-			}
+		// UDP segmentation/receive offload, unless disabled with -g. The
+		// event loop reads every socket into buffers of one size, so the
+		// other paths take GRO only if the first has it.
+		if (!udp_offload) continue;
+		bool gso = dgram_batch_enable_gso(&path->tx, path->sock_fd) == 0;
+		if (i == 0) {
+			gro = dgram_batch_enable_gro(&path->rx, path->sock_fd) == 0;
+		} else if (gro && dgram_batch_enable_gro(&path->rx, path->sock_fd) != 0) {
+			log_error("UDP GRO unavailable on path %u but not path 0 (use -g)\n", i);
+			exit(EXIT_FAILURE);
+		}
+		char name[24] = "";
+		if (c.npaths > 1) snprintf(name, sizeof(name), "Path %u: ", i);
+		log_info("%sUDP GSO %s, UDP GRO %s\n", name, gso ? "enabled" : "unavailable", gro ? "enabled" : "unavailable");
+	}
+
+	// Sockets, TUN device and the timers all run on one event loop
+	c.loop = event_loop_new(backend, batch_size, max_datagram);
+	if (!c.loop) {
+		log_error("Failed to create event loop\n");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned i = 0; i < c.npaths; i++) {
+		client_path_t *path = &c.paths[i];
+		if (event_add_dgram(c.loop, path->sock_fd, &path->rx, &metrics.rx_batch, on_server_datagram, path) != 0) {
+			exit(EXIT_FAILURE);
 		}
 	}
-	ptls_aead_free(encrypt_aead);
-	ptls_aead_free(decrypt_aead);
-	close(sock_fd);
-	close(tun_fd);
+	if (event_add_tun(c.loop, c.tun.read_fd, &metrics.tun_batch, on_tun_packet, &c) != 0) {
+		exit(EXIT_FAILURE);
+	}
+	if (c.tun_offload && event_tun_offload(c.loop, max_datagram - PMTUD_TUNNEL_OVERHEAD - frame_overhead(&c), &metrics.tun_write_batch) != 0) {
+		log_error("Failed to allocate TUN offload buffers\n");
+		exit(EXIT_FAILURE);
+	}
+	event_set_round(c.loop, NULL, on_round_end, &c);
+	// One tunnel peer, so a single slot
+	if (coalesce_init(&c.coalesce, 1, max_datagram, coalesce_deadline_ns, event_loop_pool(c.loop), send_coalesced, &c) != 0) {
+		log_error("Failed to set up packet coalescing\n");
+		exit(EXIT_FAILURE);
+	}
+	event_add_timer(c.loop, 60 * 1000, on_cleanup_timer, &c);
+	event_add_timer(c.loop, HANDSHAKE_RETRANSMIT_MS / 5, on_handshake_timer, &c);
+	if (rebind_seconds > 0) {
+		event_add_timer(c.loop, rebind_seconds * 1000, on_rebind_timer, &c);
+		log_info("Changing local port every %u s\n", rebind_seconds);
+	}
+	if (keepalive_seconds > 0) {
+		c.keepalive_ms = keepalive_seconds * 1000;
+		event_timer_init(&c.keepalive, on_keepalive_timer, &c);
+		event_timer_arm(c.loop, &c.keepalive, event_loop_now_ms(c.loop) + c.keepalive_ms);
+		log_info("Keepalive after %u s without sending\n", keepalive_seconds);
+	}
+	log_info("Event backend: %s\n", event_loop_backend(c.loop));
+	log_info("Congestion control: %s, paced\n", c.congestion->name);
+	if (c.npaths > 1) {
+		log_info("Multipath: %u paths, %s scheduler\n", c.npaths, mp_scheduler_name(scheduler));
+	}
+	if (metrics_path) {
+		if (metrics_serve(metrics_path, render_metrics, &c) != 0) {
+			exit(EXIT_FAILURE);
+		}
+		log_info("Serving metrics on %s\n", metrics_path);
+	}
+
+	if (start_handshake(&c) != 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	event_loop_run(c.loop);
+
+	coalesce_free(&c.coalesce);
+	mp_free(&c.mp);
+	mp_reorder_free(c.reorder);
+	fec_tx_free(c.fec_tx);
+	fec_rx_free(c.fec_rx);
+	event_loop_free(c.loop);
+	for (unsigned i = 0; i < c.npaths; i++) {
+		dgram_batch_free(&c.paths[i].rx);
+		dgram_batch_free(&c.paths[i].tx);
+		close(c.paths[i].sock_fd);
+	}
+	free(c.seals);
+	if (c.encrypt_aead) ptls_aead_free(c.encrypt_aead);
+	if (c.decrypt_aead) ptls_aead_free(c.decrypt_aead);
+	if (c.early_aead) ptls_aead_free(c.early_aead);
+	handshake_free(&c.hs);
+	handshake_config_free(&c.tls);
+	flow_table_free(&c.flows);
+	tun_close(&c.tun);
 	return 0;
 }
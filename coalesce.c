@@ -0,0 +1,334 @@
+#include "coalesce.h"
+#include <stdlib.h>
+#include <string.h>
+#include "frame.h"
+#include "packet.h"
+
+// Smallest frame worth waiting for: a bare IPv4 header on a stream
+#define MIN_FRAME (FRAME_HEADER_MAX + 20)
+
+int coalesce_init(coalescer_t *c, size_t nslots, size_t max_datagram, uint64_t deadline_ns,
+                  pktbuf_pool_t *pool, coalesce_send_fn send, void *arg) {
+    memset(c, 0, sizeof(*c));
+    if (max_datagram < PACKET_HEADER_MAX + COALESCE_TAG_MAX + MIN_FRAME) return -1;
+
+    size_t slots = 1;
+    while (slots < nslots) slots <<= 1;
+    c->slots = calloc(slots, sizeof(*c->slots));
+    c->active = calloc(slots, sizeof(*c->active));
+    if (!c->slots || !c->active) {
+        coalesce_free(c);
+        return -1;
+    }
+    c->mask = slots - 1;
+    c->max_payload = max_datagram - PACKET_HEADER_MAX - COALESCE_TAG_MAX;
+    c->deadline_ns = deadline_ns;
+    c->codel_target_ns = COALESCE_CODEL_TARGET_NS;
+    c->pool = pool;
+    c->send = send;
+    c->arg = arg;
+    return 0;
+}
+
+void coalesce_free(coalescer_t *c) {
+    for (size_t i = 0; c->slots && i <= c->mask; i++) {
+        coalesce_slot_t *slot = &c->slots[i];
+        if (slot->open.pkt) pktbuf_put(slot->open.pkt);
+        for (unsigned j = 0; j < slot->count; j++) {
+            pktbuf_put(slot->queue[(slot->head + j) % COALESCE_QUEUE].pkt);
+        }
+    }
+    free(c->slots);
+    free(c->active);
+    memset(c, 0, sizeof(*c));
+}
+
+static bool slot_busy(const coalesce_slot_t *slot) {
+    return slot->open.pkt || slot->count > 0;
+}
+
+// The peer's slot, or a free one to give it. NULL if all the places it
+// may go are taken by other peers.
+static coalesce_slot_t *slot_for(const coalescer_t *c, uint64_t key) {
+    uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+    size_t start = h ^ h >> 32;
+    coalesce_slot_t *free_slot = NULL;
+    for (size_t i = 0; i < COALESCE_PROBES; i++) {
+        coalesce_slot_t *slot = &c->slots[(start + i) & c->mask];
+        if (!slot_busy(slot)) {
+            if (!free_slot) free_slot = slot;
+        } else if (slot->key == key) {
+            return slot;
+        }
+    }
+    return free_slot;
+}
+
+// Take the head off the queue; len is its size when it was queued,
+// since sending adds headers
+static void pop_datagram(coalescer_t *c, coalesce_slot_t *slot, size_t len) {
+    coalesce_datagram_t *d = &slot->queue[slot->head];
+    slot->bytes -= len;
+    c->bytes -= len;
+    pktbuf_put(d->pkt);
+    slot->head = (slot->head + 1) % COALESCE_QUEUE;
+    slot->count--;
+}
+
+static uint64_t isqrt(uint64_t x) {
+    uint64_t r = 0;
+    for (uint64_t bit = (uint64_t)1 << 62; bit; bit >>= 2) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+    }
+    return r;
+}
+
+// Drops come interval / sqrt(count) apart
+static uint64_t codel_control_law(uint64_t t, uint32_t count) {
+    return t + COALESCE_CODEL_INTERVAL_NS * 256 / isqrt((uint64_t)count << 16);
+}
+
+// Whether the head has waited too long, for long enough. A queue of
+// one datagram or less is never too long.
+static bool codel_over_target(const coalescer_t *c, coalesce_slot_t *slot, const coalesce_datagram_t *d, uint64_t now_ns) {
+    coalesce_codel_t *q = &slot->codel;
+    if (!c->codel_target_ns || now_ns - d->queued_ns < c->codel_target_ns || slot->bytes <= c->max_payload) {
+        q->first_above_ns = 0;
+        return false;
+    }
+    if (q->first_above_ns == 0) {
+        q->first_above_ns = now_ns + COALESCE_CODEL_INTERVAL_NS;
+        return false;
+    }
+    return now_ns >= q->first_above_ns;
+}
+
+// Drop from the head of the queue while CoDel says so (RFC 8289,
+// section 5.5)
+static void codel_dequeue(coalescer_t *c, coalesce_slot_t *slot, uint64_t now_ns) {
+    coalesce_codel_t *q = &slot->codel;
+    while (slot->count > 0) {
+        coalesce_datagram_t *d = &slot->queue[slot->head];
+        bool over = codel_over_target(c, slot, d, now_ns);
+        if (q->dropping) {
+            if (!over) {
+                q->dropping = false;
+                return;
+            }
+            if (now_ns < q->drop_next_ns) return;
+            q->count++;
+            q->drop_next_ns = codel_control_law(q->drop_next_ns, q->count);
+        } else {
+            if (!over) return;
+            // Start dropping, faster if it stopped only a little while ago
+            q->dropping = true;
+            uint32_t delta = q->count - q->last_count;
+            q->count = delta > 1 && now_ns - q->drop_next_ns < 16 * COALESCE_CODEL_INTERVAL_NS ? delta : 1;
+            q->drop_next_ns = codel_control_law(now_ns, q->count);
+            q->last_count = q->count;
+        }
+        metric_add(&c->stats.aqm_dropped, d->frames);
+        pop_datagram(c, slot, d->pkt->len);
+    }
+}
+
+// Hand a slot's queued datagrams to the send callback while its deficit
+// covers them and the callback does not hold one back. Returns whether
+// any left the queue.
+static bool serve(coalescer_t *c, coalesce_slot_t *slot, uint64_t now_ns) {
+    unsigned count = slot->count;
+    while (slot->retry_ns <= now_ns) {
+        codel_dequeue(c, slot, now_ns);
+        if (slot->count == 0) break;
+        coalesce_datagram_t *d = &slot->queue[slot->head];
+        if ((int64_t)d->pkt->len > slot->deficit) break;
+        uint64_t retry_ns = now_ns;
+        size_t len = d->pkt->len;
+        coalesce_result_t result = c->send(c->arg, slot, d, now_ns, &retry_ns);
+        if (result == COALESCE_BLOCKED) {
+            slot->retry_ns = retry_ns > now_ns ? retry_ns : now_ns + 1;
+            break;
+        }
+        if (result == COALESCE_SENT) {
+            metric_add(&c->stats.datagrams, 1);
+            metric_add(&c->stats.frames, d->frames);
+            metric_add(&c->stats.hold_ns, d->frames * now_ns - d->arrival_sum_ns);
+        } else {
+            metric_add(&c->stats.dropped, d->frames);
+        }
+        slot->deficit -= len;
+        pop_datagram(c, slot, len);
+    }
+    // An empty queue keeps no credit
+    if (slot->count == 0) slot->deficit = 0;
+    return slot->count != count;
+}
+
+// One pass of deficit round robin over the peers with a queue: the ones
+// that were idle first, then rounds until no queue can move
+static void schedule(coalescer_t *c, uint64_t now_ns) {
+    c->closed = 0;
+    for (size_t i = 0; i < c->nactive; i++) {
+        coalesce_slot_t *slot = &c->slots[c->active[i]];
+        if (!slot->fresh || slot->count == 0 || slot->retry_ns > now_ns) continue;
+        slot->fresh = false;
+        slot->deficit += c->max_payload;
+        serve(c, slot, now_ns);
+    }
+    bool moved;
+    do {
+        moved = false;
+        for (size_t i = 0; i < c->nactive; i++) {
+            coalesce_slot_t *slot = &c->slots[c->active[i]];
+            if (slot->count == 0 || slot->retry_ns > now_ns) continue;
+            slot->fresh = false;
+            slot->deficit += c->max_payload;
+            if (serve(c, slot, now_ns)) moved = true;
+        }
+    } while (moved);
+}
+
+// Make room for len more bytes by dropping from the head of the longest
+// queues
+static void drop_longest(coalescer_t *c, size_t len) {
+    while (c->bytes + len > COALESCE_QUEUE_BYTES) {
+        coalesce_slot_t *longest = NULL;
+        for (size_t i = 0; i < c->nactive; i++) {
+            coalesce_slot_t *slot = &c->slots[c->active[i]];
+            if (slot->count > 0 && (!longest || slot->bytes > longest->bytes)) longest = slot;
+        }
+        if (!longest) return;
+        coalesce_datagram_t *d = &longest->queue[longest->head];
+        metric_add(&c->stats.dropped, d->frames);
+        pop_datagram(c, longest, d->pkt->len);
+    }
+}
+
+// Move the datagram under construction to the back of the queue
+static void close_datagram(coalescer_t *c, coalesce_slot_t *slot, uint64_t now_ns) {
+    size_t len = slot->open.pkt->len;
+    if (slot->count == COALESCE_QUEUE) {
+        metric_add(&c->stats.dropped, slot->open.frames);
+        pktbuf_put(slot->open.pkt);
+    } else {
+        drop_longest(c, len);
+        slot->open.queued_ns = now_ns;
+        slot->queue[(slot->head + slot->count++) % COALESCE_QUEUE] = slot->open;
+        slot->bytes += len;
+        c->bytes += len;
+        c->closed++;
+    }
+    slot->open.pkt = NULL;
+}
+
+// Start a datagram with pkt, framing it where it sits if the buffer is
+// ours to keep and has the room
+static int start_datagram(coalescer_t *c, coalesce_slot_t *slot, int type, uint32_t id, pktbuf_t *pkt) {
+    size_t hdr_len = frame_header_length(type, id, pkt->len);
+    if (pkt->pool && pktbuf_headroom(pkt) >= PACKET_HEADER_MAX + hdr_len && pktbuf_tailroom(pkt) >= COALESCE_TAG_MAX) {
+        pktbuf_ref(pkt);
+    } else {
+        pkt = pktbuf_copy(c->pool, pkt);
+        if (!pkt) return -1;
+    }
+    size_t len = pkt->len;
+    frame_encode_header(pktbuf_push(pkt, hdr_len), type, id, len);
+    slot->open.pkt = pkt;
+    slot->open.frames = 0;
+    slot->open.arrival_sum_ns = 0;
+    return 0;
+}
+
+int coalesce_add(coalescer_t *c, uint64_t key, uint64_t peer_id, int type, uint32_t id, pktbuf_t *pkt, size_t max_datagram, uint64_t now_ns) {
+    coalesce_slot_t *slot = slot_for(c, key);
+    if (!slot) {
+        metric_add(&c->stats.dropped, 1);
+        return -1;
+    }
+    size_t frame_len = frame_header_length(type, id, pkt->len) + pkt->len;
+    size_t max_payload = max_datagram - PACKET_HEADER_MAX - COALESCE_TAG_MAX;
+    if (max_payload > c->max_payload) max_payload = c->max_payload;
+
+    // Keep registrations apart, and close a datagram the frame does not
+    // fit into
+    pktbuf_t *open = slot->open.pkt;
+    if (open && (slot->peer_id != peer_id || open->len + frame_len > max_payload ||
+                 pktbuf_tailroom(open) < frame_len + COALESCE_TAG_MAX)) {
+        close_datagram(c, slot, now_ns);
+    }
+
+    if (!slot->open.pkt) {
+        if (start_datagram(c, slot, type, id, pkt) != 0) {
+            metric_add(&c->stats.dropped, 1);
+            return -1;
+        }
+        if (slot->count == 0) slot->retry_ns = 0;
+        if (slot->key != key) memset(&slot->codel, 0, sizeof(slot->codel));
+        slot->key = key;
+        slot->peer_id = peer_id;
+        slot->first_ns = now_ns;
+        if (!slot->listed) {
+            slot->listed = true;
+            slot->fresh = true;
+            c->active[c->nactive++] = (uint32_t)(slot - c->slots);
+        }
+    } else {
+        open = slot->open.pkt;
+        uint8_t *end = open->data + open->len;
+        size_t hdr_len = frame_encode_header(end, type, id, pkt->len);
+        memcpy(end + hdr_len, pkt->data, pkt->len);
+        open->len += frame_len;
+    }
+    slot->open.frames++;
+    slot->open.arrival_sum_ns += now_ns;
+
+    // Nothing more would fit: queue it now rather than at the deadline
+    if (slot->open.pkt->len + MIN_FRAME > max_payload) close_datagram(c, slot, now_ns);
+    if (c->closed >= COALESCE_BURST) schedule(c, now_ns);
+    return 0;
+}
+
+void coalesce_flush(coalescer_t *c, uint64_t now_ns) {
+    for (size_t i = 0; i < c->nactive; i++) {
+        coalesce_slot_t *slot = &c->slots[c->active[i]];
+        if (slot->open.pkt && now_ns - slot->first_ns >= c->deadline_ns) {
+            close_datagram(c, slot, now_ns);
+        }
+    }
+    schedule(c, now_ns);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < c->nactive; i++) {
+        coalesce_slot_t *slot = &c->slots[c->active[i]];
+        if (slot_busy(slot)) {
+            c->active[kept++] = c->active[i];
+        } else {
+            slot->listed = false;
+        }
+    }
+    c->nactive = kept;
+}
+
+void coalesce_retry(coalescer_t *c, uint64_t key) {
+    coalesce_slot_t *slot = slot_for(c, key);
+    if (slot && slot->key == key) slot->retry_ns = 0;
+}
+
+uint64_t coalesce_next_deadline(const coalescer_t *c) {
+    uint64_t due = 0;
+    for (size_t i = 0; i < c->nactive; i++) {
+        const coalesce_slot_t *slot = &c->slots[c->active[i]];
+        if (slot->open.pkt && (due == 0 || slot->first_ns + c->deadline_ns < due)) {
+            due = slot->first_ns + c->deadline_ns;
+        }
+        if (slot->count > 0 && (due == 0 || slot->retry_ns < due)) {
+            due = slot->retry_ns;
+        }
+    }
+    return due;
+}
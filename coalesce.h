@@ -0,0 +1,159 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "metrics.h"
+#include "pktbuf.h"
+
+// Coalescing of TUN packets into multi-frame tunnel datagrams, and the
+// per-peer queue in front of the congestion controller.
+//
+// Each peer with data waiting has a slot holding one datagram under
+// construction: cleartext frames in a packet buffer with headroom for
+// the tunnel header. The first packet is framed in place where it was
+// read; later ones are copied in behind it until the next would not fit
+// in the peer's datagram size (its path MTU), or until the slot's first
+// frame has waited
+// deadline_ns. A deadline of 0 closes the datagram at the end of the
+// wakeup that started it, i.e. once the TUN queue has been drained.
+//
+// Closed datagrams join the slot's queue of up to COALESCE_QUEUE; a
+// datagram that finds it full is dropped, like a full router queue
+// would. The queues of all peers together hold at most
+// COALESCE_QUEUE_BYTES, and past that the peer with the most queued
+// loses the datagram at its head, so one bulk transfer cannot take the
+// room the others need. Datagrams go to the send callback in passes over every peer
+// with a queue, after each send batch's worth of closed datagrams and
+// at each flush. The callback seals and sends them or reports that the
+// congestion window or the pacer holds them back (and until when).
+//
+// A pass is deficit round robin: each peer in turn gets a quantum of
+// one full datagram's bytes to spend, so a bulk transfer with a deep
+// queue cannot starve the others, and peers whose queue was empty since
+// the last pass (interactive traffic, mostly) go before the rest. Each
+// queue runs CoDel: once its datagrams have waited more than
+// COALESCE_CODEL_TARGET_NS for a whole interval, it drops from the head,
+// more often the longer that lasts, so a sender that fills its window
+// faster than the path drains it sees losses early instead of a
+// standing queue.
+//
+// Slots are found by peer key, probing a few places from its hash. A
+// slot never mixes peers and order within a peer is kept. A coalescer
+// belongs to one event loop thread.
+
+#define COALESCE_TAG_MAX 16           // AEAD tag appended when sealing
+#define COALESCE_QUEUE 256            // closed datagrams per peer
+#define COALESCE_QUEUE_BYTES (4 << 20)       // frame bytes queued, all peers
+#define COALESCE_BURST 32             // datagrams closed between passes
+#define COALESCE_CODEL_TARGET_NS 5000000ULL
+#define COALESCE_CODEL_INTERVAL_NS 100000000ULL
+#define COALESCE_PROBES 4
+
+typedef enum {
+    COALESCE_SENT,           // sealed and queued for sending
+    COALESCE_BLOCKED,        // not now: keep it and try again at *retry_ns
+    COALESCE_DROPPED,        // cannot be sent (e.g. the peer is gone)
+} coalesce_result_t;
+
+typedef struct {
+    pktbuf_t *pkt;
+    size_t frames;
+    uint64_t arrival_sum_ns;
+    uint64_t queued_ns;      // when it was closed
+} coalesce_datagram_t;
+
+// CoDel state of one queue (RFC 8289)
+typedef struct {
+    uint64_t first_above_ns; // when waiting above target becomes a drop, 0 if below
+    uint64_t drop_next_ns;
+    uint32_t count, last_count;
+    bool dropping;
+} coalesce_codel_t;
+
+typedef struct {
+    uint64_t key;            // peer key
+    uint64_t peer_id;        // registration the frames were built for
+    coalesce_datagram_t open;        // frames so far, pkt NULL if none
+    uint64_t first_ns;       // arrival of the first frame of open
+    coalesce_datagram_t queue[COALESCE_QUEUE];
+    unsigned head, count;
+    size_t bytes;            // frame bytes queued
+    int64_t deficit;         // bytes it may send in this round
+    uint64_t retry_ns;       // when a blocked queue may move again
+    coalesce_codel_t codel;
+    bool listed;             // in the active list
+    bool fresh;              // idle before: served first in the next pass
+} coalesce_slot_t;
+
+// Seal and send a closed datagram of a slot. The coalescer drops its
+// reference to d->pkt afterwards, so the callback takes one if it keeps
+// the buffer.
+typedef coalesce_result_t (*coalesce_send_fn)(void *arg, coalesce_slot_t *slot, coalesce_datagram_t *d, uint64_t now_ns, uint64_t *retry_ns);
+
+// Written by the coalescer's thread only, see metrics.h
+typedef struct {
+    metric_t datagrams;
+    metric_t frames;
+    metric_t hold_ns;        // time sent frames waited, summed
+    metric_t dropped;        // frames dropped for a full queue or slot table
+    metric_t aqm_dropped;    // frames dropped by CoDel
+} coalesce_stats_t;
+
+typedef struct {
+    coalesce_slot_t *slots;
+    size_t mask;
+    uint32_t *active;        // indexes of the occupied slots
+    size_t nactive;
+    size_t closed;           // datagrams closed since the last pass
+    size_t bytes;            // frame bytes queued in every slot
+    size_t max_payload;      // frame bytes per datagram, for any peer
+    uint64_t deadline_ns;
+    uint64_t codel_target_ns;    // COALESCE_CODEL_TARGET_NS; 0 turns CoDel off
+    pktbuf_pool_t *pool;     // for packets that cannot be framed in place
+    coalesce_send_fn send;
+    void *arg;
+    coalesce_stats_t stats;
+} coalescer_t;
+
+// nslots is rounded up to a power of two. max_datagram, the largest
+// datagram for any peer, counts the whole UDP payload: tunnel header,
+// frames and tag.
+int coalesce_init(coalescer_t *c, size_t nslots, size_t max_datagram, uint64_t deadline_ns,
+                  pktbuf_pool_t *pool, coalesce_send_fn send, void *arg);
+
+// Drop pending frames without sending them
+void coalesce_free(coalescer_t *c);
+
+// Queue an IP packet for a peer as one frame of the given type and id
+// (see frame_header_length), in datagrams of at most max_datagram bytes.
+// The packet buffer is referenced, not copied, if it starts a datagram.
+// Returns 0, or -1 if it was dropped.
+int coalesce_add(coalescer_t *c, uint64_t key, uint64_t peer_id, int type, uint32_t id, pktbuf_t *pkt, size_t max_datagram, uint64_t now_ns);
+
+// Close the datagrams whose first frame has waited deadline_ns (all of
+// them if the deadline is 0) and send what the callback lets through,
+// in a pass over the peers
+void coalesce_flush(coalescer_t *c, uint64_t now_ns);
+
+// Let a peer's blocked queue try again at the next flush, e.g. after an
+// ACK opened its congestion window
+void coalesce_retry(coalescer_t *c, uint64_t key);
+
+// When the next datagram is due or a blocked queue may move, or 0 if
+// nothing is pending
+uint64_t coalesce_next_deadline(const coalescer_t *c);
+
+static inline double coalesce_frames_per_datagram(const coalesce_stats_t *s) {
+    uint64_t datagrams = metric_get(&s->datagrams);
+    return datagrams ? (double)metric_get(&s->frames) / datagrams : 0.0;
+}
+
+// Average time a packet waited for its datagram to be sent, in microseconds
+static inline double coalesce_average_hold_us(const coalesce_stats_t *s) {
+    uint64_t frames = metric_get(&s->frames);
+    return frames ? metric_get(&s->hold_ns) / 1e3 / frames : 0.0;
+}
+
+#endif
@@ -0,0 +1,214 @@
+#include "congestion.h"
+#include <string.h>
+
+// ---- NewReno ----
+
+static void newreno_init(congestion_t *cc) {
+    cc->newreno.ssthresh = UINT64_MAX;
+}
+
+static void newreno_on_ack(congestion_t *cc, const congestion_ack_t *ack) {
+    newreno_t *nr = &cc->newreno;
+    bool slow_start = cc->cwnd < nr->ssthresh;
+
+    // Grow only while the window is what limits the sender, and not for
+    // packets sent before the current recovery period began
+    bool cwnd_limited = ack->prior_in_flight * 2 >= cc->cwnd;
+    if (cwnd_limited && ack->largest_sent_ns > nr->recovery_start_ns) {
+        if (slow_start) {
+            cc->cwnd += ack->acked_bytes;
+        } else {
+            nr->acked_in_round += ack->acked_bytes;
+            if (nr->acked_in_round >= cc->cwnd) {
+                nr->acked_in_round -= cc->cwnd;
+                cc->cwnd += cc->mss;
+            }
+        }
+    }
+
+    if (ack->smoothed_rtt_ns > 0) {
+        double gain = slow_start ? 2.0 : 1.25;
+        cc->pacing_rate = gain * cc->cwnd * 1e9 / ack->smoothed_rtt_ns;
+    }
+}
+
+static void newreno_on_loss(congestion_t *cc, uint64_t lost_bytes, uint64_t largest_lost_sent_ns, uint64_t now_ns, bool persistent) {
+    newreno_t *nr = &cc->newreno;
+    uint64_t min_window = CONGESTION_MIN_WINDOW * cc->mss;
+
+    // One reduction per round trip of losses
+    if (largest_lost_sent_ns > nr->recovery_start_ns) {
+        nr->recovery_start_ns = now_ns;
+        nr->ssthresh = cc->cwnd / 2 > min_window ? cc->cwnd / 2 : min_window;
+        cc->cwnd = nr->ssthresh;
+        nr->acked_in_round = 0;
+    }
+    if (persistent) {
+        cc->cwnd = min_window;
+    }
+}
+
+const congestion_ops_t congestion_newreno = { "newreno", newreno_init, newreno_on_ack, newreno_on_loss };
+
+// ---- BBR ----
+
+enum { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT };
+
+#define BBR_HIGH_GAIN 2.885                     // 2/ln(2): doubles the rate each round
+#define BBR_MIN_WINDOW 4                        // datagrams
+#define BBR_MIN_RTT_WINDOW_NS 10000000000ULL    // min RTT expires after 10 s
+#define BBR_PROBE_RTT_NS 200000000ULL
+#define BBR_CYCLE_LEN 8
+
+static const double bbr_cycle_gains[BBR_CYCLE_LEN] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+static void bbr_init(congestion_t *cc) {
+    bbr_t *b = &cc->bbr;
+    b->mode = BBR_STARTUP;
+    b->pacing_gain = BBR_HIGH_GAIN;
+    b->cwnd_gain = BBR_HIGH_GAIN;
+}
+
+// Bandwidth-delay product times gain, once both are measured
+static uint64_t bbr_bdp(const congestion_t *cc, double gain) {
+    const bbr_t *b = &cc->bbr;
+    if (b->btl_bw == 0 || b->min_rtt_ns == 0) {
+        return CONGESTION_INITIAL_WINDOW * cc->mss;
+    }
+    return (uint64_t)(gain * b->btl_bw * b->min_rtt_ns / 1e9);
+}
+
+static void bbr_enter_probe_bw(congestion_t *cc, uint64_t now_ns) {
+    bbr_t *b = &cc->bbr;
+    b->mode = BBR_PROBE_BW;
+    b->cycle = 2;    // start cruising rather than probing or draining
+    b->cycle_stamp_ns = now_ns;
+    b->pacing_gain = bbr_cycle_gains[b->cycle];
+    b->cwnd_gain = 2;
+}
+
+static void bbr_on_ack(congestion_t *cc, const congestion_ack_t *ack) {
+    bbr_t *b = &cc->bbr;
+    uint64_t now = ack->now_ns;
+
+    // A round trip ends when a packet sent after the previous one ended
+    // is acknowledged
+    bool round_start = false;
+    if (ack->packet_delivered >= b->next_round_delivered) {
+        b->next_round_delivered = ack->delivered;
+        b->round++;
+        b->bw[b->round % CONGESTION_BBR_BW_ROUNDS] = 0;
+        round_start = true;
+    }
+    double *bw = &b->bw[b->round % CONGESTION_BBR_BW_ROUNDS];
+    if (ack->delivery_rate > *bw) *bw = ack->delivery_rate;
+    b->btl_bw = 0;
+    for (int i = 0; i < CONGESTION_BBR_BW_ROUNDS; i++) {
+        if (b->bw[i] > b->btl_bw) b->btl_bw = b->bw[i];
+    }
+
+    bool min_rtt_expired = b->min_rtt_stamp_ns && now - b->min_rtt_stamp_ns > BBR_MIN_RTT_WINDOW_NS;
+    if (ack->rtt_ns && (b->min_rtt_ns == 0 || ack->rtt_ns <= b->min_rtt_ns || min_rtt_expired)) {
+        b->min_rtt_ns = ack->rtt_ns;
+        b->min_rtt_stamp_ns = now;
+    }
+
+    switch (b->mode) {
+    case BBR_STARTUP:
+        // The pipe is full once three rounds in a row grew bandwidth by
+        // less than a quarter
+        if (round_start && !b->filled_pipe) {
+            if (b->btl_bw >= b->full_bw * 1.25) {
+                b->full_bw = b->btl_bw;
+                b->full_bw_rounds = 0;
+            } else if (++b->full_bw_rounds >= 3) {
+                b->filled_pipe = true;
+            }
+        }
+        if (b->filled_pipe) {
+            b->mode = BBR_DRAIN;
+            b->pacing_gain = 1 / BBR_HIGH_GAIN;
+        }
+        break;
+    case BBR_DRAIN:
+        if (ack->bytes_in_flight <= bbr_bdp(cc, 1)) {
+            bbr_enter_probe_bw(cc, now);
+        }
+        break;
+    case BBR_PROBE_BW:
+        if (b->min_rtt_ns && now - b->cycle_stamp_ns > b->min_rtt_ns) {
+            b->cycle = (b->cycle + 1) % BBR_CYCLE_LEN;
+            b->cycle_stamp_ns = now;
+            b->pacing_gain = bbr_cycle_gains[b->cycle];
+        }
+        break;
+    case BBR_PROBE_RTT:
+        if (now >= b->probe_rtt_done_ns) {
+            b->min_rtt_stamp_ns = now;
+            if (cc->cwnd < b->prior_cwnd) cc->cwnd = b->prior_cwnd;
+            if (b->filled_pipe) {
+                bbr_enter_probe_bw(cc, now);
+            } else {
+                b->mode = BBR_STARTUP;
+                b->pacing_gain = b->cwnd_gain = BBR_HIGH_GAIN;
+            }
+        }
+        break;
+    }
+
+    // Drain the queue for a moment every 10 s to see the propagation delay
+    if (min_rtt_expired && b->mode != BBR_PROBE_RTT) {
+        b->mode = BBR_PROBE_RTT;
+        b->pacing_gain = 1;
+        b->prior_cwnd = cc->cwnd;
+        b->probe_rtt_done_ns = now + BBR_PROBE_RTT_NS;
+    }
+
+    uint64_t min_window = BBR_MIN_WINDOW * cc->mss;
+    if (b->mode == BBR_PROBE_RTT) {
+        if (cc->cwnd > min_window) cc->cwnd = min_window;
+    } else {
+        uint64_t target = bbr_bdp(cc, b->cwnd_gain) + 3 * cc->mss;
+        if (b->filled_pipe) {
+            cc->cwnd = cc->cwnd + ack->acked_bytes < target ? cc->cwnd + ack->acked_bytes : target;
+        } else if (cc->cwnd < target || ack->delivered < CONGESTION_INITIAL_WINDOW * cc->mss) {
+            cc->cwnd += ack->acked_bytes;
+        }
+        if (cc->cwnd < min_window) cc->cwnd = min_window;
+    }
+
+    if (b->btl_bw > 0) {
+        cc->pacing_rate = b->pacing_gain * b->btl_bw;
+    } else if (ack->smoothed_rtt_ns > 0) {
+        cc->pacing_rate = BBR_HIGH_GAIN * cc->cwnd * 1e9 / ack->smoothed_rtt_ns;
+    }
+}
+
+// The model already accounts for what got through; only a total
+// blackout shrinks the window
+static void bbr_on_loss(congestion_t *cc, uint64_t lost_bytes, uint64_t largest_lost_sent_ns, uint64_t now_ns, bool persistent) {
+    if (persistent) {
+        cc->bbr.prior_cwnd = cc->cwnd;
+        cc->cwnd = BBR_MIN_WINDOW * cc->mss;
+    }
+}
+
+const congestion_ops_t congestion_bbr = { "bbr", bbr_init, bbr_on_ack, bbr_on_loss };
+
+// ---- common ----
+
+const congestion_ops_t *congestion_find(const char *name) {
+    static const congestion_ops_t *all[] = { &congestion_newreno, &congestion_bbr };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(name, all[i]->name) == 0) return all[i];
+    }
+    return NULL;
+}
+
+void congestion_init(congestion_t *cc, const congestion_ops_t *ops, size_t mss) {
+    memset(cc, 0, sizeof(*cc));
+    cc->ops = ops;
+    cc->mss = mss;
+    cc->cwnd = CONGESTION_INITIAL_WINDOW * mss;
+    ops->init(cc);
+}
@@ -0,0 +1,96 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Congestion controllers for the tunnel sender. A controller is told
+// about every acknowledgement and loss and keeps the congestion window
+// and the pacing rate; the loss recovery code (recovery.h) enforces both.
+//
+//  newreno  RFC 9002 section 7: slow start, then one datagram per round
+//           trip, halving the window once per loss event. Paced at
+//           twice (slow start) or 1.25 times cwnd per smoothed RTT.
+//
+//  bbr      a BBRv1-style model: the bottleneck bandwidth is the maximum
+//           delivery rate seen over the last 10 round trips and the
+//           propagation delay the minimum RTT over 10 seconds. Sends at
+//           a gain cycle around that bandwidth with about two BDPs in
+//           flight, and does not back off on random loss.
+
+#define CONGESTION_INITIAL_WINDOW 10    // datagrams
+#define CONGESTION_MIN_WINDOW 2         // datagrams
+#define CONGESTION_BBR_BW_ROUNDS 10
+
+// What one ACK frame acknowledged
+typedef struct {
+    uint64_t now_ns;
+    uint64_t acked_bytes;
+    uint64_t prior_in_flight;         // bytes in flight before this ACK
+    uint64_t bytes_in_flight;         // and after it
+    uint64_t largest_sent_ns;         // send time of the newest packet acknowledged
+    uint64_t packet_delivered;        // delivered count when that packet was sent
+    uint64_t delivered;               // bytes delivered in total, now
+    double delivery_rate;             // bytes per second, 0 if no sample
+    uint64_t rtt_ns;                  // latest RTT sample, 0 if this ACK gave none
+    uint64_t smoothed_rtt_ns;
+    uint64_t min_rtt_ns;
+} congestion_ack_t;
+
+typedef struct congestion congestion_t;
+
+typedef struct {
+    const char *name;
+    void (*init)(congestion_t *cc);
+    void (*on_ack)(congestion_t *cc, const congestion_ack_t *ack);
+    // Packets declared lost; persistent if nothing got through for several
+    // probe timeouts
+    void (*on_loss)(congestion_t *cc, uint64_t lost_bytes, uint64_t largest_lost_sent_ns, uint64_t now_ns, bool persistent);
+} congestion_ops_t;
+
+typedef struct {
+    uint64_t ssthresh;
+    uint64_t recovery_start_ns;       // losses of packets sent before this are one event
+    uint64_t acked_in_round;          // bytes acked towards the next window increase
+} newreno_t;
+
+typedef struct {
+    int mode;
+    double bw[CONGESTION_BBR_BW_ROUNDS];    // max delivery rate per round
+    double btl_bw;
+    uint64_t round;
+    uint64_t next_round_delivered;
+    uint64_t min_rtt_ns;
+    uint64_t min_rtt_stamp_ns;
+    double pacing_gain;
+    double cwnd_gain;
+    double full_bw;
+    int full_bw_rounds;
+    bool filled_pipe;
+    int cycle;
+    uint64_t cycle_stamp_ns;
+    uint64_t probe_rtt_done_ns;
+    uint64_t prior_cwnd;
+} bbr_t;
+
+struct congestion {
+    const congestion_ops_t *ops;
+    size_t mss;                       // datagram size the window is counted in
+    uint64_t cwnd;                    // bytes
+    double pacing_rate;               // bytes per second, 0 = unpaced
+    union {
+        newreno_t newreno;
+        bbr_t bbr;
+    };
+};
+
+extern const congestion_ops_t congestion_newreno;
+extern const congestion_ops_t congestion_bbr;
+
+// Look up "newreno" or "bbr". Returns NULL if unknown.
+const congestion_ops_t *congestion_find(const char *name);
+
+void congestion_init(congestion_t *cc, const congestion_ops_t *ops, size_t mss);
+
+#endif
@@ -0,0 +1,108 @@
+#include "crypto.h"
+#include <picotls/openssl.h>
+#include <string.h>
+#ifdef HAVE_FUSION
+#include <picotls/fusion.h>
+#endif
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// Room for every suite and the terminating NULL
+static ptls_cipher_suite_t *suites[4];
+
+static ptls_cipher_suite_t *suite_of(crypto_cipher_t cipher) {
+    switch (cipher) {
+    case CRYPTO_CIPHER_AES128GCM:
+        return &ptls_openssl_aes128gcmsha256;
+    case CRYPTO_CIPHER_AES256GCM:
+        return &ptls_openssl_aes256gcmsha384;
+    case CRYPTO_CIPHER_CHACHA20:
+#ifdef PTLS_OPENSSL_HAVE_CHACHA20_POLY1305
+        return &ptls_openssl_chacha20poly1305sha256;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+int crypto_cipher_parse(const char *name, crypto_cipher_t *cipher) {
+    static const char *const names[] = { "auto", "aes128gcm", "aes256gcm", "chacha20" };
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0 && (i == CRYPTO_CIPHER_AUTO || suite_of(i))) {
+            *cipher = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void crypto_set_cipher(crypto_cipher_t cipher) {
+    size_t n = 0;
+    if (cipher != CRYPTO_CIPHER_AUTO) {
+        suites[n++] = suite_of(cipher);
+    } else {
+        static const crypto_cipher_t aes_first[] = { CRYPTO_CIPHER_AES128GCM, CRYPTO_CIPHER_AES256GCM, CRYPTO_CIPHER_CHACHA20 };
+        static const crypto_cipher_t chacha_first[] = { CRYPTO_CIPHER_CHACHA20, CRYPTO_CIPHER_AES128GCM, CRYPTO_CIPHER_AES256GCM };
+        const crypto_cipher_t *order = crypto_cpu_has_aes() ? aes_first : chacha_first;
+        for (int i = 0; i < 3; i++) {
+            if (suite_of(order[i])) suites[n++] = suite_of(order[i]);
+        }
+    }
+    suites[n] = NULL;
+}
+
+ptls_cipher_suite_t **crypto_cipher_suites(void) {
+    if (!suites[0]) crypto_set_cipher(CRYPTO_CIPHER_AUTO);
+    return suites;
+}
+
+bool crypto_cpu_has_aes(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+#else
+    return false;
+#endif
+}
+
+bool crypto_fusion_available(void) {
+#ifdef HAVE_FUSION
+    return ptls_fusion_is_supported_by_cpu();
+#else
+    return false;
+#endif
+}
+
+ptls_aead_algorithm_t *crypto_aead(const ptls_cipher_suite_t *suite) {
+#ifdef HAVE_FUSION
+    if (crypto_fusion_available()) {
+        if (suite->id == PTLS_CIPHER_SUITE_AES_128_GCM_SHA256) return &ptls_fusion_aes128gcm;
+        if (suite->id == PTLS_CIPHER_SUITE_AES_256_GCM_SHA384) return &ptls_fusion_aes256gcm;
+    }
+#endif
+    return suite->aead;
+}
+
+const char *crypto_engine_name(const ptls_aead_algorithm_t *aead) {
+#ifdef HAVE_FUSION
+    if (aead == &ptls_fusion_aes128gcm || aead == &ptls_fusion_aes256gcm) return "fusion";
+#endif
+    return "openssl";
+}
+
+void crypto_seal_batch(const crypto_seal_t *ops, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        const crypto_seal_t *op = &ops[i];
+        if (i + 1 < n) {
+            __builtin_prefetch(ops[i + 1].aad, 1);
+            __builtin_prefetch(ops[i + 1].data, 1);
+            __builtin_prefetch(ops[i + 1].aead);
+        }
+        ptls_aead_encrypt(op->aead, op->data, op->data, op->len, op->pn, op->aad, op->aad_len);
+    }
+}
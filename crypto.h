@@ -0,0 +1,74 @@
+#ifndef CRYPTO_H
+#define CRYPTO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <picotls.h>
+
+// AEAD engines for the tunnel keys. The TLS handshake negotiates the
+// cipher suite from the list crypto_cipher_suites() gives, and the keys
+// exported from it then use the fastest implementation of the suite's
+// AEAD that this build and CPU have:
+//
+//  fusion   picotls's AES-GCM for x86-64 CPUs with AES-NI, PCLMULQDQ and
+//           AVX2 (and VAES where present). It runs the AES rounds of a
+//           packet interleaved with its GHASH. Built in when the Makefile
+//           compiles picotls/lib/fusion.c (HAVE_FUSION).
+//  openssl  OpenSSL's implementation of every suite, also used for the
+//           handshake itself
+//
+// By default AES-GCM is preferred on CPUs with AES instructions, and
+// ChaCha20-Poly1305 on the others, where AES is slow and not constant
+// time. The server takes the client's preference, so each end decides
+// by its own CPU.
+
+typedef enum {
+    CRYPTO_CIPHER_AUTO,
+    CRYPTO_CIPHER_AES128GCM,
+    CRYPTO_CIPHER_AES256GCM,
+    CRYPTO_CIPHER_CHACHA20,
+} crypto_cipher_t;
+
+// Parse "auto", "aes128gcm", "aes256gcm" or "chacha20". Returns -1 if
+// unknown or not in this OpenSSL.
+int crypto_cipher_parse(const char *name, crypto_cipher_t *cipher);
+
+// Offer only the given suite (any of them for CRYPTO_CIPHER_AUTO,
+// ordered by what this CPU is fast at). Call before creating handshake
+// configs.
+void crypto_set_cipher(crypto_cipher_t cipher);
+
+// NULL-terminated list for ptls_context_t.cipher_suites
+ptls_cipher_suite_t **crypto_cipher_suites(void);
+
+// True if the CPU has AES and carry-less multiply instructions
+bool crypto_cpu_has_aes(void);
+
+// True if the fusion engine is built in and this CPU can run it
+bool crypto_fusion_available(void);
+
+// The AEAD for tunnel keys of a negotiated suite: fusion for AES-GCM
+// where available, otherwise the suite's own
+ptls_aead_algorithm_t *crypto_aead(const ptls_cipher_suite_t *suite);
+
+// "fusion" or "openssl"
+const char *crypto_engine_name(const ptls_aead_algorithm_t *aead);
+
+// One datagram to seal: len bytes at data are encrypted in place as
+// packet pn, with the tag written after them and the aad (its header)
+// authenticated.
+typedef struct {
+    ptls_aead_context_t *aead;
+    uint8_t *data;
+    size_t len;
+    uint64_t pn;
+    const uint8_t *aad;
+    size_t aad_len;
+} crypto_seal_t;
+
+// Seal a batch in one pass, each datagram's buffers fetched while the
+// one before is being encrypted. Sealing cannot fail.
+void crypto_seal_batch(const crypto_seal_t *ops, size_t n);
+
+#endif
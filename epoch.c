@@ -0,0 +1,101 @@
+#include "epoch.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct epoch_retired {
+    void *ptr;
+    epoch_free_fn free_fn;
+    uint64_t epoch;
+    struct epoch_retired *next;
+};
+
+// Each thread gets a reader slot the first time it enters any domain.
+// Two threads sharing one would clear each other's announcement, and
+// objects they still hold could be freed, so running out is fatal.
+static _Atomic int next_reader_id = 0;
+static __thread int reader_id = -1;
+
+static int current_reader(void) {
+    if (reader_id < 0) {
+        int id = atomic_fetch_add(&next_reader_id, 1);
+        if (id >= EPOCH_MAX_READERS) {
+            fprintf(stderr, "epoch: more than %d reader threads\n", EPOCH_MAX_READERS);
+            abort();
+        }
+        reader_id = id;
+    }
+    return reader_id;
+}
+
+void epoch_init(epoch_domain_t *d) {
+    atomic_init(&d->epoch, 1);
+    pthread_mutex_init(&d->lock, NULL);
+    d->retired = NULL;
+    for (int i = 0; i < EPOCH_MAX_READERS; i++) {
+        atomic_init(&d->readers[i].epoch, 0);
+    }
+}
+
+void epoch_destroy(epoch_domain_t *d) {
+    while (d->retired) {
+        epoch_retired_t *next = d->retired->next;
+        d->retired->free_fn(d->retired->ptr);
+        free(d->retired);
+        d->retired = next;
+    }
+    pthread_mutex_destroy(&d->lock);
+}
+
+void epoch_enter(epoch_domain_t *d) {
+    // Retry if a writer advanced the epoch between our load and the
+    // announcement, otherwise it may already have scanned past this slot
+    epoch_slot_t *slot = &d->readers[current_reader()];
+    uint64_t e;
+    do {
+        e = atomic_load(&d->epoch);
+        atomic_store(&slot->epoch, e);
+    } while (atomic_load(&d->epoch) != e);
+}
+
+void epoch_exit(epoch_domain_t *d) {
+    atomic_store_explicit(&d->readers[current_reader()].epoch, 0, memory_order_release);
+}
+
+void epoch_retire(epoch_domain_t *d, void *ptr, epoch_free_fn free_fn) {
+    epoch_retired_t *r = malloc(sizeof(*r));
+    if (!r) {
+        return;    // leak rather than free something a reader may hold
+    }
+    r->ptr = ptr;
+    r->free_fn = free_fn;
+
+    pthread_mutex_lock(&d->lock);
+    r->epoch = atomic_fetch_add(&d->epoch, 1);
+    r->next = d->retired;
+    d->retired = r;
+    pthread_mutex_unlock(&d->lock);
+}
+
+void epoch_reclaim(epoch_domain_t *d) {
+    pthread_mutex_lock(&d->lock);
+
+    // Oldest epoch any reader may still be in
+    uint64_t min_epoch = UINT64_MAX;
+    for (int i = 0; i < EPOCH_MAX_READERS; i++) {
+        uint64_t e = atomic_load(&d->readers[i].epoch);
+        if (e && e < min_epoch) min_epoch = e;
+    }
+
+    epoch_retired_t **prev = &d->retired;
+    while (*prev) {
+        epoch_retired_t *r = *prev;
+        if (r->epoch < min_epoch) {
+            *prev = r->next;
+            r->free_fn(r->ptr);
+            free(r);
+        } else {
+            prev = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+}
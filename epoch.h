@@ -0,0 +1,48 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Epoch-based reclamation for structures with lock-free readers.
+//
+// Readers bracket their accesses with epoch_enter/epoch_exit, which only
+// publishes the global epoch in a per-thread slot. A writer that unlinks
+// an object hands it to epoch_retire; it is freed by epoch_reclaim once
+// every reader has moved past the epoch in which it was unlinked.
+//
+// A thread keeps its slot for the life of the process; the process
+// aborts if more than EPOCH_MAX_READERS threads ever read.
+#define EPOCH_MAX_READERS 64
+
+typedef void (*epoch_free_fn)(void *ptr);
+
+// One cache line per reader so epoch updates don't false-share
+typedef struct {
+    _Atomic uint64_t epoch;    // 0 when outside a read section
+    char pad[64 - sizeof(uint64_t)];
+} epoch_slot_t;
+
+typedef struct epoch_retired epoch_retired_t;
+
+typedef struct {
+    _Atomic uint64_t epoch;
+    pthread_mutex_t lock;      // protects the retired list
+    epoch_retired_t *retired;
+    epoch_slot_t readers[EPOCH_MAX_READERS];
+} epoch_domain_t;
+
+void epoch_init(epoch_domain_t *d);
+// Frees everything still retired; no reader may be active
+void epoch_destroy(epoch_domain_t *d);
+
+void epoch_enter(epoch_domain_t *d);
+void epoch_exit(epoch_domain_t *d);
+
+// Queue ptr for free_fn once no reader can still hold it. Call after
+// the object has been unlinked from every reader-visible structure.
+void epoch_retire(epoch_domain_t *d, void *ptr, epoch_free_fn free_fn);
+void epoch_reclaim(epoch_domain_t *d);
+
+#endif
@@ -0,0 +1,942 @@
+#define _GNU_SOURCE    // MSG_TRUNC in recvmsg_out flags, O_NONBLOCK handling
+#include "event.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "vnet.h"
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define RECV_GROUP 0                            // provided buffer group of the sockets
+#define RECV_CONTROL_SIZE CMSG_SPACE(sizeof(int))    // UDP_GRO segment size
+#define RECV_MIN_BUFFERS 64
+#define RECV_MAX_BUFFERS 4096
+
+// io_uring user_data: operation in the high word, slot (socket index for
+// OP_RECV and OP_POLL) in the low word
+enum { OP_RECV = 1, OP_POLL, OP_TUN_READ, OP_TUN_WRITE };
+#define USER_DATA(op, slot) (((uint64_t)(op) << 32) | (uint32_t)(slot))
+
+typedef struct {
+    int fd;                  // -1 if not added
+    batch_stats_t *stats;
+    event_packet_fn fn;
+    void *arg;
+    size_t round_packets;    // packets delivered in the current wakeup
+} source_t;
+
+// A timer of event_add_timer, re-armed each time it fires
+typedef struct {
+    event_timer_t timer;
+    event_loop_t *loop;
+    unsigned interval_ms;
+    event_fn fn;
+    void *arg;
+} periodic_t;
+
+// A submission/completion ring mapped from the kernel, driven with raw
+// syscalls (no liburing dependency)
+typedef struct {
+    int fd;
+    unsigned flags;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_khead, *sq_ktail, sq_mask, sq_entries;
+    unsigned sq_tail;        // local tail, published on submit
+    unsigned *cq_khead, *cq_ktail, cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+struct event_loop {
+    event_backend_t backend;
+    size_t batch_size;
+    size_t buf_size;
+    source_t dgram[EVENT_MAX_SOCKETS], tun;
+    dgram_batch_t *rx[EVENT_MAX_SOCKETS];
+    int ndgram;
+    timer_wheel_t wheel;     // ticks are event_clock_ns milliseconds
+    uint64_t now_ns;         // clock read at the start of the wakeup
+    periodic_t timers[EVENT_MAX_TIMERS];
+    int ntimers;
+    event_fn round_begin, round_end;
+    void *round_arg;
+    uint64_t deadline_ns;    // one-shot deadline, 0 if none
+    event_fn deadline_fn;
+    void *deadline_arg;
+    uint64_t wakeups;
+    pktbuf_pool_t tun_pool;  // TUN packets, read behind PKTBUF_HEADROOM
+    uint8_t *tun_buf;        // epoll: read target if the pool runs dry
+
+    // TUN offloads (event_tun_offload)
+    bool offload;
+    size_t max_segment;      // largest packet cut from a super-packet
+    pktbuf_pool_t vnet_pool; // io_uring: super-packet reads
+    vnet_gro_t gro;
+    batch_stats_t *write_stats;
+
+    // epoll backend
+    int epfd;
+    bool no_pwait2;          // kernel without epoll_pwait2: ms timeouts
+
+    // io_uring backend
+    uring_t ring;
+    bool fixed_bufs;         // TUN pool registered with the ring
+    bool fatal;
+    pktbuf_t *tun_reads[EVENT_TUN_READS];    // buffer of each posted read
+    pktbuf_t *write_pkts[EVENT_WRITE_SLOTS]; // buffer of each write in flight
+    size_t write_len[EVENT_WRITE_SLOTS];
+    struct virtio_net_hdr write_hdrs[EVENT_WRITE_SLOTS];    // offload: header and
+    struct iovec write_iov[EVENT_WRITE_SLOTS][2];           // iovec of each writev
+    int free_slots[EVENT_WRITE_SLOTS];
+    int nfree;
+    struct io_uring_sqe *last_write;    // unsubmitted end of the write chain
+
+    struct io_uring_buf_ring *recv_ring;
+    size_t recv_ring_size;
+    unsigned recv_entries;
+    uint16_t recv_tail;
+    pktbuf_pool_t recv_pool; // one buffer per ring entry, lent to the kernel
+    struct msghdr recv_msg;  // multishot template: name and control sizes
+    bool recv_poll;          // no multishot recvmsg: poll and recvmmsg instead
+    bool recv_armed[EVENT_MAX_SOCKETS];
+};
+
+uint64_t event_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int event_backend_parse(const char *name, event_backend_t *backend) {
+    if (strcmp(name, "auto") == 0) {
+        *backend = EVENT_BACKEND_AUTO;
+    } else if (strcmp(name, "epoll") == 0) {
+        *backend = EVENT_BACKEND_EPOLL;
+    } else if (strcmp(name, "io_uring") == 0) {
+        *backend = EVENT_BACKEND_IO_URING;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *event_loop_backend(const event_loop_t *loop) {
+    return loop->backend == EVENT_BACKEND_IO_URING ? "io_uring" : "epoll";
+}
+
+uint64_t event_loop_wakeups(const event_loop_t *loop) {
+    return loop->wakeups;
+}
+
+uint64_t event_loop_now_ms(const event_loop_t *loop) {
+    return loop->now_ns / 1000000;
+}
+
+// ---- io_uring plumbing ----
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_unmap(uring_t *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring) munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0) close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static int uring_setup(uring_t *r) {
+    // Single issuer with deferred task work keeps completions on the loop
+    // thread. The ring starts disabled so it can be enabled (and bound) by
+    // whichever thread ends up running the loop.
+    struct io_uring_params p;
+    unsigned tries[] = {
+        IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED,
+        IORING_SETUP_CQSIZE,
+    };
+    r->fd = -1;
+    for (size_t i = 0; i < sizeof(tries) / sizeof(tries[0]) && r->fd < 0; i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = tries[i];
+        p.cq_entries = URING_CQ_ENTRIES;
+        r->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+    }
+    if (r->fd < 0) return -1;
+    r->flags = p.flags;
+
+    // Timed waits need IORING_ENTER_EXT_ARG; NODROP keeps completions that
+    // overflow the CQ instead of losing them
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        close(r->fd);
+        r->fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        uring_unmap(r);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            uring_unmap(r);
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_unmap(r);
+        return -1;
+    }
+
+    uint8_t *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_khead = (unsigned *)(sq + p.sq_off.head);
+    r->sq_ktail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_tail = *r->sq_ktail;
+    r->cq_khead = (unsigned *)(cq + p.cq_off.head);
+    r->cq_ktail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // SQ slots map one-to-one onto SQEs
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+    return 0;
+}
+
+// Hand queued SQEs to the kernel and, if wait, block for at least one
+// completion or until timeout_ns (-1 = no timeout) passes
+static int uring_submit(event_loop_t *loop, bool wait, int64_t timeout_ns) {
+    uring_t *r = &loop->ring;
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+    loop->last_write = NULL;    // submitted SQEs can no longer be linked to
+
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {0};
+    if (wait && timeout_ns >= 0) {
+        ts.tv_sec = timeout_ns / 1000000000;
+        ts.tv_nsec = timeout_ns % 1000000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    if (to_submit == 0 && !wait) return 0;
+
+    int ret = uring_enter(r->fd, to_submit, wait ? 1 : 0, flags, (flags & IORING_ENTER_EXT_ARG) ? (void *)&arg : NULL, (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+    if (ret < 0 && (errno == ETIME || errno == EINTR)) return 0;
+    return ret;
+}
+
+// Next free SQE, submitting queued ones if the ring is full. Anything
+// other than a TUN write ends the current write chain, since IOSQE_IO_LINK
+// always applies to the next SQE in the ring.
+static struct io_uring_sqe *uring_sqe(event_loop_t *loop, bool tun_write) {
+    uring_t *r = &loop->ring;
+    if (r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        if (uring_submit(loop, false, 0) < 0 || r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_tail & r->sq_mask];
+    r->sq_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    if (!tun_write) loop->last_write = NULL;
+    return sqe;
+}
+
+static int uring_init(event_loop_t *loop) {
+    if (uring_setup(&loop->ring) != 0) return -1;
+
+    for (int i = 0; i < EVENT_WRITE_SLOTS; i++) {
+        loop->free_slots[i] = EVENT_WRITE_SLOTS - 1 - i;
+    }
+    loop->nfree = EVENT_WRITE_SLOTS;
+
+    // Register the TUN pool so the kernel pins it once instead of on
+    // every read. Falls back to plain reads if the memlock limit is too low.
+    struct iovec iov = { loop->tun_pool.slab, loop->tun_pool.count * loop->tun_pool.buf_size };
+    loop->fixed_bufs = uring_register(loop->ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    return 0;
+}
+
+// Give a buffer back to the kernel once nothing references it (published
+// at the end of the wakeup)
+static void recv_buffer_return(pktbuf_pool_t *pool, pktbuf_t *pkt, void *arg) {
+    event_loop_t *loop = arg;
+    struct io_uring_buf *b = &loop->recv_ring->bufs[loop->recv_tail & (loop->recv_entries - 1)];
+    b->addr = (uint64_t)(uintptr_t)pkt->base;
+    b->len = pkt->size;
+    b->bid = pkt->index;
+    loop->recv_tail++;
+}
+
+// Set up the provided buffer ring the multishot recvmsgs receive into,
+// sized for the first socket's batch
+static int recv_ring_init(event_loop_t *loop) {
+    dgram_batch_t *rx = loop->rx[0];
+    unsigned entries = RECV_MIN_BUFFERS;
+    if (!rx->gro) {
+        while (entries < 4 * loop->batch_size && entries < RECV_MAX_BUFFERS) entries <<= 1;
+    }
+
+    memset(&loop->recv_msg, 0, sizeof(loop->recv_msg));
+    loop->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    loop->recv_msg.msg_controllen = rx->gro ? RECV_CONTROL_SIZE : 0;
+    size_t buf_size = sizeof(struct io_uring_recvmsg_out) + loop->recv_msg.msg_namelen + loop->recv_msg.msg_controllen + rx->buf_size;
+
+    loop->recv_ring_size = entries * sizeof(struct io_uring_buf);
+    loop->recv_ring = mmap(NULL, loop->recv_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->recv_ring == MAP_FAILED) {
+        loop->recv_ring = NULL;
+        return -1;
+    }
+    // Every buffer belongs to the kernel until a completion hands it out;
+    // dropping the last reference lends it back instead of freeing it
+    if (pktbuf_pool_init(&loop->recv_pool, entries, buf_size) != 0) return -1;
+    loop->recv_pool.nfree = 0;
+    loop->recv_pool.release = recv_buffer_return;
+    loop->recv_pool.release_arg = loop;
+
+    struct io_uring_buf_reg reg = {0};
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->recv_ring;
+    reg.ring_entries = entries;
+    reg.bgid = RECV_GROUP;
+    if (uring_register(loop->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) return -1;
+
+    loop->recv_entries = entries;
+    for (unsigned i = 0; i < entries; i++) {
+        recv_buffer_return(&loop->recv_pool, &loop->recv_pool.bufs[i], loop);
+    }
+    __atomic_store_n(&loop->recv_ring->tail, loop->recv_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void arm_recv(event_loop_t *loop, int i) {
+    struct io_uring_sqe *sqe = uring_sqe(loop, false);
+    if (!sqe) return;
+    sqe->fd = loop->dgram[i].fd;
+    if (loop->recv_poll) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = USER_DATA(OP_POLL, i);
+    } else {
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->addr = (uint64_t)(uintptr_t)&loop->recv_msg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RECV_GROUP;
+        sqe->user_data = USER_DATA(OP_RECV, i);
+    }
+    loop->recv_armed[i] = true;
+}
+
+// Post a read into a fresh pool buffer. The slot stays idle if the pool
+// is empty and is retried once the wakeup's sends have released buffers.
+static void post_tun_read(event_loop_t *loop, unsigned slot) {
+    pktbuf_t *pkt = pktbuf_alloc(loop->offload ? &loop->vnet_pool : &loop->tun_pool);
+    if (!pkt) return;
+    struct io_uring_sqe *sqe = uring_sqe(loop, false);
+    if (!sqe) {
+        pktbuf_put(pkt);
+        return;
+    }
+    sqe->opcode = loop->fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = loop->tun.fd;
+    sqe->addr = (uint64_t)(uintptr_t)pkt->data;
+    sqe->len = loop->offload ? VNET_READ_SIZE : loop->buf_size;
+    sqe->user_data = USER_DATA(OP_TUN_READ, slot);
+    loop->tun_reads[slot] = pkt;
+}
+
+// ---- packet delivery shared by both backends ----
+
+static void deliver(source_t *src, pktbuf_t *pkt, struct sockaddr_in *from) {
+    src->round_packets++;
+    src->fn(src->arg, pkt, from);
+}
+
+static void deliver_segment(void *arg, pktbuf_t *pkt) {
+    event_loop_t *loop = arg;
+    deliver(&loop->tun, pkt, NULL);
+}
+
+// Cut a read from an offloading TUN fd into the packets it carries
+static void deliver_super(event_loop_t *loop, uint8_t *buf, size_t len) {
+    source_t *src = &loop->tun;
+    int n = vnet_segment(buf, len, loop->max_segment, deliver_segment, loop);
+    if (n < 0) {
+        log_limited(LOG_LEVEL_WARN, "Dropping TUN packet with a malformed virtio-net header\n");
+    } else if (src->stats && n > 1) {
+        metric_add(&src->stats->super_buffers, 1);
+        metric_add(&src->stats->segments, n);
+    }
+}
+
+// Drain a readable socket with recvmmsg batches
+static void drain_dgram(event_loop_t *loop, int sock) {
+    source_t *src = &loop->dgram[sock];
+    dgram_batch_t *rx = loop->rx[sock];
+    for (int round = 0; round < EVENT_DRAIN_BUDGET; round++) {
+        int n = dgram_batch_recv(src->fd, rx, src->stats);
+        if (n < 0) {
+            log_limited(LOG_LEVEL_ERROR, "recvmmsg: %s\n", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            // The batch reuses its slots on the next recv, so these are views
+            pktbuf_t pkt = pktbuf_view(dgram_batch_pkt(rx, i), dgram_batch_pkt_len(rx, i));
+            src->fn(src->arg, &pkt, dgram_batch_pkt_addr(rx, i));
+        }
+        if (!dgram_batch_recv_full(rx)) break;    // socket drained
+    }
+}
+
+// Drain a readable TUN fd until EAGAIN, reading each packet into its own
+// pool buffer behind the headroom
+static void drain_tun(event_loop_t *loop) {
+    source_t *src = &loop->tun;
+    while (src->round_packets < EVENT_DRAIN_BUDGET * loop->batch_size) {
+        if (loop->offload) {
+            // Segments are handed out as views, so one buffer does
+            ssize_t len = read(src->fd, loop->tun_buf, VNET_READ_SIZE);
+            if (len < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) log_limited(LOG_LEVEL_ERROR, "Reading from TUN: %s\n", strerror(errno));
+                break;
+            }
+            deliver_super(loop, loop->tun_buf, len);
+            continue;
+        }
+        pktbuf_t *pkt = pktbuf_alloc(&loop->tun_pool);
+        pktbuf_t view = pktbuf_view(loop->tun_buf, 0);
+        uint8_t *buf = pkt ? pkt->data : loop->tun_buf;
+        ssize_t len = read(src->fd, buf, loop->buf_size);
+        if (len < 0) {
+            if (pkt) pktbuf_put(pkt);
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_limited(LOG_LEVEL_ERROR, "Reading from TUN: %s\n", strerror(errno));
+            break;
+        }
+        if (!pkt) pkt = &view;
+        pkt->len = len;
+        deliver(src, pkt, NULL);
+        pktbuf_put(pkt);
+    }
+}
+
+// Split one multishot recvmsg completion into the packets the peer sent
+static void handle_recv(event_loop_t *loop, int sock, struct io_uring_cqe *cqe) {
+    source_t *src = &loop->dgram[sock];
+    if (!(cqe->flags & IORING_CQE_F_MORE)) loop->recv_armed[sock] = false;
+
+    if (cqe->res < 0) {
+        if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+            // Kernel without multishot recvmsg: fall back to readiness
+            log_warn("Multishot recvmsg unavailable, polling the socket instead\n");
+            loop->recv_poll = true;
+        } else if (cqe->res != -ENOBUFS && cqe->res != -EMSGSIZE) {
+            // EMSGSIZE: an ICMP error reported on a connected socket, see
+            // dgram_batch_recv
+            log_limited(LOG_LEVEL_ERROR, "recvmsg: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) return;
+
+    // The callback may keep the buffer (e.g. for a TUN write of the
+    // payload decrypted in place); it is lent back to the kernel when the
+    // last reference goes
+    pktbuf_t *pkt = &loop->recv_pool.bufs[cqe->flags >> IORING_CQE_BUFFER_SHIFT];
+    pkt->refs = 1;
+    uint8_t *buf = pkt->base;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    uint8_t *name = buf + sizeof(*out);
+    uint8_t *control = name + loop->recv_msg.msg_namelen;
+    uint8_t *payload = control + loop->recv_msg.msg_controllen;
+
+    if (!(out->flags & MSG_TRUNC) && out->namelen >= sizeof(struct sockaddr_in)) {
+        struct sockaddr_in from;
+        memcpy(&from, name, sizeof(from));
+
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = out->controllen;
+        size_t len = out->payloadlen;
+        size_t seg = loop->recv_msg.msg_controllen ? dgram_gro_segment_size(&msg) : 0;
+        if (seg == 0 || seg >= len) seg = len;
+
+        size_t segments = 0;
+        for (size_t off = 0; off < len; off += seg) {
+            pkt->data = payload + off;
+            pkt->len = len - off < seg ? len - off : seg;
+            deliver(src, pkt, &from);
+            segments++;
+        }
+        if (src->stats && segments > 1) {
+            metric_add(&src->stats->super_buffers, 1);
+            metric_add(&src->stats->segments, segments);
+        }
+    }
+    pktbuf_put(pkt);
+}
+
+static void handle_tun_read(event_loop_t *loop, unsigned slot, int res) {
+    pktbuf_t *pkt = loop->tun_reads[slot];
+    loop->tun_reads[slot] = NULL;
+    if (res > 0 && loop->offload) {
+        deliver_super(loop, pkt->data, res);
+    } else if (res > 0) {
+        pkt->len = res;
+        deliver(&loop->tun, pkt, NULL);
+    }
+    pktbuf_put(pkt);
+    if (res < 0 && res != -EAGAIN && res != -EINTR) {
+        log_limited(LOG_LEVEL_ERROR, "Reading from TUN: %s\n", strerror(-res));
+        loop->fatal = true;
+        return;
+    }
+    post_tun_read(loop, slot);
+}
+
+static void handle_tun_write(event_loop_t *loop, unsigned slot, int res) {
+    if (res < 0) {
+        log_limited(LOG_LEVEL_ERROR, "Writing to TUN: %s\n", strerror(-res));
+    } else if ((size_t)res != loop->write_len[slot]) {
+        log_limited(LOG_LEVEL_ERROR, "Incomplete write to TUN: %d/%zu\n", res, loop->write_len[slot]);
+    }
+    pktbuf_put(loop->write_pkts[slot]);
+    loop->write_pkts[slot] = NULL;
+    loop->free_slots[loop->nfree++] = slot;
+}
+
+// Account one wakeup's packets like one batched syscall per source
+static void round_stats(source_t *src) {
+    if (src->stats && src->round_packets > 0) {
+        metric_add(&src->stats->calls, 1);
+        metric_add(&src->stats->packets, src->round_packets);
+    }
+    src->round_packets = 0;
+}
+
+// ---- loop setup ----
+
+event_loop_t *event_loop_new(event_backend_t backend, size_t batch_size, size_t buf_size) {
+    event_loop_t *loop = calloc(1, sizeof(*loop));
+    if (!loop) return NULL;
+    loop->batch_size = batch_size;
+    loop->buf_size = buf_size;
+    loop->tun.fd = -1;
+    loop->epfd = -1;
+    loop->ring.fd = -1;
+    loop->now_ns = event_clock_ns();
+    timer_wheel_init(&loop->wheel, loop->now_ns / 1000000);
+
+    // Enough TUN buffers for the posted reads plus a full send batch
+    // waiting for its flush, and for datagrams queued until the
+    // congestion window or the pacer lets them go
+    size_t count = EVENT_TUN_READS + 2 * batch_size + 1 + EVENT_HELD_BUFFERS;
+    loop->tun_buf = malloc(buf_size);
+    if (!loop->tun_buf || pktbuf_pool_init(&loop->tun_pool, count, PKTBUF_HEADROOM + buf_size + PKTBUF_TAILROOM) != 0) {
+        event_loop_free(loop);
+        return NULL;
+    }
+
+    if (backend != EVENT_BACKEND_EPOLL) {
+        if (uring_init(loop) == 0) {
+            loop->backend = EVENT_BACKEND_IO_URING;
+            return loop;
+        }
+        if (backend == EVENT_BACKEND_IO_URING) {
+            log_errno("io_uring_setup");
+            event_loop_free(loop);
+            return NULL;
+        }
+    }
+
+    loop->backend = EVENT_BACKEND_EPOLL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        log_errno("epoll_create1");
+        event_loop_free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void event_loop_free(event_loop_t *loop) {
+    if (!loop) return;
+    if (loop->ring.fd >= 0) uring_unmap(&loop->ring);
+    if (loop->recv_ring) munmap(loop->recv_ring, loop->recv_ring_size);
+    if (loop->epfd >= 0) close(loop->epfd);
+    pktbuf_pool_free(&loop->recv_pool);
+    pktbuf_pool_free(&loop->tun_pool);
+    pktbuf_pool_free(&loop->vnet_pool);
+    vnet_gro_free(&loop->gro);
+    free(loop->tun_buf);
+    free(loop);
+}
+
+static int epoll_add(event_loop_t *loop, int fd, uint32_t id) {
+    // Edge state is not tracked: every wakeup drains the fd (within budget)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = id;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_errno("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+int event_add_dgram(event_loop_t *loop, int sock, dgram_batch_t *rx, batch_stats_t *stats, event_packet_fn fn, void *arg) {
+    if (loop->ndgram == EVENT_MAX_SOCKETS) {
+        log_error("At most %d sockets per event loop\n", EVENT_MAX_SOCKETS);
+        return -1;
+    }
+    int i = loop->ndgram++;
+    loop->dgram[i] = (source_t){ sock, stats, fn, arg, 0 };
+    loop->rx[i] = rx;
+    if (loop->backend == EVENT_BACKEND_EPOLL) {
+        return epoll_add(loop, sock, i);
+    }
+    if (i == 0 && recv_ring_init(loop) != 0) {
+        log_warn("Provided buffer rings unavailable, polling the socket instead\n");
+        loop->recv_poll = true;
+    }
+    return 0;
+}
+
+int event_add_tun(event_loop_t *loop, int fd, batch_stats_t *stats, event_packet_fn fn, void *arg) {
+    loop->tun = (source_t){ fd, stats, fn, arg, 0 };
+    if (loop->backend == EVENT_BACKEND_EPOLL) {
+        return epoll_add(loop, fd, EVENT_MAX_SOCKETS);
+    }
+    // io_uring completes a posted read when a packet arrives, but returns
+    // -EAGAIN right away on an O_NONBLOCK file
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    return 0;
+}
+
+static void run_periodic(void *arg) {
+    periodic_t *p = arg;
+    timer_wheel_arm(&p->loop->wheel, &p->timer, p->loop->wheel.now + p->interval_ms);
+    p->fn(p->arg);
+}
+
+int event_add_timer(event_loop_t *loop, unsigned interval_ms, event_fn fn, void *arg) {
+    if (loop->ntimers == EVENT_MAX_TIMERS) return -1;
+    periodic_t *p = &loop->timers[loop->ntimers++];
+    p->loop = loop;
+    p->interval_ms = interval_ms;
+    p->fn = fn;
+    p->arg = arg;
+    wheel_timer_init(&p->timer, run_periodic, p);
+    timer_wheel_arm(&loop->wheel, &p->timer, event_loop_now_ms(loop) + interval_ms);
+    return 0;
+}
+
+void event_timer_init(event_timer_t *t, event_fn fn, void *arg) {
+    wheel_timer_init(t, fn, arg);
+}
+
+void event_timer_arm(event_loop_t *loop, event_timer_t *t, uint64_t due_ms) {
+    timer_wheel_arm(&loop->wheel, t, due_ms);
+}
+
+void event_timer_cancel(event_loop_t *loop, event_timer_t *t) {
+    timer_wheel_cancel(&loop->wheel, t);
+}
+
+void event_set_round(event_loop_t *loop, event_fn begin, event_fn end, void *arg) {
+    loop->round_begin = begin;
+    loop->round_end = end;
+    loop->round_arg = arg;
+}
+
+void event_set_deadline(event_loop_t *loop, uint64_t due_ns, event_fn fn, void *arg) {
+    loop->deadline_ns = due_ns;
+    loop->deadline_fn = fn;
+    loop->deadline_arg = arg;
+}
+
+// ---- TUN writes ----
+
+pktbuf_pool_t *event_loop_pool(event_loop_t *loop) {
+    return &loop->tun_pool;
+}
+
+// Write a packet, behind a virtio-net header if hdr is set
+static void write_tun(event_loop_t *loop, int fd, pktbuf_t *pkt, const struct virtio_net_hdr *hdr) {
+    // A borrowed view may be gone by the time an async write runs
+    struct io_uring_sqe *sqe = NULL;
+    if (loop->backend == EVENT_BACKEND_IO_URING && pkt->pool && loop->nfree > 0) {
+        sqe = uring_sqe(loop, true);
+    }
+    if (!sqe) {
+        // epoll, a view, or every io_uring slot in flight: write now
+        struct iovec iov[2] = { { (void *)hdr, VNET_HDR_LEN }, { pkt->data, pkt->len } };
+        ssize_t written = hdr ? writev(fd, iov, 2) : write(fd, pkt->data, pkt->len);
+        if (written != (ssize_t)(pkt->len + (hdr ? VNET_HDR_LEN : 0))) {
+            log_limited(LOG_LEVEL_ERROR, "Writing to TUN: %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    int slot = loop->free_slots[--loop->nfree];
+    pktbuf_ref(pkt);
+    loop->write_pkts[slot] = pkt;
+    loop->write_len[slot] = pkt->len;
+    sqe->fd = fd;
+    sqe->user_data = USER_DATA(OP_TUN_WRITE, slot);
+    if (hdr) {
+        loop->write_hdrs[slot] = *hdr;
+        loop->write_iov[slot][0] = (struct iovec){ &loop->write_hdrs[slot], VNET_HDR_LEN };
+        loop->write_iov[slot][1] = (struct iovec){ pkt->data, pkt->len };
+        loop->write_len[slot] += VNET_HDR_LEN;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uint64_t)(uintptr_t)loop->write_iov[slot];
+        sqe->len = 2;
+    } else {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uint64_t)(uintptr_t)pkt->data;
+        sqe->len = pkt->len;
+    }
+
+    // Chain this wakeup's writes so they reach the TUN device in order.
+    // A hard link keeps the chain going if one write fails.
+    if (loop->last_write && loop->last_write->fd == fd) {
+        loop->last_write->flags |= IOSQE_IO_HARDLINK;
+    }
+    loop->last_write = sqe;
+}
+
+// Merged (or lone) packets from the receive coalescer
+static void write_merged(void *arg, const struct virtio_net_hdr *hdr, pktbuf_t *pkt) {
+    event_loop_t *loop = arg;
+    if (loop->write_stats) {
+        size_t segments = 1;
+        if (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+            segments = (pkt->len - hdr->hdr_len + hdr->gso_size - 1) / hdr->gso_size;
+        }
+        metric_add(&loop->write_stats->calls, 1);
+        metric_add(&loop->write_stats->packets, segments);
+        if (segments > 1) {
+            metric_add(&loop->write_stats->super_buffers, 1);
+            metric_add(&loop->write_stats->segments, segments);
+        }
+    }
+    write_tun(loop, loop->tun.fd, pkt, hdr);
+}
+
+void event_write(event_loop_t *loop, int fd, pktbuf_t *pkt) {
+    if (loop->offload && fd == loop->tun.fd) {
+        vnet_gro_add(&loop->gro, pkt);
+    } else {
+        write_tun(loop, fd, pkt, NULL);
+    }
+}
+
+int event_tun_offload(event_loop_t *loop, size_t max_segment, batch_stats_t *write_stats) {
+    if (loop->backend == EVENT_BACKEND_IO_URING) {
+        // Reads go to large buffers now: register those instead
+        if (pktbuf_pool_init(&loop->vnet_pool, EVENT_TUN_READS, PKTBUF_HEADROOM + VNET_READ_SIZE) != 0) return -1;
+        if (loop->fixed_bufs) uring_register(loop->ring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        struct iovec iov = { loop->vnet_pool.slab, loop->vnet_pool.count * loop->vnet_pool.buf_size };
+        loop->fixed_bufs = uring_register(loop->ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    } else {
+        uint8_t *buf = realloc(loop->tun_buf, VNET_READ_SIZE);
+        if (!buf) return -1;
+        loop->tun_buf = buf;
+    }
+    if (vnet_gro_init(&loop->gro, EVENT_GRO_BUFFERS, write_merged, loop) != 0) return -1;
+    loop->offload = true;
+    loop->max_segment = max_segment;
+    loop->write_stats = write_stats;
+    return 0;
+}
+
+// Write what the receive coalescer holds once a wakeup's packets are in
+static void flush_merged(event_loop_t *loop) {
+    if (loop->offload) vnet_gro_flush(&loop->gro);
+}
+
+// ---- main loops ----
+
+// Nanoseconds until the timer wheel has work or the deadline is due, or
+// -1 if neither has
+static int64_t next_timeout(event_loop_t *loop) {
+    uint64_t due = loop->deadline_ns ? loop->deadline_ns : UINT64_MAX;
+    uint64_t tick = timer_wheel_next(&loop->wheel);
+    if (tick != UINT64_MAX && tick * 1000000 < due) due = tick * 1000000;
+    if (due == UINT64_MAX) return -1;
+    uint64_t now = event_clock_ns();
+    return due > now ? (int64_t)(due - now) : 0;
+}
+
+static void run_deadline(event_loop_t *loop) {
+    if (loop->deadline_ns && loop->deadline_ns <= loop->now_ns) {
+        loop->deadline_ns = 0;
+        loop->deadline_fn(loop->deadline_arg);
+    }
+}
+
+// epoll_wait with a nanosecond timeout where the kernel has epoll_pwait2,
+// otherwise rounded up to the next millisecond
+static int epoll_wait_ns(event_loop_t *loop, struct epoll_event *events, int max, int64_t timeout_ns) {
+    if (!loop->no_pwait2) {
+        struct timespec ts = { timeout_ns / 1000000000, timeout_ns % 1000000000 };
+        int n = epoll_pwait2(loop->epfd, events, max, timeout_ns >= 0 ? &ts : NULL, NULL);
+        if (n >= 0 || errno != ENOSYS) return n;
+        loop->no_pwait2 = true;
+    }
+    int timeout_ms = timeout_ns >= 0 ? (int)((timeout_ns + 999999) / 1000000) : -1;
+    return epoll_wait(loop->epfd, events, max, timeout_ms);
+}
+
+// Read the clock for this wakeup and fire the timers due by then
+static void run_timers(event_loop_t *loop) {
+    loop->now_ns = event_clock_ns();
+    timer_wheel_advance(&loop->wheel, loop->now_ns / 1000000);
+}
+
+static int run_epoll(event_loop_t *loop) {
+    struct epoll_event events[EVENT_MAX_SOCKETS + 1];
+    while (1) {
+        int n = epoll_wait_ns(loop, events, EVENT_MAX_SOCKETS + 1, next_timeout(loop));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_errno("epoll_wait");
+            return -1;
+        }
+        loop->wakeups++;
+        run_timers(loop);
+        run_deadline(loop);
+        flush_merged(loop);
+        if (n == 0) continue;
+
+        if (loop->round_begin) loop->round_begin(loop->round_arg);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u32 < EVENT_MAX_SOCKETS) {
+                drain_dgram(loop, events[i].data.u32);
+            } else {
+                drain_tun(loop);
+            }
+        }
+        if (loop->round_end) loop->round_end(loop->round_arg);
+        flush_merged(loop);
+        round_stats(&loop->tun);
+    }
+}
+
+static int run_uring(event_loop_t *loop) {
+    uring_t *r = &loop->ring;
+    if ((r->flags & IORING_SETUP_R_DISABLED) && uring_register(r->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) != 0) {
+        log_errno("io_uring enable");
+        return -1;
+    }
+
+    for (int i = 0; i < loop->ndgram; i++) arm_recv(loop, i);
+    if (loop->tun.fd >= 0) {
+        for (unsigned i = 0; i < EVENT_TUN_READS; i++) post_tun_read(loop, i);
+    }
+
+    while (!loop->fatal) {
+        if (uring_submit(loop, true, next_timeout(loop)) < 0) {
+            log_errno("io_uring_enter");
+            return -1;
+        }
+        loop->wakeups++;
+        run_timers(loop);
+        run_deadline(loop);
+        flush_merged(loop);
+
+        unsigned head = *r->cq_khead;
+        unsigned tail = __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE);
+        if (head == tail) continue;
+
+        if (loop->round_begin) loop->round_begin(loop->round_arg);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            unsigned slot = (uint32_t)cqe->user_data;
+            switch (cqe->user_data >> 32) {
+            case OP_RECV:
+                handle_recv(loop, slot, cqe);
+                break;
+            case OP_POLL:
+                if (!(cqe->flags & IORING_CQE_F_MORE)) loop->recv_armed[slot] = false;
+                if (cqe->res >= 0) drain_dgram(loop, slot);
+                break;
+            case OP_TUN_READ:
+                handle_tun_read(loop, slot, cqe->res);
+                break;
+            case OP_TUN_WRITE:
+                handle_tun_write(loop, slot, cqe->res);
+                break;
+            }
+        }
+        __atomic_store_n(r->cq_khead, head, __ATOMIC_RELEASE);
+
+        // Return consumed receive buffers, then re-arm the receives that
+        // stopped (buffer ring ran dry, or fallback to polling)
+        if (loop->recv_ring) {
+            __atomic_store_n(&loop->recv_ring->tail, loop->recv_tail, __ATOMIC_RELEASE);
+        }
+        for (int i = 0; i < loop->ndgram; i++) {
+            if (!loop->recv_armed[i]) arm_recv(loop, i);
+        }
+
+        if (loop->round_end) loop->round_end(loop->round_arg);
+        flush_merged(loop);
+        for (int i = 0; i < loop->ndgram; i++) round_stats(&loop->dgram[i]);
+        round_stats(&loop->tun);
+
+        // Re-post reads that found the pool empty, now that the flush
+        // has released the sent buffers
+        for (unsigned i = 0; i < EVENT_TUN_READS && loop->tun.fd >= 0; i++) {
+            if (!loop->tun_reads[i]) post_tun_read(loop, i);
+        }
+    }
+    return -1;
+}
+
+int event_loop_run(event_loop_t *loop) {
+    return loop->backend == EVENT_BACKEND_IO_URING ? run_uring(loop) : run_epoll(loop);
+}
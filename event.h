@@ -0,0 +1,130 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "batch_io.h"
+#include "pktbuf.h"
+#include "timer_wheel.h"
+
+// Event loop driving up to EVENT_MAX_SOCKETS UDP sockets and one TUN fd
+// (plus timers).
+//
+// Two backends share the same callback interface:
+//
+//  epoll     readiness based. A readable socket is drained with
+//            recvmmsg batches, a readable TUN fd with read() until
+//            EAGAIN, and TUN writes are plain write() calls.
+//
+//  io_uring  completion based. A multishot recvmsg stays armed on each
+//            socket and fills a provided buffer ring, EVENT_TUN_READS
+//            reads into registered buffers stay posted on the TUN fd,
+//            and TUN writes are queued as one linked chain per wakeup.
+//            (The kernel parks posted reads that lose the race for a
+//            packet on its io-wq threads until the next one arrives.)
+//            Submissions and completions for a whole wakeup cost a
+//            single io_uring_enter.
+//
+// Timers live on a hierarchical timer wheel (timer_wheel.h) with 1 ms
+// ticks; the wheel's next busy slot and the deadline are folded into the
+// wait timeout of either backend, so an idle loop sleeps until its next
+// timer instead of polling, however many timers are armed. The clock is
+// read once per wakeup and cached for event_loop_now_ms.
+//
+// TUN packets are read into buffers of the loop's pktbuf pool behind
+// PKTBUF_HEADROOM, so they can be framed and encrypted in place and then
+// queued for sending with a reference (dgram_batch_queue). Received
+// datagrams are delivered in io_uring ring buffers, or as views of the
+// recvmmsg batch on epoll; a TUN write of a payload decrypted in place
+// holds the buffer until the write completes.
+
+#define EVENT_TUN_READS 16       // io_uring: reads kept posted on the TUN fd
+#define EVENT_WRITE_SLOTS 256    // io_uring: TUN writes in flight
+#define EVENT_DRAIN_BUDGET 8     // epoll: batches handled per fd per wakeup
+#define EVENT_HELD_BUFFERS 512   // TUN packets held back by congestion control
+#define EVENT_GRO_BUFFERS 32     // offload: merged 64 KB packets in flight
+#define EVENT_MAX_TIMERS 4       // periodic timers (event_add_timer)
+#define EVENT_MAX_SOCKETS 8      // event_add_dgram
+
+typedef enum {
+    EVENT_BACKEND_AUTO,        // io_uring if the kernel allows it, else epoll
+    EVENT_BACKEND_EPOLL,
+    EVENT_BACKEND_IO_URING,
+} event_backend_t;
+
+typedef struct event_loop event_loop_t;
+
+// One packet read from the socket or TUN fd. The callback may modify the
+// packet in place and take a reference to keep a pool-owned buffer; a
+// view (pkt->pool == NULL) is only valid for the duration of the call.
+// from is NULL for TUN packets.
+typedef void (*event_packet_fn)(void *arg, pktbuf_t *pkt, struct sockaddr_in *from);
+typedef void (*event_fn)(void *arg);
+
+// Parse "auto", "epoll" or "io_uring". Returns -1 if unknown.
+int event_backend_parse(const char *name, event_backend_t *backend);
+
+// buf_size is the largest TUN packet read. The loop may be created on
+// one thread and run on another.
+event_loop_t *event_loop_new(event_backend_t backend, size_t batch_size, size_t buf_size);
+void event_loop_free(event_loop_t *loop);
+const char *event_loop_backend(const event_loop_t *loop);
+
+// Deliver datagrams from sock. The epoll backend receives into rx (and
+// honours its GRO setting); io_uring uses its own buffer ring, one for
+// all the sockets, set up for the first one's rx: sockets added later
+// must have GRO on if and only if it has.
+int event_add_dgram(event_loop_t *loop, int sock, dgram_batch_t *rx, batch_stats_t *stats, event_packet_fn fn, void *arg);
+
+// Deliver packets read from a TUN fd
+int event_add_tun(event_loop_t *loop, int fd, batch_stats_t *stats, event_packet_fn fn, void *arg);
+
+// Switch the TUN fd (opened with IFF_VNET_HDR, see vnet_enable) to
+// offload mode before the loop runs. Reads then take whole super-packets,
+// delivered cut into packets of at most max_segment bytes and counted as
+// super-buffers in the TUN stats; writes to the fd are merged per TCP
+// flow within a wakeup and counted in write_stats.
+int event_tun_offload(event_loop_t *loop, size_t max_segment, batch_stats_t *write_stats);
+
+// Call fn every interval_ms from the loop thread
+int event_add_timer(event_loop_t *loop, unsigned interval_ms, event_fn fn, void *arg);
+
+// One-shot timer embedded in the caller's state, e.g. one per peer. Set
+// it up once with event_timer_init; arming (or moving) and cancelling
+// are O(1) and only done from the loop thread. due_ms is
+// event_loop_now_ms time; a timer that is due fires on the next tick.
+typedef wheel_timer_t event_timer_t;
+void event_timer_init(event_timer_t *t, event_fn fn, void *arg);
+void event_timer_arm(event_loop_t *loop, event_timer_t *t, uint64_t due_ms);
+void event_timer_cancel(event_loop_t *loop, event_timer_t *t);
+
+// event_clock_ns time in milliseconds as of the start of the current
+// wakeup: cheap enough to stamp every packet with
+uint64_t event_loop_now_ms(const event_loop_t *loop);
+
+// Called before and after the packets of each wakeup are delivered, e.g.
+// to take a read lock once per wakeup and flush a send batch at the end
+void event_set_round(event_loop_t *loop, event_fn begin, event_fn end, void *arg);
+
+// Call fn once at due_ns (event_clock_ns time), for deadlines finer than
+// the millisecond timers. Replaces any earlier deadline; 0 cancels it.
+void event_set_deadline(event_loop_t *loop, uint64_t due_ns, event_fn fn, void *arg);
+uint64_t event_clock_ns(void);
+
+// Pool the TUN packets come from; also used for fallback copies
+pktbuf_pool_t *event_loop_pool(event_loop_t *loop);
+
+// Write pkt->data/len to a TUN fd. On io_uring a pool-owned buffer is
+// referenced and written with the next wakeup, in order with the other
+// writes; anything else is written immediately. In offload mode a TCP
+// segment may be copied and held until the end of the wakeup instead.
+void event_write(event_loop_t *loop, int fd, pktbuf_t *pkt);
+
+// Run until a fatal error. Returns -1.
+int event_loop_run(event_loop_t *loop);
+
+// Number of times the loop waited for events (epoll_wait/io_uring_enter)
+uint64_t event_loop_wakeups(const event_loop_t *loop);
+
+#endif
@@ -0,0 +1,415 @@
+#include "fec.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, as in most
+// Reed-Solomon codes; products through a full table
+static uint8_t gf_exp[510], gf_log[256];
+static uint8_t gf_mul[256][256];
+
+// Repair row j weighs source i by y / (x ^ y) with x = j, y = r_max + i,
+// a Cauchy matrix scaled so that row 0 is all ones (XOR parity). Every
+// square submatrix of a Cauchy matrix is invertible, which makes the
+// code MDS.
+static uint8_t coefficients[FEC_MAX_REPAIRS][FEC_MAX_SOURCES];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static uint8_t gf_inverse(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+static void build_tables(void) {
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+    }
+    for (int a = 1; a < 256; a++) {
+        for (int b = 1; b < 256; b++) gf_mul[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+    }
+    for (int j = 0; j < FEC_MAX_REPAIRS; j++) {
+        for (int i = 0; i < FEC_MAX_SOURCES; i++) {
+            uint8_t y = (uint8_t)(FEC_MAX_REPAIRS + i);
+            coefficients[j][i] = gf_mul[y][gf_inverse((uint8_t)(j ^ y))];
+        }
+    }
+}
+
+// dst += c * src over len bytes; c = 1, the common case, is a plain XOR
+static void gf_add_scaled(uint8_t *dst, const uint8_t *src, size_t len, uint8_t c) {
+    if (c == 1) {
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            uint64_t a, b;
+            memcpy(&a, dst + i, 8);
+            memcpy(&b, src + i, 8);
+            a ^= b;
+            memcpy(dst + i, &a, 8);
+        }
+        for (; i < len; i++) dst[i] ^= src[i];
+        return;
+    }
+    const uint8_t *row = gf_mul[c];
+    for (size_t i = 0; i < len; i++) dst[i] ^= row[src[i]];
+}
+
+static void gf_scale(uint8_t *buf, size_t len, uint8_t c) {
+    const uint8_t *row = gf_mul[c];
+    for (size_t i = 0; i < len; i++) buf[i] = row[buf[i]];
+}
+
+// Add a source symbol (packet number, then payload) of source index into
+// the first r sums, which hold *len bytes so far and grow to take it
+static void add_source(uint8_t *sums, size_t symbol_max, unsigned r, size_t *len, unsigned index, uint64_t pn,
+        const uint8_t *payload, size_t payload_len) {
+    size_t symbol_len = FEC_SYMBOL_HEADER + payload_len;
+    uint8_t header[FEC_SYMBOL_HEADER];
+    for (int i = 0; i < FEC_SYMBOL_HEADER; i++) header[i] = (uint8_t)(pn >> (8 * (FEC_SYMBOL_HEADER - 1 - i)));
+    for (unsigned j = 0; j < r; j++) {
+        uint8_t *sum = sums + j * symbol_max;
+        if (symbol_len > *len) memset(sum + *len, 0, symbol_len - *len);
+        uint8_t c = coefficients[j][index];
+        gf_add_scaled(sum, header, FEC_SYMBOL_HEADER, c);
+        gf_add_scaled(sum + FEC_SYMBOL_HEADER, payload, payload_len, c);
+    }
+    if (symbol_len > *len) *len = symbol_len;
+}
+
+// Residual loss with a code: the chance that a source is lost along with
+// at least r of the other k + r - 1 packets of its group
+static double residual_loss(double p, unsigned k, unsigned r) {
+    unsigned n = k + r - 1;
+    double term = 1;                 // chance that none of the n is lost
+    for (unsigned i = 0; i < n; i++) term *= 1 - p;
+    double below = 0;
+    for (unsigned x = 0; x < r; x++) {
+        below += term;
+        term *= (double)(n - x) / (x + 1) * p / (1 - p);
+    }
+    return p * (1 - below);
+}
+
+// The cheapest code (fewest repairs per source, then the smaller group)
+// that cuts loss rate p FEC_LOSS_REDUCTION-fold; at very high rates, the
+// strongest
+static void choose_code(double p, unsigned *k, unsigned *r) {
+    static const unsigned sizes[] = { 4, 8, 16, 32 };
+    *k = 4;
+    *r = 0;
+    if (p < FEC_MIN_LOSS) return;
+    *r = FEC_MAX_REPAIRS;
+    if (p >= 1) return;
+    double best = 2;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (unsigned repairs = 1; repairs <= FEC_MAX_REPAIRS; repairs++) {
+            double ratio = (double)repairs / sizes[s];
+            if (ratio < best && residual_loss(p, sizes[s], repairs) <= p / FEC_LOSS_REDUCTION) {
+                best = ratio;
+                *k = sizes[s];
+                *r = repairs;
+            }
+        }
+    }
+}
+
+fec_tx_t *fec_tx_new(size_t max_payload) {
+    pthread_once(&tables_once, build_tables);
+    fec_tx_t *tx = calloc(1, sizeof(*tx));
+    if (!tx) return NULL;
+    tx->symbol_max = FEC_SYMBOL_HEADER + max_payload;
+    tx->sums = malloc(FEC_MAX_REPAIRS * tx->symbol_max);
+    if (!tx->sums) {
+        free(tx);
+        return NULL;
+    }
+    fec_tx_reset(tx);
+    return tx;
+}
+
+void fec_tx_free(fec_tx_t *tx) {
+    if (!tx) return;
+    free(tx->sums);
+    free(tx);
+}
+
+void fec_tx_reset(fec_tx_t *tx) {
+    tx->k = 4;
+    tx->r = 0;
+    tx->peer_loss = -1;
+    tx->count = 0;
+}
+
+void fec_tx_on_report(fec_tx_t *tx, const frame_t *frame) {
+    tx->peer_loss = (frame->data[0] << 8 | frame->data[1]) / 65535.0;
+    choose_code(tx->peer_loss, &tx->k, &tx->r);
+}
+
+bool fec_tx_source(fec_tx_t *tx, pktbuf_t *pkt, uint64_t pn, size_t max_payload, uint64_t now_ns, fec_stats_t *stats) {
+    if (tx->count == 0 && tx->r == 0) return false;
+    if (pktbuf_headroom(pkt) < FRAME_FEC_SOURCE_LEN || pkt->len + FEC_OVERHEAD > max_payload ||
+        pkt->len + FEC_OVERHEAD > tx->symbol_max) {
+        return false;
+    }
+    if (tx->count == 0) {
+        tx->group++;
+        tx->group_k = tx->k;
+        tx->group_r = tx->r;
+        tx->len = 0;
+        tx->opened_ns = now_ns;
+    }
+    unsigned index = tx->count++;
+    uint8_t *tag = pktbuf_push(pkt, FRAME_FEC_SOURCE_LEN);
+    tag[0] = FRAME_FEC_SOURCE;
+    tag[1] = tx->group;
+    tag[2] = (uint8_t)((tx->group_r - 1) << 5 | index);
+    add_source(tx->sums, tx->symbol_max, tx->group_r, &tx->len, index, pn, pkt->data, pkt->len);
+    metric_add(&stats->sources, 1);
+    return true;
+}
+
+uint64_t fec_tx_due(const fec_tx_t *tx, uint64_t rtt_ns) {
+    if (tx->count == 0) return 0;
+    if (tx->count >= tx->group_k) return tx->opened_ns;
+    uint64_t hold = rtt_ns / 8;
+    if (hold < FEC_MIN_HOLD_NS) hold = FEC_MIN_HOLD_NS;
+    if (hold > FEC_MAX_HOLD_NS) hold = FEC_MAX_HOLD_NS;
+    return tx->opened_ns + hold;
+}
+
+unsigned fec_tx_repairs(const fec_tx_t *tx) {
+    if (tx->count == 0) return 0;
+    return (tx->group_r * tx->count + tx->group_k - 1) / tx->group_k;
+}
+
+size_t fec_tx_repair(const fec_tx_t *tx, unsigned row, uint8_t *out, size_t room, fec_stats_t *stats) {
+    size_t body = 2 + tx->len;
+    size_t hdr_len = frame_header_length(FRAME_REPAIR, tx->group, body);
+    if (hdr_len + body > room) return 0;
+    size_t n = frame_encode_header(out, FRAME_REPAIR, tx->group, body);
+    out[n++] = (uint8_t)(tx->count - 1);
+    out[n++] = (uint8_t)((tx->group_r - 1) << 4 | row);
+    memcpy(out + n, tx->sums + row * tx->symbol_max, tx->len);
+    metric_add(&stats->repairs_sent, 1);
+    return n + tx->len;
+}
+
+void fec_tx_close(fec_tx_t *tx) {
+    tx->count = 0;
+}
+
+fec_rx_t *fec_rx_new(size_t max_payload) {
+    pthread_once(&tables_once, build_tables);
+    fec_rx_t *rx = calloc(1, sizeof(*rx));
+    if (!rx) return NULL;
+    rx->symbol_max = FEC_SYMBOL_HEADER + max_payload;
+    for (int g = 0; g < FEC_RX_GROUPS; g++) {
+        rx->groups[g].sums = malloc(FEC_MAX_REPAIRS * rx->symbol_max);
+        if (!rx->groups[g].sums) {
+            fec_rx_free(rx);
+            return NULL;
+        }
+    }
+    fec_rx_reset(rx);
+    return rx;
+}
+
+void fec_rx_free(fec_rx_t *rx) {
+    if (!rx) return;
+    for (int g = 0; g < FEC_RX_GROUPS; g++) free(rx->groups[g].sums);
+    free(rx);
+}
+
+void fec_rx_reset(fec_rx_t *rx) {
+    for (int g = 0; g < FEC_RX_GROUPS; g++) rx->groups[g].used = 0;
+    rx->clock = 0;
+    rx->largest = rx->interval_start = rx->interval_received = 0;
+    rx->loss = -1;
+    rx->report_ns = 0;
+}
+
+// The state of group id, or the oldest one's made over to it
+static fec_group_t *find_group(fec_rx_t *rx, uint8_t id, unsigned r) {
+    fec_group_t *oldest = &rx->groups[0];
+    for (int g = 0; g < FEC_RX_GROUPS; g++) {
+        fec_group_t *group = &rx->groups[g];
+        if (group->used && group->id == id) return group;
+        if (group->used < oldest->used) oldest = group;
+    }
+    fec_group_t *group = oldest;
+    group->used = ++rx->clock;
+    group->id = id;
+    group->k = 0;
+    group->r = r;
+    group->received = 0;
+    group->repairs = 0;
+    group->len = 0;
+    group->done = false;
+    group->nrebuilt = group->taken = 0;
+    return group;
+}
+
+static unsigned count_bits(uint32_t v) {
+    unsigned n = 0;
+    for (; v; v &= v - 1) n++;
+    return n;
+}
+
+// Rebuild a group's missing sources if enough repairs are in. The sums
+// with a repair hold, for each row j, the sum over missing sources i of
+// C[j][i] * symbol i: Gauss-Jordan elimination on as many of them as
+// sources are missing leaves one source in each.
+static bool rebuild(fec_rx_t *rx, fec_group_t *group) {
+    if (group->done || group->k == 0) return false;
+    uint32_t all = group->k == 32 ? UINT32_MAX : (1U << group->k) - 1;
+    uint32_t missing_set = all & ~group->received;
+    unsigned m = count_bits(missing_set);
+    if (m == 0) {
+        group->done = true;
+        return false;
+    }
+    if (m > count_bits(group->repairs)) return false;
+
+    uint8_t missing[FEC_MAX_REPAIRS], rows[FEC_MAX_REPAIRS];
+    unsigned n = 0;
+    for (unsigned i = 0; i < group->k; i++) {
+        if (missing_set >> i & 1) missing[n++] = (uint8_t)i;
+    }
+    n = 0;
+    for (unsigned j = 0; j < group->r && n < m; j++) {
+        if (group->repairs >> j & 1) rows[n++] = (uint8_t)j;
+    }
+    uint8_t a[FEC_MAX_REPAIRS][FEC_MAX_REPAIRS];
+    uint8_t *sums[FEC_MAX_REPAIRS];
+    for (unsigned t = 0; t < m; t++) {
+        sums[t] = group->sums + rows[t] * rx->symbol_max;
+        for (unsigned s = 0; s < m; s++) a[t][s] = coefficients[rows[t]][missing[s]];
+    }
+    for (unsigned s = 0; s < m; s++) {
+        unsigned p = s;
+        while (a[p][s] == 0) p++;    // there is one: the matrix is invertible
+        if (p != s) {
+            uint8_t row[FEC_MAX_REPAIRS], *sum = sums[p], kept = rows[p];
+            memcpy(row, a[p], m);
+            memcpy(a[p], a[s], m);
+            memcpy(a[s], row, m);
+            sums[p] = sums[s];
+            sums[s] = sum;
+            rows[p] = rows[s];
+            rows[s] = kept;
+        }
+        uint8_t inverse = gf_inverse(a[s][s]);
+        for (unsigned c = 0; c < m; c++) a[s][c] = gf_mul[inverse][a[s][c]];
+        gf_scale(sums[s], group->len, inverse);
+        for (unsigned t = 0; t < m; t++) {
+            uint8_t f = a[t][s];
+            if (t == s || f == 0) continue;
+            for (unsigned c = 0; c < m; c++) a[t][c] ^= gf_mul[f][a[s][c]];
+            gf_add_scaled(sums[t], sums[s], group->len, f);
+        }
+    }
+    for (unsigned t = 0; t < m; t++) group->rebuilt[t] = rows[t];
+    group->nrebuilt = m;
+    group->taken = 0;
+    group->done = true;
+    return true;
+}
+
+bool fec_rx_on_packet(fec_rx_t *rx, uint64_t pn, const uint8_t *payload, size_t len) {
+    if (rx->interval_received == 0 && rx->interval_start == 0) rx->interval_start = pn - 1;
+    rx->interval_received++;
+    if (pn > rx->largest) rx->largest = pn;
+
+    if (len < FRAME_FEC_SOURCE_LEN || payload[0] != FRAME_FEC_SOURCE || FEC_SYMBOL_HEADER + len > rx->symbol_max) {
+        return false;
+    }
+    unsigned r = (payload[2] >> 5) + 1, index = payload[2] & 0x1f;
+    if (r > FEC_MAX_REPAIRS) return false;
+    fec_group_t *group = find_group(rx, payload[1], r);
+    if (group->done || group->r != r || (group->received >> index & 1)) return false;
+    add_source(group->sums, rx->symbol_max, r, &group->len, index, pn, payload, len);
+    group->received |= 1U << index;
+    return rebuild(rx, group);
+}
+
+bool fec_rx_on_repair(fec_rx_t *rx, const frame_t *frame, fec_stats_t *stats) {
+    if (frame->len < 2 || frame->len - 2 > rx->symbol_max) return false;
+    unsigned k = frame->data[0] + 1, r = (frame->data[1] >> 4) + 1, row = frame->data[1] & 0xf;
+    if (k > FEC_MAX_SOURCES || r > FEC_MAX_REPAIRS || row >= r) return false;
+    metric_add(&stats->repairs_received, 1);
+    fec_group_t *group = find_group(rx, frame->context, r);
+    if (group->done || group->r != r || (group->repairs >> row & 1)) return false;
+
+    // The sums of the other rows cover the sources as far as they go;
+    // the repair symbol is the longest
+    const uint8_t *symbol = frame->data + 2;
+    size_t len = frame->len - 2;
+    if (len < group->len) return false;
+    uint8_t *sum = group->sums + row * rx->symbol_max;
+    for (unsigned j = 0; j < r; j++) memset(group->sums + j * rx->symbol_max + group->len, 0, len - group->len);
+    group->len = len;
+    gf_add_scaled(sum, symbol, len, 1);
+    group->k = k;
+    group->repairs |= 1U << row;
+    return rebuild(rx, group);
+}
+
+size_t fec_rx_take(fec_rx_t *rx, uint64_t *pn, uint8_t *out, size_t size) {
+    for (int g = 0; g < FEC_RX_GROUPS; g++) {
+        fec_group_t *group = &rx->groups[g];
+        if (!group->used || group->taken == group->nrebuilt) continue;
+        const uint8_t *symbol = group->sums + group->rebuilt[group->taken++] * rx->symbol_max;
+        size_t len = group->len - FEC_SYMBOL_HEADER;
+        if (len > size) continue;
+        *pn = 0;
+        for (int i = 0; i < FEC_SYMBOL_HEADER; i++) *pn = *pn << 8 | symbol[i];
+        memcpy(out, symbol + FEC_SYMBOL_HEADER, len);
+        return len;
+    }
+    return 0;
+}
+
+size_t fec_rx_take_report(fec_rx_t *rx, uint64_t now_ns, uint8_t *out, size_t room) {
+    if (now_ns < rx->report_ns || room < FRAME_FEC_LEN) return 0;
+    rx->report_ns = now_ns + FEC_REPORT_NS;
+
+    // A measurement over enough packets, smoothed over the last few
+    uint64_t expected = rx->largest - rx->interval_start;
+    if (rx->interval_received > 0 && expected >= 32) {
+        double sample = rx->interval_received >= expected ? 0 : 1 - (double)rx->interval_received / expected;
+        rx->loss = rx->loss < 0 ? sample : 0.75 * rx->loss + 0.25 * sample;
+        rx->interval_start = rx->largest;
+        rx->interval_received = 0;
+    }
+    unsigned loss = (unsigned)(fec_rx_loss(rx) * 65535 + 0.5);
+    out[0] = FRAME_FEC;
+    out[1] = (uint8_t)(loss >> 8);
+    out[2] = (uint8_t)loss;
+    return FRAME_FEC_LEN;
+}
+
+double fec_rx_loss(const fec_rx_t *rx) {
+    return rx->loss < 0 ? 0 : rx->loss;
+}
+
+void fec_render(FILE *out, const fec_stats_t *const *sets, const char *const *labels, size_t n) {
+    static const struct {
+        const char *name, *help;
+        size_t offset;
+    } families[] = {
+        { "tunnel_fec_sources_total", "Packets sent in FEC groups", offsetof(fec_stats_t, sources) },
+        { "tunnel_fec_repairs_sent_total", "FEC repair packets sent", offsetof(fec_stats_t, repairs_sent) },
+        { "tunnel_fec_repairs_received_total", "FEC repair packets received", offsetof(fec_stats_t, repairs_received) },
+        { "tunnel_fec_recovered_total", "Lost packets rebuilt from repairs", offsetof(fec_stats_t, recovered) },
+    };
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+        metrics_family(out, families[f].name, "counter", families[f].help);
+        for (size_t i = 0; i < n; i++) {
+            const metric_t *m = (const metric_t *)((const char *)sets[i] + families[f].offset);
+            metrics_sample(out, families[f].name, labels[i], metric_get(m));
+        }
+    }
+}
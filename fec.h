@@ -0,0 +1,168 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "frame.h"
+#include "metrics.h"
+#include "pktbuf.h"
+
+// Forward error correction over groups of tunnel packets, so that a
+// datagram lost on a lossy link is rebuilt at the receiver a fraction of
+// a round trip later, before its IP packets reach TUN, rather than
+// costing the inner transport a retransmission.
+//
+// The sender takes up to k data packets in a row (sources) into a group
+// and, once it is full or has been open an eighth of the RTT, sends r
+// repair packets. These are combinations of the group's sources under a
+// systematic Reed-Solomon code over GF(2^8) with a Cauchy matrix: any k
+// of the k + r packets give back all k sources. The first combination is
+// plain XOR parity, the only one needed at low loss rates. A source
+// symbol is the packet number (8 bytes) and the decrypted payload,
+// zero-padded to the longest in the group; the padding reads as PADDING
+// frames.
+//
+// Each source starts with a FEC_SOURCE frame naming its group, its index
+// and r. The receiver adds it into r running sums as it arrives, and a
+// REPAIR frame's symbol into its own; what is left in the sums then
+// depends on the missing sources only. Once as many repairs as missing
+// sources are in, a small linear system gives those back, and they are
+// handled as if they had arrived (the replay window drops one whose
+// original turns up after all). The eighth of an RTT keeps a rebuilt
+// packet within the reordering window the inner TCP allows (RACK waits a
+// quarter of the RTT) so that it does not see the loss at all.
+//
+// The receiver measures the packets lost on the way (gaps in the packet
+// numbers, before any are rebuilt) and reports the rate every
+// FEC_REPORT_NS in a FEC frame, which also tells the sender that it takes
+// repairs: FEC is on in a direction once both ends asked for it. The
+// sender picks the cheapest code that cuts the loss rate
+// FEC_LOSS_REDUCTION-fold, and sends no repairs while it is below
+// FEC_MIN_LOSS.
+//
+// A sender and a receiver are used under the locks of the direction they
+// serve.
+
+#define FEC_MAX_SOURCES 32           // k
+#define FEC_MAX_REPAIRS 4            // r
+#define FEC_RX_GROUPS 4              // groups a receiver tracks at once
+#define FEC_SYMBOL_HEADER 8          // packet number
+#define FEC_REPORT_NS 250000000ULL
+#define FEC_MIN_LOSS 0.001
+#define FEC_LOSS_REDUCTION 10
+#define FEC_MIN_HOLD_NS 1000000ULL   // bounds on how long a group stays open
+#define FEC_MAX_HOLD_NS 25000000ULL
+
+// Bytes of a datagram kept free when FEC is on: the FEC_SOURCE frame of a
+// source, and what its group's REPAIR frames add to it
+#define FEC_OVERHEAD (FRAME_FEC_SOURCE_LEN + FRAME_REPAIR_HEADER_MAX + FEC_SYMBOL_HEADER)
+
+typedef struct {
+    metric_t sources;                // packets sent in groups
+    metric_t repairs_sent;
+    metric_t repairs_received;
+    metric_t recovered;              // lost packets rebuilt (counted by the caller)
+} fec_stats_t;
+
+// Sender, for one peer
+typedef struct {
+    uint8_t *sums;                   // the open group's repair symbols
+    size_t symbol_max;
+    unsigned k, r;                   // code for the next group, r = 0: none
+    double peer_loss;                // as last reported, < 0 before any report
+    uint8_t group;                   // number of the open group
+    unsigned count;                  // its sources so far, 0 if none is open
+    unsigned group_k, group_r;
+    size_t len;                      // its longest source symbol
+    uint64_t opened_ns;
+} fec_tx_t;
+
+typedef struct {
+    uint8_t *sums;                   // FEC_MAX_REPAIRS of symbol_max bytes
+    uint64_t used;                   // receiver clock at its start, 0 if free
+    uint8_t id;
+    unsigned k, r;                   // k is 0 until a repair names it
+    uint32_t received;               // sources in, by index
+    uint8_t repairs;                 // repair symbols added, by row
+    size_t len;                      // bytes of the sums in use
+    bool done;                       // nothing (more) to rebuild
+    unsigned nrebuilt, taken;        // sources rebuilt, and handed out
+    uint8_t rebuilt[FEC_MAX_REPAIRS];    // the sum holding each
+} fec_group_t;
+
+// Receiver, for one peer
+typedef struct {
+    fec_group_t groups[FEC_RX_GROUPS];
+    size_t symbol_max;
+    uint64_t clock;
+    uint64_t largest;                // largest packet number received
+    uint64_t interval_start;         // and at the start of the measurement
+    uint64_t interval_received;      // packets received since
+    double loss;                     // smoothed, < 0 before the first measurement
+    uint64_t report_ns;              // when the next report is due
+} fec_rx_t;
+
+// A sender and a receiver for payloads of up to max_payload bytes. Return
+// NULL if out of memory.
+fec_tx_t *fec_tx_new(size_t max_payload);
+fec_rx_t *fec_rx_new(size_t max_payload);
+void fec_tx_free(fec_tx_t *tx);
+void fec_rx_free(fec_rx_t *rx);
+
+// Packet numbers start over (a new session): drop the open group, and
+// what was measured and reported
+void fec_tx_reset(fec_tx_t *tx);
+void fec_rx_reset(fec_rx_t *rx);
+
+// The peer's FEC frame: its loss rate, from which the code for the next
+// groups is chosen
+void fec_tx_on_report(fec_tx_t *tx, const frame_t *frame);
+
+// Take the payload of pkt, about to go out as packet pn, into the open
+// group, or open one: a FEC_SOURCE frame is put in front of it. Returns
+// false if the peer takes no repairs, or the packet does not leave room
+// for them in a payload of max_payload bytes.
+bool fec_tx_source(fec_tx_t *tx, pktbuf_t *pkt, uint64_t pn, size_t max_payload, uint64_t now_ns, fec_stats_t *stats);
+
+// When the open group's repairs are due, given the RTT: as soon as it is
+// full, 0 if none is open
+uint64_t fec_tx_due(const fec_tx_t *tx, uint64_t rtt_ns);
+
+// Repairs to send for the open group: r, or for a group closed before it
+// filled up, as many as keep the same ratio (at least one)
+unsigned fec_tx_repairs(const fec_tx_t *tx);
+
+// Write the open group's REPAIR frame of the given row, if it fits in
+// room. Returns its length, or 0.
+size_t fec_tx_repair(const fec_tx_t *tx, unsigned row, uint8_t *out, size_t room, fec_stats_t *stats);
+
+// Done with the open group's repairs
+void fec_tx_close(fec_tx_t *tx);
+
+// Take an authenticated packet's payload into the loss measurement and,
+// if it is a source, into its group. Returns true if packets were rebuilt
+// (see fec_rx_take).
+bool fec_rx_on_packet(fec_rx_t *rx, uint64_t pn, const uint8_t *payload, size_t len);
+
+// A REPAIR frame. Returns true if packets were rebuilt.
+bool fec_rx_on_repair(fec_rx_t *rx, const frame_t *frame, fec_stats_t *stats);
+
+// Copy the next rebuilt packet's payload into out (size bytes) and its
+// packet number into *pn. Returns its length, or 0 if there is none. The
+// payload may end in padding.
+size_t fec_rx_take(fec_rx_t *rx, uint64_t *pn, uint8_t *out, size_t size);
+
+// Write a FEC frame with the loss rate if one is due and fits in room.
+// Returns the bytes written.
+size_t fec_rx_take_report(fec_rx_t *rx, uint64_t now_ns, uint8_t *out, size_t room);
+
+// Loss rate measured, 0 before the first measurement
+double fec_rx_loss(const fec_rx_t *rx);
+
+// Prometheus families for n sets of statistics, labelled as in
+// metrics_render
+void fec_render(FILE *out, const fec_stats_t *const *sets, const char *const *labels, size_t n);
+
+#endif
@@ -0,0 +1,154 @@
+#include "flow.h"
+#include <openssl/rand.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t flow_hash(const flow_table_t *t, const flow_key_t *key) {
+    uint64_t words[(sizeof(flow_key_t) + 7) / 8] = {0};
+    memcpy(words, key, sizeof(*key));
+    uint64_t h = t->seed;
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        h = (h ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+static int stream_id_of(const flow_table_t *t, uint32_t entry) {
+    return (int)((uint32_t)t->entries[entry].generation << FLOW_INDEX_BITS | (entry + 1));
+}
+
+int flow_table_init(flow_table_t *t, size_t capacity) {
+    memset(t, 0, sizeof(*t));
+    if (capacity == 0 || capacity > FLOW_MAX_CAPACITY) return -1;
+
+    // Keep the index at most half full so probe runs stay short
+    size_t slots = 1;
+    while (slots < 2 * capacity) slots <<= 1;
+    t->entries = calloc(capacity, sizeof(*t->entries));
+    t->index = calloc(slots, sizeof(*t->index));
+    t->free = calloc(capacity, sizeof(*t->free));
+    if (!t->entries || !t->index || !t->free) {
+        flow_table_free(t);
+        return -1;
+    }
+    t->capacity = capacity;
+    t->index_mask = slots - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        t->free[i] = capacity - 1 - i;
+    }
+    t->nfree = capacity;
+    RAND_bytes((unsigned char *)&t->seed, sizeof(t->seed));
+    return 0;
+}
+
+void flow_table_free(flow_table_t *t) {
+    free(t->entries);
+    free(t->index);
+    free(t->free);
+    memset(t, 0, sizeof(*t));
+}
+
+int flow_key_from_packet(const uint8_t *ip, size_t len, flow_key_t *key) {
+    memset(key, 0, sizeof(*key));
+    const uint8_t *l4;
+    size_t l4_len;
+    if (len >= 20 && ip[0] >> 4 == 4) {
+        size_t ihl = (ip[0] & 0x0f) * 4;
+        if (ihl < 20 || ihl > len) return -1;
+        key->family = 4;
+        key->proto = ip[9];
+        memcpy(key->src, ip + 12, 4);
+        memcpy(key->dst, ip + 16, 4);
+        // Only the first fragment carries the ports
+        if ((((ip[6] & 0x1f) << 8) | ip[7]) != 0) return 0;
+        l4 = ip + ihl;
+        l4_len = len - ihl;
+    } else if (len >= 40 && ip[0] >> 4 == 6) {
+        // Extension headers are not walked; such flows are keyed without ports
+        key->family = 6;
+        key->proto = ip[6];
+        memcpy(key->src, ip + 8, 16);
+        memcpy(key->dst, ip + 24, 16);
+        l4 = ip + 40;
+        l4_len = len - 40;
+    } else {
+        return -1;
+    }
+
+    switch (key->proto) {
+    case 6:      // TCP
+    case 17:     // UDP
+    case 132:    // SCTP
+    case 136:    // UDP-Lite
+        if (l4_len >= 4) {
+            key->src_port = (uint16_t)(l4[0] << 8 | l4[1]);
+            key->dst_port = (uint16_t)(l4[2] << 8 | l4[3]);
+        }
+        break;
+    }
+    return 0;
+}
+
+int flow_stream_id(flow_table_t *t, const flow_key_t *key, time_t now) {
+    uint64_t hash = flow_hash(t, key);
+    size_t slot = hash & t->index_mask;
+    for (; t->index[slot]; slot = (slot + 1) & t->index_mask) {
+        uint32_t entry = t->index[slot] - 1;
+        flow_entry_t *e = &t->entries[entry];
+        if (e->hash == hash && memcmp(&e->key, key, sizeof(*key)) == 0) {
+            e->last_activity = now;
+            return stream_id_of(t, entry);
+        }
+    }
+
+    if (t->nfree == 0) return 0;
+    uint32_t entry = t->free[--t->nfree];
+    flow_entry_t *e = &t->entries[entry];
+    e->key = *key;
+    e->hash = hash;
+    e->last_activity = now;
+    e->generation = (e->generation + 1) & 0x3fff;    // keeps IDs under 2^30, 4 varint bytes
+    e->live = true;
+    t->index[slot] = entry + 1;
+    t->count++;
+    return stream_id_of(t, entry);
+}
+
+bool flow_stream_active(const flow_table_t *t, int stream_id) {
+    uint32_t entry = ((uint32_t)stream_id & FLOW_MAX_CAPACITY) - 1;
+    if (stream_id <= 0 || entry >= t->capacity) return false;
+    return t->entries[entry].live && stream_id_of(t, entry) == stream_id;
+}
+
+// Remove the index slot of an entry, shifting later members of its probe
+// run back so lookups never need tombstones
+static void index_remove(flow_table_t *t, size_t slot) {
+    size_t hole = slot;
+    for (size_t next = (slot + 1) & t->index_mask; t->index[next]; next = (next + 1) & t->index_mask) {
+        size_t home = t->entries[t->index[next] - 1].hash & t->index_mask;
+        // Move next into the hole unless its home lies in (hole, next]
+        if (((next - home) & t->index_mask) >= ((next - hole) & t->index_mask)) {
+            t->index[hole] = t->index[next];
+            hole = next;
+        }
+    }
+    t->index[hole] = 0;
+}
+
+size_t flow_table_expire(flow_table_t *t, time_t now, int timeout) {
+    size_t expired = 0;
+    for (uint32_t entry = 0; entry < t->capacity; entry++) {
+        flow_entry_t *e = &t->entries[entry];
+        if (!e->live || now - e->last_activity <= timeout) continue;
+
+        size_t slot = e->hash & t->index_mask;
+        while (t->index[slot] != entry + 1) slot = (slot + 1) & t->index_mask;
+        index_remove(t, slot);
+        e->live = false;
+        t->free[t->nfree++] = entry;
+        t->count--;
+        expired++;
+    }
+    return expired;
+}
@@ -0,0 +1,68 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Map from inner flows to tunnel stream IDs, so that every packet of one
+// TCP/UDP flow travels on the same stream.
+//
+// A flow is keyed by the inner packet's addresses, protocol and, for
+// protocols that have them, ports. Entries live in a fixed array and
+// never move; an open-addressing index (linear probing, backward-shift
+// deletion) maps key hashes to entries. A stream ID names its entry and
+// the entry's generation, so checking whether an ID is live is a single
+// array access, and IDs of expired flows are never mistaken for new ones.
+//
+// The table has no lock: it belongs to one thread (the client's event
+// loop, which also runs the expiry timer).
+
+#define FLOW_INDEX_BITS 16
+#define FLOW_MAX_CAPACITY ((1 << FLOW_INDEX_BITS) - 1)
+
+typedef struct {
+    uint8_t family;       // 4 or 6
+    uint8_t proto;
+    uint16_t src_port;    // 0 for protocols without ports
+    uint16_t dst_port;
+    uint8_t src[16];
+    uint8_t dst[16];
+} flow_key_t;
+
+typedef struct {
+    flow_key_t key;
+    uint64_t hash;
+    time_t last_activity;
+    uint16_t generation;
+    bool live;
+} flow_entry_t;
+
+typedef struct {
+    flow_entry_t *entries;
+    size_t capacity;
+    size_t count;
+    uint32_t *index;      // entry number + 1, or 0 if the slot is empty
+    size_t index_mask;
+    uint32_t *free;       // unused entry numbers
+    size_t nfree;
+    uint64_t seed;        // random hash key
+} flow_table_t;
+
+int flow_table_init(flow_table_t *t, size_t capacity);
+void flow_table_free(flow_table_t *t);
+
+// Extract the flow key of an IPv4/IPv6 packet. Returns -1 if it is not IP.
+int flow_key_from_packet(const uint8_t *ip, size_t len, flow_key_t *key);
+
+// Stream ID of the flow, adding it if new. Returns 0 if the table is full.
+int flow_stream_id(flow_table_t *t, const flow_key_t *key, time_t now);
+
+// True if stream_id belongs to a flow still in the table
+bool flow_stream_active(const flow_table_t *t, int stream_id);
+
+// Drop flows idle for more than timeout seconds. Returns how many.
+size_t flow_table_expire(flow_table_t *t, time_t now, int timeout);
+
+#endif
@@ -0,0 +1,195 @@
+#include "frame.h"
+#include <string.h>
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+    return p + 4;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t len = frame_varint_length(v);
+    static const uint8_t prefix[9] = { 0, 0x00, 0x40, 0, 0x80, 0, 0, 0, 0xc0 };
+    for (size_t i = 0; i < len; i++) p[i] = (uint8_t)(v >> (8 * (len - 1 - i)));
+    p[0] |= prefix[len];
+    return len;
+}
+
+// Read a varint from the left bytes at p. Returns its length, or 0 if
+// it does not fit.
+static size_t get_varint(const uint8_t *p, size_t left, uint64_t *v) {
+    if (left == 0) return 0;
+    size_t len = (size_t)1 << (p[0] >> 6);
+    if (len > left) return 0;
+    *v = p[0] & 0x3f;
+    for (size_t i = 1; i < len; i++) *v = *v << 8 | p[i];
+    return len;
+}
+
+size_t frame_encode_header(uint8_t *out, int type, uint32_t id, size_t len) {
+    size_t n = 0;
+    out[n++] = (uint8_t)type;
+    if (type == FRAME_STREAM) {
+        n += put_varint(out + n, id);
+    } else if (type != FRAME_DATAGRAM) {
+        out[n++] = (uint8_t)id;
+    }
+    return n + put_varint(out + n, len);
+}
+
+size_t frame_encode_ack(uint8_t *out, const ack_frame_t *ack) {
+    uint8_t *p = out;
+    *p++ = FRAME_ACK;
+    p = put_u32(p, (uint32_t)(ack->ranges[0].largest >> 32));
+    p = put_u32(p, (uint32_t)ack->ranges[0].largest);
+    p = put_u32(p, ack->delay_us > UINT32_MAX ? UINT32_MAX : (uint32_t)ack->delay_us);
+    *p++ = (uint8_t)ack->nranges;
+    p = put_u32(p, (uint32_t)(ack->ranges[0].largest - ack->ranges[0].smallest));
+    for (size_t i = 1; i < ack->nranges; i++) {
+        p = put_u32(p, (uint32_t)(ack->ranges[i - 1].smallest - ack->ranges[i].largest - 2));
+        p = put_u32(p, (uint32_t)(ack->ranges[i].largest - ack->ranges[i].smallest));
+    }
+    return p - out;
+}
+
+size_t frame_encode_token(uint8_t *out, int type, const uint8_t *token) {
+    out[0] = (uint8_t)type;
+    memcpy(out + 1, token, FRAME_TOKEN_LEN);
+    return FRAME_TOKEN_MAX;
+}
+
+int frame_decode_ack(const frame_t *frame, ack_frame_t *ack) {
+    const uint8_t *p = frame->data;
+    uint64_t largest = (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+    ack->delay_us = get_u32(p + 8);
+    ack->nranges = p[12];
+    p += 13;
+    for (size_t i = 0; i < ack->nranges; i++) {
+        if (i > 0) {
+            uint64_t gap = get_u32(p) + 2ULL;
+            p += 4;
+            if (ack->ranges[i - 1].smallest < gap) return -1;
+            largest = ack->ranges[i - 1].smallest - gap;
+        }
+        uint64_t len = get_u32(p);
+        p += 4;
+        if (len > largest) return -1;
+        ack->ranges[i].largest = largest;
+        ack->ranges[i].smallest = largest - len;
+    }
+    return 0;
+}
+
+int frame_next(uint8_t *payload, size_t len, size_t *off, frame_t *frame) {
+    while (*off < len && payload[*off] == FRAME_PADDING) {
+        (*off)++;
+    }
+    if (*off == len) return 0;
+
+    uint8_t *p = payload + *off;
+    size_t left = len - *off;
+    size_t hdr_len;
+    switch (p[0]) {
+    case FRAME_PING:
+        frame->type = FRAME_PING;
+        frame->stream_id = 0;
+        frame->data = p + 1;
+        frame->len = 0;
+        *off += 1;
+        return 1;
+    case FRAME_STREAM: {
+        uint64_t id;
+        hdr_len = 1 + get_varint(p + 1, left - 1, &id);
+        if (hdr_len == 1 || id == 0 || id > INT32_MAX) return -1;
+        frame->stream_id = (int)id;
+        break;
+    }
+    case FRAME_DATAGRAM:
+        frame->stream_id = 0;
+        hdr_len = 1;
+        break;
+    case FRAME_HC_FULL:
+    case FRAME_HC:
+    case FRAME_REPAIR:
+        if (left < 2) return -1;
+        frame->stream_id = 0;
+        frame->context = p[1];
+        hdr_len = 2;
+        break;
+    case FRAME_HC_RESYNC:
+        if (left < FRAME_HC_RESYNC_LEN) return -1;
+        frame->type = FRAME_HC_RESYNC;
+        frame->stream_id = 0;
+        frame->context = p[1];
+        frame->data = p + 2;
+        frame->len = 0;
+        *off += FRAME_HC_RESYNC_LEN;
+        return 1;
+    case FRAME_MP_PATH:
+        if (left < FRAME_MP_PATH_LEN) return -1;
+        frame->type = FRAME_MP_PATH;
+        frame->stream_id = 0;
+        frame->context = p[1];
+        frame->data = p + 2;
+        frame->len = 0;
+        *off += FRAME_MP_PATH_LEN;
+        return 1;
+    case FRAME_FEC:
+        if (left < FRAME_FEC_LEN) return -1;
+        frame->type = FRAME_FEC;
+        frame->stream_id = 0;
+        frame->data = p + 1;
+        frame->len = FRAME_FEC_LEN - 1;
+        *off += FRAME_FEC_LEN;
+        return 1;
+    case FRAME_FEC_SOURCE:
+        if (left < FRAME_FEC_SOURCE_LEN) return -1;
+        frame->type = FRAME_FEC_SOURCE;
+        frame->stream_id = 0;
+        frame->context = p[1];
+        frame->data = p + 2;
+        frame->len = FRAME_FEC_SOURCE_LEN - 2;
+        *off += FRAME_FEC_SOURCE_LEN;
+        return 1;
+    case FRAME_NEW_CONNECTION_ID:
+    case FRAME_PATH_CHALLENGE:
+    case FRAME_PATH_RESPONSE:
+        if (left < FRAME_TOKEN_MAX) return -1;
+        frame->type = p[0];
+        frame->stream_id = 0;
+        frame->data = p + 1;
+        frame->len = FRAME_TOKEN_LEN;
+        *off += FRAME_TOKEN_MAX;
+        return 1;
+    case FRAME_ACK: {
+        if (left < 18 || p[13] == 0 || p[13] > FRAME_ACK_MAX_RANGES) return -1;
+        size_t body_len = 17 + 8 * (size_t)(p[13] - 1);
+        if (body_len > left - 1) return -1;
+        frame->type = FRAME_ACK;
+        frame->stream_id = 0;
+        frame->data = p + 1;
+        frame->len = body_len;
+        *off += 1 + body_len;
+        return 1;
+    }
+    default:
+        return -1;
+    }
+
+    uint64_t data_len;
+    size_t n = get_varint(p + hdr_len, left - hdr_len, &data_len);
+    if (n == 0) return -1;
+    hdr_len += n;
+    if (data_len > left - hdr_len) return -1;
+    frame->type = p[0];
+    frame->data = p + hdr_len;
+    frame->len = data_len;
+    *off += hdr_len + data_len;
+    return 1;
+}
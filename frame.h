@@ -0,0 +1,129 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "replay.h"
+
+// Frames inside the encrypted payload of a tunnel packet, after the
+// QUIC frames of the same name. A packet carries one or more of them back
+// to back, so several small inner IP packets can share one datagram, one
+// AEAD call and one send:
+//
+//   PADDING   : 0x00, one byte, skipped by the receiver
+//   PING      : 0x01, one byte, asks for an acknowledgement (path MTU
+//               probes: a PING padded out to the size under test)
+//   ACK       : 0x02 | largest (8) | ACK delay in us (4) | range count (1)
+//               | first range (4) | { gap (4) | range (4) } ...
+//   STREAM    : 0x08 | stream ID (v) | length (v) | IP packet
+//   NEW_CONNECTION_ID
+//             : 0x18 | connection ID (8); server to client, to be put in
+//               the packet header from now on (see packet.h)
+//   PATH_CHALLENGE
+//             : 0x1a | data (8); sent to a new client address
+//   PATH_RESPONSE
+//             : 0x1b | data (8); echoes a challenge from the address it
+//               reached, which proves the client is there
+//   DATAGRAM  : 0x30 | length (v) | IP packet    (not on any stream)
+//   HC_FULL   : 0x40 | context (1) | length (v) | IP packet; sets up a
+//               header compression context (see hdrcomp.h)
+//   HC        : 0x41 | context (1) | length (v) | compressed header and
+//               payload of an IP packet
+//   HC_RESYNC : 0x42 | context (1); asks for a full header on a context
+//               whose packets could not be rebuilt
+//   FEC       : 0x43 | loss rate (2, in 1/65535); the sender takes repairs
+//               and lost this much of what came to it (see fec.h)
+//   FEC_SOURCE: 0x44 | group (1) | r - 1 << 5 | index (1); first in a
+//               packet that is part of a group
+//   REPAIR    : 0x45 | group (1) | length (v) | k - 1 (1) | r - 1 << 4 |
+//               row (1) | repair symbol; the length counts the two bytes
+//               before the symbol
+//   MP_PATH   : 0x46 | path (1); client to server, first in every packet
+//               sent on a path other than the first, or right after its
+//               FEC_SOURCE (see multipath.h)
+//
+// Multi-byte fields are big endian; (v) marks a QUIC variable-length
+// integer, whose first two bits give its length (1, 2, 4 or 8 bytes), so
+// a small IP packet's frame header is 3 bytes on a stream (stream IDs
+// take 4, see flow.h) and 2 compressed. ACK ranges are encoded as in QUIC:
+// the first range counts the packets below the largest, each gap the
+// missing packets minus one and each further range its packets minus one.
+// Packets carrying only ACK, NEW_CONNECTION_ID, PATH_*, HC_RESYNC, FEC and MP_PATH frames are not
+// acknowledged themselves; the sender repeats the latter until they have
+// an effect.
+#define FRAME_PADDING 0x00
+#define FRAME_PING 0x01
+#define FRAME_ACK 0x02
+#define FRAME_STREAM 0x08
+#define FRAME_NEW_CONNECTION_ID 0x18
+#define FRAME_PATH_CHALLENGE 0x1a
+#define FRAME_PATH_RESPONSE 0x1b
+#define FRAME_DATAGRAM 0x30
+#define FRAME_HC_FULL 0x40
+#define FRAME_HC 0x41
+#define FRAME_HC_RESYNC 0x42
+#define FRAME_FEC 0x43
+#define FRAME_FEC_SOURCE 0x44
+#define FRAME_REPAIR 0x45
+#define FRAME_MP_PATH 0x46
+#define FRAME_HEADER_MAX 7       // STREAM with a 4-byte stream ID
+#define FRAME_MAX_DATA 16383     // lengths fit in two varint bytes
+#define FRAME_HC_RESYNC_LEN 2
+#define FRAME_FEC_LEN 3
+#define FRAME_FEC_SOURCE_LEN 3
+#define FRAME_REPAIR_HEADER_MAX 6
+#define FRAME_MP_PATH_LEN 2
+#define FRAME_ACK_MAX_RANGES 32  // several paths interleave their packets
+#define FRAME_ACK_MAX (18 + 8 * (FRAME_ACK_MAX_RANGES - 1))
+#define FRAME_TOKEN_LEN 8    // connection ID or path challenge data
+#define FRAME_TOKEN_MAX (1 + FRAME_TOKEN_LEN)
+
+typedef struct {
+    int type;
+    int stream_id;        // 0 for DATAGRAM and HC frames
+    uint8_t context;      // HC frames: generation and index; FEC_SOURCE
+                          // and REPAIR: the group; MP_PATH: the path
+    uint8_t *data;        // the IP packet (ACK, FEC, FEC_SOURCE and REPAIR:
+                          // the frame body after the above, others: the
+                          // connection ID or challenge data), inside the payload
+    size_t len;
+} frame_t;
+
+typedef struct {
+    uint64_t delay_us;    // how long the largest was held before acknowledging
+    size_t nranges;
+    pn_range_t ranges[FRAME_ACK_MAX_RANGES];    // largest first
+} ack_frame_t;
+
+static inline size_t frame_varint_length(uint64_t v) {
+    return v < 64 ? 1 : v < 16384 ? 2 : v < 1073741824 ? 4 : 8;
+}
+
+// Header of a frame of the given type carrying len bytes of IP packet:
+// STREAM (id is the stream ID), DATAGRAM, HC_FULL or HC (id is the
+// context byte)
+static inline size_t frame_header_length(int type, uint32_t id, size_t len) {
+    size_t n = 1 + frame_varint_length(len);
+    if (type == FRAME_STREAM) return n + frame_varint_length(id);
+    return type == FRAME_DATAGRAM ? n : n + 1;
+}
+
+// Write that header. Returns its length.
+size_t frame_encode_header(uint8_t *out, int type, uint32_t id, size_t len);
+
+// Write an ACK frame (at most FRAME_ACK_MAX bytes). Returns its length.
+size_t frame_encode_ack(uint8_t *out, const ack_frame_t *ack);
+
+// Write a NEW_CONNECTION_ID, PATH_CHALLENGE or PATH_RESPONSE frame
+// (FRAME_TOKEN_MAX bytes) carrying the 8 bytes at token. Returns its length.
+size_t frame_encode_token(uint8_t *out, int type, const uint8_t *token);
+
+// Decode the body of an ACK frame returned by frame_next. Returns 0, or
+// -1 if the ranges do not make sense.
+int frame_decode_ack(const frame_t *frame, ack_frame_t *ack);
+
+// Parse the frame at *off in a decrypted payload and move *off past it.
+// Returns 1 for a frame, 0 at the end of the payload, -1 if malformed.
+int frame_next(uint8_t *payload, size_t len, size_t *off, frame_t *frame);
+
+#endif
@@ -0,0 +1,392 @@
+#include "handshake.h"
+#include "packet.h"
+#include <fcntl.h>
+#include <openssl/pem.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+#include <picotls/pembase64.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "crypto.h"
+
+#define HANDSHAKE_HEADER_LEN 7    // type byte, 4-byte offset and 2-byte length
+
+uint64_t handshake_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8; p[1] = v;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// Session tickets are sealed with the server's ticket key. The nonce is
+// a counter, sent in front of the sealed ticket and authenticated. The
+// client's certificate hash is sealed along with picotls's state, and
+// restored when the ticket comes back.
+static int encrypt_ticket_cb(ptls_encrypt_ticket_t *self, ptls_t *tls, int is_encrypt, ptls_buffer_t *dst, ptls_iovec_t src) {
+    handshake_config_t *cfg = (handshake_config_t *)((char *)self - offsetof(handshake_config_t, encrypt_ticket));
+    handshake_t *hs = *ptls_get_data_ptr(tls);
+    size_t tag_size = cfg->ticket_enc->algo->tag_size;
+    int ret;
+
+    if (is_encrypt) {
+        if ((ret = ptls_buffer_reserve(dst, 8 + HANDSHAKE_CLIENT_ID_LEN + src.len + tag_size)) != 0) return ret;
+        uint8_t *out = dst->base + dst->off;
+        ptls_iovec_t plain[2] = { ptls_iovec_init(hs->client_id, HANDSHAKE_CLIENT_ID_LEN), src };
+        pthread_mutex_lock(&cfg->ticket_lock);
+        uint64_t seq = cfg->ticket_seq++;
+        put_u32(out, seq >> 32);
+        put_u32(out + 4, (uint32_t)seq);
+        ptls_aead_encrypt_v(cfg->ticket_enc, out + 8, plain, 2, seq, out, 8);
+        pthread_mutex_unlock(&cfg->ticket_lock);
+        dst->off += 8 + HANDSHAKE_CLIENT_ID_LEN + src.len + tag_size;
+        return 0;
+    }
+
+    if (src.len < 8 + HANDSHAKE_CLIENT_ID_LEN + tag_size) return PTLS_ALERT_DECRYPT_ERROR;
+    if ((ret = ptls_buffer_reserve(dst, src.len)) != 0) return ret;
+    uint8_t *out = dst->base + dst->off;
+    uint64_t seq = (uint64_t)get_u32(src.base) << 32 | get_u32(src.base + 4);
+    pthread_mutex_lock(&cfg->ticket_lock);
+    size_t len = ptls_aead_decrypt(cfg->ticket_dec, out, src.base + 8, src.len - 8, seq, src.base, 8);
+    pthread_mutex_unlock(&cfg->ticket_lock);
+    if (len == SIZE_MAX) return PTLS_ALERT_DECRYPT_ERROR;
+    memcpy(hs->client_id, out, HANDSHAKE_CLIENT_ID_LEN);
+    memmove(out, out + HANDSHAKE_CLIENT_ID_LEN, len - HANDSHAKE_CLIENT_ID_LEN);
+    dst->off += len - HANDSHAKE_CLIENT_ID_LEN;
+    return 0;
+}
+
+// Server: check the client's chain as openssl does, and note which
+// certificate the client is known by
+static int verify_client_cb(ptls_verify_certificate_t *self, ptls_t *tls, const char *server_name,
+                            int (**verify_sign)(void *, uint16_t, ptls_iovec_t, ptls_iovec_t), void **verify_data,
+                            ptls_iovec_t *certs, size_t num_certs) {
+    handshake_config_t *cfg = (handshake_config_t *)((char *)self - offsetof(handshake_config_t, verify));
+    int ret = cfg->verify_chain.cb(self, tls, server_name, verify_sign, verify_data, certs, num_certs);
+    if (ret == 0 && num_certs > 0) {
+        handshake_t *hs = *ptls_get_data_ptr(tls);
+        SHA256(certs[0].base, certs[0].len, hs->client_id);
+    }
+    return ret;
+}
+
+// Keep the latest ticket for the next handshake, and on disk if asked
+static int save_ticket_cb(ptls_save_ticket_t *self, ptls_t *tls, ptls_iovec_t input) {
+    handshake_config_t *cfg = (handshake_config_t *)((char *)self - offsetof(handshake_config_t, save_ticket));
+    if (input.len > sizeof(cfg->ticket)) return 0;
+    memcpy(cfg->ticket, input.base, input.len);
+    cfg->ticket_len = input.len;
+
+    if (cfg->ticket_file) {
+        int fd = open(cfg->ticket_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0 || write(fd, input.base, input.len) != (ssize_t)input.len) {
+            log_errno("Saving session ticket");
+        }
+        if (fd >= 0) close(fd);
+    }
+    return 0;
+}
+
+static void init_context(handshake_config_t *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->ctx.random_bytes = ptls_openssl_random_bytes;
+    cfg->ctx.get_time = &ptls_get_time;
+    cfg->ctx.key_exchanges = ptls_openssl_key_exchanges;
+    cfg->ctx.cipher_suites = crypto_cipher_suites();
+    cfg->ctx.use_exporter = 1;
+    // 0-RTT tunnel packets travel outside TLS, so there is no
+    // EndOfEarlyData message to wait for
+    cfg->ctx.omit_end_of_early_data = 1;
+}
+
+// Present cert_file, signed with key_file (PEM)
+static int load_identity(handshake_config_t *cfg, const char *cert_file, const char *key_file) {
+    if (ptls_load_certificates(&cfg->ctx, cert_file) != 0) {
+        log_error("Failed to load certificate %s\n", cert_file);
+        return -1;
+    }
+
+    FILE *f = fopen(key_file, "r");
+    if (!f) {
+        log_errno("Opening private key");
+        return -1;
+    }
+    EVP_PKEY *pkey = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+    fclose(f);
+    if (!pkey) {
+        log_error("Failed to read private key %s\n", key_file);
+        return -1;
+    }
+    int ret = ptls_openssl_init_sign_certificate(&cfg->sign, pkey);
+    EVP_PKEY_free(pkey);
+    if (ret != 0) {
+        log_error("Unsupported private key in %s\n", key_file);
+        return -1;
+    }
+    cfg->ctx.sign_certificate = &cfg->sign.super;
+    return 0;
+}
+
+// Accept only peers whose certificate chains up to one in ca_file
+static int load_trust(handshake_config_t *cfg, const char *ca_file) {
+    X509_STORE *store = X509_STORE_new();
+    if (!store || X509_STORE_load_locations(store, ca_file, NULL) != 1 || ptls_openssl_init_verify_certificate(&cfg->verify, store) != 0) {
+        log_error("Failed to load trusted certificates from %s\n", ca_file);
+        X509_STORE_free(store);
+        return -1;
+    }
+    X509_STORE_free(store);
+    cfg->ctx.verify_certificate = &cfg->verify.super;
+    return 0;
+}
+
+int handshake_server_config(handshake_config_t *cfg, const char *cert_file, const char *key_file, const char *client_ca_file) {
+    init_context(cfg);
+    if (load_identity(cfg, cert_file, key_file) != 0 || load_trust(cfg, client_ca_file) != 0) {
+        return -1;
+    }
+    // Only clients with a certificate get a session, and tickets are only
+    // issued to them
+    cfg->ctx.require_client_authentication = 1;
+    cfg->verify_chain = cfg->verify.super;
+    cfg->verify.super.cb = verify_client_cb;
+
+    // Tickets for resumption, sealed with a key that lives as long as the process
+    uint8_t secret[PTLS_MAX_DIGEST_SIZE];
+    ptls_cipher_suite_t *suite = cfg->ctx.cipher_suites[0];
+    cfg->ctx.random_bytes(secret, sizeof(secret));
+    cfg->ticket_enc = ptls_aead_new(suite->aead, suite->hash, 1, secret, "vpn ticket ");
+    cfg->ticket_dec = ptls_aead_new(suite->aead, suite->hash, 0, secret, "vpn ticket ");
+    ptls_clear_memory(secret, sizeof(secret));
+    if (!cfg->ticket_enc || !cfg->ticket_dec) {
+        log_error("Failed to create the ticket key\n");
+        return -1;
+    }
+    pthread_mutex_init(&cfg->ticket_lock, NULL);
+    cfg->encrypt_ticket.cb = encrypt_ticket_cb;
+    cfg->ctx.encrypt_ticket = &cfg->encrypt_ticket;
+    cfg->ctx.ticket_lifetime = TICKET_LIFETIME;
+    cfg->ctx.max_early_data_size = UINT32_MAX;    // any amount: 0-RTT data is not in TLS records
+    cfg->ctx.require_dhe_on_psk = 1;              // resumed sessions keep forward secrecy
+    return 0;
+}
+
+int handshake_client_config(handshake_config_t *cfg, const char *cert_file, const char *key_file, const char *ca_file,
+                            const char *server_name, const char *ticket_file) {
+    init_context(cfg);
+    if (load_identity(cfg, cert_file, key_file) != 0 || (ca_file && load_trust(cfg, ca_file) != 0)) {
+        return -1;
+    }
+    cfg->server_name = server_name;
+
+    cfg->save_ticket.cb = save_ticket_cb;
+    cfg->ctx.save_ticket = &cfg->save_ticket;
+    cfg->ticket_file = ticket_file;
+    if (ticket_file) {
+        int fd = open(ticket_file, O_RDONLY);
+        if (fd >= 0) {
+            ssize_t n = read(fd, cfg->ticket, sizeof(cfg->ticket));
+            cfg->ticket_len = n > 0 ? n : 0;
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+void handshake_config_free(handshake_config_t *cfg) {
+    if (cfg->ctx.sign_certificate) ptls_openssl_dispose_sign_certificate(&cfg->sign);
+    if (cfg->ctx.verify_certificate) ptls_openssl_dispose_verify_certificate(&cfg->verify);
+    if (cfg->ticket_enc) {
+        ptls_aead_free(cfg->ticket_enc);
+        ptls_aead_free(cfg->ticket_dec);
+        pthread_mutex_destroy(&cfg->ticket_lock);
+    }
+}
+
+int handshake_start(handshake_t *hs, handshake_config_t *cfg, bool is_server) {
+    memset(hs, 0, sizeof(*hs));
+    ptls_buffer_init(&hs->sent, "", 0);
+    hs->started_ns = handshake_clock_ns();
+    hs->is_server = is_server;
+    hs->tls = ptls_new(&cfg->ctx, is_server);
+    if (!hs->tls) return -1;
+    *ptls_get_data_ptr(hs->tls) = hs;
+    if (is_server) return 0;
+
+    // Sent as SNI unless it is an address, and checked against the
+    // server's certificate
+    if (cfg->server_name && ptls_set_server_name(hs->tls, cfg->server_name, 0) != 0) {
+        return -1;
+    }
+
+    if (cfg->ticket_len > 0) {
+        hs->props.client.session_ticket = ptls_iovec_init(cfg->ticket, cfg->ticket_len);
+    }
+    hs->props.client.max_early_data_size = &hs->max_early_data;
+    int ret = ptls_handshake(hs->tls, &hs->sent, NULL, NULL, &hs->props);
+    if (ret != PTLS_ERROR_IN_PROGRESS) {
+        log_error("Failed to start TLS handshake (%d)\n", ret);
+        return -1;
+    }
+    return 0;
+}
+
+int handshake_input(handshake_t *hs, uint32_t offset, const uint8_t *data, size_t len, bool *repeated) {
+    if (offset == 0 && hs->prefix_len == 0) {
+        hs->prefix_len = len < HANDSHAKE_PREFIX_LEN ? len : HANDSHAKE_PREFIX_LEN;
+        memcpy(hs->prefix, data, hs->prefix_len);
+    }
+
+    // Only bytes continuing the stream are used; a gap is left for the
+    // peer's retransmission to fill
+    *repeated = !hs->tls || (uint64_t)offset + len <= hs->received;
+    if (*repeated || offset > hs->received) return 0;
+    data += hs->received - offset;
+    len -= hs->received - offset;
+
+    int ret;
+    if (!hs->complete) {
+        size_t consumed = len;
+        ret = ptls_handshake(hs->tls, &hs->sent, data, &consumed, &hs->props);
+        if (ret != 0 && ret != PTLS_ERROR_IN_PROGRESS) {
+            log_limited(LOG_LEVEL_WARN, "TLS handshake failed (%d)\n", ret);
+            return -1;
+        }
+        hs->received += consumed;
+        data += consumed;
+        len -= consumed;
+        if (ret == 0) {
+            hs->complete = true;
+            hs->resumed = ptls_is_psk_handshake(hs->tls);
+            hs->completed_ns = handshake_clock_ns();
+        }
+    }
+
+    // Messages after the handshake, i.e. the server's session ticket
+    while (hs->complete && len > 0) {
+        ptls_buffer_t plain;
+        ptls_buffer_init(&plain, "", 0);
+        size_t consumed = len;
+        ret = ptls_receive(hs->tls, &plain, data, &consumed);
+        ptls_buffer_dispose(&plain);
+        if (ret != 0) {
+            log_limited(LOG_LEVEL_WARN, "TLS post-handshake message failed (%d)\n", ret);
+            return -1;
+        }
+        hs->received += consumed;
+        data += consumed;
+        len -= consumed;
+    }
+    return 0;
+}
+
+bool handshake_is_new(const handshake_t *hs, const uint8_t *data, size_t len) {
+    size_t n = len < hs->prefix_len ? len : hs->prefix_len;
+    return hs->prefix_len > 0 && memcmp(hs->prefix, data, n) != 0;
+}
+
+int handshake_send(handshake_t *hs, int sock, const struct sockaddr_in *addr, int type, bool all) {
+    uint8_t dgram[HANDSHAKE_HEADER_LEN + HANDSHAKE_CHUNK];
+    socklen_t addr_len = addr ? sizeof(*addr) : 0;
+    size_t off = all ? 0 : hs->sent_off;
+
+    while (off < hs->sent.off) {
+        size_t n = hs->sent.off - off < HANDSHAKE_CHUNK ? hs->sent.off - off : HANDSHAKE_CHUNK;
+        size_t len = HANDSHAKE_HEADER_LEN + n;
+        if (type == PACKET_INITIAL && len < HANDSHAKE_MIN_INITIAL) len = HANDSHAKE_MIN_INITIAL;
+        // The client has proven its address once the handshake completes
+        if (hs->is_server && !hs->complete && hs->sent_bytes + len > HANDSHAKE_AMPLIFICATION * hs->datagram_bytes) break;
+        dgram[0] = PACKET_LONG_HEADER | PACKET_FIXED_BIT | (type << PACKET_TYPE_SHIFT);
+        put_u32(dgram + 1, (uint32_t)off);
+        put_u16(dgram + 5, (uint16_t)n);
+        memcpy(dgram + HANDSHAKE_HEADER_LEN, hs->sent.base + off, n);
+        memset(dgram + HANDSHAKE_HEADER_LEN + n, 0, len - HANDSHAKE_HEADER_LEN - n);
+        if (sendto(sock, dgram, len, 0, (const struct sockaddr *)addr, addr_len) < 0) {
+            log_limited(LOG_LEVEL_ERROR, "Sending handshake: %s\n", strerror(errno));
+            return -1;
+        }
+        hs->sent_bytes += len;
+        off += n;
+    }
+    if (off > hs->sent_off) hs->sent_off = off;
+    hs->last_sent_ns = handshake_clock_ns();
+    return 0;
+}
+
+int handshake_send_done(const handshake_t *hs, int sock, const struct sockaddr_in *addr) {
+    uint8_t done[5];
+    done[0] = PACKET_LONG_HEADER | PACKET_FIXED_BIT | (PACKET_DONE << PACKET_TYPE_SHIFT);
+    put_u32(done + 1, (uint32_t)hs->sent.off);
+    if (sendto(sock, done, sizeof(done), 0, (const struct sockaddr *)addr, addr ? sizeof(*addr) : 0) < 0) {
+        log_limited(LOG_LEVEL_ERROR, "Sending handshake done: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+bool handshake_done_received(const handshake_t *hs, const uint8_t *in, size_t len) {
+    return len >= 5 && hs->complete && hs->received >= get_u32(in + 1);
+}
+
+int handshake_parse(const uint8_t *in, size_t len, uint32_t *offset, const uint8_t **data, size_t *data_len) {
+    if (len < HANDSHAKE_HEADER_LEN || !packet_is_handshake(in[0])) {
+        return -1;
+    }
+    size_t n = get_u16(in + 5);
+    if (n > len - HANDSHAKE_HEADER_LEN) {
+        return -1;
+    }
+    *offset = get_u32(in + 1);
+    *data = in + HANDSHAKE_HEADER_LEN;
+    *data_len = n;
+    return 0;
+}
+
+int handshake_export(handshake_t *hs, const char *label, bool early, tunnel_secret_t *out) {
+    if (!hs->tls) return -1;
+    // A resuming client has no negotiated suite yet; its early secret
+    // uses the suite of the ticket, which picotls reports once known
+    ptls_cipher_suite_t *suite = ptls_get_cipher(hs->tls);
+    if (!suite) suite = crypto_cipher_suites()[0];
+    out->suite = suite;
+    if (ptls_export_secret(hs->tls, out->secret, suite->hash->digest_size, label, ptls_iovec_init(NULL, 0), early) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+ptls_aead_context_t *tunnel_secret_aead(const tunnel_secret_t *s, bool is_enc) {
+    return ptls_aead_new(crypto_aead(s->suite), s->suite->hash, is_enc, s->secret, "vpn ");
+}
+
+void handshake_finish(handshake_t *hs) {
+    if (hs->tls) {
+        ptls_free(hs->tls);
+        hs->tls = NULL;
+    }
+}
+
+void handshake_free(handshake_t *hs) {
+    handshake_finish(hs);
+    ptls_buffer_dispose(&hs->sent);
+}
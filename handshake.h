@@ -0,0 +1,176 @@
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <picotls.h>
+#include <picotls/openssl.h>
+
+// TLS 1.3 session setup (picotls) carried in long header datagrams, and
+// the per-peer tunnel keys exported from it.
+//
+// Each side's handshake bytes form one stream. A datagram carries a chunk
+// of it, with the chunk's offset and length, and the receiver feeds
+// ptls_handshake the bytes in order, dropping anything it has already
+// seen. Loss is repaired by retransmission: the client resends its flight
+// on a timer with backoff, and the server answers a chunk it has seen
+// before by sending its own flight again. Once the server has completed
+// the handshake it answers with DONE, which carries the length of its
+// stream, session ticket included. The client stops retransmitting (and
+// frees its TLS state) only once it has all of that, so a lost ticket is
+// sent again like the rest of the flight.
+//
+// Until then the server cannot tell whether the client's address is its
+// own, so it must not become a reflector. INITIAL datagrams are padded
+// to HANDSHAKE_MIN_INITIAL bytes, and the server drops shorter ones and
+// sends at most HANDSHAKE_AMPLIFICATION times the bytes it received from
+// the address; the rest of its flight follows the client's next datagram.
+//
+// Both sides authenticate with certificates: the server only completes a
+// handshake with a client whose certificate it trusts, so a session (and
+// the TUN device behind it) is only open to configured clients. It
+// records which certificate each client used in the handshake and in
+// the tickets it issues, so a resumed session is known as the same
+// client too.
+//
+// The tunnel keys come from the TLS exporter, one secret per direction,
+// so every peer has keys and a nonce space of its own. The server issues
+// session tickets; a client resuming with one also gets an early secret
+// and can send tunnel packets as ZERO_RTT in its first flight.
+
+#define HANDSHAKE_CHUNK 1200             // handshake bytes per datagram
+#define HANDSHAKE_MIN_INITIAL 1200       // bytes an INITIAL datagram is padded to
+#define HANDSHAKE_AMPLIFICATION 3        // server bytes per client byte before the handshake completes
+#define HANDSHAKE_RETRANSMIT_MS 250      // first client retransmission timeout
+#define HANDSHAKE_MAX_BACKOFF_MS 8000
+#define HANDSHAKE_TIMEOUT 10             // seconds a server keeps an unfinished handshake
+#define HANDSHAKE_TICKET_MAX 2048
+#define HANDSHAKE_PREFIX_LEN 64          // bytes kept to recognise a retransmitted first chunk
+#define HANDSHAKE_CLIENT_ID_LEN 32       // SHA-256 of a client's certificate
+#define TICKET_LIFETIME (24 * 3600)
+
+// Exporter labels for the tunnel keys
+#define HANDSHAKE_LABEL_CLIENT "EXPORTER-vpn client"
+#define HANDSHAKE_LABEL_SERVER "EXPORTER-vpn server"
+#define HANDSHAKE_LABEL_EARLY "EXPORTER-vpn early"
+
+// picotls context and callbacks shared by every handshake of a process
+typedef struct {
+    ptls_context_t ctx;
+    ptls_openssl_sign_certificate_t sign;        // our certificate
+    ptls_openssl_verify_certificate_t verify;    // the peer's, unless a client skips it
+    ptls_verify_certificate_t verify_chain;      // server: openssl's check, wrapped by verify
+    ptls_encrypt_ticket_t encrypt_ticket;        // server
+    ptls_save_ticket_t save_ticket;              // client
+
+    // Server: session ticket protection, shared by all workers
+    pthread_mutex_t ticket_lock;
+    ptls_aead_context_t *ticket_enc;
+    ptls_aead_context_t *ticket_dec;
+    uint64_t ticket_seq;
+
+    // Client: the server's name, and its latest ticket and the file
+    // keeping it across runs
+    const char *server_name;
+    uint8_t ticket[HANDSHAKE_TICKET_MAX];
+    size_t ticket_len;
+    const char *ticket_file;
+} handshake_config_t;
+
+// One side of one handshake
+typedef struct {
+    ptls_t *tls;                  // NULL once finished
+    ptls_handshake_properties_t props;
+    size_t max_early_data;        // client: nonzero if the server allows 0-RTT
+    ptls_buffer_t sent;           // our handshake bytes so far
+    size_t sent_off;              // how many of them have been transmitted
+    uint32_t received;            // peer handshake bytes fed to TLS
+    uint64_t datagram_bytes;      // server: received from the client's address,
+    uint64_t sent_bytes;          // and sent there
+    uint8_t prefix[HANDSHAKE_PREFIX_LEN];    // first bytes the peer sent
+    uint8_t client_id[HANDSHAKE_CLIENT_ID_LEN];    // server: the client's certificate, from it or its ticket
+    size_t prefix_len;
+    bool is_server;
+    bool complete;                // TLS handshake finished
+    bool resumed;                 // completed with a session ticket
+    bool confirmed;               // client: server sent DONE, and all its bytes arrived
+    uint64_t started_ns;
+    uint64_t completed_ns;
+    uint64_t last_sent_ns;
+    unsigned retransmits;
+} handshake_t;
+
+// Secret for one direction of the tunnel and the suite it is used with
+typedef struct {
+    ptls_cipher_suite_t *suite;
+    uint8_t secret[PTLS_MAX_DIGEST_SIZE];
+} tunnel_secret_t;
+
+// Server: present cert_file, signed with key_file (PEM), and require
+// clients to present a certificate that chains up to one in
+// client_ca_file. Tickets are protected with a random key, so they do
+// not survive a restart.
+int handshake_server_config(handshake_config_t *cfg, const char *cert_file, const char *key_file, const char *client_ca_file);
+
+// Client: present cert_file, signed with key_file; verify the server
+// against ca_file and server_name (a host name or address) if given,
+// and load and save session tickets in ticket_file if given
+int handshake_client_config(handshake_config_t *cfg, const char *cert_file, const char *key_file, const char *ca_file,
+                            const char *server_name, const char *ticket_file);
+void handshake_config_free(handshake_config_t *cfg);
+
+// Begin a handshake. The client's first flight (resuming with the saved
+// ticket, if any) is left in hs->sent for handshake_send.
+int handshake_start(handshake_t *hs, handshake_config_t *cfg, bool is_server);
+
+// Feed a chunk of the peer's handshake bytes. *repeated is set if the
+// chunk held nothing new (the peer is retransmitting). Returns 0, or -1
+// if the handshake failed.
+int handshake_input(handshake_t *hs, uint32_t offset, const uint8_t *data, size_t len, bool *repeated);
+
+// True if data, the first chunk of a peer's handshake, belongs to a
+// different handshake than the one hs was started for
+bool handshake_is_new(const handshake_t *hs, const uint8_t *data, size_t len);
+
+// Server: a datagram of len bytes came from the client, which allows
+// more to be sent there (see HANDSHAKE_AMPLIFICATION)
+static inline void handshake_on_datagram(handshake_t *hs, size_t len) {
+    hs->datagram_bytes += len;
+}
+
+// Whether the server's flight has not all gone out yet, held back until
+// the client sends more
+static inline bool handshake_send_blocked(const handshake_t *hs) {
+    return hs->sent_off < hs->sent.off;
+}
+
+// Send our handshake bytes as datagrams of the given type: only those not
+// yet sent, or all of them again, as far as the server's limit allows.
+// INITIAL datagrams are padded. addr may be NULL on a connected socket.
+int handshake_send(handshake_t *hs, int sock, const struct sockaddr_in *addr, int type, bool all);
+int handshake_send_done(const handshake_t *hs, int sock, const struct sockaddr_in *addr);
+
+// Client: whether the DONE datagram in means we have everything the
+// server sent, so our TLS state is no longer needed
+bool handshake_done_received(const handshake_t *hs, const uint8_t *in, size_t len);
+
+// Parse an INITIAL or HANDSHAKE datagram. Returns 0 and the chunk,
+// without any padding.
+int handshake_parse(const uint8_t *in, size_t len, uint32_t *offset, const uint8_t **data, size_t *data_len);
+
+// Export a tunnel secret. Fails (-1) until the keys exist: the early
+// secret right after a resumed ClientHello, the others once the server
+// has sent its flight (server) or the handshake completed (client).
+int handshake_export(handshake_t *hs, const char *label, bool early, tunnel_secret_t *out);
+ptls_aead_context_t *tunnel_secret_aead(const tunnel_secret_t *s, bool is_enc);
+
+// Release the TLS state once the keys have been exported
+void handshake_finish(handshake_t *hs);
+void handshake_free(handshake_t *hs);
+
+uint64_t handshake_clock_ns(void);
+
+#endif
@@ -0,0 +1,527 @@
+#include "hdrcomp.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "frame.h"
+
+#define PROTO_TCP 6
+#define PROTO_UDP 17
+
+enum { IP_ID, SEQ, ACK, TSVAL, TSECR };    // W-LSB fields
+enum { TTL, TOS, WINDOW, URGENT };         // fields sent when they change
+enum { OPTIONS_NONE, OPTIONS_TIMESTAMPS, OPTIONS_RAW };
+
+static const unsigned code_bytes[4] = { 0, 1, 2, 4 };
+static const unsigned lsb_width[HDRCOMP_LSB_FIELDS] = { 16, 32, 32, 32, 32 };
+static const unsigned raw_bytes[HDRCOMP_RAW_FIELDS] = { 1, 1, 2, 2 };
+
+// Fields of a compressed header in the order they are written
+static const struct {
+    bool raw;                // sent when it changes, rather than W-LSB
+    int field;
+    bool tcp;                // TCP only
+} fields[] = {
+    { true, TTL, false }, { true, TOS, false }, { false, IP_ID, false },
+    { false, SEQ, true }, { false, ACK, true }, { true, WINDOW, true }, { true, URGENT, true },
+    { false, TSVAL, true }, { false, TSECR, true },
+};
+
+static const char *const class_names[HDRCOMP_CLASSES] = {
+    "tcp_ack", "tcp_data", "udp", "plain",
+};
+
+// Where the headers of a compressible packet are
+typedef struct {
+    bool v6, tcp;
+    size_t l3_len;           // IP header
+    size_t hdr_len;          // IP and TCP/UDP headers
+    size_t payload;
+} parsed_t;
+
+static uint32_t get_be(const uint8_t *p, unsigned n) {
+    uint32_t v = 0;
+    for (unsigned i = 0; i < n; i++) v = v << 8 | p[i];
+    return v;
+}
+
+static uint8_t *put_be(uint8_t *p, uint32_t v, unsigned n) {
+    for (unsigned i = 0; i < n; i++) p[i] = (uint8_t)(v >> (8 * (n - 1 - i)));
+    return p + n;
+}
+
+// CRC-8 with polynomial 0x07
+static uint8_t crc8(const uint8_t *p, size_t len) {
+    static const uint8_t table[256] = {
+        0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+        0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65, 0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+        0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+        0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+        0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2, 0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+        0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+        0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+        0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42, 0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+        0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+        0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+        0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c, 0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+        0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+        0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+        0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b, 0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+        0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+        0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3,
+    };
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; i++) crc = table[crc ^ p[i]];
+    return crc;
+}
+
+static uint16_t ipv4_csum(const uint8_t *ip) {
+    uint32_t sum = 0;
+    for (int i = 0; i < 20; i += 2) sum += (uint32_t)ip[i] << 8 | ip[i + 1];
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+static void ipv4_set_csum(uint8_t *ip) {
+    ip[10] = ip[11] = 0;
+    put_be(ip + 10, (uint16_t)~ipv4_csum(ip), 2);
+}
+
+// A TCP or UDP packet over IPv4 without options or fragments, or IPv6
+// without extension headers, whose lengths (and IPv4 checksum) agree
+// with what is there: those the receiver can work out again
+static bool parse(const uint8_t *ip, size_t len, parsed_t *p) {
+    uint8_t proto;
+    if (len >= 20 && ip[0] == 0x45) {
+        if (get_be(ip + 2, 2) != len || (ip[6] & 0xbf) || ip[7] || ipv4_csum(ip) != 0xffff) return false;
+        p->v6 = false;
+        p->l3_len = 20;
+        proto = ip[9];
+    } else if (len >= 40 && ip[0] >> 4 == 6) {
+        if (get_be(ip + 4, 2) != len - 40) return false;
+        p->v6 = true;
+        p->l3_len = 40;
+        proto = ip[6];
+    } else {
+        return false;
+    }
+
+    const uint8_t *l4 = ip + p->l3_len;
+    if (proto == PROTO_TCP) {
+        if (len < p->l3_len + 20 || (l4[12] & 0x0f)) return false;
+        p->hdr_len = p->l3_len + (l4[12] >> 4) * 4;
+        if (l4[12] >> 4 < 5 || p->hdr_len > len) return false;
+    } else if (proto == PROTO_UDP) {
+        if (len < p->l3_len + 8 || get_be(l4 + 4, 2) != len - p->l3_len) return false;
+        p->hdr_len = p->l3_len + 8;
+    } else {
+        return false;
+    }
+    p->tcp = proto == PROTO_TCP;
+    p->payload = len - p->hdr_len;
+    return true;
+}
+
+// The same for a header kept in a context, which passed parse before
+static void parse_ref(const hdrcomp_ref_t *ref, parsed_t *p) {
+    p->v6 = ref->hdr[0] >> 4 == 6;
+    p->l3_len = p->v6 ? 40 : 20;
+    p->tcp = ref->hdr[p->v6 ? 6 : 9] == PROTO_TCP;
+    p->hdr_len = ref->hdr_len;
+    p->payload = 0;
+}
+
+static int options_form(const uint8_t *ip, const parsed_t *p) {
+    const uint8_t *opt = ip + p->l3_len + 20;
+    size_t len = p->hdr_len - p->l3_len - 20;
+    if (len == 0) return OPTIONS_NONE;
+    if (len == 12 && opt[0] == 1 && opt[1] == 1 && opt[2] == 8 && opt[3] == 10) return OPTIONS_TIMESTAMPS;
+    return OPTIONS_RAW;
+}
+
+// The fields that change from packet to packet; timestamps are 0 when
+// the options are not in the usual layout
+static void values_of(const uint8_t *ip, const parsed_t *p, hdrcomp_values_t *v) {
+    memset(v, 0, sizeof(*v));
+    const uint8_t *l4 = ip + p->l3_len;
+    if (p->v6) {
+        v->raw[TTL] = ip[7];
+        v->raw[TOS] = (uint16_t)((ip[0] & 0x0f) << 4 | ip[1] >> 4);
+    } else {
+        v->lsb[IP_ID] = get_be(ip + 4, 2);
+        v->raw[TTL] = ip[8];
+        v->raw[TOS] = ip[1];
+    }
+    if (!p->tcp) return;
+    v->lsb[SEQ] = get_be(l4 + 4, 4);
+    v->lsb[ACK] = get_be(l4 + 8, 4);
+    v->raw[WINDOW] = (uint16_t)get_be(l4 + 14, 2);
+    v->raw[URGENT] = (uint16_t)get_be(l4 + 18, 2);
+    if (options_form(ip, p) == OPTIONS_TIMESTAMPS) {
+        v->lsb[TSVAL] = get_be(l4 + 24, 4);
+        v->lsb[TSECR] = get_be(l4 + 28, 4);
+    }
+}
+
+static size_t flow_key(const uint8_t *ip, const parsed_t *p, uint8_t *key) {
+    size_t n = 0;
+    if (p->v6) {
+        key[n++] = ip[0] & 0xf0;
+        key[n++] = ip[1] & 0x0f;    // flow label, without the traffic class
+        key[n++] = ip[2];
+        key[n++] = ip[3];
+        key[n++] = ip[6];
+        memcpy(key + n, ip + 8, 32);
+        n += 32;
+    } else {
+        key[n++] = ip[0];
+        key[n++] = ip[6];           // DF
+        key[n++] = ip[9];
+        memcpy(key + n, ip + 12, 8);
+        n += 8;
+    }
+    memcpy(key + n, ip + p->l3_len, 4);    // ports
+    return n + 4;
+}
+
+static uint64_t hash_key(const uint8_t *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ key[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static uint32_t width_mask(unsigned width) {
+    return width == 32 ? UINT32_MAX : ((uint32_t)1 << width) - 1;
+}
+
+// The interpretation interval of k bits against ref is
+// [ref - 2^k / 4, ref + 3 * 2^k / 4): mostly forwards, a little back
+static uint32_t lsb_offset(unsigned bits) {
+    return (uint32_t)1 << (bits - 2);
+}
+
+// Signed distance from ref to v in a field of width bits
+static int32_t lsb_distance(uint32_t v, uint32_t ref, unsigned width) {
+    return width == 16 ? (int16_t)(v - ref) : (int32_t)(v - ref);
+}
+
+// The size codes and raw fields v needs against the window: a W-LSB
+// field takes the smallest code whose interval, around every value in
+// the window, holds v; a raw field goes if any value in the window
+// differs. UDP has only the first W-LSB field (the IP ID) and the first
+// two raw ones (TTL and TOS); what it lacks is 0 throughout.
+static void window_codes(const hdrcomp_context_t *ctx, const parsed_t *p, const hdrcomp_values_t *v, unsigned *codes, bool *raw) {
+    int nlsb = p->tcp ? HDRCOMP_LSB_FIELDS : 1, nraw = p->tcp ? HDRCOMP_RAW_FIELDS : 2;
+    for (int f = 0; f < HDRCOMP_LSB_FIELDS; f++) {
+        codes[f] = 0;
+        if (f >= nlsb) continue;
+        const uint32_t *w = ctx->window_lsb[f];
+        int32_t lo = 0, hi = 0;
+        for (int i = 0; i < HDRCOMP_WINDOW; i++) {
+            int32_t d = lsb_distance(v->lsb[f], w[i], lsb_width[f]);
+            lo = d < lo ? d : lo;
+            hi = d > hi ? d : hi;
+        }
+        while (codes[f] < 3) {
+            unsigned bits = 8 * code_bytes[codes[f]];
+            if (bits >= lsb_width[f]) break;
+            if (bits == 0 ? lo == 0 && hi == 0 :
+                lo >= -(int32_t)lsb_offset(bits) && hi < (int32_t)(3 * lsb_offset(bits))) break;
+            codes[f]++;
+        }
+    }
+    for (int f = 0; f < HDRCOMP_RAW_FIELDS; f++) {
+        uint16_t differs = 0;
+        for (int i = 0; f < nraw && i < HDRCOMP_WINDOW; i++) differs |= ctx->window_raw[f][i] ^ v->raw[f];
+        raw[f] = differs != 0;
+    }
+}
+
+static uint32_t lsb_decode(uint32_t ref, uint32_t lsb, unsigned bits, unsigned width) {
+    uint32_t mask = width_mask(width);
+    if (bits == 0) return ref;
+    if (bits >= width) return lsb & mask;
+    uint32_t base = (ref - lsb_offset(bits)) & mask;
+    return (base + ((lsb - base) & (((uint32_t)1 << bits) - 1))) & mask;
+}
+
+// Write the compressed header of ip into out (at least
+// HDRCOMP_HEADER_MAX bytes). Returns its length.
+static size_t encode(const hdrcomp_context_t *ctx, const uint8_t *ip, const parsed_t *p, const hdrcomp_values_t *v, uint8_t *out) {
+    const uint8_t *l4 = ip + p->l3_len;
+    unsigned codes[HDRCOMP_LSB_FIELDS];
+    bool raw[HDRCOMP_RAW_FIELDS];
+    window_codes(ctx, p, v, codes, raw);
+    int form = p->tcp ? options_form(ip, p) : OPTIONS_NONE;
+    if (form != OPTIONS_TIMESTAMPS) codes[TSVAL] = codes[TSECR] = 0;
+
+    uint8_t *o = out;
+    *o++ = (uint8_t)(codes[IP_ID] << 6 | raw[TTL] << 5 | raw[TOS] << 4 | codes[TSVAL] << 2 | codes[TSECR]);
+    if (p->tcp) {
+        *o++ = (uint8_t)(codes[SEQ] << 6 | codes[ACK] << 4 | raw[WINDOW] << 3 | raw[URGENT] << 2 | form);
+        *o++ = l4[13];
+    }
+    *o++ = crc8(ip, p->hdr_len);
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        int f = fields[i].field;
+        if (fields[i].tcp && !p->tcp) break;
+        if (!fields[i].raw) {
+            o = put_be(o, v->lsb[f], code_bytes[codes[f]]);
+        } else if (raw[f]) {
+            o = put_be(o, v->raw[f], raw_bytes[f]);
+        }
+    }
+    if (form == OPTIONS_RAW) {
+        size_t len = p->hdr_len - p->l3_len - 20;
+        *o++ = (uint8_t)len;
+        memcpy(o, l4 + 20, len);
+        o += len;
+    }
+    memcpy(o, l4 + (p->tcp ? 16 : 6), 2);
+    return o + 2 - out;
+}
+
+static void account(hdrcomp_stats_t *stats, hdrcomp_class_t class, size_t plain, size_t sent) {
+    metric_add(&stats->packets[class], 1);
+    metric_add(&stats->plain_bytes[class], plain);
+    metric_add(&stats->sent_bytes[class], sent);
+}
+
+int hdrcomp_compress(hdrcomp_tx_t *tx, pktbuf_t *pkt, size_t plain_frame, uint8_t *context, hdrcomp_stats_t *stats) {
+    parsed_t p;
+    if (!parse(pkt->data, pkt->len, &p)) {
+        account(stats, HDRCOMP_PLAIN, plain_frame, plain_frame);
+        return 0;
+    }
+    hdrcomp_class_t class = !p.tcp ? HDRCOMP_UDP : p.payload ? HDRCOMP_TCP_DATA : HDRCOMP_TCP_ACK;
+
+    // The flow's context, or the one used longest ago
+    uint8_t key[HDRCOMP_KEY_MAX];
+    size_t key_len = flow_key(pkt->data, &p, key);
+    uint64_t hash = hash_key(key, key_len);
+    hdrcomp_context_t *ctx = NULL, *victim = &tx->contexts[0];
+    tx->clock++;
+    for (int i = 0; i < HDRCOMP_CONTEXTS; i++) {
+        hdrcomp_context_t *c = &tx->contexts[i];
+        if (c->ref.live && c->hash == hash && c->key_len == key_len && memcmp(c->key, key, key_len) == 0) {
+            ctx = c;
+            break;
+        }
+        if (victim->ref.live && (!c->ref.live || tx->clock - c->used > tx->clock - victim->used)) victim = c;
+    }
+    bool restart = !ctx;
+    if (!ctx) {
+        ctx = victim;
+        memcpy(ctx->key, key, key_len);
+        ctx->key_len = (uint8_t)key_len;
+        ctx->hash = hash;
+    }
+    ctx->used = tx->clock;
+
+    hdrcomp_values_t v;
+    values_of(pkt->data, &p, &v);
+    uint8_t co[HDRCOMP_HEADER_MAX];
+    size_t co_len = 0;
+    restart = restart || ctx->resync;
+    bool full = restart || ctx->since_full >= HDRCOMP_REFRESH;
+    if (!full) {
+        co_len = encode(ctx, pkt->data, &p, &v, co);
+        full = co_len >= p.hdr_len;
+    }
+
+    // The header sent becomes the reference. A context set up afresh
+    // starts a new generation and window; other full headers (refreshes)
+    // join the window, so that losing one costs nothing.
+    if (restart) {
+        ctx->ref.gen = (ctx->ref.gen + 1) & 0x0f;
+        ctx->resync = false;
+    }
+    if (full) {
+        ctx->since_full = 0;
+        metric_add(&stats->full, 1);
+    } else {
+        ctx->since_full++;
+    }
+    memcpy(ctx->ref.hdr, pkt->data, p.hdr_len);
+    ctx->ref.hdr_len = (uint8_t)p.hdr_len;
+    ctx->ref.live = true;
+    int first = restart ? 0 : ctx->next, last = restart ? HDRCOMP_WINDOW : ctx->next + 1;
+    for (int i = first; i < last; i++) {
+        for (int f = 0; f < HDRCOMP_LSB_FIELDS; f++) ctx->window_lsb[f][i] = v.lsb[f];
+        for (int f = 0; f < HDRCOMP_RAW_FIELDS; f++) ctx->window_raw[f][i] = v.raw[f];
+    }
+    ctx->next = (ctx->next + 1) % HDRCOMP_WINDOW;
+    *context = (uint8_t)(ctx->ref.gen << 4 | (ctx - tx->contexts));
+
+    if (full) {
+        account(stats, class, plain_frame + p.hdr_len, frame_header_length(FRAME_HC_FULL, *context, pkt->len) + p.hdr_len);
+        return FRAME_HC_FULL;
+    }
+    pkt->data += p.hdr_len - co_len;
+    pkt->len -= p.hdr_len - co_len;
+    memcpy(pkt->data, co, co_len);
+    account(stats, class, plain_frame + p.hdr_len, frame_header_length(FRAME_HC, *context, pkt->len) + co_len);
+    return FRAME_HC;
+}
+
+void hdrcomp_on_resync(hdrcomp_tx_t *tx, uint8_t context, hdrcomp_stats_t *stats) {
+    hdrcomp_context_t *ctx = &tx->contexts[context & 0x0f];
+    // Not if a full header went out since
+    if (!ctx->ref.live || ctx->ref.gen != context >> 4 || ctx->resync) return;
+    ctx->resync = true;
+    metric_add(&stats->resyncs, 1);
+}
+
+void hdrcomp_on_dropped(hdrcomp_tx_t *tx, uint8_t context) {
+    hdrcomp_context_t *ctx = &tx->contexts[context & 0x0f];
+    if (ctx->ref.live && ctx->ref.gen == context >> 4) ctx->resync = true;
+}
+
+int hdrcomp_full(hdrcomp_rx_t *rx, uint8_t context, const uint8_t *ip, size_t len) {
+    parsed_t p;
+    if (!parse(ip, len, &p)) return -1;
+    hdrcomp_ref_t *ref = &rx->contexts[context & 0x0f];
+    memcpy(ref->hdr, ip, p.hdr_len);
+    ref->hdr_len = (uint8_t)p.hdr_len;
+    ref->gen = context >> 4;
+    ref->live = true;
+    rx->resync_due &= ~(1u << (context & 0x0f));
+    return 0;
+}
+
+static size_t request_resync(hdrcomp_rx_t *rx, uint8_t context) {
+    rx->resync_due |= 1u << (context & 0x0f);
+    rx->resync_context[context & 0x0f] = context;
+    return 0;
+}
+
+size_t hdrcomp_decompress(hdrcomp_rx_t *rx, uint8_t context, const uint8_t *data, size_t len, uint8_t *out, size_t size) {
+    hdrcomp_ref_t *ref = &rx->contexts[context & 0x0f];
+    if (!ref->live || ref->gen != context >> 4) return request_resync(rx, context);
+    parsed_t p;
+    parse_ref(ref, &p);
+    hdrcomp_values_t rv;
+    values_of(ref->hdr, &p, &rv);
+    size_t fixed = p.l3_len + (p.tcp ? 20 : 8);
+    if (size < HDRCOMP_HEADER_MAX) return 0;
+
+    const uint8_t *in = data, *end = data + len;
+    if (end - in < (p.tcp ? 4 : 2)) return 0;
+    uint8_t a = *in++, b = p.tcp ? *in++ : 0, flags = p.tcp ? *in++ : 0;
+    uint8_t crc = *in++;
+    unsigned codes[HDRCOMP_LSB_FIELDS] = { a >> 6, b >> 6, (b >> 4) & 3, (a >> 2) & 3, a & 3 };
+    bool raw[HDRCOMP_RAW_FIELDS] = { a >> 5 & 1, a >> 4 & 1, b >> 3 & 1, b >> 2 & 1 };
+    int form = b & 3;
+    if ((p.v6 && codes[IP_ID]) || codes[IP_ID] == 3 || form > OPTIONS_RAW ||
+        (!p.tcp && (a & 0x0f)) || (form != OPTIONS_TIMESTAMPS && (codes[TSVAL] || codes[TSECR]))) return 0;
+
+    // The fields, in the order they were written; what is left out has
+    // the reference's value
+    hdrcomp_values_t v = rv;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        int f = fields[i].field;
+        if (fields[i].tcp && !p.tcp) break;
+        unsigned n = fields[i].raw ? (raw[f] ? raw_bytes[f] : 0) : code_bytes[codes[f]];
+        if ((size_t)(end - in) < n) return 0;
+        if (!fields[i].raw) {
+            v.lsb[f] = lsb_decode(rv.lsb[f], get_be(in, n), 8 * n, lsb_width[f]);
+        } else if (n) {
+            v.raw[f] = (uint16_t)get_be(in, n);
+        }
+        in += n;
+    }
+
+    memcpy(out, ref->hdr, fixed);
+    uint8_t *l4 = out + p.l3_len;
+    size_t hdr_len = fixed;
+    if (p.tcp) {
+        put_be(l4 + 4, v.lsb[SEQ], 4);
+        put_be(l4 + 8, v.lsb[ACK], 4);
+        l4[13] = flags;
+        put_be(l4 + 14, v.raw[WINDOW], 2);
+        put_be(l4 + 18, v.raw[URGENT], 2);
+        if (form == OPTIONS_TIMESTAMPS) {
+            static const uint8_t layout[4] = { 1, 1, 8, 10 };
+            memcpy(l4 + 20, layout, 4);
+            put_be(l4 + 24, v.lsb[TSVAL], 4);
+            put_be(l4 + 28, v.lsb[TSECR], 4);
+            hdr_len += 12;
+        } else if (form == OPTIONS_RAW) {
+            if (in == end || *in > 40 || *in % 4 || (size_t)(end - in) < 1u + *in) return 0;
+            memcpy(l4 + 20, in + 1, *in);
+            hdr_len += *in;
+            in += 1 + *in;
+        }
+        l4[12] = (uint8_t)((hdr_len - p.l3_len) / 4 << 4);
+    }
+    if (end - in < 2) return 0;
+    memcpy(l4 + (p.tcp ? 16 : 6), in, 2);
+    in += 2;
+
+    size_t total = hdr_len + (end - in);
+    if (total > size || total > 0xffff) return 0;
+    if (p.v6) {
+        out[0] = (uint8_t)(0x60 | v.raw[TOS] >> 4);
+        out[1] = (uint8_t)(v.raw[TOS] << 4 | (out[1] & 0x0f));
+        put_be(out + 4, (uint32_t)(total - 40), 2);
+        out[7] = (uint8_t)v.raw[TTL];
+    } else {
+        out[1] = (uint8_t)v.raw[TOS];
+        put_be(out + 2, (uint32_t)total, 2);
+        put_be(out + 4, v.lsb[IP_ID], 2);
+        out[8] = (uint8_t)v.raw[TTL];
+        ipv4_set_csum(out);
+    }
+    if (!p.tcp) put_be(l4 + 4, (uint32_t)(total - p.l3_len), 2);
+
+    // A wrong reference shows here
+    if (crc8(out, hdr_len) != crc) return request_resync(rx, context);
+    memcpy(out + hdr_len, in, end - in);
+    memcpy(ref->hdr, out, hdr_len);
+    ref->hdr_len = (uint8_t)hdr_len;
+    return total;
+}
+
+size_t hdrcomp_take_resync(hdrcomp_rx_t *rx, uint8_t *out, size_t room) {
+    size_t n = 0;
+    for (int i = 0; i < HDRCOMP_CONTEXTS && rx->resync_due; i++) {
+        if (!(rx->resync_due & (1u << i))) continue;
+        if (room - n < FRAME_HC_RESYNC_LEN) break;
+        out[n++] = FRAME_HC_RESYNC;
+        out[n++] = rx->resync_context[i];
+        rx->resync_due &= ~(1u << i);
+    }
+    return n;
+}
+
+double hdrcomp_saved_per_packet(const hdrcomp_stats_t *s, hdrcomp_class_t class) {
+    uint64_t packets = metric_get(&s->packets[class]);
+    if (packets == 0) return 0;
+    return ((double)metric_get(&s->plain_bytes[class]) - (double)metric_get(&s->sent_bytes[class])) / packets;
+}
+
+void hdrcomp_render(FILE *out, const hdrcomp_stats_t *const *sets, const char *const *labels, size_t n) {
+    static const struct {
+        const char *name, *help;
+        size_t offset;
+    } families[] = {
+        { "tunnel_hc_packets_total", "TUN packets sent, by kind", offsetof(hdrcomp_stats_t, packets) },
+        { "tunnel_hc_plain_header_bytes_total", "Frame and IP headers of those packets, uncompressed", offsetof(hdrcomp_stats_t, plain_bytes) },
+        { "tunnel_hc_header_bytes_total", "Frame and IP headers of those packets as sent", offsetof(hdrcomp_stats_t, sent_bytes) },
+    };
+    char buf[128];
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+        metrics_family(out, families[f].name, "counter", families[f].help);
+        for (size_t i = 0; i < n; i++) {
+            const metric_t *counts = (const metric_t *)((const char *)sets[i] + families[f].offset);
+            for (int c = 0; c < HDRCOMP_CLASSES; c++) {
+                snprintf(buf, sizeof(buf), "%s%sclass=\"%s\"", labels[i], *labels[i] ? "," : "", class_names[c]);
+                metrics_sample(out, families[f].name, buf, metric_get(&counts[c]));
+            }
+        }
+    }
+    metrics_family(out, "tunnel_hc_full_headers_total", "counter", "Full headers sent to set up or refresh a context");
+    for (size_t i = 0; i < n; i++) metrics_sample(out, "tunnel_hc_full_headers_total", labels[i], metric_get(&sets[i]->full));
+    metrics_family(out, "tunnel_hc_resyncs_total", "counter", "Full headers the peer asked for");
+    for (size_t i = 0; i < n; i++) metrics_sample(out, "tunnel_hc_resyncs_total", labels[i], metric_get(&sets[i]->resyncs));
+}
@@ -0,0 +1,161 @@
+#ifndef HDRCOMP_H
+#define HDRCOMP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "metrics.h"
+#include "pktbuf.h"
+
+// Compression of the inner TCP/IP and UDP/IP headers, after ROHC
+// (RFC 5795, 6846) but much simpler.
+//
+// The sender keeps a context per inner flow: the last header it sent on
+// it. The first packet of a flow goes whole in a HC_FULL frame, which
+// sets up the same context at the receiver; after that, HC frames carry
+// only what changed:
+//
+//   - addresses, ports, protocol, DF and the IPv6 flow label never do
+//     (a packet where they differ takes over another context),
+//   - lengths and the IPv4 header checksum are worked out again,
+//   - the IP ID, TCP sequence and acknowledgement numbers and TCP
+//     timestamps are sent as their low 0, 1, 2 or 4 bytes (W-LSB
+//     encoding: enough bytes that the receiver finds the right value
+//     whichever of the last HDRCOMP_WINDOW packets it decompressed last,
+//     so up to HDRCOMP_WINDOW - 1 lost in a row cost nothing),
+//   - TTL, TOS, the TCP window and urgent pointer only when one of the
+//     last HDRCOMP_WINDOW packets had another value,
+//   - TCP flags and the TCP/UDP checksum always, as they are.
+//
+// A CRC-8 over the original header goes along, so a header rebuilt
+// wrong (too many losses, a context the receiver never saw) is caught.
+// The receiver drops the packet and asks for a full header with a
+// HC_RESYNC frame; the sender's next packet on that context goes in a
+// HC_FULL frame, as does every HDRCOMP_REFRESH-th. A full header that
+// sets a context up (for a new flow, or when asked for) starts a new
+// generation of it, named in every frame, so packets compressed against
+// a header the receiver missed fail at once; refreshes do not.
+//
+// Frames (see frame.h) name the context in one byte: generation << 4 |
+// index. A compressed header is:
+//
+//   byte 0    : I I L S T T E E   (II = IP ID, TT = TSval, EE = TSecr
+//                                  size codes; L = TTL, S = TOS present)
+//   TCP only  : Q Q A A W U O O   (QQ = sequence, AA = acknowledgement
+//                                  size codes; W = window, U = urgent
+//                                  pointer present; OO = options form)
+//               TCP flags (1)
+//   CRC-8 (1), then the fields present in the order above: TTL, TOS,
+//   IP ID, sequence, acknowledgement, window, urgent pointer, then the
+//   options: nothing, TSval and TSecr (the NOP NOP TS layout), or a
+//   length byte and the options as they are; then the checksum (2) and
+//   the payload.
+//
+// Size codes 0-3 mean 0, 1, 2 and 4 bytes (the IP ID has 2 at most).
+//
+// Only IPv4 without options or fragments and IPv6 without extension
+// headers are compressed; other packets go in STREAM or DATAGRAM frames.
+// A compressor and a decompressor are used under the locks of the
+// direction they serve.
+
+#define HDRCOMP_CONTEXTS 16
+#define HDRCOMP_WINDOW 16           // packets a compressed field is decodable against
+#define HDRCOMP_REFRESH 1024        // packets between full headers
+#define HDRCOMP_HEADER_MAX (40 + 60)
+#define HDRCOMP_KEY_MAX 44
+#define HDRCOMP_LSB_FIELDS 5        // IP ID, seq, ack, TSval, TSecr
+#define HDRCOMP_RAW_FIELDS 4        // TTL, TOS, window, urgent pointer
+
+// Kinds of TUN packet, for the statistics
+typedef enum {
+    HDRCOMP_TCP_ACK,                // TCP without payload
+    HDRCOMP_TCP_DATA,
+    HDRCOMP_UDP,
+    HDRCOMP_PLAIN,                  // not compressible
+    HDRCOMP_CLASSES
+} hdrcomp_class_t;
+
+typedef struct {
+    metric_t packets[HDRCOMP_CLASSES];
+    metric_t plain_bytes[HDRCOMP_CLASSES];   // frame and IP headers, uncompressed
+    metric_t sent_bytes[HDRCOMP_CLASSES];    // the same as sent
+    metric_t full;                  // full headers sent
+    metric_t resyncs;               // full headers the peer asked for
+} hdrcomp_stats_t;
+
+typedef struct {
+    uint32_t lsb[HDRCOMP_LSB_FIELDS];
+    uint16_t raw[HDRCOMP_RAW_FIELDS];
+} hdrcomp_values_t;
+
+typedef struct {
+    uint8_t hdr[HDRCOMP_HEADER_MAX]; // last header sent or rebuilt
+    uint8_t hdr_len;
+    uint8_t gen;
+    bool live;
+} hdrcomp_ref_t;
+
+typedef struct {
+    hdrcomp_ref_t ref;
+    uint8_t key[HDRCOMP_KEY_MAX];   // the flow's fixed fields
+    uint8_t key_len;
+    uint64_t hash;
+    uint32_t used;                  // compressor clock at the last packet
+    uint32_t since_full;
+    bool resync;                    // the peer asked for a full header
+    // The last HDRCOMP_WINDOW values of each field, a field's together;
+    // a new generation fills every slot with its first packet's
+    uint32_t window_lsb[HDRCOMP_LSB_FIELDS][HDRCOMP_WINDOW];
+    uint16_t window_raw[HDRCOMP_RAW_FIELDS][HDRCOMP_WINDOW];
+    uint8_t next;                   // slot the next packet's values go in
+} hdrcomp_context_t;
+
+// Compressor, for one peer
+typedef struct {
+    hdrcomp_context_t contexts[HDRCOMP_CONTEXTS];
+    uint32_t clock;
+} hdrcomp_tx_t;
+
+// Decompressor, for one peer
+typedef struct {
+    hdrcomp_ref_t contexts[HDRCOMP_CONTEXTS];
+    uint16_t resync_due;            // contexts to ask a full header for
+    uint8_t resync_context[HDRCOMP_CONTEXTS];    // as named by the frame that failed
+} hdrcomp_rx_t;
+
+// Compress the headers of pkt in place if it is a TCP or UDP packet.
+// Returns the frame to send it in, FRAME_HC or FRAME_HC_FULL, with its
+// context byte in *context, or 0 to send it as it is in a frame of
+// plain_frame bytes of header (which the statistics compare against).
+int hdrcomp_compress(hdrcomp_tx_t *tx, pktbuf_t *pkt, size_t plain_frame, uint8_t *context, hdrcomp_stats_t *stats);
+
+// The peer asked for a full header on a context (HC_RESYNC frame)
+void hdrcomp_on_resync(hdrcomp_tx_t *tx, uint8_t context, hdrcomp_stats_t *stats);
+
+// A packet compressed on context was dropped before it was sent. Enough
+// of them in a row would leave the peer's reference outside the window,
+// so the next one goes full.
+void hdrcomp_on_dropped(hdrcomp_tx_t *tx, uint8_t context);
+
+// Set up a context from the IP packet of a HC_FULL frame. Returns 0, or
+// -1 if it is not a packet a context can hold.
+int hdrcomp_full(hdrcomp_rx_t *rx, uint8_t context, const uint8_t *ip, size_t len);
+
+// Rebuild the IP packet of a HC frame into out (size bytes). Returns its
+// length, or 0 if it cannot be rebuilt (a full header is asked for) or
+// is malformed.
+size_t hdrcomp_decompress(hdrcomp_rx_t *rx, uint8_t context, const uint8_t *data, size_t len, uint8_t *out, size_t size);
+
+// Write the HC_RESYNC frames due, as many as fit in room. Returns the
+// bytes written.
+size_t hdrcomp_take_resync(hdrcomp_rx_t *rx, uint8_t *out, size_t room);
+
+// Average frame and header bytes saved per packet of a class
+double hdrcomp_saved_per_packet(const hdrcomp_stats_t *s, hdrcomp_class_t class);
+
+// Prometheus families for n sets of statistics, labelled as in
+// metrics_render
+void hdrcomp_render(FILE *out, const hdrcomp_stats_t *const *sets, const char *const *labels, size_t n);
+
+#endif
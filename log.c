@@ -0,0 +1,55 @@
+#include "log.h"
+#include <arpa/inet.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+log_level_t log_level = LOG_LEVEL_INFO;
+
+static const char *const level_names[] = { "error", "warn", "info", "debug" };
+
+int log_level_parse(const char *name, log_level_t *level) {
+    for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *level = (log_level_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void log_write(log_level_t level, const char *fmt, ...) {
+    // stdio locks the stream for the whole call
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(level <= LOG_LEVEL_WARN ? stderr : stdout, fmt, ap);
+    va_end(ap);
+}
+
+bool log_limit_pass(log_limit_t *limit, log_level_t level) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t second = (uint64_t)ts.tv_sec;
+
+    // Racing threads may let a message or two more through; that is fine
+    if (atomic_load_explicit(&limit->second, memory_order_relaxed) != second) {
+        atomic_store_explicit(&limit->second, second, memory_order_relaxed);
+        atomic_store_explicit(&limit->count, 0, memory_order_relaxed);
+    }
+    if (atomic_fetch_add_explicit(&limit->count, 1, memory_order_relaxed) >= LOG_BURST) {
+        atomic_fetch_add_explicit(&limit->suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+    uint64_t suppressed = atomic_exchange_explicit(&limit->suppressed, 0, memory_order_relaxed);
+    if (suppressed > 0) {
+        log_write(level, "(%llu similar messages suppressed)\n", (unsigned long long)suppressed);
+    }
+    return true;
+}
+
+const char *log_format_addr(const struct sockaddr_in *addr, char *buf) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+    snprintf(buf, LOG_ADDR_LEN, "%s:%u", ip, ntohs(addr->sin_port));
+    return buf;
+}
@@ -0,0 +1,72 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Leveled logging. A message below the configured level costs one
+// comparison: its arguments (address formatting included) are not even
+// evaluated. Errors and warnings go to stderr, the rest to stdout, each
+// message in one write so lines from different threads do not mix.
+//
+// Messages that packets can trigger use log_limited, which lets
+// LOG_BURST of them through per second and call site and then counts
+// the rest, so a flood of bad packets cannot turn into a flood of
+// output.
+
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+} log_level_t;
+
+#define LOG_BURST 10    // rate limited messages per second, per call site
+
+// Set once at startup (-L), before any thread starts
+extern log_level_t log_level;
+
+// Parse "error", "warn", "info" or "debug". Returns -1 if unknown.
+int log_level_parse(const char *name, log_level_t *level);
+
+void log_write(log_level_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// State of one rate limited call site
+typedef struct {
+    _Atomic uint64_t second;     // of the current window
+    _Atomic unsigned count;      // messages in it
+    _Atomic uint64_t suppressed; // not printed since the last one that was
+} log_limit_t;
+
+// True if the call site may print now. Reports how many messages it
+// suppressed before letting the next one through.
+bool log_limit_pass(log_limit_t *limit, log_level_t level);
+
+#define log_at(level, ...) do { \
+    if ((level) <= log_level) log_write((level), __VA_ARGS__); \
+} while (0)
+
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// perror() through the log
+#define log_errno(what) log_error("%s: %s\n", (what), strerror(errno))
+
+#define log_limited(level, ...) do { \
+    static log_limit_t log_limit_; \
+    if ((level) <= log_level && log_limit_pass(&log_limit_, (level))) log_write((level), __VA_ARGS__); \
+} while (0)
+
+// "a.b.c.d:port" in a buffer that lives until the end of the enclosing
+// block; unlike inet_ntoa, safe on any thread
+#define LOG_ADDR_LEN 22
+const char *log_format_addr(const struct sockaddr_in *addr, char *buf);
+#define log_addr(addr) log_format_addr((addr), (char[LOG_ADDR_LEN]){0})
+
+#endif
@@ -0,0 +1,197 @@
+#include "metrics.h"
+#include "log.h"
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define LABELS_MAX 128
+#define REQUEST_TIMEOUT_MS 100
+
+void metrics_observe(metrics_hist_t *h, uint64_t ns) {
+    // Bucket i holds durations up to 2^(i + METRICS_MIN_BUCKET_LOG2) ns
+    unsigned log2 = ns <= 1 ? 0 : 64 - __builtin_clzll(ns - 1);
+    unsigned i = log2 > METRICS_MIN_BUCKET_LOG2 ? log2 - METRICS_MIN_BUCKET_LOG2 : 0;
+    if (i < METRICS_BUCKETS) metric_add(&h->buckets[i], 1);
+    metric_add(&h->count, 1);
+    metric_add(&h->sum_ns, ns);
+}
+
+void metrics_family(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_sample(FILE *out, const char *name, const char *labels, uint64_t value) {
+    if (*labels) {
+        fprintf(out, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+    } else {
+        fprintf(out, "%s %llu\n", name, (unsigned long long)value);
+    }
+}
+
+// base and one more label, comma separated
+static const char *with_label(char *buf, size_t size, const char *base, const char *name, const char *value) {
+    snprintf(buf, size, "%s%s%s=\"%s\"", base, *base ? "," : "", name, value);
+    return buf;
+}
+
+static void render_histogram(FILE *out, const char *name, const char *labels, const metrics_hist_t *h) {
+    char with_le[2 * LABELS_MAX];    // labels has one added already
+    uint64_t cumulative = 0;
+    for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += metric_get(&h->buckets[i]);
+        char le[32];
+        snprintf(le, sizeof(le), "%g", (double)(1ULL << (i + METRICS_MIN_BUCKET_LOG2)) / 1e9);
+        fprintf(out, "%s_bucket{%s} %llu\n", name, with_label(with_le, sizeof(with_le), labels, "le", le), (unsigned long long)cumulative);
+    }
+    // Read count last so that it is never below the buckets
+    uint64_t count = metric_get(&h->count);
+    if (count < cumulative) count = cumulative;
+    fprintf(out, "%s_bucket{%s} %llu\n", name, with_label(with_le, sizeof(with_le), labels, "le", "+Inf"), (unsigned long long)count);
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", metric_get(&h->sum_ns) / 1e9);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", (unsigned long long)count);
+}
+
+static const char *const drop_names[METRICS_DROP_REASONS] = {
+    "malformed", "replay", "decrypt", "no_session", "no_route", "source", "no_buffer", "expired", "context",
+};
+
+static const char *const stage_names[METRICS_STAGES] = {
+    "tun_read", "crypt", "send", "recv_to_tun",
+};
+
+// A counter family with one field of metrics_t per set
+#define RENDER_COUNTER(name, help, field) do { \
+    metrics_family(out, name, "counter", help); \
+    for (size_t i = 0; i < n; i++) metrics_sample(out, name, labels[i], metric_get(&sets[i]->field)); \
+} while (0)
+
+// The same for one field of each batch_stats_t, labelled by operation
+#define RENDER_BATCH(name, help, field) do { \
+    static const char *const ops[] = { "recvmmsg", "sendmmsg", "tun_read", "tun_write" }; \
+    metrics_family(out, name, "counter", help); \
+    for (size_t i = 0; i < n; i++) { \
+        const batch_stats_t *b[] = { &sets[i]->rx_batch, &sets[i]->tx_batch, &sets[i]->tun_batch, &sets[i]->tun_write_batch }; \
+        for (size_t op = 0; op < 4; op++) { \
+            metrics_sample(out, name, with_label(buf, sizeof(buf), labels[i], "op", ops[op]), metric_get(&b[op]->field)); \
+        } \
+    } \
+} while (0)
+
+void metrics_render(FILE *out, const metrics_t *const *sets, const char *const *labels, size_t n) {
+    char buf[LABELS_MAX];
+    RENDER_COUNTER("tunnel_rx_packets_total", "Tunnel packets received from peers, handshakes aside", rx_packets);
+    RENDER_COUNTER("tunnel_rx_bytes_total", "UDP payload bytes received from peers", rx_bytes);
+    RENDER_COUNTER("tunnel_tx_packets_total", "Tunnel packets sent to peers, handshakes aside", tx_packets);
+    RENDER_COUNTER("tunnel_tx_bytes_total", "UDP payload bytes sent to peers", tx_bytes);
+    RENDER_COUNTER("tunnel_tun_rx_packets_total", "IP packets read from the TUN device", tun_rx_packets);
+    RENDER_COUNTER("tunnel_tun_rx_bytes_total", "Bytes of IP packets read from the TUN device", tun_rx_bytes);
+    RENDER_COUNTER("tunnel_tun_tx_packets_total", "IP packets written to the TUN device", tun_tx_packets);
+    RENDER_COUNTER("tunnel_tun_tx_bytes_total", "Bytes of IP packets written to the TUN device", tun_tx_bytes);
+
+    metrics_family(out, "tunnel_drops_total", "counter", "Packets dropped, by reason");
+    for (size_t i = 0; i < n; i++) {
+        for (int r = 0; r < METRICS_DROP_REASONS; r++) {
+            metrics_sample(out, "tunnel_drops_total", with_label(buf, sizeof(buf), labels[i], "reason", drop_names[r]), metric_get(&sets[i]->drops[r]));
+        }
+    }
+
+    RENDER_BATCH("tunnel_batch_calls_total", "Batched I/O calls (or TUN wakeups and merged writes)", calls);
+    RENDER_BATCH("tunnel_batch_packets_total", "Packets moved by batched I/O calls", packets);
+    RENDER_BATCH("tunnel_batch_super_buffers_total", "GSO/GRO buffers and TUN super-packets carrying more than one packet", super_buffers);
+    RENDER_BATCH("tunnel_batch_segments_total", "Packets carried in super-buffers", segments);
+
+    metrics_family(out, "tunnel_stage_seconds", "histogram", "Per-packet latency of each data plane stage, sampled");
+    for (size_t i = 0; i < n; i++) {
+        for (int s = 0; s < METRICS_STAGES; s++) {
+            render_histogram(out, "tunnel_stage_seconds", with_label(buf, sizeof(buf), labels[i], "stage", stage_names[s]), &sets[i]->stages[s]);
+        }
+    }
+}
+
+typedef struct {
+    int fd;
+    metrics_render_fn render;
+    void *arg;
+} metrics_server_t;
+
+static void send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        data += n;
+        len -= n;
+    }
+}
+
+static void *serve(void *arg) {
+    metrics_server_t *s = arg;
+    for (;;) {
+        int fd = accept(s->fd, NULL, NULL);
+        if (fd < 0) continue;
+
+        // Whatever the client asks, if anything, it gets the metrics
+        char request[256] = "";
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, REQUEST_TIMEOUT_MS) > 0) {
+            ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+            if (n > 0) request[n] = '\0';
+        }
+
+        char *body = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&body, &len);
+        if (out) {
+            s->render(out, s->arg);
+            fclose(out);
+            if (strncmp(request, "GET ", 4) == 0) {
+                char header[128];
+                int n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+                send_all(fd, header, n);
+            }
+            send_all(fd, body, len);
+            free(body);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(const char *path, metrics_render_fn render, void *arg) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Metrics socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    metrics_server_t *s = calloc(1, sizeof(*s));
+    if (!s) return -1;
+    s->render = render;
+    s->arg = arg;
+    s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s->fd < 0) {
+        log_errno("Metrics socket");
+        free(s);
+        return -1;
+    }
+    unlink(path);
+    pthread_t thread;
+    if (bind(s->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(s->fd, 8) < 0) {
+        log_errno("Metrics socket");
+        close(s->fd);
+        free(s);
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, serve, s) != 0) {
+        log_error("Failed to start the metrics thread\n");
+        close(s->fd);
+        free(s);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
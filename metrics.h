@@ -0,0 +1,116 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Data plane counters and latency histograms, and a Unix socket serving
+// them in the Prometheus text format.
+//
+// Every thread of the data plane owns its counters and is their only
+// writer, so an update is a plain load and store (metric_add), with no
+// locked instruction and no shared cache line. The scraper reads them
+// from its own thread at any time without stopping anyone; atomics keep
+// each value whole.
+//
+// Per-packet latencies are timed on one packet in METRICS_SAMPLE, so the
+// clock is read only for those.
+
+typedef _Atomic uint64_t metric_t;
+
+static inline void metric_add(metric_t *m, uint64_t n) {
+    atomic_store_explicit(m, atomic_load_explicit(m, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline uint64_t metric_get(const metric_t *m) {
+    return atomic_load_explicit(m, memory_order_relaxed);
+}
+
+// Counters used to report the batch size actually achieved
+typedef struct {
+    metric_t calls;
+    metric_t packets;
+    metric_t super_buffers;    // GSO sends / GRO receives carrying >1 packet
+    metric_t segments;         // packets carried in those super-buffers
+} batch_stats_t;
+
+// Why a packet was dropped
+typedef enum {
+    METRICS_DROP_MALFORMED,    // bad header, frame or IP packet
+    METRICS_DROP_REPLAY,       // replayed, stale or duplicate packet number
+    METRICS_DROP_DECRYPT,      // failed authentication
+    METRICS_DROP_NO_SESSION,   // no session or keys for the peer yet
+    METRICS_DROP_NO_ROUTE,     // no peer owns the inner destination
+    METRICS_DROP_SOURCE,       // inner source the peer may not use
+    METRICS_DROP_NO_BUFFER,    // packet buffers or queues full
+    METRICS_DROP_EXPIRED,      // peer went away with packets queued
+    METRICS_DROP_CONTEXT,      // compressed header that could not be rebuilt
+    METRICS_DROP_REASONS
+} metrics_drop_t;
+
+// Stages timed per packet
+typedef enum {
+    METRICS_STAGE_TUN_READ,    // read from TUN until its datagram is queued
+    METRICS_STAGE_CRYPT,       // one AEAD open, or a seal averaged over a batch
+    METRICS_STAGE_SEND,        // one sendmmsg flush
+    METRICS_STAGE_RECV_TO_TUN, // datagram received until its packets are handed to TUN
+    METRICS_STAGES
+} metrics_stage_t;
+
+// Powers of two from 128 ns to about 1 s
+#define METRICS_BUCKETS 24
+#define METRICS_MIN_BUCKET_LOG2 7
+#define METRICS_SAMPLE 16      // packets per timed one
+
+typedef struct {
+    metric_t buckets[METRICS_BUCKETS];  // not cumulative; longer ones only in count
+    metric_t count;
+    metric_t sum_ns;
+} metrics_hist_t;
+
+typedef struct {
+    metric_t rx_packets, rx_bytes;          // tunnel packets from peers
+    metric_t tx_packets, tx_bytes;          // tunnel packets sent to peers
+    metric_t tun_rx_packets, tun_rx_bytes;  // IP packets read from TUN
+    metric_t tun_tx_packets, tun_tx_bytes;  // IP packets written to TUN
+    metric_t drops[METRICS_DROP_REASONS];
+    batch_stats_t rx_batch, tx_batch;       // recvmmsg, sendmmsg
+    batch_stats_t tun_batch, tun_write_batch;
+    metrics_hist_t stages[METRICS_STAGES];
+    unsigned sample;                        // packets since the last timed one
+} metrics_t;
+
+void metrics_observe(metrics_hist_t *h, uint64_t ns);
+
+static inline void metrics_drop(metrics_t *m, metrics_drop_t reason) {
+    metric_add(&m->drops[reason], 1);
+}
+
+// True for one packet in METRICS_SAMPLE, the one to time
+static inline bool metrics_timed(metrics_t *m) {
+    if (++m->sample < METRICS_SAMPLE) return false;
+    m->sample = 0;
+    return true;
+}
+
+// Prometheus text output. A family's HELP and TYPE lines come first,
+// then every sample of it. labels is "" or like `worker="0"`.
+void metrics_family(FILE *out, const char *name, const char *type, const char *help);
+void metrics_sample(FILE *out, const char *name, const char *labels, uint64_t value);
+
+// Every family of metrics_t, with one sample per set (labels[i] for sets[i])
+void metrics_render(FILE *out, const metrics_t *const *sets, const char *const *labels, size_t n);
+
+typedef void (*metrics_render_fn)(FILE *out, void *arg);
+
+// Answer every connection to a Unix stream socket at path with what
+// render writes, from a thread of its own: as an HTTP response if the
+// request looks like one (curl --unix-socket), otherwise as is. An old
+// socket file at path is replaced. Returns -1 if the socket cannot be
+// set up.
+int metrics_serve(const char *path, metrics_render_fn render, void *arg);
+
+#endif
@@ -0,0 +1,521 @@
+#include "multipath.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "packet.h"
+
+#define REORDER_MASK (MP_REORDER_SLOTS - 1)
+
+void mp_init(mp_t *mp, const congestion_ops_t *cc, mp_scheduler_t scheduler) {
+    memset(mp, 0, sizeof(*mp));
+    mp->cc = cc;
+    mp->scheduler = scheduler;
+}
+
+void mp_free(mp_t *mp) {
+    for (unsigned i = 0; i < mp->count; i++) {
+        recovery_free(&mp->paths[i].recovery);
+    }
+    mp->count = 0;
+}
+
+int mp_path_open(mp_t *mp, unsigned i, const struct sockaddr_in *addr, size_t max_datagram) {
+    mp_path_t *p = &mp->paths[i];
+    if (p->state == MP_PATH_UNUSED) {
+        pmtud_init(&p->pmtud, max_datagram);
+        if (recovery_init(&p->recovery, mp->cc, p->pmtud.plpmtu) != 0) return -1;
+        p->last_sent_ns = 0;
+        p->credit = 0;
+    }
+    p->addr = *addr;
+    p->state = i == 0 ? MP_PATH_ACTIVE : MP_PATH_PROBING;
+    if (i >= mp->count) mp->count = i + 1;
+    return 0;
+}
+
+void mp_path_reset(mp_t *mp, unsigned i, size_t max_datagram) {
+    mp_path_t *p = &mp->paths[i];
+    recovery_reset(&p->recovery, PMTUD_BASE);
+    pmtud_init(&p->pmtud, max_datagram);
+    p->credit = 0;
+}
+
+void mp_path_close(mp_t *mp, unsigned i) {
+    mp_path_t *p = &mp->paths[i];
+    recovery_free(&p->recovery);
+    p->state = MP_PATH_UNUSED;
+}
+
+void mp_new_session(mp_t *mp) {
+    for (unsigned i = 0; i < mp->count; i++) {
+        mp_path_t *p = &mp->paths[i];
+        if (p->state == MP_PATH_UNUSED) continue;
+        recovery_reset(&p->recovery, p->pmtud.plpmtu);
+        pmtud_new_session(&p->pmtud);
+        p->state = i == 0 ? MP_PATH_ACTIVE : MP_PATH_PROBING;
+        p->last_sent_ns = 0;
+        p->credit = 0;
+    }
+}
+
+unsigned mp_active(const mp_t *mp) {
+    unsigned n = 0;
+    for (unsigned i = 0; i < mp->count; i++) {
+        if (mp->paths[i].state == MP_PATH_ACTIVE) n++;
+    }
+    return n;
+}
+
+static unsigned open_paths(const mp_t *mp) {
+    unsigned n = 0;
+    for (unsigned i = 0; i < mp->count; i++) {
+        if (mp->paths[i].state != MP_PATH_UNUSED) n++;
+    }
+    return n;
+}
+
+// A path's RTT for scheduling: until it has a sample, the initial RTT
+static uint64_t path_rtt(const mp_path_t *p) {
+    return p->recovery.has_rtt ? p->recovery.smoothed_rtt_ns : RECOVERY_INITIAL_RTT_NS;
+}
+
+// Its share under wrr: the rate its window allows, in bytes per ns
+static double path_weight(const mp_path_t *p) {
+    return (double)p->recovery.cc.cwnd / path_rtt(p);
+}
+
+mp_path_t *mp_select(mp_t *mp, size_t size, uint64_t now_ns, uint64_t *retry_ns) {
+    double total = 0;
+    for (unsigned i = 0; i < mp->count; i++) {
+        if (mp->paths[i].state == MP_PATH_ACTIVE) total += path_weight(&mp->paths[i]);
+    }
+
+    // Try the paths in the scheduler's order of preference until one's
+    // window and pacer let the datagram go
+    unsigned tried = 0;
+    uint64_t retry = 0;
+    for (;;) {
+        int best = -1;
+        for (unsigned i = 0; i < mp->count; i++) {
+            const mp_path_t *p = &mp->paths[i];
+            if (p->state != MP_PATH_ACTIVE || (tried & 1u << i)) continue;
+            if (best < 0) {
+                best = i;
+            } else if (mp->scheduler == MP_WRR) {
+                const mp_path_t *b = &mp->paths[best];
+                if (p->credit + path_weight(p) > b->credit + path_weight(b)) best = i;
+            } else if (path_rtt(p) < path_rtt(&mp->paths[best])) {
+                best = i;
+            }
+        }
+        if (best < 0) break;
+        tried |= 1u << best;
+
+        mp_path_t *p = &mp->paths[best];
+        uint64_t path_retry;
+        if (recovery_can_send(&p->recovery, size, now_ns, &path_retry)) {
+            // Smooth weighted round robin: every path earns its weight,
+            // the one that sends pays for all of them
+            if (mp->scheduler == MP_WRR) {
+                for (unsigned i = 0; i < mp->count; i++) {
+                    if (mp->paths[i].state == MP_PATH_ACTIVE) mp->paths[i].credit += path_weight(&mp->paths[i]);
+                }
+                p->credit -= total;
+            }
+            return p;
+        }
+        if (retry == 0 || path_retry < retry) retry = path_retry;
+    }
+    *retry_ns = retry;
+    return NULL;
+}
+
+mp_path_t *mp_fastest(mp_t *mp) {
+    mp_path_t *best = NULL;
+    for (unsigned i = 0; i < mp->count; i++) {
+        mp_path_t *p = &mp->paths[i];
+        if (p->state != MP_PATH_ACTIVE) continue;
+        if (!best || path_rtt(p) < path_rtt(best)) best = p;
+    }
+    return best ? best : &mp->paths[0];
+}
+
+mp_path_t *mp_ack_path(mp_t *mp, unsigned i) {
+    return i < mp->count && mp->paths[i].state == MP_PATH_ACTIVE ? &mp->paths[i] : mp_fastest(mp);
+}
+
+void mp_on_sent(mp_path_t *p, uint64_t pn, size_t size, uint64_t now_ns, bool ack_eliciting) {
+    recovery_on_sent(&p->recovery, pn, size, now_ns, ack_eliciting);
+    if (ack_eliciting) p->last_sent_ns = now_ns;
+}
+
+unsigned mp_on_ack(mp_t *mp, const ack_frame_t *ack, uint64_t now_ns, bool *mtu_changed) {
+    unsigned up = 0;
+    for (unsigned i = 0; i < mp->count; i++) {
+        mp_path_t *p = &mp->paths[i];
+        if (p->state == MP_PATH_UNUSED) continue;
+        uint64_t acked = p->recovery.acked_packets;
+        recovery_on_ack(&p->recovery, ack, now_ns);
+        if (pmtud_on_ack(&p->pmtud, ack, now_ns)) *mtu_changed = true;
+        if (p->recovery.acked_packets != acked && p->state != MP_PATH_ACTIVE) {
+            p->state = MP_PATH_ACTIVE;
+            p->credit = 0;
+            up |= 1u << i;
+        }
+    }
+    return up;
+}
+
+bool mp_path_down(mp_t *mp, unsigned i) {
+    mp_path_t *p = &mp->paths[i];
+    if (p->state != MP_PATH_ACTIVE || mp_active(mp) < 2) return false;
+    p->state = MP_PATH_DOWN;
+    p->failovers++;
+    // What was in flight on it is gone, and its window and RTT tell
+    // nothing about the path that answers next
+    recovery_reset(&p->recovery, p->pmtud.plpmtu);
+    pmtud_new_session(&p->pmtud);
+    p->last_sent_ns = 0;
+    p->credit = 0;
+    return true;
+}
+
+// When the oldest packet in flight on path i was sent, if nothing was
+// acknowledged on it since, else 0
+static uint64_t unanswered_since(const mp_path_t *p) {
+    uint64_t sent_ns = recovery_oldest_sent_ns(&p->recovery);
+    return sent_ns && p->recovery.last_ack_ns <= sent_ns ? sent_ns : 0;
+}
+
+// When path i, in use, is to be taken out: MP_FAILURE_PTOS probe
+// timeouts after its oldest packet in flight, if nothing was
+// acknowledged on it since but something on another path (the peer is
+// there, the path is not). 0 if it is not, or not yet known to be.
+static uint64_t failure_due(const mp_t *mp, unsigned i) {
+    const mp_path_t *p = &mp->paths[i];
+    uint64_t sent_ns = unanswered_since(p);
+    if (!sent_ns) return 0;
+    for (unsigned j = 0; j < mp->count; j++) {
+        const mp_path_t *q = &mp->paths[j];
+        if (j != i && q->state == MP_PATH_ACTIVE && q->recovery.last_ack_ns > sent_ns) {
+            return sent_ns + MP_FAILURE_PTOS * recovery_pto(&p->recovery);
+        }
+    }
+    return 0;
+}
+
+// When the paths in use other than i that sent nothing to be
+// acknowledged since path i went quiet are to be PINGed, so that one
+// answers for the peer: a probe timeout after its oldest packet in
+// flight. 0 if none is.
+static uint64_t others_ping_due(const mp_t *mp, unsigned i) {
+    const mp_path_t *p = &mp->paths[i];
+    uint64_t sent_ns = unanswered_since(p);
+    if (!sent_ns) return 0;
+    for (unsigned j = 0; j < mp->count; j++) {
+        const mp_path_t *q = &mp->paths[j];
+        if (j != i && q->state == MP_PATH_ACTIVE && q->last_sent_ns < sent_ns) {
+            return sent_ns + recovery_pto(&p->recovery);
+        }
+    }
+    return 0;
+}
+
+unsigned mp_check(mp_t *mp, uint64_t now_ns) {
+    // Failures first: the persistent congestion timeout, due as soon,
+    // would take the packet that shows it out of flight
+    unsigned down = 0;
+    for (unsigned i = 0; i < mp->count; i++) {
+        if (mp->paths[i].state != MP_PATH_ACTIVE) continue;
+        uint64_t due = failure_due(mp, i);
+        if (due && now_ns >= due && mp_path_down(mp, i)) down |= 1u << i;
+    }
+
+    for (unsigned i = 0; i < mp->count; i++) {
+        if (mp->paths[i].state != MP_PATH_UNUSED) recovery_on_timeout(&mp->paths[i].recovery, now_ns);
+    }
+    return down;
+}
+
+unsigned mp_pings_due(const mp_t *mp, uint64_t now_ns) {
+    bool several = open_paths(mp) > 1;
+    unsigned due = 0;
+    for (unsigned i = 0; i < mp->count; i++) {
+        const mp_path_t *p = &mp->paths[i];
+        if (p->state == MP_PATH_UNUSED) continue;
+        uint64_t interval = p->state == MP_PATH_ACTIVE ? MP_IDLE_NS : MP_PROBE_NS;
+        if ((p->state != MP_PATH_ACTIVE || several) && now_ns - p->last_sent_ns >= interval) due |= 1u << i;
+        // A path in use went quiet: ask the others whether the peer is
+        // still there, rather than wait for their idle PINGs
+        uint64_t quiet = p->state == MP_PATH_ACTIVE ? others_ping_due(mp, i) : 0;
+        if (quiet && now_ns >= quiet) {
+            uint64_t sent_ns = unanswered_since(p);
+            for (unsigned j = 0; j < mp->count; j++) {
+                const mp_path_t *q = &mp->paths[j];
+                if (j != i && q->state == MP_PATH_ACTIVE && q->last_sent_ns < sent_ns) due |= 1u << j;
+            }
+        }
+    }
+    return due;
+}
+
+static void earliest(uint64_t *due, uint64_t t) {
+    if (t && (*due == 0 || t < *due)) *due = t;
+}
+
+uint64_t mp_next_due(const mp_t *mp) {
+    bool several = open_paths(mp) > 1;
+    uint64_t due = 0;
+    for (unsigned i = 0; i < mp->count; i++) {
+        const mp_path_t *p = &mp->paths[i];
+        if (p->state == MP_PATH_UNUSED) continue;
+        earliest(&due, recovery_timeout_ns(&p->recovery));
+        if (p->state == MP_PATH_ACTIVE) {
+            earliest(&due, pmtud_next_due(&p->pmtud, &p->recovery));
+            earliest(&due, failure_due(mp, i));
+            earliest(&due, others_ping_due(mp, i));
+            if (several) earliest(&due, p->last_sent_ns + MP_IDLE_NS);
+        } else {
+            earliest(&due, p->last_sent_ns + MP_PROBE_NS);
+        }
+    }
+    return due;
+}
+
+size_t mp_pn_length(const mp_t *mp, uint64_t pn) {
+    // The peer has seen at least the largest packet any path had acknowledged
+    uint64_t largest = 0;
+    for (unsigned i = 0; i < mp->count; i++) {
+        if (mp->paths[i].recovery.largest_acked > largest) largest = mp->paths[i].recovery.largest_acked;
+    }
+    // but a packet on a slow path is overtaken by all those a faster one
+    // sends meanwhile, and decoded against the newest of them: more than
+    // one byte covers
+    size_t len = packet_pn_length(pn, largest);
+    return len < MP_MIN_PN_LEN && open_paths(mp) > 1 ? MP_MIN_PN_LEN : len;
+}
+
+size_t mp_mtu(const mp_t *mp) {
+    size_t mtu = 0;
+    for (unsigned i = 0; i < mp->count; i++) {
+        const mp_path_t *p = &mp->paths[i];
+        if (p->state == MP_PATH_ACTIVE && (mtu == 0 || p->pmtud.plpmtu < mtu)) mtu = p->pmtud.plpmtu;
+    }
+    return mtu ? mtu : mp->paths[0].pmtud.plpmtu;
+}
+
+bool mp_mtu_confirmed(const mp_t *mp) {
+    for (unsigned i = 0; i < mp->count; i++) {
+        const mp_path_t *p = &mp->paths[i];
+        if (p->state == MP_PATH_ACTIVE && p->pmtud.state != PMTUD_COMPLETE) return false;
+    }
+    return true;
+}
+
+uint64_t mp_rtt(const mp_t *mp) {
+    return mp_fastest((mp_t *)mp)->recovery.smoothed_rtt_ns;
+}
+
+int mp_scheduler_parse(const char *name, mp_scheduler_t *scheduler) {
+    if (strcmp(name, "minrtt") == 0) {
+        *scheduler = MP_MINRTT;
+    } else if (strcmp(name, "wrr") == 0) {
+        *scheduler = MP_WRR;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *mp_scheduler_name(mp_scheduler_t scheduler) {
+    return scheduler == MP_WRR ? "wrr" : "minrtt";
+}
+
+void mp_render(FILE *out, const mp_t *mp, const char *labels) {
+    static const struct {
+        const char *name, *type, *help;
+    } families[] = {
+        { "tunnel_path_up", "gauge", "1 while the path is in use" },
+        { "tunnel_path_srtt_microseconds", "gauge", "Smoothed RTT of the path" },
+        { "tunnel_path_cwnd_bytes", "gauge", "Congestion window of the path" },
+        { "tunnel_path_mtu_bytes", "gauge", "Datagram size the path is known to carry" },
+        { "tunnel_path_sent_packets_total", "counter", "Ack-eliciting packets sent on the path" },
+        { "tunnel_path_lost_packets_total", "counter", "Packets declared lost on the path" },
+        { "tunnel_path_failovers_total", "counter", "Times the path was taken out of use" },
+    };
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+        metrics_family(out, families[f].name, families[f].type, families[f].help);
+        for (unsigned i = 0; i < mp->count; i++) {
+            const mp_path_t *p = &mp->paths[i];
+            if (p->state == MP_PATH_UNUSED) continue;
+            const recovery_t *r = &p->recovery;
+            uint64_t values[] = {
+                p->state == MP_PATH_ACTIVE, r->smoothed_rtt_ns / 1000, r->cc.cwnd, p->pmtud.plpmtu,
+                r->sent_packets, r->lost_packets, p->failovers,
+            };
+            char label[64];
+            snprintf(label, sizeof(label), "%s%spath=\"%u\"", labels, *labels ? "," : "", i);
+            metrics_sample(out, families[f].name, label, values[f]);
+        }
+    }
+}
+
+mp_reorder_t *mp_reorder_new(size_t max_payload) {
+    mp_reorder_t *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    r->data = malloc(MP_REORDER_SLOTS * max_payload);
+    if (!r->data) {
+        free(r);
+        return NULL;
+    }
+    r->max_payload = max_payload;
+    return r;
+}
+
+void mp_reorder_reset(mp_reorder_t *r) {
+    uint8_t *data = r->data;
+    size_t max_payload = r->max_payload;
+    memset(r, 0, sizeof(*r));
+    r->data = data;
+    r->max_payload = max_payload;
+}
+
+void mp_reorder_free(mp_reorder_t *r) {
+    if (!r) return;
+    free(r->data);
+    free(r);
+}
+
+// Packets came on more than one path lately
+static bool reordering(const mp_reorder_t *r, uint64_t now_ns) {
+    unsigned n = 0;
+    for (unsigned i = 0; i < MP_MAX_PATHS; i++) {
+        if (r->seen_ns[i] && now_ns - r->seen_ns[i] < MP_REORDER_ACTIVE_NS) n++;
+    }
+    return n > 1;
+}
+
+// A packet that filled a gap (or missed it) was this late relative to
+// the one waiting for it: the skew rises at once, and decays slowly
+static void measure_skew(mp_reorder_t *r, uint64_t late_ns) {
+    if (late_ns > r->skew_ns) {
+        r->skew_ns = late_ns;
+    } else {
+        r->skew_ns = (15 * r->skew_ns + late_ns) / 16;
+    }
+    uint64_t hold = r->skew_ns + r->skew_ns / 2;
+    if (hold < MP_REORDER_MIN_HOLD_NS) hold = MP_REORDER_MIN_HOLD_NS;
+    if (hold > MP_REORDER_MAX_HOLD_NS) hold = MP_REORDER_MAX_HOLD_NS;
+    r->hold_ns = hold;
+}
+
+// Arrival of the first packet held after next, 0 if none is
+static uint64_t first_held_ns(const mp_reorder_t *r) {
+    for (uint64_t pn = r->next + 1; pn < r->next + MP_REORDER_SLOTS; pn++) {
+        if (r->slots[pn & REORDER_MASK].pn == pn + 1) return r->slots[pn & REORDER_MASK].arrival_ns;
+    }
+    return 0;
+}
+
+static bool has_data(const uint8_t *payload, size_t len) {
+    size_t off = 0;
+    frame_t frame;
+    while (frame_next((uint8_t *)payload, len, &off, &frame) > 0) {
+        if (frame.type == FRAME_STREAM || frame.type == FRAME_DATAGRAM || frame.type == FRAME_HC || frame.type == FRAME_HC_FULL) return true;
+    }
+    return false;
+}
+
+bool mp_reorder_hold(mp_reorder_t *r, unsigned path, uint64_t pn, const uint8_t *payload, size_t len, uint64_t now_ns, mp_reorder_stats_t *stats) {
+    if (path < MP_MAX_PATHS) r->seen_ns[path] = now_ns;
+    if (r->hold_ns == 0) r->hold_ns = MP_REORDER_MIN_HOLD_NS;
+
+    if (pn < r->next) {
+        // Its gap was given up on; the hold time was too short
+        if (r->skip_ns) measure_skew(r, r->hold_ns + (now_ns - r->skip_ns));
+        metric_add(&stats->late, 1);
+        return false;
+    }
+    if (r->count == 0 && (pn == r->next || !reordering(r, now_ns))) {
+        r->next = pn + 1;
+        return false;
+    }
+    if (pn == r->next) {
+        // Fills the gap the held packets wait for; they follow it
+        measure_skew(r, now_ns - first_held_ns(r));
+        r->next = pn + 1;
+        return false;
+    }
+    if (pn - r->next >= MP_REORDER_SLOTS) {
+        // Too far ahead to hold: give up what is missing below the window
+        r->skip_to = pn - MP_REORDER_SLOTS + 1;
+        return false;
+    }
+
+    size_t held = 0;
+    if (has_data(payload, len)) {
+        if (len > r->max_payload) return false;
+        memcpy(r->data + (pn & REORDER_MASK) * r->max_payload, payload, len);
+        held = len;
+        metric_add(&stats->held, 1);
+    }
+    r->slots[pn & REORDER_MASK].pn = pn + 1;
+    r->slots[pn & REORDER_MASK].len = held;
+    r->slots[pn & REORDER_MASK].arrival_ns = now_ns;
+    r->count++;
+    return true;
+}
+
+size_t mp_reorder_pop(mp_reorder_t *r, uint64_t now_ns, uint64_t *pn, uint8_t *out, size_t size, mp_reorder_stats_t *stats) {
+    uint64_t waiting_ns = 0;    // arrival of the packet after the gap
+    while (r->count > 0) {
+        uint64_t next = r->next;
+        if (r->slots[next & REORDER_MASK].pn == next + 1) {
+            size_t len = r->slots[next & REORDER_MASK].len;
+            r->slots[next & REORDER_MASK].pn = 0;
+            r->count--;
+            r->next++;
+            waiting_ns = 0;
+            if (len > 0 && len <= size) {
+                memcpy(out, r->data + (next & REORDER_MASK) * r->max_payload, len);
+                *pn = next;
+                return len;
+            }
+            continue;
+        }
+        // A gap: wait for it until the packet after it has waited hold_ns
+        if (!waiting_ns) waiting_ns = first_held_ns(r);
+        if (next >= r->skip_to && now_ns - waiting_ns < r->hold_ns) return 0;
+        r->next++;
+        r->skip_ns = now_ns;
+        metric_add(&stats->gaps_skipped, 1);
+    }
+    if (r->skip_to > r->next) {
+        metric_add(&stats->gaps_skipped, r->skip_to - r->next);
+        r->next = r->skip_to;
+    }
+    return 0;
+}
+
+uint64_t mp_reorder_due(const mp_reorder_t *r) {
+    if (r->count == 0) return 0;
+    return first_held_ns(r) + r->hold_ns;
+}
+
+void mp_reorder_render(FILE *out, const mp_reorder_stats_t *const *sets, const char *const *labels, size_t n) {
+    static const struct {
+        const char *name, *help;
+        size_t offset;
+    } families[] = {
+        { "tunnel_reorder_held_total", "Packets held for an earlier one that took another path", offsetof(mp_reorder_stats_t, held) },
+        { "tunnel_reorder_gaps_skipped_total", "Missing packets given up on after the hold time", offsetof(mp_reorder_stats_t, gaps_skipped) },
+        { "tunnel_reorder_late_total", "Packets that arrived after their gap was given up on", offsetof(mp_reorder_stats_t, late) },
+    };
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+        metrics_family(out, families[f].name, "counter", families[f].help);
+        for (size_t i = 0; i < n; i++) {
+            const metric_t *m = (const metric_t *)((const char *)sets[i] + families[f].offset);
+            metrics_sample(out, families[f].name, labels[i], metric_get(m));
+        }
+    }
+}
@@ -0,0 +1,241 @@
+#ifndef MULTIPATH_H
+#define MULTIPATH_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "congestion.h"
+#include "frame.h"
+#include "metrics.h"
+#include "pmtud.h"
+#include "recovery.h"
+
+// Several paths between a client and the server, used at once: a client
+// with two uplinks (or two source addresses, or two server addresses)
+// gets the throughput of both, and keeps going on one when the other
+// fails.
+//
+// A path is a socket of the client and the address it reaches the server
+// at. The client numbers its paths and puts an MP_PATH frame naming the
+// path in every packet it sends on one other than the first; the server
+// validates a new one with a PATH_CHALLENGE, as for a migration, and
+// replies to each path at the address it last saw there. Both ends keep
+// one packet number space and one replay window for the session, but
+// loss recovery, congestion control and PMTUD per path: every ACK is
+// offered to every path, which takes the packet numbers it sent.
+//
+// Each datagram goes on the path the scheduler picks among those whose
+// window and pacer allow it:
+//
+//  minrtt  the one with the lowest smoothed RTT, so the others only take
+//          what it cannot (the default)
+//  wrr     smooth weighted round robin, by each path's cwnd / srtt
+//
+// ACKs go back on the path the last packet that asked for one came on,
+// so that a path which failed both ways does not swallow them; other
+// control packets go on the fastest path.
+//
+// A path is taken out of use once its oldest packet in flight has gone
+// MP_FAILURE_PTOS probe timeouts (persistent congestion, as recovery.c
+// has it) without an ACK on it while another path was acknowledged
+// after it was sent: the peer is alive, this path is not. Once it has
+// gone one probe timeout so, the other paths get a PING to find that
+// out. Its congestion state starts over and it is probed with a PING
+// every MP_PROBE_NS until one is acknowledged; so are new paths. Idle
+// paths get a PING every MP_IDLE_NS, so that a failure is noticed before
+// traffic is put on them. The last path in use is never taken out.
+//
+// Packets that took different paths arrive out of order. A receiver that
+// sees packets on more than one path puts their data frames through a
+// reorder buffer (mp_reorder_t), which holds what arrives after a gap
+// until the gap is filled or the first packet after it has waited the
+// hold time. The hold time follows the skew between the paths: how late
+// the packets that filled gaps were, with a fast rise and a slow decay.
+// A packet later still is delivered at once. A gap from a lost packet
+// costs the hold time; FEC rebuilds are delivered at once. Held payloads
+// are copied into the buffer's own memory, so it may be freed on any
+// thread.
+//
+// The paths of a session are used under its send lock (the server's
+// tx_lock), the reorder buffer under its receive lock.
+
+#define MP_MAX_PATHS 4
+#define MP_PROBE_NS 250000000ULL             // PING on a path not in use
+#define MP_IDLE_NS 1000000000ULL             // PING on an idle path in use
+#define MP_FAILURE_PTOS 3                    // probe timeouts without an ACK that take a path out
+#define MP_MIN_PN_LEN 2                      // packet number bytes with several paths open
+#define MP_REORDER_SLOTS 1024                // packet numbers held at most (power of two)
+#define MP_REORDER_MIN_HOLD_NS 2000000ULL
+#define MP_REORDER_MAX_HOLD_NS 100000000ULL
+#define MP_REORDER_ACTIVE_NS 1000000000ULL   // reorder while several paths were seen this recently
+
+typedef enum {
+    MP_PATH_UNUSED,
+    MP_PATH_PROBING,             // opened, nothing acknowledged on it yet
+    MP_PATH_ACTIVE,
+    MP_PATH_DOWN,                // failed, probed until it answers
+} mp_path_state_t;
+
+typedef enum {
+    MP_MINRTT,
+    MP_WRR,
+} mp_scheduler_t;
+
+typedef struct {
+    mp_path_state_t state;
+    struct sockaddr_in addr;     // the peer on this path
+    recovery_t recovery;
+    pmtud_t pmtud;
+    uint64_t last_sent_ns;       // last ack-eliciting packet
+    double credit;               // wrr
+    uint64_t failovers;          // times it was taken out of use
+} mp_path_t;
+
+typedef struct {
+    mp_path_t paths[MP_MAX_PATHS];
+    unsigned count;              // paths below this index may be open
+    mp_scheduler_t scheduler;
+    const congestion_ops_t *cc;
+} mp_t;
+
+typedef struct {
+    metric_t held;               // packets held for an earlier one
+    metric_t gaps_skipped;       // packet numbers given up on
+    metric_t late;               // packets that came after their gap was given up
+} mp_reorder_stats_t;
+
+typedef struct {
+    struct {
+        uint64_t pn;             // packet number + 1, 0 if empty
+        size_t len;              // of its payload, 0 if it has no data frames
+        uint64_t arrival_ns;
+    } slots[MP_REORDER_SLOTS];
+    uint8_t *data;               // max_payload bytes per slot
+    size_t max_payload;
+    uint64_t next;               // next packet number to deliver
+    uint64_t skip_to;            // gaps below this are given up at once
+    unsigned count;              // slots in use
+    uint64_t seen_ns[MP_MAX_PATHS];  // last packet on each path
+    uint64_t skip_ns;            // when a gap was last given up
+    uint64_t skew_ns;            // as measured
+    uint64_t hold_ns;
+} mp_reorder_t;
+
+void mp_init(mp_t *mp, const congestion_ops_t *cc, mp_scheduler_t scheduler);
+void mp_free(mp_t *mp);
+
+// Open path i to addr, for datagrams of up to max_datagram bytes. The
+// first path starts in use, the others once a PING on them is
+// acknowledged. Returns -1 if out of memory.
+int mp_path_open(mp_t *mp, unsigned i, const struct sockaddr_in *addr, size_t max_datagram);
+
+// Path i now leads somewhere else (a new peer host): start its loss
+// recovery and PMTUD over
+void mp_path_reset(mp_t *mp, unsigned i, size_t max_datagram);
+
+// Stop using path i until it is opened again
+void mp_path_close(mp_t *mp, unsigned i);
+
+// Packet numbers start over (a new session): nothing is in flight, and
+// only the first path is in use until the others answer again
+void mp_new_session(mp_t *mp);
+
+static inline bool mp_path_open_at(const mp_t *mp, unsigned i) {
+    return i < mp->count && mp->paths[i].state != MP_PATH_UNUSED;
+}
+
+// The path for a datagram of size bytes, by the scheduler, or NULL if
+// every path's window or pacer holds it back; *retry_ns then says when
+// to try again
+mp_path_t *mp_select(mp_t *mp, size_t size, uint64_t now_ns, uint64_t *retry_ns);
+
+// The path in use with the lowest RTT, for control packets
+mp_path_t *mp_fastest(mp_t *mp);
+
+// The path for an ACK, when the last ack-eliciting packet came on path i
+mp_path_t *mp_ack_path(mp_t *mp, unsigned i);
+
+// Record packet pn sent on p (see recovery_on_sent)
+void mp_on_sent(mp_path_t *p, uint64_t pn, size_t size, uint64_t now_ns, bool ack_eliciting);
+
+// Process an ACK frame on every path. Returns a mask of the paths it
+// brought into use; *mtu_changed is set if it confirmed a PMTUD probe.
+unsigned mp_on_ack(mp_t *mp, const ack_frame_t *ack, uint64_t now_ns, bool *mtu_changed);
+
+// Run loss detection timeouts, and take failed paths out of use.
+// Returns a mask of those taken out now.
+unsigned mp_check(mp_t *mp, uint64_t now_ns);
+
+// Take path i out of use: sends on it fail locally (its interface or
+// address went away). Returns false if it is the last path in use,
+// which stays.
+bool mp_path_down(mp_t *mp, unsigned i);
+
+// Paths to send a PING on now, as a mask (see mp_on_sent: they are
+// ack-eliciting)
+unsigned mp_pings_due(const mp_t *mp, uint64_t now_ns);
+
+// When mp_check, mp_pings_due or PMTUD next need a look, 0 if never
+uint64_t mp_next_due(const mp_t *mp);
+
+// Bytes of packet number the peer needs to reconstruct pn
+size_t mp_pn_length(const mp_t *mp, uint64_t pn);
+
+// Largest datagram every path in use carries, and whether all their
+// searches completed
+size_t mp_mtu(const mp_t *mp);
+bool mp_mtu_confirmed(const mp_t *mp);
+
+// Smoothed RTT of the fastest path
+uint64_t mp_rtt(const mp_t *mp);
+
+// Paths in use
+unsigned mp_active(const mp_t *mp);
+
+// The path a decrypted payload names in its MP_PATH frame, 0 if none
+static inline unsigned mp_packet_path(const uint8_t *payload, size_t len) {
+    size_t off = len > 0 && payload[0] == FRAME_FEC_SOURCE ? FRAME_FEC_SOURCE_LEN : 0;
+    if (off + FRAME_MP_PATH_LEN > len || payload[off] != FRAME_MP_PATH || payload[off + 1] >= MP_MAX_PATHS) return 0;
+    return payload[off + 1];
+}
+
+static inline const char *mp_path_state_name(mp_path_state_t state) {
+    static const char *const names[] = { "unused", "probing", "active", "down" };
+    return names[state];
+}
+
+int mp_scheduler_parse(const char *name, mp_scheduler_t *scheduler);
+const char *mp_scheduler_name(mp_scheduler_t scheduler);
+
+// Prometheus families of each open path, labelled path="i" after labels
+void mp_render(FILE *out, const mp_t *mp, const char *labels);
+
+// A reorder buffer for payloads of up to max_payload bytes, NULL if out
+// of memory
+mp_reorder_t *mp_reorder_new(size_t max_payload);
+void mp_reorder_free(mp_reorder_t *r);
+
+// Packets start over (a new session): deliver nothing held, from the
+// next packet on
+void mp_reorder_reset(mp_reorder_t *r);
+
+// An authenticated packet pn arrived on path, with its decrypted
+// payload. Returns true if the buffer took it: its data frames are to be
+// delivered once mp_reorder_pop hands it back. Otherwise deliver them
+// now, and then pop what may follow them.
+bool mp_reorder_hold(mp_reorder_t *r, unsigned path, uint64_t pn, const uint8_t *payload, size_t len, uint64_t now_ns, mp_reorder_stats_t *stats);
+
+// Copy the next held payload to deliver now into out (size bytes) and
+// its packet number into *pn. Returns its length, or 0 if there is none.
+size_t mp_reorder_pop(mp_reorder_t *r, uint64_t now_ns, uint64_t *pn, uint8_t *out, size_t size, mp_reorder_stats_t *stats);
+
+// When the next gap is given up, 0 if nothing is held
+uint64_t mp_reorder_due(const mp_reorder_t *r);
+
+// Prometheus families for n sets of statistics, labelled as in
+// metrics_render
+void mp_reorder_render(FILE *out, const mp_reorder_stats_t *const *sets, const char *const *labels, size_t n);
+
+#endif
@@ -0,0 +1,71 @@
+#include "packet.h"
+
+size_t packet_pn_length(uint64_t pn, uint64_t largest_acked) {
+    // Leave room for twice the number of packets in flight
+    uint64_t num_unacked = pn > largest_acked ? pn - largest_acked : 1;
+    uint64_t range = 2 * num_unacked;
+
+    if (range < (1ULL << 7)) return 1;
+    if (range < (1ULL << 15)) return 2;
+    if (range < (1ULL << 23)) return 3;
+    return 4;
+}
+
+size_t packet_encode_header(uint8_t *out, uint64_t cid, uint64_t pn, size_t pn_len) {
+    size_t n = 0;
+    out[n++] = PACKET_FIXED_BIT | (cid ? PACKET_CID_BIT : 0) | (uint8_t)(pn_len - 1);
+    if (cid) {
+        for (size_t i = 0; i < PACKET_CID_LEN; i++) {
+            out[n++] = (uint8_t)(cid >> (8 * (PACKET_CID_LEN - 1 - i)));
+        }
+    }
+    for (size_t i = 0; i < pn_len; i++) {
+        out[n++] = (uint8_t)(pn >> (8 * (pn_len - 1 - i)));
+    }
+    return n;
+}
+
+uint64_t packet_decode_pn(uint64_t expected_pn, uint64_t truncated_pn, size_t pn_len) {
+    uint64_t pn_win = 1ULL << (pn_len * 8);
+    uint64_t pn_hwin = pn_win / 2;
+    uint64_t pn_mask = pn_win - 1;
+    uint64_t candidate = (expected_pn & ~pn_mask) | truncated_pn;
+
+    if (candidate + pn_hwin <= expected_pn && candidate < (1ULL << 62) - pn_win) {
+        return candidate + pn_win;
+    }
+    if (candidate > expected_pn + pn_hwin && candidate >= pn_win) {
+        return candidate - pn_win;
+    }
+    return candidate;
+}
+
+int packet_decode_header(const uint8_t *in, size_t len, uint64_t expected_pn, packet_header_t *hdr) {
+    if (len < 1 || !(in[0] & PACKET_FIXED_BIT) || (in[0] & 0x04)) {
+        return -1;
+    }
+    hdr->zero_rtt = in[0] & PACKET_LONG_HEADER;
+    if (hdr->zero_rtt && packet_type(in[0]) != PACKET_ZERO_RTT) {
+        return -1;
+    }
+    if (!hdr->zero_rtt && (in[0] & PACKET_TYPE_MASK)) {
+        return -1;
+    }
+    size_t cid_len = (in[0] & PACKET_CID_BIT) ? PACKET_CID_LEN : 0;
+    hdr->pn_len = (in[0] & PACKET_PN_LEN_MASK) + 1;
+    hdr->header_len = 1 + cid_len + hdr->pn_len;
+    if (len < hdr->header_len) {
+        return -1;
+    }
+
+    hdr->cid = packet_cid(in, len);
+    if (cid_len && hdr->cid == 0) {
+        return -1;
+    }
+    hdr->truncated_pn = 0;
+    for (size_t i = 0; i < hdr->pn_len; i++) {
+        hdr->truncated_pn = (hdr->truncated_pn << 8) | in[1 + cid_len + i];
+    }
+    hdr->packet_number = packet_decode_pn(expected_pn, hdr->truncated_pn, hdr->pn_len);
+    return 0;
+}
@@ -0,0 +1,114 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Cleartext tunnel header, modelled on the QUIC short header:
+//
+//   byte 0      : 0 1 0 0 C 0 L L   (C = connection ID present,
+//                                    LL = packet number length - 1)
+//   bytes 1..8  : connection ID, if C
+//   then 1..4   : truncated packet number, big endian
+//
+// The header is passed to the AEAD as associated data, so it is
+// authenticated even though it is not encrypted.
+//
+// The connection ID names the client's session on the server, which
+// issues it once the session has keys; until then clients are known by
+// their address and leave it out. It stays the same when the client's
+// address changes, so a session survives NAT rebinding and roaming. Its
+// first byte is the index of a server worker, which the kernel uses to
+// steer the datagram to that worker's socket.
+//
+// Packets sent while the session is set up use a long header instead:
+//
+//   byte 0      : 1 1 T T 0 0 L L   (TT = packet type)
+//
+//   INITIAL     client handshake bytes: 4-byte offset, 2-byte length,
+//               the bytes, then padding to HANDSHAKE_MIN_INITIAL
+//   HANDSHAKE   server handshake bytes, laid out the same way, unpadded
+//   ZERO_RTT    tunnel data under the early key: LL and the truncated
+//               packet number as in the short header
+//   DONE        server has completed the handshake: 4-byte length of
+//               its handshake bytes, ticket included
+#define PACKET_LONG_HEADER 0x80
+#define PACKET_FIXED_BIT 0x40
+#define PACKET_TYPE_SHIFT 4
+#define PACKET_TYPE_MASK 0x30
+#define PACKET_PN_LEN_MASK 0x03
+#define PACKET_CID_BIT 0x08
+#define PACKET_CID_LEN 8
+#define PACKET_HEADER_MAX (1 + PACKET_CID_LEN + 4)
+
+enum {
+    PACKET_INITIAL,
+    PACKET_HANDSHAKE,
+    PACKET_ZERO_RTT,
+    PACKET_DONE,
+};
+
+// Room to reserve beyond the IP payload: header, stream framing, AEAD tag
+#define PACKET_MAX_OVERHEAD 64
+
+// First packet number used in each direction
+#define CLIENT_INITIAL_PN 1000
+#define SERVER_INITIAL_PN 2000
+
+typedef struct {
+    uint64_t packet_number;    // full packet number (after decode)
+    uint64_t truncated_pn;     // packet number as carried on the wire
+    size_t pn_len;             // 1..4 bytes
+    size_t header_len;         // bytes consumed by the header
+    uint64_t cid;              // connection ID, 0 if none
+    bool zero_rtt;             // long header ZERO_RTT packet
+} packet_header_t;
+
+// True for the long header handshake packets (INITIAL, HANDSHAKE, DONE),
+// which carry no packet number
+static inline bool packet_is_handshake(uint8_t first_byte) {
+    if (!(first_byte & PACKET_LONG_HEADER)) return false;
+    return ((first_byte & PACKET_TYPE_MASK) >> PACKET_TYPE_SHIFT) != PACKET_ZERO_RTT;
+}
+
+static inline int packet_type(uint8_t first_byte) {
+    return (first_byte & PACKET_TYPE_MASK) >> PACKET_TYPE_SHIFT;
+}
+
+// Number of bytes needed to send pn so that a receiver which has seen
+// everything up to largest_acked can still reconstruct it (RFC 9000 A.2)
+size_t packet_pn_length(uint64_t pn, uint64_t largest_acked);
+
+// Header length with a connection ID unless cid is 0
+static inline size_t packet_header_length(uint64_t cid, size_t pn_len) {
+    return 1 + (cid ? PACKET_CID_LEN : 0) + pn_len;
+}
+
+// Write the header for pn, carrying cid unless it is 0, into out (at
+// least PACKET_HEADER_MAX bytes). Returns the header length.
+size_t packet_encode_header(uint8_t *out, uint64_t cid, uint64_t pn, size_t pn_len);
+
+// Turn a header written by packet_encode_header into a ZERO_RTT one
+static inline void packet_mark_zero_rtt(uint8_t *hdr) {
+    hdr[0] |= PACKET_LONG_HEADER | (PACKET_ZERO_RTT << PACKET_TYPE_SHIFT);
+}
+
+// The connection ID of a short or ZERO_RTT header, 0 if it has none or
+// is too short to hold one. Enough to find the session, whose state
+// packet_decode_header needs.
+static inline uint64_t packet_cid(const uint8_t *in, size_t len) {
+    if (len < 1 + PACKET_CID_LEN || !(in[0] & PACKET_CID_BIT)) return 0;
+    uint64_t cid = 0;
+    for (size_t i = 0; i < PACKET_CID_LEN; i++) cid = (cid << 8) | in[1 + i];
+    return cid;
+}
+
+// Parse a short or ZERO_RTT header. The full packet number is reconstructed
+// against expected_pn (largest received + 1). Returns 0 on success.
+int packet_decode_header(const uint8_t *in, size_t len, uint64_t expected_pn, packet_header_t *hdr);
+
+// Recover the full packet number from its truncated form (RFC 9000 A.3)
+uint64_t packet_decode_pn(uint64_t expected_pn, uint64_t truncated_pn, size_t pn_len);
+
+#endif
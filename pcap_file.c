@@ -0,0 +1,163 @@
+#include "pcap_file.h"
+#include "log.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAPNG_MAGIC 0x0a0d0d0a
+#define PCAP_HEADER_LEN 24
+#define PCAP_RECORD_LEN 16
+
+// Link types (www.tcpdump.org/linktypes.html)
+#define LINKTYPE_NULL 0          // 4-byte address family, host order
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW_BSD 12
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define LINKTYPE_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+
+static uint32_t read32(const uint8_t *p, bool swap) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t read_be16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// Offset of the IP header in a record of the given link type, or -1 if
+// the record does not carry IP
+static long ip_offset(uint32_t linktype, const uint8_t *p, size_t len) {
+    size_t off;
+    switch (linktype) {
+    case LINKTYPE_RAW:
+    case LINKTYPE_RAW_BSD:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        off = 0;
+        break;
+    case LINKTYPE_NULL:
+        off = 4;
+        break;
+    case LINKTYPE_ETHERNET:
+        if (len < 14) return -1;
+        off = 14;
+        if (read_be16(p + 12) == ETHERTYPE_VLAN) {
+            if (len < 18) return -1;
+            off = 18;
+        }
+        if (read_be16(p + off - 2) != ETHERTYPE_IPV4 && read_be16(p + off - 2) != ETHERTYPE_IPV6) return -1;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (len < 16) return -1;
+        off = 16;
+        if (read_be16(p + 14) != ETHERTYPE_IPV4 && read_be16(p + 14) != ETHERTYPE_IPV6) return -1;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        if (len < 20) return -1;
+        off = 20;
+        if (read_be16(p) != ETHERTYPE_IPV4 && read_be16(p) != ETHERTYPE_IPV6) return -1;
+        break;
+    default:
+        return -1;
+    }
+    if (len <= off) return -1;
+    uint8_t version = p[off] >> 4;
+    return version == 4 || version == 6 ? (long)off : -1;
+}
+
+// Length of the IP packet by its own header, if all of it was captured
+// (Ethernet may pad it), otherwise 0
+static size_t ip_length(const uint8_t *ip, size_t len) {
+    size_t ip_len;
+    if (ip[0] >> 4 == 4) {
+        ip_len = len >= 20 ? read_be16(ip + 2) : 0;
+        if (ip_len < 20) return 0;
+    } else {
+        ip_len = len >= 40 ? read_be16(ip + 4) + 40u : 0;
+    }
+    return ip_len <= len ? ip_len : 0;
+}
+
+int pcap_file_load(pcap_file_t *f, const char *path) {
+    memset(f, 0, sizeof(*f));
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        log_errno(path);
+        return -1;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    f->buf = size > 0 ? malloc(size) : NULL;
+    if (!f->buf || fread(f->buf, 1, size, in) != (size_t)size) {
+        log_error("%s: cannot read the file\n", path);
+        fclose(in);
+        pcap_file_free(f);
+        return -1;
+    }
+    fclose(in);
+
+    uint32_t magic = size >= PCAP_HEADER_LEN ? read32(f->buf, false) : 0;
+    bool swap = magic == __builtin_bswap32(PCAP_MAGIC_USEC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC);
+    if (magic == PCAPNG_MAGIC) {
+        log_error("%s: pcapng is not supported (convert it with: editcap -F pcap in out)\n", path);
+        pcap_file_free(f);
+        return -1;
+    }
+    if (!swap && magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+        log_error("%s: not a pcap file\n", path);
+        pcap_file_free(f);
+        return -1;
+    }
+    uint32_t linktype = read32(f->buf + 20, swap) & 0xffff;
+
+    // Count the records first, then point at their packets
+    size_t capacity = 0;
+    for (long off = PCAP_HEADER_LEN; off + PCAP_RECORD_LEN <= size; capacity++) {
+        off += PCAP_RECORD_LEN + read32(f->buf + off + 8, swap);
+    }
+    f->packets = calloc(capacity ? capacity : 1, sizeof(*f->packets));
+    if (!f->packets) {
+        pcap_file_free(f);
+        return -1;
+    }
+    for (long off = PCAP_HEADER_LEN; off + PCAP_RECORD_LEN <= size;) {
+        size_t caplen = read32(f->buf + off + 8, swap);
+        const uint8_t *rec = f->buf + off + PCAP_RECORD_LEN;
+        off += PCAP_RECORD_LEN + caplen;
+        if (off > size) {
+            f->skipped++;    // file cut off in the middle of a record
+            break;
+        }
+        long ip = ip_offset(linktype, rec, caplen);
+        size_t len = ip < 0 ? 0 : ip_length(rec + ip, caplen - ip);
+        if (len == 0) {
+            f->skipped++;
+            continue;
+        }
+        f->packets[f->count++] = (pcap_packet_t){ rec + ip, len };
+    }
+    if (f->count == 0) {
+        log_error("%s: no whole IP packets (link type %u, %zu records skipped)\n", path, linktype, f->skipped);
+        pcap_file_free(f);
+        return -1;
+    }
+    return 0;
+}
+
+void pcap_file_free(pcap_file_t *f) {
+    free(f->packets);
+    free(f->buf);
+    memset(f, 0, sizeof(*f));
+}
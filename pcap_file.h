@@ -0,0 +1,31 @@
+#ifndef PCAP_FILE_H
+#define PCAP_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reader for classic pcap capture files (not pcapng), as used by the
+// pcap TUN backend and the loopback benchmark. The whole file is read
+// into memory and its records are reduced to the IP packets they carry:
+// link layer headers (Ethernet, Linux cooked, BSD loopback or none) are
+// stripped, and other protocols and packets cut short by the snap
+// length are skipped.
+
+typedef struct {
+    const uint8_t *data;     // IPv4 or IPv6 header first
+    size_t len;
+} pcap_packet_t;
+
+typedef struct {
+    pcap_packet_t *packets;
+    size_t count;
+    size_t skipped;          // records that were not whole IP packets
+    uint8_t *buf;            // the file, which packets point into
+} pcap_file_t;
+
+// Returns -1 (with a message) if the file cannot be read or holds no IP
+// packets
+int pcap_file_load(pcap_file_t *f, const char *path);
+void pcap_file_free(pcap_file_t *f);
+
+#endif
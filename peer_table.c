@@ -0,0 +1,193 @@
+#include "peer_table.h"
+#include "epoch.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+typedef struct peer_node {
+    _Atomic(struct peer_node *) next;
+    uint64_t key;
+    void *value;
+    peer_table_free_fn free_value;    // set when retired along with its value
+} peer_node_t;
+
+struct peer_table {
+    _Atomic(peer_node_t *) *buckets;
+    size_t mask;
+    size_t capacity;
+    _Atomic size_t count;
+    peer_table_free_fn free_value;
+
+    pthread_mutex_t write_lock;
+    epoch_domain_t epoch;
+};
+
+static size_t hash_key(uint64_t key) {
+    // splitmix64 finaliser
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return (size_t)key;
+}
+
+peer_table_t *peer_table_new(size_t capacity, peer_table_free_fn free_value) {
+    peer_table_t *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+
+    size_t nbuckets = 16;
+    while (nbuckets < capacity) nbuckets <<= 1;
+    t->buckets = calloc(nbuckets, sizeof(*t->buckets));
+    if (!t->buckets) {
+        free(t);
+        return NULL;
+    }
+    t->mask = nbuckets - 1;
+    t->capacity = capacity;
+    t->free_value = free_value;
+    epoch_init(&t->epoch);
+    pthread_mutex_init(&t->write_lock, NULL);
+    return t;
+}
+
+static void free_node(void *ptr) {
+    peer_node_t *n = ptr;
+    if (n->free_value) n->free_value(n->value);
+    free(n);
+}
+
+void peer_table_free(peer_table_t *t) {
+    for (size_t i = 0; i <= t->mask; i++) {
+        peer_node_t *n = atomic_load_explicit(&t->buckets[i], memory_order_relaxed);
+        while (n) {
+            peer_node_t *next = atomic_load_explicit(&n->next, memory_order_relaxed);
+            n->free_value = t->free_value;
+            free_node(n);
+            n = next;
+        }
+    }
+    epoch_destroy(&t->epoch);
+    pthread_mutex_destroy(&t->write_lock);
+    free(t->buckets);
+    free(t);
+}
+
+size_t peer_table_count(const peer_table_t *t) {
+    return atomic_load_explicit(&((peer_table_t *)t)->count, memory_order_relaxed);
+}
+
+size_t peer_table_capacity(const peer_table_t *t) {
+    return t->capacity;
+}
+
+void peer_table_read_lock(peer_table_t *t) {
+    epoch_enter(&t->epoch);
+}
+
+void peer_table_read_unlock(peer_table_t *t) {
+    epoch_exit(&t->epoch);
+}
+
+void *peer_table_lookup(peer_table_t *t, uint64_t key) {
+    peer_node_t *n = atomic_load_explicit(&t->buckets[hash_key(key) & t->mask], memory_order_acquire);
+    while (n) {
+        if (n->key == key) return n->value;
+        n = atomic_load_explicit(&n->next, memory_order_acquire);
+    }
+    return NULL;
+}
+
+void peer_table_foreach(peer_table_t *t, bool (*fn)(uint64_t key, void *value, void *arg), void *arg) {
+    for (size_t i = 0; i <= t->mask; i++) {
+        peer_node_t *n = atomic_load_explicit(&t->buckets[i], memory_order_acquire);
+        while (n) {
+            if (!fn(n->key, n->value, arg)) return;
+            n = atomic_load_explicit(&n->next, memory_order_acquire);
+        }
+    }
+}
+
+// Caller holds write_lock
+static peer_node_t *find_locked(peer_table_t *t, uint64_t key, _Atomic(peer_node_t *) **link) {
+    _Atomic(peer_node_t *) *prev = &t->buckets[hash_key(key) & t->mask];
+    peer_node_t *n = atomic_load_explicit(prev, memory_order_relaxed);
+    while (n && n->key != key) {
+        prev = &n->next;
+        n = atomic_load_explicit(prev, memory_order_relaxed);
+    }
+    if (link) *link = prev;
+    return n;
+}
+
+static void link_locked(peer_table_t *t, peer_node_t *n) {
+    _Atomic(peer_node_t *) *head = &t->buckets[hash_key(n->key) & t->mask];
+    atomic_store_explicit(&n->next, atomic_load_explicit(head, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(head, n, memory_order_release);
+}
+
+// Unlink the node and queue it until readers have left the current epoch
+static void retire_locked(peer_table_t *t, _Atomic(peer_node_t *) *link, peer_node_t *n, bool free_value) {
+    atomic_store_explicit(link, atomic_load_explicit(&n->next, memory_order_relaxed), memory_order_release);
+    n->free_value = free_value ? t->free_value : NULL;
+    epoch_retire(&t->epoch, n, free_node);
+}
+
+int peer_table_insert(peer_table_t *t, uint64_t key, void *value) {
+    int ret = -1;
+    pthread_mutex_lock(&t->write_lock);
+    if (atomic_load_explicit(&t->count, memory_order_relaxed) < t->capacity && !find_locked(t, key, NULL)) {
+        peer_node_t *n = calloc(1, sizeof(*n));
+        if (n) {
+            n->key = key;
+            n->value = value;
+            link_locked(t, n);
+            atomic_fetch_add_explicit(&t->count, 1, memory_order_relaxed);
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&t->write_lock);
+    return ret;
+}
+
+int peer_table_remove(peer_table_t *t, uint64_t key) {
+    int ret = -1;
+    _Atomic(peer_node_t *) *link;
+    pthread_mutex_lock(&t->write_lock);
+    peer_node_t *n = find_locked(t, key, &link);
+    if (n) {
+        retire_locked(t, link, n, true);
+        atomic_fetch_sub_explicit(&t->count, 1, memory_order_relaxed);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&t->write_lock);
+    peer_table_reclaim(t);
+    return ret;
+}
+
+int peer_table_migrate(peer_table_t *t, uint64_t old_key, uint64_t new_key) {
+    int ret = -1;
+    _Atomic(peer_node_t *) *link;
+    pthread_mutex_lock(&t->write_lock);
+    peer_node_t *old = find_locked(t, old_key, &link);
+    if (old && !find_locked(t, new_key, NULL)) {
+        // Publish the new key before hiding the old one, so a concurrent
+        // reader finds the value under at least one of them
+        peer_node_t *n = calloc(1, sizeof(*n));
+        if (n) {
+            n->key = new_key;
+            n->value = old->value;
+            link_locked(t, n);
+            find_locked(t, old_key, &link);
+            retire_locked(t, link, old, false);
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&t->write_lock);
+    peer_table_reclaim(t);
+    return ret;
+}
+
+void peer_table_reclaim(peer_table_t *t) {
+    epoch_reclaim(&t->epoch);
+}
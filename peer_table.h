@@ -0,0 +1,53 @@
+#ifndef PEER_TABLE_H
+#define PEER_TABLE_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hash table from a 64-bit peer key to a caller-owned value.
+//
+// Lookups take no lock: a reader brackets its accesses with
+// peer_table_read_lock/unlock, which only publishes the reader's epoch.
+// Writers (insert, remove, migrate) are serialised by an internal mutex
+// and never free a node or value while a reader might still see it;
+// unlinked entries are retired and reclaimed once every reader has moved
+// past the epoch in which they were unlinked (see epoch.h).
+
+typedef struct peer_table peer_table_t;
+
+// Called once a removed value can no longer be reached by any reader
+typedef void (*peer_table_free_fn)(void *value);
+
+// Key for an IPv4 peer: address and port packed into one word
+static inline uint64_t peer_key_from_addr(const struct sockaddr_in *addr) {
+    return ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+// capacity is the maximum number of live entries, fixed at creation
+peer_table_t *peer_table_new(size_t capacity, peer_table_free_fn free_value);
+void peer_table_free(peer_table_t *t);
+
+size_t peer_table_count(const peer_table_t *t);
+size_t peer_table_capacity(const peer_table_t *t);
+
+// Reader side. Values returned by lookup stay valid until read_unlock.
+void peer_table_read_lock(peer_table_t *t);
+void peer_table_read_unlock(peer_table_t *t);
+void *peer_table_lookup(peer_table_t *t, uint64_t key);
+
+// Visit every entry; call under read lock. Stops early if fn returns false.
+void peer_table_foreach(peer_table_t *t, bool (*fn)(uint64_t key, void *value, void *arg), void *arg);
+
+// Writer side. Insert fails (-1) if the key exists or the table is full.
+int peer_table_insert(peer_table_t *t, uint64_t key, void *value);
+// Unlink key; its value is passed to free_value after a grace period
+int peer_table_remove(peer_table_t *t, uint64_t key);
+// Re-key an entry without touching its value (e.g. NAT rebinding)
+int peer_table_migrate(peer_table_t *t, uint64_t old_key, uint64_t new_key);
+
+// Free retired entries that no reader can still hold
+void peer_table_reclaim(peer_table_t *t);
+
+#endif
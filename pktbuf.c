@@ -0,0 +1,69 @@
+#include "pktbuf.h"
+#include <stdlib.h>
+#include <string.h>
+
+int pktbuf_pool_init(pktbuf_pool_t *pool, size_t count, size_t buf_size) {
+    memset(pool, 0, sizeof(*pool));
+    // Start every buffer on a cache line; this also keeps the headers the
+    // kernel writes at the front of ring buffers aligned
+    buf_size = (buf_size + PKTBUF_ALIGN - 1) & ~(size_t)(PKTBUF_ALIGN - 1);
+    pool->slab = aligned_alloc(PKTBUF_ALIGN, count * buf_size);
+    pool->bufs = calloc(count, sizeof(*pool->bufs));
+    pool->free = calloc(count, sizeof(*pool->free));
+    if (!pool->slab || !pool->bufs || !pool->free) {
+        pktbuf_pool_free(pool);
+        return -1;
+    }
+    pool->buf_size = buf_size;
+    pool->count = count;
+    for (size_t i = 0; i < count; i++) {
+        pktbuf_t *pkt = &pool->bufs[i];
+        pkt->base = pool->slab + i * buf_size;
+        pkt->size = buf_size;
+        pkt->pool = pool;
+        pkt->index = i;
+        pool->free[i] = count - 1 - i;    // hand out low indexes first
+    }
+    pool->nfree = count;
+    return 0;
+}
+
+void pktbuf_pool_free(pktbuf_pool_t *pool) {
+    free(pool->slab);
+    free(pool->bufs);
+    free(pool->free);
+    memset(pool, 0, sizeof(*pool));
+}
+
+pktbuf_t *pktbuf_alloc(pktbuf_pool_t *pool) {
+    if (pool->nfree == 0) return NULL;
+    pktbuf_t *pkt = &pool->bufs[pool->free[--pool->nfree]];
+    pkt->data = pkt->base + PKTBUF_HEADROOM;
+    pkt->len = 0;
+    pkt->refs = 1;
+    return pkt;
+}
+
+void pktbuf_put(pktbuf_t *pkt) {
+    pktbuf_pool_t *pool = pkt->pool;
+    if (!pool || --pkt->refs > 0) return;
+    if (pool->release) {
+        pool->release(pool, pkt, pool->release_arg);
+    } else {
+        pool->free[pool->nfree++] = pkt->index;
+    }
+}
+
+pktbuf_t *pktbuf_copy(pktbuf_pool_t *pool, const pktbuf_t *src) {
+    pktbuf_t *pkt = pktbuf_alloc(pool);
+    if (!pkt) return NULL;
+    if (src->len > pktbuf_tailroom(pkt) - PKTBUF_TAILROOM) {
+        pktbuf_put(pkt);
+        return NULL;
+    }
+    memcpy(pkt->data, src->data, src->len);
+    pkt->len = src->len;
+    pool->copies++;
+    pool->copied_bytes += src->len;
+    return pkt;
+}
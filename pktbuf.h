@@ -0,0 +1,97 @@
+#ifndef PKTBUF_H
+#define PKTBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Packet buffers with headroom and tailroom.
+//
+// A TUN packet is read PKTBUF_HEADROOM bytes into its buffer, so the
+// stream framing and tunnel header can be pushed in front of it and the
+// AEAD can encrypt it in place, appending its tag in the tailroom. The
+// finished datagram is sent straight from the same buffer.
+//
+// Buffers are reference counted and owned by a pool that lives on one
+// thread. A pktbuf_t with no pool is a borrowed view of memory owned by
+// someone else; it must not be kept past the callback that received it.
+#define PKTBUF_HEADROOM 64    // >= PACKET_HEADER_MAX + stream framing
+#define PKTBUF_TAILROOM 32    // >= AEAD tag
+#define PKTBUF_ALIGN 64       // buffer stride, rounded up to this
+
+typedef struct pktbuf_pool pktbuf_pool_t;
+
+typedef struct {
+    uint8_t *data;           // first byte of the packet
+    size_t len;
+    uint8_t *base;           // start of the buffer; [base, data) is headroom
+    size_t size;             // bytes from base to the end of the buffer
+    unsigned refs;
+    pktbuf_pool_t *pool;     // NULL for a borrowed view
+    uint32_t index;          // position in the pool
+} pktbuf_t;
+
+// Called instead of returning a buffer to the free list, for pools whose
+// buffers are lent to someone else (e.g. an io_uring buffer ring)
+typedef void (*pktbuf_release_fn)(pktbuf_pool_t *pool, pktbuf_t *pkt, void *arg);
+
+struct pktbuf_pool {
+    uint8_t *slab;           // count * buf_size bytes, one allocation
+    size_t buf_size;
+    size_t count;
+    pktbuf_t *bufs;
+    uint32_t *free;          // stack of free buffer indexes
+    size_t nfree;
+    pktbuf_release_fn release;
+    void *release_arg;
+    uint64_t copies;         // payloads memcpy'd by pktbuf_copy
+    uint64_t copied_bytes;
+};
+
+int pktbuf_pool_init(pktbuf_pool_t *pool, size_t count, size_t buf_size);
+void pktbuf_pool_free(pktbuf_pool_t *pool);
+
+// Take a buffer with an empty packet at PKTBUF_HEADROOM and one
+// reference. Returns NULL if the pool is exhausted.
+pktbuf_t *pktbuf_alloc(pktbuf_pool_t *pool);
+
+// Drop a reference; the last one gives the buffer back to its pool
+void pktbuf_put(pktbuf_t *pkt);
+
+// Copy a packet into a fresh buffer with full headroom. This is the only
+// payload copy on the data path and is counted in pool->copies; it is
+// used when a packet arrives in memory that cannot be kept or extended.
+pktbuf_t *pktbuf_copy(pktbuf_pool_t *pool, const pktbuf_t *src);
+
+static inline void pktbuf_ref(pktbuf_t *pkt) {
+    if (pkt->pool) pkt->refs++;
+}
+
+static inline size_t pktbuf_headroom(const pktbuf_t *pkt) {
+    return pkt->data - pkt->base;
+}
+
+static inline size_t pktbuf_tailroom(const pktbuf_t *pkt) {
+    return pkt->size - pktbuf_headroom(pkt) - pkt->len;
+}
+
+// Grow the packet by n bytes at the front. Caller checks the headroom.
+static inline uint8_t *pktbuf_push(pktbuf_t *pkt, size_t n) {
+    pkt->data -= n;
+    pkt->len += n;
+    return pkt->data;
+}
+
+// Drop n bytes from the front
+static inline uint8_t *pktbuf_pull(pktbuf_t *pkt, size_t n) {
+    pkt->data += n;
+    pkt->len -= n;
+    return pkt->data;
+}
+
+// View of memory the caller does not own
+static inline pktbuf_t pktbuf_view(uint8_t *data, size_t len) {
+    pktbuf_t pkt = { data, len, data, len, 0, NULL, 0 };
+    return pkt;
+}
+
+#endif
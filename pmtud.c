@@ -0,0 +1,142 @@
+#include "pmtud.h"
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void complete(pmtud_t *p, uint64_t now_ns) {
+    p->state = PMTUD_COMPLETE;
+    p->complete_ns = now_ns;
+}
+
+static void start_search(pmtud_t *p, uint64_t now_ns) {
+    p->state = PMTUD_SEARCHING;
+    p->ceiling = p->max;
+    p->probe_sent_ns = 0;
+    p->probe_losses = 0;
+    if (p->plpmtu >= p->max) complete(p, now_ns);
+}
+
+void pmtud_init(pmtud_t *p, size_t max_datagram) {
+    memset(p, 0, sizeof(*p));
+    p->max = max_datagram > PMTUD_BASE ? max_datagram : PMTUD_BASE;
+    p->plpmtu = PMTUD_BASE;
+    start_search(p, 0);
+}
+
+void pmtud_new_session(pmtud_t *p) {
+    p->probe_sent_ns = 0;
+    p->probe_losses = 0;
+    p->black_holes = 0;
+}
+
+// Try the ceiling first, then halve the gap
+static size_t next_size(const pmtud_t *p) {
+    if (p->ceiling == p->max) return p->ceiling;
+    return p->plpmtu + (p->ceiling - p->plpmtu + 1) / 2;
+}
+
+static void check_done(pmtud_t *p, uint64_t now_ns) {
+    if (p->plpmtu >= p->ceiling || p->ceiling - p->plpmtu < PMTUD_RESOLUTION) complete(p, now_ns);
+}
+
+// The outstanding probe was lost (or refused locally, which rules its
+// size out at once)
+static void probe_lost(pmtud_t *p, bool refused, uint64_t now_ns) {
+    p->probe_sent_ns = 0;
+    p->probes_lost++;
+    if (++p->probe_losses < PMTUD_MAX_PROBES && !refused) return;
+    p->probe_losses = 0;
+    p->ceiling = p->probe_size - 1;
+    check_done(p, now_ns);
+}
+
+size_t pmtud_probe_size(pmtud_t *p, const recovery_t *r, uint64_t now_ns) {
+    if (r->persistent_congestions != p->black_holes) {
+        p->black_holes = r->persistent_congestions;
+        if (p->plpmtu > PMTUD_BASE) {
+            p->plpmtu = PMTUD_BASE;
+            start_search(p, now_ns);
+        }
+    }
+    if (p->state == PMTUD_COMPLETE) {
+        if (p->plpmtu >= p->max || now_ns - p->complete_ns < PMTUD_RAISE_NS) return 0;
+        start_search(p, now_ns);
+    }
+    if (p->probe_sent_ns) {
+        if (now_ns - p->probe_sent_ns < recovery_pto(r)) return 0;
+        probe_lost(p, false, now_ns);
+        if (p->state == PMTUD_COMPLETE) return 0;
+    }
+    // Repeat a size until it is confirmed or ruled out
+    if (p->probe_losses == 0) p->probe_size = next_size(p);
+    return p->probe_size;
+}
+
+void pmtud_on_probe_sent(pmtud_t *p, uint64_t pn, bool sent, uint64_t now_ns) {
+    p->probes_sent++;
+    if (!sent) {
+        probe_lost(p, true, now_ns);
+        return;
+    }
+    p->probe_pn = pn;
+    p->probe_sent_ns = now_ns ? now_ns : 1;
+}
+
+bool pmtud_on_ack(pmtud_t *p, const ack_frame_t *ack, uint64_t now_ns) {
+    if (!p->probe_sent_ns) return false;
+    for (size_t i = 0; i < ack->nranges; i++) {
+        if (p->probe_pn >= ack->ranges[i].smallest && p->probe_pn <= ack->ranges[i].largest) {
+            p->probe_sent_ns = 0;
+            p->probe_losses = 0;
+            if (p->probe_size > p->plpmtu) p->plpmtu = p->probe_size;
+            check_done(p, now_ns);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t pmtud_next_due(const pmtud_t *p, const recovery_t *r) {
+    uint64_t due = 0;
+    if (p->state == PMTUD_COMPLETE) {
+        if (p->plpmtu < p->max) due = p->complete_ns + PMTUD_RAISE_NS;
+    } else if (p->probe_sent_ns) {
+        due = p->probe_sent_ns + recovery_pto(r);
+    }
+    // A black hole above the base shows as everything in flight timing out
+    uint64_t timeout_ns = p->plpmtu > PMTUD_BASE ? recovery_timeout_ns(r) : 0;
+    if (timeout_ns && (due == 0 || timeout_ns < due)) due = timeout_ns;
+    return due;
+}
+
+int pmtud_socket_init(int sock) {
+    // PROBE sets DF but, unlike DO, ignores the PMTU the kernel learned
+    // from ICMP: the probes decide what is sent
+    int mode = IP_PMTUDISC_PROBE;
+    if (setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode)) == 0) return 0;
+    mode = IP_PMTUDISC_DO;
+    return setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+}
+
+size_t pmtud_route_max(int sock, size_t max_datagram) {
+    int mtu;
+    socklen_t len = sizeof(mtu);
+    if (getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &len) != 0 || mtu <= PMTUD_UDP_OVERHEAD) return max_datagram;
+    size_t route = (size_t)mtu - PMTUD_UDP_OVERHEAD;
+    return route < max_datagram ? route : max_datagram;
+}
+
+int pmtud_set_mtu(const char *ifname, size_t mtu) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) return -1;
+    struct ifreq ifr = {0};
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    ifr.ifr_mtu = (int)mtu;
+    int ret = ioctl(sock, SIOCSIFMTU, &ifr);
+    close(sock);
+    return ret;
+}
@@ -0,0 +1,113 @@
+#ifndef PMTUD_H
+#define PMTUD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "coalesce.h"
+#include "frame.h"
+#include "packet.h"
+#include "recovery.h"
+
+// Datagram Packetization Layer Path MTU Discovery (RFC 8899) for the
+// datagrams sent to one peer.
+//
+// Every path is assumed to carry PMTUD_BASE bytes of UDP payload, as in
+// QUIC. Larger sizes are tried with probes: a PING frame padded out to
+// the size under test, sent with DF set (the socket never fragments, see
+// pmtud_socket_init) and acknowledged like any other packet. Probes are
+// not counted against the congestion window and their loss is not taken
+// as congestion. An acknowledged probe raises the confirmed size
+// (PLPMTU); PMTUD_MAX_PROBES lost in a row, or a send the local interface
+// refuses, rule its size out. ICMP "packet too big" messages are ignored,
+// so a router that drops them does not matter.
+//
+// The search first tries the largest size allowed, since most paths
+// carry whatever the local link does, then halves the remaining gap
+// until it is under PMTUD_RESOLUTION bytes. A completed search starts
+// again after PMTUD_RAISE_NS in case the path grew. Persistent
+// congestion (everything in flight lost for three probe timeouts, see
+// recovery.h) is taken as a possible black hole: the PLPMTU falls back
+// to the base and the search starts over.
+//
+// The confirmed size bounds the datagrams built for the peer, and
+// (less the tunnel overhead) the MTU of the TUN device, so the kernel
+// hands over inner packets that fit.
+
+#define PMTUD_BASE 1200                      // BASE_PLPMTU, UDP payload
+#define PMTUD_MAX_PROBES 3
+#define PMTUD_RESOLUTION 16                  // bytes: close enough to stop
+#define PMTUD_RAISE_NS (600 * 1000000000ULL) // PMTU_RAISE_TIMER
+#define PMTUD_UDP_OVERHEAD 28                // outer IPv4 and UDP headers
+#define PMTUD_DEFAULT_MTU 1500               // outer link MTU searched up to
+#define PMTUD_MAX_MTU 9216
+
+// Tunnel bytes around one inner packet: header, frame header and tag
+#define PMTUD_TUNNEL_OVERHEAD (PACKET_HEADER_MAX + FRAME_HEADER_MAX + COALESCE_TAG_MAX)
+
+// The kernel removes the IPv6 addresses of an interface whose MTU drops
+// below 1280, so the TUN MTU stays at least that
+#define PMTUD_MIN_TUN_MTU 1280
+#define PMTUD_MIN_MTU (PMTUD_MIN_TUN_MTU + PMTUD_TUNNEL_OVERHEAD + PMTUD_UDP_OVERHEAD)
+
+typedef enum {
+    PMTUD_SEARCHING,
+    PMTUD_COMPLETE,
+} pmtud_state_t;
+
+typedef struct {
+    pmtud_state_t state;
+    size_t plpmtu;               // largest datagram known to get through
+    size_t ceiling;              // largest that still might
+    size_t max;                  // largest allowed
+    size_t probe_size;           // size of the last probe
+    uint64_t probe_pn;
+    uint64_t probe_sent_ns;      // 0 if no probe is outstanding
+    unsigned probe_losses;       // of probe_size, in a row
+    uint64_t complete_ns;        // when the search completed
+    uint64_t black_holes;        // persistent congestion events seen
+    uint64_t probes_sent, probes_lost;
+} pmtud_t;
+
+// max_datagram is the largest UDP payload to search up to
+void pmtud_init(pmtud_t *p, size_t max_datagram);
+
+// Packet numbers and loss recovery start over (a new session on the
+// same path): forget the outstanding probe, keep what the path carries
+void pmtud_new_session(pmtud_t *p);
+
+// Size of the probe to send now, or 0 if none is due. Declares an
+// unanswered probe lost after a probe timeout of r, and watches r for
+// black holes: call recovery_on_timeout first, so that a path losing
+// everything is noticed without ACKs.
+size_t pmtud_probe_size(pmtud_t *p, const recovery_t *r, uint64_t now_ns);
+
+// The probe went out as packet pn, or (!sent) the local interface refused it
+void pmtud_on_probe_sent(pmtud_t *p, uint64_t pn, bool sent, uint64_t now_ns);
+
+// Note an ACK frame from the peer. Returns true if it confirmed the
+// outstanding probe.
+bool pmtud_on_ack(pmtud_t *p, const ack_frame_t *ack, uint64_t now_ns);
+
+// When the outstanding probe times out, the next search is due or the
+// packets in flight time out, 0 if none of these is pending
+uint64_t pmtud_next_due(const pmtud_t *p, const recovery_t *r);
+
+// Inner packets that fit datagrams of the given size
+static inline size_t pmtud_tun_mtu(size_t datagram) {
+    size_t mtu = datagram - PMTUD_TUNNEL_OVERHEAD;
+    return mtu > PMTUD_MIN_TUN_MTU ? mtu : PMTUD_MIN_TUN_MTU;
+}
+
+// Set DF on a UDP socket and stop the kernel from fragmenting. Returns
+// -1 if the socket option is unavailable.
+int pmtud_socket_init(int sock);
+
+// Largest datagram the route of a connected socket allows, capped at
+// max_datagram
+size_t pmtud_route_max(int sock, size_t max_datagram);
+
+// Set the MTU of a network interface. Returns -1 on failure.
+int pmtud_set_mtu(const char *ifname, size_t mtu);
+
+#endif
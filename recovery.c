@@ -0,0 +1,279 @@
+#include "recovery.h"
+#include <stdlib.h>
+#include <string.h>
+#include "packet.h"
+
+#define SENT_MASK (RECOVERY_MAX_SENT - 1)
+#define BLOCKED_RETRY_NS 1000000ULL    // window full: look again after 1 ms
+
+int recovery_init(recovery_t *r, const congestion_ops_t *cc, size_t mss) {
+    memset(r, 0, sizeof(*r));
+    r->sent = calloc(RECOVERY_MAX_SENT, sizeof(*r->sent));
+    if (!r->sent) return -1;
+    congestion_init(&r->cc, cc, mss);
+    return 0;
+}
+
+void recovery_reset(recovery_t *r, size_t mss) {
+    sent_packet_t *sent = r->sent;
+    const congestion_ops_t *cc = r->cc.ops;
+    memset(sent, 0, RECOVERY_MAX_SENT * sizeof(*sent));
+    memset(r, 0, sizeof(*r));
+    r->sent = sent;
+    congestion_init(&r->cc, cc, mss);
+}
+
+void recovery_free(recovery_t *r) {
+    free(r->sent);
+    r->sent = NULL;
+}
+
+uint64_t recovery_pto(const recovery_t *r) {
+    uint64_t srtt = r->has_rtt ? r->smoothed_rtt_ns : RECOVERY_INITIAL_RTT_NS;
+    uint64_t rttvar = r->has_rtt ? r->rttvar_ns : RECOVERY_INITIAL_RTT_NS / 2;
+    uint64_t var = 4 * rttvar > RECOVERY_GRANULARITY_NS ? 4 * rttvar : RECOVERY_GRANULARITY_NS;
+    return srtt + var + ACK_MAX_DELAY_NS;
+}
+
+size_t recovery_pn_length(const recovery_t *r, uint64_t pn) {
+    return packet_pn_length(pn, r->largest_acked);
+}
+
+// Move first_in_flight up past packets that are no longer in flight
+static void advance_first(recovery_t *r) {
+    while (r->first_in_flight <= r->largest_sent) {
+        const sent_packet_t *p = &r->sent[r->first_in_flight & SENT_MASK];
+        if (p->pn == r->first_in_flight && p->in_flight) break;
+        r->first_in_flight++;
+    }
+}
+
+static void lose(recovery_t *r, sent_packet_t *p) {
+    p->in_flight = false;
+    r->bytes_in_flight -= p->size;
+    r->lost_packets++;
+}
+
+// Declare lost what crossed the packet or time threshold below the
+// largest acknowledged packet, and anything unanswered for three probe
+// timeouts
+static void detect_lost(recovery_t *r, uint64_t now_ns) {
+    uint64_t rtt = RECOVERY_INITIAL_RTT_NS;
+    if (r->has_rtt) rtt = r->latest_rtt_ns > r->smoothed_rtt_ns ? r->latest_rtt_ns : r->smoothed_rtt_ns;
+    uint64_t loss_delay = rtt * 9 / 8 > RECOVERY_GRANULARITY_NS ? rtt * 9 / 8 : RECOVERY_GRANULARITY_NS;
+    uint64_t persistent_ns = 3 * recovery_pto(r);
+
+    uint64_t lost_bytes = 0, largest_lost_sent_ns = 0;
+    bool persistent = false;
+    for (uint64_t pn = r->first_in_flight; pn <= r->largest_sent; pn++) {
+        sent_packet_t *p = &r->sent[pn & SENT_MASK];
+        if (p->pn != pn || !p->in_flight) continue;
+
+        uint64_t age = now_ns - p->sent_ns;
+        bool below_largest = r->largest_acked && pn < r->largest_acked;
+        bool lost = below_largest && (r->largest_acked_seq - p->seq >= RECOVERY_PACKET_THRESHOLD || age >= loss_delay);
+        if (!lost && age >= persistent_ns) {
+            lost = persistent = true;
+        }
+        if (!lost) {
+            // Later packets were sent later: none of them has timed out
+            if (!below_largest) break;
+            continue;
+        }
+        lost_bytes += p->size;
+        if (p->sent_ns > largest_lost_sent_ns) largest_lost_sent_ns = p->sent_ns;
+        lose(r, p);
+    }
+    advance_first(r);
+    if (persistent) r->persistent_congestions++;
+    if (lost_bytes > 0) {
+        r->cc.ops->on_loss(&r->cc, lost_bytes, largest_lost_sent_ns, now_ns, persistent);
+    }
+}
+
+uint64_t recovery_timeout_ns(const recovery_t *r) {
+    if (r->bytes_in_flight == 0) return 0;
+    return recovery_oldest_sent_ns(r) + 3 * recovery_pto(r);
+}
+
+uint64_t recovery_oldest_sent_ns(const recovery_t *r) {
+    if (r->bytes_in_flight == 0) return 0;
+    return r->sent[r->first_in_flight & SENT_MASK].sent_ns;
+}
+
+void recovery_on_timeout(recovery_t *r, uint64_t now_ns) {
+    uint64_t timeout_ns = recovery_timeout_ns(r);
+    if (timeout_ns && now_ns >= timeout_ns) {
+        detect_lost(r, now_ns);
+    }
+}
+
+bool recovery_can_send(recovery_t *r, size_t size, uint64_t now_ns, uint64_t *retry_ns) {
+    if (r->bytes_in_flight > 0 && r->bytes_in_flight + size > r->cc.cwnd) {
+        // A full window whose oldest packet timed out means the ACKs
+        // stopped; declaring it lost frees the window
+        uint64_t timeout_ns = recovery_timeout_ns(r);
+        recovery_on_timeout(r, now_ns);
+        if (r->bytes_in_flight > 0 && r->bytes_in_flight + size > r->cc.cwnd) {
+            r->cwnd_blocked++;
+            *retry_ns = now_ns + BLOCKED_RETRY_NS < timeout_ns ? now_ns + BLOCKED_RETRY_NS : timeout_ns;
+            return false;
+        }
+    }
+    if (r->next_send_ns > now_ns) {
+        r->pacing_blocked++;
+        *retry_ns = r->next_send_ns;
+        return false;
+    }
+    return true;
+}
+
+// Space sends out at the pacing rate, letting a burst through after idle
+static void pace(recovery_t *r, size_t size, uint64_t now_ns) {
+    double rate = r->cc.pacing_rate;
+    if (rate <= 0) return;
+    uint64_t burst_ns = (uint64_t)(RECOVERY_PACING_BURST * r->cc.mss * 1e9 / rate);
+    if (r->next_send_ns + burst_ns < now_ns) {
+        r->next_send_ns = now_ns - burst_ns;
+    }
+    r->next_send_ns += (uint64_t)(size * 1e9 / rate);
+}
+
+void recovery_on_sent(recovery_t *r, uint64_t pn, size_t size, uint64_t now_ns, bool ack_eliciting) {
+    if (pn > r->largest_sent) r->largest_sent = pn;
+    if (!ack_eliciting) return;
+
+    // The ring wrapped onto a packet still in flight: give up on it
+    sent_packet_t *p = &r->sent[pn & SENT_MASK];
+    if (p->in_flight) {
+        lose(r, p);
+        r->cc.ops->on_loss(&r->cc, p->size, p->sent_ns, now_ns, false);
+    }
+    if (r->bytes_in_flight == 0) {
+        r->first_in_flight = pn;
+        r->first_sent_ns = r->delivered_ns = now_ns;
+    }
+    p->pn = pn;
+    p->seq = r->sent_packets;
+    p->sent_ns = now_ns;
+    p->delivered = r->delivered;
+    p->delivered_ns = r->delivered_ns;
+    p->first_sent_ns = r->first_sent_ns;
+    p->size = (uint32_t)size;
+    p->in_flight = true;
+    r->bytes_in_flight += size;
+    r->sent_packets++;
+    advance_first(r);
+    pace(r, size, now_ns);
+}
+
+static void update_rtt(recovery_t *r, uint64_t latest_ns, uint64_t ack_delay_ns) {
+    r->latest_rtt_ns = latest_ns;
+    if (ack_delay_ns > ACK_MAX_DELAY_NS) ack_delay_ns = ACK_MAX_DELAY_NS;
+    if (!r->has_rtt) {
+        // Unlike RFC 9002, take the peer's ACK delay off the first sample
+        // too: the first packets of a session are often lone ones (router
+        // solicitations and the like) acknowledged only after the full
+        // delay, and a smoothed RTT starting that high paces the first
+        // burst of real traffic far too slowly
+        r->min_rtt_ns = latest_ns;
+        r->smoothed_rtt_ns = latest_ns > ack_delay_ns + RECOVERY_GRANULARITY_NS ? latest_ns - ack_delay_ns : latest_ns;
+        r->rttvar_ns = r->smoothed_rtt_ns / 2;
+        r->has_rtt = true;
+        return;
+    }
+    if (latest_ns < r->min_rtt_ns) r->min_rtt_ns = latest_ns;
+    uint64_t adjusted = latest_ns >= r->min_rtt_ns + ack_delay_ns ? latest_ns - ack_delay_ns : latest_ns;
+    uint64_t diff = r->smoothed_rtt_ns > adjusted ? r->smoothed_rtt_ns - adjusted : adjusted - r->smoothed_rtt_ns;
+    r->rttvar_ns = (3 * r->rttvar_ns + diff) / 4;
+    r->smoothed_rtt_ns = (7 * r->smoothed_rtt_ns + adjusted) / 8;
+}
+
+void recovery_on_ack(recovery_t *r, const ack_frame_t *ack, uint64_t now_ns) {
+    if (ack->nranges == 0) return;
+
+    // Packet numbers above largest_sent went out on another path (or are
+    // bogus): nothing to do with this one
+    uint64_t prior_in_flight = r->bytes_in_flight;
+    uint64_t acked_bytes = 0;
+    sent_packet_t newest = {0};
+    for (size_t i = 0; i < ack->nranges; i++) {
+        uint64_t lo = ack->ranges[i].smallest > r->first_in_flight ? ack->ranges[i].smallest : r->first_in_flight;
+        uint64_t hi = ack->ranges[i].largest < r->largest_sent ? ack->ranges[i].largest : r->largest_sent;
+        if (lo > hi) continue;
+        // A range wider than the ring (most of it sent on other paths)
+        // is looked up slot by slot
+        bool by_slot = hi - lo >= RECOVERY_MAX_SENT;
+        uint64_t n = by_slot ? RECOVERY_MAX_SENT : hi - lo + 1;
+        for (uint64_t k = 0; k < n; k++) {
+            sent_packet_t *p = &r->sent[by_slot ? k : (lo + k) & SENT_MASK];
+            if (!p->in_flight || p->pn < lo || p->pn > hi) continue;
+            p->in_flight = false;
+            r->bytes_in_flight -= p->size;
+            r->delivered += p->size;
+            acked_bytes += p->size;
+            r->acked_packets++;
+            if (p->pn > newest.pn) newest = *p;
+        }
+    }
+    if (acked_bytes == 0) return;
+    r->last_ack_ns = now_ns;
+    r->delivered_ns = now_ns;
+    advance_first(r);
+
+    // RTT sample if the largest packet acknowledged so far is newly
+    // acknowledged. The ACK delay is that of the frame's largest packet
+    // number, which may have been a bare ACK or gone out on another path.
+    uint64_t rtt_ns = 0;
+    if (newest.pn > r->largest_acked) {
+        r->largest_acked = newest.pn;
+        r->largest_acked_seq = newest.seq;
+        rtt_ns = now_ns - newest.sent_ns;
+        update_rtt(r, rtt_ns, newest.pn == ack->ranges[0].largest ? ack->delay_us * 1000 : 0);
+    }
+
+    // Delivery rate over the time the newest packet spent in flight
+    uint64_t send_elapsed = newest.sent_ns - newest.first_sent_ns;
+    uint64_t ack_elapsed = now_ns - newest.delivered_ns;
+    uint64_t interval = send_elapsed > ack_elapsed ? send_elapsed : ack_elapsed;
+    double rate = interval > 0 ? (r->delivered - newest.delivered) * 1e9 / interval : 0;
+    r->first_sent_ns = newest.sent_ns;
+
+    congestion_ack_t sample = {
+        .now_ns = now_ns,
+        .acked_bytes = acked_bytes,
+        .prior_in_flight = prior_in_flight,
+        .bytes_in_flight = r->bytes_in_flight,
+        .largest_sent_ns = newest.sent_ns,
+        .packet_delivered = newest.delivered,
+        .delivered = r->delivered,
+        .delivery_rate = rate,
+        .rtt_ns = rtt_ns,
+        .smoothed_rtt_ns = r->smoothed_rtt_ns,
+        .min_rtt_ns = r->min_rtt_ns,
+    };
+    r->cc.ops->on_ack(&r->cc, &sample);
+    detect_lost(r, now_ns);
+}
+
+void ack_state_on_received(ack_state_t *a, bool ack_eliciting, bool largest, uint64_t now_ns) {
+    if (largest) a->largest_ns = now_ns;
+    if (!ack_eliciting) return;
+    if (a->unacked++ == 0) a->first_unacked_ns = now_ns;
+}
+
+uint64_t ack_state_due(const ack_state_t *a) {
+    if (a->unacked == 0) return 0;
+    if (a->unacked >= ACK_ELICITING_THRESHOLD) return a->first_unacked_ns;
+    return a->first_unacked_ns + ACK_MAX_DELAY_NS;
+}
+
+size_t ack_state_take(ack_state_t *a, const replay_window_t *w, uint64_t now_ns, uint8_t *out, size_t room) {
+    if (a->unacked == 0) return 0;
+    ack_frame_t ack;
+    ack.nranges = replay_ranges(w, ack.ranges, FRAME_ACK_MAX_RANGES);
+    if (ack.nranges == 0 || 18 + 8 * (ack.nranges - 1) > room) return 0;
+    ack.delay_us = (now_ns - a->largest_ns) / 1000;
+    a->unacked = 0;
+    return frame_encode_ack(out, &ack);
+}
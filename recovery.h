@@ -0,0 +1,142 @@
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "congestion.h"
+#include "frame.h"
+#include "replay.h"
+
+// Loss detection, RTT estimation and pacing for one direction of a
+// tunnel session, after RFC 9002.
+//
+// The sender records every ack-eliciting packet (anything but a bare ACK)
+// and the peer acknowledges ranges of packet numbers, taken from its
+// replay window. Acknowledgements give RTT samples and delivery rate
+// samples; a packet is lost once three later ones are acknowledged, or
+// once it is older than 9/8 of the RTT when a later one is. Several
+// paths may share one packet number space (see multipath.h), each with
+// its own recovery_t: ACKs are taken for the packets recorded here only,
+// and "later" counts those. Packets are
+// never retransmitted: the tunnel carries IP, and the inner transport
+// repairs its own losses. Losses only feed the congestion controller.
+//
+// A packet nothing has been heard about for three probe timeouts is also
+// declared lost, as persistent congestion, so a sender whose ACKs stopped
+// does not stay blocked on its window forever.
+//
+// Sends are paced at the controller's rate, with a burst allowance of
+// RECOVERY_PACING_BURST datagrams after an idle period.
+
+#define RECOVERY_MAX_SENT 1024                 // packets in flight at most (power of two)
+#define RECOVERY_PACKET_THRESHOLD 3
+#define RECOVERY_INITIAL_RTT_NS 333000000ULL
+#define RECOVERY_GRANULARITY_NS 1000000ULL
+#define RECOVERY_PACING_BURST 10               // datagrams
+
+// Receiver: acknowledge after this many ack-eliciting packets, or once
+// the oldest of them has waited ACK_MAX_DELAY_NS
+#define ACK_ELICITING_THRESHOLD 2
+#define ACK_MAX_DELAY_NS 25000000ULL
+
+typedef struct {
+    uint64_t pn;
+    uint64_t seq;                // ack-eliciting packets recorded before it
+    uint64_t sent_ns;
+    uint64_t delivered;          // rate sampling state when sent
+    uint64_t delivered_ns;
+    uint64_t first_sent_ns;
+    uint32_t size;
+    bool in_flight;
+} sent_packet_t;
+
+typedef struct {
+    sent_packet_t *sent;         // ring indexed by packet number
+    uint64_t first_in_flight;    // no packet below this is in flight
+    uint64_t largest_sent;
+    uint64_t largest_acked;      // 0 until the first ACK
+    uint64_t largest_acked_seq;  // and its seq
+    uint64_t bytes_in_flight;
+    uint64_t last_ack_ns;
+
+    // RTT estimate
+    uint64_t latest_rtt_ns;
+    uint64_t min_rtt_ns;
+    uint64_t smoothed_rtt_ns;
+    uint64_t rttvar_ns;
+    bool has_rtt;
+
+    // Delivery rate sampling
+    uint64_t delivered;          // bytes acknowledged so far
+    uint64_t delivered_ns;
+    uint64_t first_sent_ns;
+
+    uint64_t next_send_ns;       // pacer
+    congestion_t cc;
+
+    uint64_t sent_packets;
+    uint64_t acked_packets;
+    uint64_t lost_packets;
+    uint64_t persistent_congestions;    // times everything in flight was lost
+    uint64_t cwnd_blocked;       // sends deferred by the window
+    uint64_t pacing_blocked;     // and by the pacer
+} recovery_t;
+
+// Receive side: ack-eliciting packets not yet acknowledged
+typedef struct {
+    uint64_t largest_ns;         // arrival of the largest packet number
+    uint64_t first_unacked_ns;   // arrival of the oldest unacknowledged one
+    unsigned unacked;
+} ack_state_t;
+
+int recovery_init(recovery_t *r, const congestion_ops_t *cc, size_t mss);
+void recovery_free(recovery_t *r);
+
+// The peer moved to another path: start over with no packets in flight,
+// no RTT estimate and a fresh congestion controller, as recovery_init
+// does but without allocating
+void recovery_reset(recovery_t *r, size_t mss);
+
+// True if size more bytes may go out now. Otherwise *retry_ns says when
+// to try again: when the pacer allows it, or, if the window is full,
+// shortly (an ACK may arrive on another thread) or when the oldest
+// packet in flight times out.
+bool recovery_can_send(recovery_t *r, size_t size, uint64_t now_ns, uint64_t *retry_ns);
+
+// When the oldest packet in flight has waited three probe timeouts, 0
+// if nothing is in flight. Loss detection otherwise runs on ACKs, which
+// stop coming if the path loses everything.
+uint64_t recovery_timeout_ns(const recovery_t *r);
+
+// Declare everything lost (persistent congestion) once that time passed
+void recovery_on_timeout(recovery_t *r, uint64_t now_ns);
+
+// When the oldest packet in flight was sent, 0 if nothing is in flight
+uint64_t recovery_oldest_sent_ns(const recovery_t *r);
+
+// Record a sent packet. Bare ACKs (!ack_eliciting) are not tracked.
+void recovery_on_sent(recovery_t *r, uint64_t pn, size_t size, uint64_t now_ns, bool ack_eliciting);
+
+// Process an ACK frame from the peer
+void recovery_on_ack(recovery_t *r, const ack_frame_t *ack, uint64_t now_ns);
+
+// Bytes of packet number the peer needs to reconstruct pn
+size_t recovery_pn_length(const recovery_t *r, uint64_t pn);
+
+// Probe timeout: how long an ACK may reasonably take
+uint64_t recovery_pto(const recovery_t *r);
+
+// Receiver: note an authenticated packet (largest: it is the largest
+// packet number so far)
+void ack_state_on_received(ack_state_t *a, bool ack_eliciting, bool largest, uint64_t now_ns);
+
+// When an ACK should go out, 0 if nothing is waiting for one
+uint64_t ack_state_due(const ack_state_t *a);
+
+// Write an ACK frame for the packets in the replay window and clear the
+// pending count. Returns the frame length, or 0 if there is nothing new
+// to acknowledge or the frame would not fit in room bytes.
+size_t ack_state_take(ack_state_t *a, const replay_window_t *w, uint64_t now_ns, uint8_t *out, size_t room);
+
+#endif
@@ -0,0 +1,82 @@
+#include "replay.h"
+#include <string.h>
+
+#define WORD_MASK (REPLAY_WINDOW_WORDS - 1)
+
+void replay_init(replay_window_t *w) {
+    memset(w, 0, sizeof(*w));
+}
+
+bool replay_check(const replay_window_t *w, uint64_t pn) {
+    if (!w->initialized || pn > w->largest) {
+        return true;
+    }
+    if (w->largest - pn >= REPLAY_WINDOW_BITS) {
+        return false;    // too old to tell apart from a replay
+    }
+    uint64_t word = w->bitmap[(pn >> 6) & WORD_MASK];
+    return (word & (1ULL << (pn & 63))) == 0;
+}
+
+bool replay_update(replay_window_t *w, uint64_t pn) {
+    if (!replay_check(w, pn)) {
+        return false;
+    }
+
+    uint64_t index = pn >> 6;
+    if (!w->initialized) {
+        memset(w->bitmap, 0, sizeof(w->bitmap));
+        w->largest = pn;
+        w->initialized = true;
+    } else if (pn > w->largest) {
+        // Clear the words the window slides over, at most the whole ring
+        uint64_t current = w->largest >> 6;
+        uint64_t diff = index - current;
+        if (diff > REPLAY_WINDOW_WORDS) diff = REPLAY_WINDOW_WORDS;
+        for (uint64_t i = 1; i <= diff; i++) {
+            w->bitmap[(current + i) & WORD_MASK] = 0;
+        }
+        w->largest = pn;
+    }
+
+    w->bitmap[index & WORD_MASK] |= 1ULL << (pn & 63);
+    return true;
+}
+
+// Highest packet number in [floor, pn] whose bit is set (or clear, if
+// !set), a word at a time
+static bool find_below(const replay_window_t *w, uint64_t pn, uint64_t floor, bool set, uint64_t *out) {
+    while (pn >= floor) {
+        uint64_t word = w->bitmap[(pn >> 6) & WORD_MASK];
+        if (!set) word = ~word;
+        unsigned bit = pn & 63;
+        if (bit < 63) word &= (2ULL << bit) - 1;
+        if (word) {
+            uint64_t found = (pn & ~63ULL) | (63 - __builtin_clzll(word));
+            if (found < floor) return false;
+            *out = found;
+            return true;
+        }
+        if (pn < 64) return false;
+        pn = (pn & ~63ULL) - 1;
+    }
+    return false;
+}
+
+size_t replay_ranges(const replay_window_t *w, pn_range_t *ranges, size_t max) {
+    if (!w->initialized || max == 0) {
+        return 0;
+    }
+    uint64_t floor = w->largest >= REPLAY_WINDOW_BITS ? w->largest - REPLAY_WINDOW_BITS + 1 : 0;
+    uint64_t top = w->largest;
+    size_t n = 0;
+    while (n < max) {
+        uint64_t gap;
+        bool found = find_below(w, top, floor, false, &gap);
+        ranges[n].largest = top;
+        ranges[n].smallest = found ? gap + 1 : floor;
+        n++;
+        if (!found || !find_below(w, gap, floor, true, &top)) break;
+    }
+    return n;
+}
@@ -0,0 +1,40 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sliding-window replay/reorder tracker. The bitmap is a ring of 64-bit
+// words indexed by packet number, so both the check and the update touch
+// a bounded number of words regardless of how far the window moves.
+#define REPLAY_WINDOW_WORDS 32    // must be a power of two
+#define REPLAY_WINDOW_BITS ((REPLAY_WINDOW_WORDS - 1) * 64)
+
+// Run of consecutive packet numbers
+typedef struct {
+    uint64_t smallest;
+    uint64_t largest;
+} pn_range_t;
+
+typedef struct {
+    uint64_t largest;    // highest packet number accepted so far
+    bool initialized;
+    uint64_t bitmap[REPLAY_WINDOW_WORDS];
+} replay_window_t;
+
+void replay_init(replay_window_t *w);
+
+// True if pn is new and still inside the window. Does not modify state,
+// so it can be used to drop replays before spending an AEAD call on them.
+bool replay_check(const replay_window_t *w, uint64_t pn);
+
+// Mark pn as received. Call only after the packet authenticated.
+// Returns false if pn was a duplicate or too old.
+bool replay_update(replay_window_t *w, uint64_t pn);
+
+// The runs of received packet numbers in the window, largest first, for
+// acknowledging them. Returns how many were written (at most max).
+size_t replay_ranges(const replay_window_t *w, pn_range_t *ranges, size_t max);
+
+#endif
@@ -0,0 +1,218 @@
+#include "route.h"
+#include "epoch.h"
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Entries are immutable once published; replacing or removing one
+// retires the old copy. Removing an entry also unlinks and retires the
+// nodes left with neither entry nor children, so host routes that come
+// and go (learned addresses) do not leave their branches behind.
+typedef struct route_node {
+    _Atomic(struct route_node *) child[2];
+    _Atomic(route_entry_t *) entry;
+} route_node_t;
+
+struct route_table {
+    route_node_t *root[2];    // [0] IPv4, [1] IPv6
+    size_t count;
+    pthread_mutex_t write_lock;
+    epoch_domain_t epoch;
+};
+
+static int family_index(int family) {
+    return family == AF_INET6 ? 1 : 0;
+}
+
+static int family_bits(int family) {
+    return family == AF_INET6 ? 128 : 32;
+}
+
+static int bit_at(const uint8_t *addr, int i) {
+    return (addr[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+route_table_t *route_table_new(void) {
+    route_table_t *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    t->root[0] = calloc(1, sizeof(route_node_t));
+    t->root[1] = calloc(1, sizeof(route_node_t));
+    pthread_mutex_init(&t->write_lock, NULL);
+    epoch_init(&t->epoch);
+    if (!t->root[0] || !t->root[1]) {
+        route_table_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static void free_nodes(route_node_t *n) {
+    if (!n) return;
+    free_nodes(atomic_load_explicit(&n->child[0], memory_order_relaxed));
+    free_nodes(atomic_load_explicit(&n->child[1], memory_order_relaxed));
+    free(atomic_load_explicit(&n->entry, memory_order_relaxed));
+    free(n);
+}
+
+void route_table_free(route_table_t *t) {
+    free_nodes(t->root[0]);
+    free_nodes(t->root[1]);
+    epoch_destroy(&t->epoch);
+    pthread_mutex_destroy(&t->write_lock);
+    free(t);
+}
+
+void route_read_lock(route_table_t *t) {
+    epoch_enter(&t->epoch);
+}
+
+void route_read_unlock(route_table_t *t) {
+    epoch_exit(&t->epoch);
+}
+
+int route_add(route_table_t *t, int family, const uint8_t *prefix, int prefix_len, const route_entry_t *entry) {
+    if (prefix_len < 0 || prefix_len > family_bits(family)) return -1;
+
+    route_entry_t *copy = malloc(sizeof(*copy));
+    if (!copy) return -1;
+    *copy = *entry;
+
+    pthread_mutex_lock(&t->write_lock);
+    route_node_t *n = t->root[family_index(family)];
+    for (int i = 0; i < prefix_len; i++) {
+        int b = bit_at(prefix, i);
+        route_node_t *child = atomic_load_explicit(&n->child[b], memory_order_relaxed);
+        if (!child) {
+            child = calloc(1, sizeof(route_node_t));
+            if (!child) {
+                pthread_mutex_unlock(&t->write_lock);
+                free(copy);
+                return -1;
+            }
+            atomic_store_explicit(&n->child[b], child, memory_order_release);
+        }
+        n = child;
+    }
+    route_entry_t *old = atomic_exchange_explicit(&n->entry, copy, memory_order_acq_rel);
+    if (old) {
+        epoch_retire(&t->epoch, old, free);
+    } else {
+        t->count++;
+    }
+    pthread_mutex_unlock(&t->write_lock);
+    epoch_reclaim(&t->epoch);
+    return 0;
+}
+
+// Remove the entry at prefix, only if it names expected's peer when
+// expected is given, and prune the branch it leaves empty
+static int remove_entry(route_table_t *t, int family, const uint8_t *prefix, int prefix_len, const route_entry_t *expected) {
+    if (prefix_len < 0 || prefix_len > family_bits(family)) return -1;
+
+    pthread_mutex_lock(&t->write_lock);
+    route_node_t *path[129];
+    int depth = 0;
+    path[0] = t->root[family_index(family)];
+    while (depth < prefix_len && path[depth]) {
+        path[depth + 1] = atomic_load_explicit(&path[depth]->child[bit_at(prefix, depth)], memory_order_relaxed);
+        depth++;
+    }
+    route_node_t *n = path[depth];
+    route_entry_t *old = n ? atomic_load_explicit(&n->entry, memory_order_relaxed) : NULL;
+    if (old && expected && (old->peer_key != expected->peer_key || old->peer_id != expected->peer_id)) {
+        old = NULL;
+    }
+    if (old) {
+        atomic_store_explicit(&n->entry, NULL, memory_order_release);
+        epoch_retire(&t->epoch, old, free);
+        t->count--;
+
+        // Readers may still be on the unlinked nodes; the epoch keeps them
+        for (; depth > 0; depth--) {
+            n = path[depth];
+            if (atomic_load_explicit(&n->entry, memory_order_relaxed) ||
+                atomic_load_explicit(&n->child[0], memory_order_relaxed) ||
+                atomic_load_explicit(&n->child[1], memory_order_relaxed)) {
+                break;
+            }
+            atomic_store_explicit(&path[depth - 1]->child[bit_at(prefix, depth - 1)], NULL, memory_order_release);
+            epoch_retire(&t->epoch, n, free);
+        }
+    }
+    pthread_mutex_unlock(&t->write_lock);
+    epoch_reclaim(&t->epoch);
+    return old ? 0 : -1;
+}
+
+int route_remove(route_table_t *t, int family, const uint8_t *prefix, int prefix_len) {
+    return remove_entry(t, family, prefix, prefix_len, NULL);
+}
+
+int route_remove_if(route_table_t *t, int family, const uint8_t *prefix, int prefix_len, const route_entry_t *expected) {
+    return remove_entry(t, family, prefix, prefix_len, expected);
+}
+
+const route_entry_t *route_lookup(route_table_t *t, int family, const uint8_t *addr) {
+    const route_node_t *n = t->root[family_index(family)];
+    const route_entry_t *best = NULL;
+    int bits = family_bits(family);
+
+    for (int i = 0; n; i++) {
+        const route_entry_t *e = atomic_load_explicit(&((route_node_t *)n)->entry, memory_order_acquire);
+        if (e) best = e;
+        if (i == bits) break;
+        n = atomic_load_explicit(&((route_node_t *)n)->child[bit_at(addr, i)], memory_order_acquire);
+    }
+    return best;
+}
+
+size_t route_count(const route_table_t *t) {
+    return t->count;
+}
+
+int route_parse_prefix(const char *str, int *family, uint8_t *prefix, int *prefix_len) {
+    char buf[INET6_ADDRSTRLEN + 8];
+    strncpy(buf, str, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    char *slash = strchr(buf, '/');
+    if (slash) *slash = '\0';
+
+    memset(prefix, 0, 16);
+    if (inet_pton(AF_INET, buf, prefix) == 1) {
+        *family = AF_INET;
+    } else if (inet_pton(AF_INET6, buf, prefix) == 1) {
+        *family = AF_INET6;
+    } else {
+        return -1;
+    }
+
+    *prefix_len = family_bits(*family);
+    if (slash) {
+        char *end;
+        long l = strtol(slash + 1, &end, 10);
+        if (*end != '\0' || l < 0 || l > *prefix_len) return -1;
+        *prefix_len = (int)l;
+    }
+    return 0;
+}
+
+int route_packet_addr(const uint8_t *ip, size_t len, bool dst, int *family, const uint8_t **addr) {
+    if (len < 1) return -1;
+    switch (ip[0] >> 4) {
+    case 4:
+        if (len < 20) return -1;
+        *family = AF_INET;
+        *addr = ip + (dst ? 16 : 12);
+        return 0;
+    case 6:
+        if (len < 40) return -1;
+        *family = AF_INET6;
+        *addr = ip + (dst ? 24 : 8);
+        return 0;
+    default:
+        return -1;
+    }
+}
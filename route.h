@@ -0,0 +1,50 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest-prefix-match table from inner (tunnelled) IPv4/IPv6 addresses
+// to the peer that owns them. One binary trie per address family.
+//
+// Entries name their peer by table key plus a per-registration id, so a
+// route left behind by an expired peer never resolves to a newer peer
+// that happens to reuse the same key.
+//
+// Lookups take no lock: readers bracket them with route_read_lock/unlock
+// and the returned entry stays valid until the unlock. Writers serialise
+// on an internal mutex and retire replaced entries, and the nodes a
+// removal leaves empty, through an epoch.
+
+typedef struct route_table route_table_t;
+
+typedef struct {
+    uint64_t peer_key;    // connection ID of the owning client (its stream key)
+    uint64_t peer_id;     // stream_state_t.peer_id at install time
+    bool learned;         // host route learned from traffic, not configured
+} route_entry_t;
+
+route_table_t *route_table_new(void);
+void route_table_free(route_table_t *t);
+
+void route_read_lock(route_table_t *t);
+void route_read_unlock(route_table_t *t);
+
+// family is AF_INET or AF_INET6; prefix is 4 or 16 bytes in network order
+int route_add(route_table_t *t, int family, const uint8_t *prefix, int prefix_len, const route_entry_t *entry);
+int route_remove(route_table_t *t, int family, const uint8_t *prefix, int prefix_len);
+// Remove the route only while it still names the peer (key and id) of
+// expected, e.g. one found stale, which another writer may have replaced
+// since. Returns -1 if it did not.
+int route_remove_if(route_table_t *t, int family, const uint8_t *prefix, int prefix_len, const route_entry_t *expected);
+const route_entry_t *route_lookup(route_table_t *t, int family, const uint8_t *addr);
+size_t route_count(const route_table_t *t);
+
+// Parse "10.8.0.0/24" or "fd00::/64"; a bare address is a host route
+int route_parse_prefix(const char *str, int *family, uint8_t *prefix, int *prefix_len);
+
+// Locate the source or destination address inside an IPv4/IPv6 packet
+int route_packet_addr(const uint8_t *ip, size_t len, bool dst, int *family, const uint8_t **addr);
+
+#endif
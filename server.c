@@ -1,3 +1,4 @@
+#define _GNU_SOURCE    // pthread_setaffinity_np
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <openssl/ssl.h>    // OpenSSL base
@@ -9,286 +10,2284 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <linux/if_tun.h>    // TUN Interface
-#include <net/if.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <time.h>
+#include "packet.h"
+#include "replay.h"
+#include "epoch.h"
+#include "peer_table.h"
+#include "route.h"
+#include "batch_io.h"
+#include "event.h"
+#include "handshake.h"
+#include "frame.h"
+#include "coalesce.h"
+#include "recovery.h"
+#include "vnet.h"
+#include "tun.h"
+#include "crypto.h"
+#include "pmtud.h"
+#include "fec.h"
+#include "multipath.h"
+#include "hdrcomp.h"
+#include "log.h"
+#include "metrics.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <linux/filter.h>    // Reuseport CBPF steering
 
 #define PORT 8080    // UDP port number
-#define BUFFER_SIZE 2048    // Max buffer size for packets
-#define MAX_STREAMS 1024    // Max number of client streams
+#define DEFAULT_MAX_STREAMS 1024    // Default peer table capacity (override with -c)
+#define STREAM_TIMEOUT 300    // Seconds of inactivity before a stream expires
+#define REPORT_INTERVAL 60    // Seconds between statistics reports
+#define MAX_LEARNED_ROUTES 16    // Inner host addresses a client may claim without config
+#define MAX_WORKERS (EPOCH_MAX_READERS - 1)    // each needs a reader slot in the tables, as does main
+#define COALESCE_SLOTS 256    // clients with a datagram under construction, per worker
+#define MAX_PENDING_ACKS 256    // clients waiting for an ACK, per worker
+#define MAX_PENDING_REPAIRS 256    // clients with a FEC group open, per worker
+#define MAX_PENDING_REORDERS 256    // clients with packets held for reordering, per worker
+#define PATH_CHALLENGE_MIN_MS 10    // least time between challenges of a new client address
+
+// Validation of a new client address on one of its paths
+typedef struct {
+    struct sockaddr_in addr;         // the address,
+    uint8_t data[FRAME_TOKEN_LEN];   // with the PATH_CHALLENGE data sent there
+    uint64_t sent_ns;                // when it last went out, 0 if none pending
+} path_challenge_t;
 
 // Stream state structure
 typedef struct {
-    int stream_id;
-    struct sockaddr_in client_addr;
+    int stream_id;                   // names the session in logs
+    uint64_t peer_id;                // unique per registration, checked by routes
+    uint64_t cid;                    // connection ID issued to the client, its key in streams
+    struct sockaddr_in client_addr;  // changed under addr_lock and tx_lock when
+                                     // the client has moved (see migrate_stream)
+    _Atomic uint64_t addr_key;       // peer_key_from_addr(&client_addr)
+    _Atomic bool cid_confirmed;      // the client puts cid in its headers
     socklen_t addr_len;
-    bool active;
-    time_t last_activity;
-    uint64_t expected_packet_number; // per-client nonce tracking
-    uint64_t outgoing_packet_number; // for packets going to this client
+    _Atomic uint64_t last_activity;  // event_loop_now_ms of the last packet from the client
+    pthread_spinlock_t rx_lock;      // guards the receive state below; uncontended
+                                     // since reuseport keeps a peer on one worker
+    uint64_t expected_packet_number; // largest received packet number + 1
+    replay_window_t replay;          // accepted/reordered packet numbers
+    ack_state_t ack;                 // received packets not yet acknowledged
+    bool ack_queued;                 // on some worker's pending ACK list
+    hdrcomp_rx_t hc_rx;              // the client's compressed headers
+    fec_rx_t *fec_rx;                // repairs from the client, once it asked for FEC
+    mp_reorder_t *reorder;           // once it used a second path
+    bool reorder_queued;             // on its worker's pending reorder list
+    unsigned ack_path;               // the last ack-eliciting packet came on it
+
+    // Send state. Any worker may send to this client, so the packet
+    // numbers, loss recovery and congestion control are used under
+    // tx_lock, which may take rx_lock (never the other way around).
+    pthread_spinlock_t tx_lock;
+    uint64_t outgoing_packet_number;
+    mp_t mp;                         // paths to the client, the first at client_addr
+    hdrcomp_tx_t hc_tx;              // header compression of packets to the client
+    fec_tx_t *fec_tx;                // and their repairs, set with fec_rx
+    bool repairs_queued;             // on some worker's pending repair list
+    _Atomic size_t plpmtu;           // mp_mtu, for use without tx_lock
+    _Atomic size_t tun_datagram;     // plpmtu as far as the TUN MTU goes, 0 until
+                                     // a search completes
+    _Atomic uint64_t probe_ns;       // when pmtud next needs a look
+    bool has_static_routes;          // inner subnets come from the allowed-ips file
+    _Atomic int learned_routes;      // inner host routes learned from this client, and still its own
+    path_challenge_t challenges[MP_MAX_PATHS];
+
+    // Session setup. Handshake packets may reach any worker, so the
+    // handshake and the 0-RTT key are used under hs_lock.
+    pthread_mutex_t hs_lock;
+    _Atomic uint64_t successor_cid;  // a new handshake from this address, 0 if none
+    uint64_t replaces_cid;           // the established session this one is to replace
+    handshake_t hs;
+    ptls_aead_context_t *early_aead; // 0-RTT receive key until the handshake completes
+    _Atomic bool established;        // handshake completed
+    _Atomic bool keys_ready;         // tx/rx secrets below are set
+    tunnel_secret_t tx_secret, rx_secret;
+    ptls_aead_context_t **tx_aead;   // per worker, created from the secrets
+    ptls_aead_context_t **rx_aead;   // by (and only used on) that worker
 } stream_state_t;
 
-// Global variables (shared symmetric key)
-uint8_t key[32] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
-                    0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
-                    0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
-                    0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20};
+// Inner subnet a client is allowed to use, keyed by its outer address
+typedef struct {
+    struct in_addr client_ip;
+    int family;
+    uint8_t prefix[16];
+    int prefix_len;
+} allowed_ips_t;
+
+// Per-worker data plane state. Each worker owns one TUN queue, one
+// SO_REUSEPORT socket and its own AEAD contexts for every stream, so
+// workers share only the lock-free stream and route tables.
+typedef struct {
+    int id;
+    tun_t tun;                       // its TUN queue, or other backend (-T)
+    int sock;
+    dgram_batch_t rx, tx;
+    crypto_seal_t *seals;            // datagrams in tx still to be sealed
+    size_t nseals;
+    metrics_t metrics;               // read by the metrics thread too
+    metric_t handshakes_full, handshakes_resumed;
+    metric_t handshake_cpu_ns;       // thread CPU time spent in handshakes
+    metric_t zero_rtt_packets;
+    coalescer_t coalesce;            // TUN packets waiting for their datagram
+    hdrcomp_stats_t hc_stats;        // of the TUN packets this worker read
+    fec_stats_t fec_stats;
+    struct { uint64_t key, peer_id; } pending_acks[MAX_PENDING_ACKS];
+    size_t npending_acks;            // clients this worker owes an ACK
+    struct { uint64_t key, peer_id; } pending_repairs[MAX_PENDING_REPAIRS];
+    size_t npending_repairs;         // clients whose FEC group this worker opened
+    struct { uint64_t key, peer_id; } pending_reorders[MAX_PENDING_REORDERS];
+    size_t npending_reorders;        // clients with packets held here
+    mp_reorder_stats_t reorder_stats;
+    event_loop_t *loop;
+    pthread_t thread;
+} worker_t;
+
+// Idle expiry, statistics and path probing of a stream, on the timer
+// wheel of the worker that registered it. Like the other per-worker
+// references to a stream it holds the key and registration, not the
+// stream, so it needs no cancelling from other workers: once the stream
+// is gone the timer frees itself the next time it fires.
+typedef struct {
+    event_timer_t timer;
+    worker_t *worker;
+    uint64_t cid, peer_id;
+    uint64_t report_ms;              // next statistics report
+} stream_timer_t;
+
+// TLS context shared by the handshakes of every client
+static handshake_config_t tls_config;
+
+// Global stream registry, keyed by the connection ID issued to each
+// client. Lookups are lock-free; callers hold peer_table_read_lock while
+// using a stream.
+static peer_table_t *streams;
+
+// Client address and port -> stream, for handshakes and the packets a
+// client sends before it has its connection ID. Entries do not own their
+// stream: one is unlinked here before it leaves streams, so a reader
+// that holds both read locks (see data_plane_enter) never finds a freed
+// stream. Writers hold addr_lock, which makes lookup-then-change atomic.
+static peer_table_t *stream_addrs;
+static pthread_mutex_t addr_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic uint64_t next_peer_id = 1;
+
+// Inner destination -> client routing, also read lock-free by workers
+static route_table_t *routes;
+static allowed_ips_t *allowed_ips;
+static size_t allowed_ips_count;
+
+static worker_t *workers;
+static int num_workers = 1;
 
-// Global stream registry and mutex
-static stream_state_t streams[MAX_STREAMS];
-static pthread_mutex_t streams_mutex = PTHREAD_MUTEX_INITIALIZER;
+// How long a TUN packet may wait for others to share its datagram (-F)
+static uint64_t coalesce_deadline_ns;
 
-// Find all active streams given matching client address
+// Congestion controller of every client stream (-K)
+static const congestion_ops_t *congestion = &congestion_newreno;
+
+// TUN super-packets cut up in userspace, and writes merged (-O)
+static bool tun_offload;
+
+// Largest datagram to search up to, from the link MTU (-M)
+static size_t max_datagram;
+
+// Forward error correction for clients that ask for it (-X)
+static bool fec_enabled;
+
+// How clients' datagrams are spread over their paths (-S)
+static mp_scheduler_t scheduler = MP_MINRTT;
+
+// Datagram bytes kept free for FEC, when it may be used (see fec.h)
+static size_t fec_overhead(void) {
+    return fec_enabled ? FEC_OVERHEAD : 0;
+}
+
+// Unix socket serving the metrics, if any (-m)
+static const char *metrics_path;
+
+// The TUN device (or backend, -T) and the MTU last set on it, for the
+// client with the smallest path MTU
+static const char *tun_spec = "tun0";
+static pthread_mutex_t tun_mtu_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t tun_mtu;
+
+// Enter/leave the read side of both shared tables
+static void data_plane_enter(void) {
+    peer_table_read_lock(streams);
+    peer_table_read_lock(stream_addrs);
+    route_read_lock(routes);
+}
+
+static void data_plane_exit(void) {
+    route_read_unlock(routes);
+    peer_table_read_unlock(stream_addrs);
+    peer_table_read_unlock(streams);
+}
+
+// Load "<client-ip> <prefix> [<prefix> ...]" lines; '#' starts a comment
+int load_allowed_ips(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        log_errno("Opening allowed-ips file");
+        return -1;
+    }
+
+    char line[512];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char *saveptr;
+        char *client = strtok_r(line, " \t\r\n", &saveptr);
+        if (!client) continue;
+
+        struct in_addr client_ip;
+        if (inet_pton(AF_INET, client, &client_ip) != 1) {
+            log_error("%s:%d: invalid client address %s\n", path, lineno, client);
+            fclose(f);
+            return -1;
+        }
+
+        char *prefix;
+        while ((prefix = strtok_r(NULL, " \t\r\n", &saveptr))) {
+            allowed_ips_t entry = { .client_ip = client_ip };
+            if (route_parse_prefix(prefix, &entry.family, entry.prefix, &entry.prefix_len) != 0) {
+                log_error("%s:%d: invalid prefix %s\n", path, lineno, prefix);
+                fclose(f);
+                return -1;
+            }
+            allowed_ips_t *grown = realloc(allowed_ips, (allowed_ips_count + 1) * sizeof(*allowed_ips));
+            if (!grown) {
+                fclose(f);
+                return -1;
+            }
+            allowed_ips = grown;
+            allowed_ips[allowed_ips_count++] = entry;
+        }
+    }
+    fclose(f);
+    log_info("Loaded %zu allowed subnets from %s\n", allowed_ips_count, path);
+    return 0;
+}
+
+// Whether the allowed-ips file gives the client at addr subnets
+static bool has_allowed_ips(const struct sockaddr_in *addr) {
+    for (size_t i = 0; i < allowed_ips_count; i++) {
+        if (allowed_ips[i].client_ip.s_addr == addr->sin_addr.s_addr) return true;
+    }
+    return false;
+}
+
+// Point the configured subnets of a client at it, once its handshake
+// has completed: until then anyone may be sending from its address
+void install_static_routes(stream_state_t *stream) {
+    route_entry_t entry = { stream->cid, stream->peer_id, false };
+    for (size_t i = 0; i < allowed_ips_count; i++) {
+        if (allowed_ips[i].client_ip.s_addr != stream->client_addr.sin_addr.s_addr) continue;
+        route_add(routes, allowed_ips[i].family, allowed_ips[i].prefix, allowed_ips[i].prefix_len, &entry);
+    }
+}
+
+// Check the inner source address of a packet from a client. Configured
+// clients must stay inside their subnets; others get a host route for
+// each source address they use, unless another live session owns it.
+// Its outer address proves nothing (clients behind one NAT share it):
+// a route only changes hands once its owner is gone, e.g. a client that
+// reconnected after its old session expired or was replaced, or to a
+// session whose handshake completed with the owner's own certificate
+// (the same client, restarted on another port). Until then a resumed
+// session's certificate comes from its ticket alone, and its 0-RTT
+// packets may be replayed from anywhere. A session that moved keeps its
+// routes, which name its connection ID.
+bool check_inner_source(stream_state_t *stream, const uint8_t *ip, size_t len) {
+    int family;
+    const uint8_t *src;
+    if (route_packet_addr(ip, len, false, &family, &src) != 0) {
+        return false;
+    }
+
+    const route_entry_t *r = route_lookup(routes, family, src);
+    if (r && r->peer_key == stream->cid && r->peer_id == stream->peer_id) {
+        return true;
+    }
+    if (stream->has_static_routes) {
+        return false;
+    }
+    stream_state_t *previous = NULL;    // live owner handing the address over
+    if (r) {
+        stream_state_t *owner = peer_table_lookup(streams, r->peer_key);
+        bool live = owner && owner->peer_id == r->peer_id;
+        bool same_client = live && atomic_load(&stream->established) &&
+                           memcmp(owner->hs.client_id, stream->hs.client_id, HANDSHAKE_CLIENT_ID_LEN) == 0;
+        if (!r->learned || (live && !same_client)) {
+            return false;
+        }
+        if (live) previous = owner;
+    }
+    if (atomic_load_explicit(&stream->learned_routes, memory_order_relaxed) >= MAX_LEARNED_ROUTES) {
+        return false;
+    }
+
+    route_entry_t entry = { stream->cid, stream->peer_id, true };
+    route_add(routes, family, src, family == AF_INET6 ? 128 : 32, &entry);
+    atomic_fetch_add_explicit(&stream->learned_routes, 1, memory_order_relaxed);
+    if (previous) {
+        atomic_fetch_sub_explicit(&previous->learned_routes, 1, memory_order_relaxed);
+    }
+
+    char text[INET6_ADDRSTRLEN];
+    inet_ntop(family, src, text, sizeof(text));
+    log_info("Learned inner address %s for stream %d\n", text, stream->stream_id);
+    return true;
+}
+
+// Release a stream once no worker can still reference it
+void free_stream(void *value) {
+    stream_state_t *stream = value;
+    for (int i = 0; i < num_workers; i++) {
+        if (stream->tx_aead[i]) ptls_aead_free(stream->tx_aead[i]);
+        if (stream->rx_aead[i]) ptls_aead_free(stream->rx_aead[i]);
+    }
+    if (stream->early_aead) ptls_aead_free(stream->early_aead);
+    handshake_free(&stream->hs);
+    mp_free(&stream->mp);
+    mp_reorder_free(stream->reorder);
+    fec_tx_free(stream->fec_tx);
+    fec_rx_free(stream->fec_rx);
+    ptls_clear_memory(&stream->tx_secret, sizeof(stream->tx_secret));
+    ptls_clear_memory(&stream->rx_secret, sizeof(stream->rx_secret));
+    free(stream->tx_aead);
+    free(stream->rx_aead);
+    pthread_mutex_destroy(&stream->hs_lock);
+    pthread_spin_destroy(&stream->rx_lock);
+    pthread_spin_destroy(&stream->tx_lock);
+    free(stream);
+}
+
+// This worker's AEAD context for one direction of a stream whose keys
+// are ready. Returns NULL if it cannot be created.
+static ptls_aead_context_t *stream_aead(worker_t *w, stream_state_t *stream, bool is_enc) {
+    ptls_aead_context_t **slot = is_enc ? &stream->tx_aead[w->id] : &stream->rx_aead[w->id];
+    if (!*slot) {
+        *slot = tunnel_secret_aead(is_enc ? &stream->tx_secret : &stream->rx_secret, is_enc);
+    }
+    return *slot;
+}
+
+// Find the stream for a client address
 stream_state_t* find_stream_by_addr(struct sockaddr_in *addr) {
-    pthread_mutex_lock(&streams_mutex);
-    for (int i = 0; i < MAX_STREAMS; i++) {
-        if (streams[i].active && streams[i].client_addr.sin_addr.s_addr == addr->sin_addr.s_addr && streams[i].client_addr.sin_port == addr->sin_port) {
-            pthread_mutex_unlock(&streams_mutex);
-            return &streams[i];
+    return peer_table_lookup(stream_addrs, peer_key_from_addr(addr));
+}
+
+// The handshake waiting to replace a stream, NULL if none
+static stream_state_t *find_successor(stream_state_t *stream) {
+    uint64_t cid = atomic_load(&stream->successor_cid);
+    return cid ? peer_table_lookup(streams, cid) : NULL;
+}
+
+// A connection ID for a client registered by the given worker: its index
+// in the first byte, for reuseport steering (attach_reuseport_cid_cbpf),
+// then random bytes so that IDs are not guessable. Never 0.
+static uint64_t new_cid(int worker) {
+    uint64_t cid;
+    do {
+        uint64_t r;
+        ptls_openssl_random_bytes(&r, sizeof(r));
+        cid = (uint64_t)worker << 56 | (r >> 8);
+    } while (cid == 0);
+    return cid;
+}
+
+static void remove_stream(stream_state_t *stream);
+static int watch_stream(worker_t *w, stream_state_t *stream);
+
+// Register a new client, starting its handshake. Returns the existing
+// stream if another worker registered the address first. A handshake
+// that is to replace the established session at the address stays out
+// of the address index until it completes (see replace_session).
+stream_state_t* register_stream(int worker, struct sockaddr_in *client_addr, socklen_t addr_len, stream_state_t *replaces) {
+    stream_state_t *stream = calloc(1, sizeof(*stream));
+    if (stream) {
+        stream->tx_aead = calloc(num_workers, sizeof(*stream->tx_aead));
+        stream->rx_aead = calloc(num_workers, sizeof(*stream->rx_aead));
+    }
+    if (!stream || !stream->tx_aead || !stream->rx_aead) {
+        log_errno("Allocating stream");
+        if (stream) {
+            free(stream->tx_aead);
+            free(stream->rx_aead);
+            free(stream);
         }
+        return NULL;
     }
-    pthread_mutex_unlock(&streams_mutex);
-    return NULL;
+    stream->peer_id = atomic_fetch_add(&next_peer_id, 1);
+    stream->stream_id = (int)stream->peer_id;
+    stream->cid = new_cid(worker);
+    memcpy(&stream->client_addr, client_addr, sizeof(struct sockaddr_in));
+    atomic_init(&stream->addr_key, peer_key_from_addr(client_addr));
+    stream->has_static_routes = has_allowed_ips(client_addr);
+    stream->addr_len = addr_len;
+    atomic_init(&stream->last_activity, event_loop_now_ms(workers[worker].loop));
+    pthread_spin_init(&stream->rx_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_spin_init(&stream->tx_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_mutex_init(&stream->hs_lock, NULL);
+    stream->expected_packet_number = CLIENT_INITIAL_PN;  // Starting value for incoming packets
+    stream->outgoing_packet_number = SERVER_INITIAL_PN;  // Starting value for outgoing packets
+    replay_init(&stream->replay);
+    mp_init(&stream->mp, congestion, scheduler);
+    int opened = mp_path_open(&stream->mp, 0, client_addr, max_datagram);
+    atomic_init(&stream->plpmtu, mp_mtu(&stream->mp));
+    if (opened != 0 || handshake_start(&stream->hs, &tls_config, true) != 0) {
+        log_limited(LOG_LEVEL_ERROR, "Failed to start handshake for client %s\n", log_addr(client_addr));
+        free_stream(stream);
+        return NULL;
+    }
+
+    if (peer_table_insert(streams, stream->cid, stream) != 0) {
+        free_stream(stream);
+        stream = replaces ? NULL : find_stream_by_addr(client_addr);
+        if (!stream) {
+            log_limited(LOG_LEVEL_WARN, "No available slots for new stream (capacity %zu)\n", peer_table_capacity(streams));
+        }
+        return stream;
+    }
+
+    // Another worker may have registered the same client first
+    pthread_mutex_lock(&addr_lock);
+    stream_state_t *existing = NULL;
+    if (replaces) {
+        stream->replaces_cid = replaces->cid;
+        atomic_store(&replaces->successor_cid, stream->cid);
+    } else if (peer_table_insert(stream_addrs, peer_key_from_addr(client_addr), stream) != 0) {
+        existing = find_stream_by_addr(client_addr);
+    }
+    pthread_mutex_unlock(&addr_lock);
+    if (existing) {
+        peer_table_remove(streams, stream->cid);
+        return existing;
+    }
+    if (watch_stream(&workers[worker], stream) != 0) {
+        remove_stream(stream);
+        return NULL;
+    }
+    if (replaces) {
+        log_info("New handshake from client %s, its session stays until it completes\n", log_addr(client_addr));
+    } else {
+        log_info("Handshake started with client %s\n", log_addr(client_addr));
+    }
+    return stream;
 }
 
-// Register new stream if client doesn't exist yet
-void register_stream(int stream_id, struct sockaddr_in *client_addr, socklen_t addr_len) {
-    pthread_mutex_lock(&streams_mutex);
-    
-    // First check if this client already exists
-    for (int i = 0; i < MAX_STREAMS; i++) {
-        if (streams[i].active && streams[i].client_addr.sin_addr.s_addr == client_addr->sin_addr.s_addr && streams[i].client_addr.sin_port == client_addr->sin_port) {
-            // Update the existing stream with new ID if needed
-            if (streams[i].stream_id != stream_id) {
-                printf("Updated stream ID for existing client %s:%d: %d -> %d\n", inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), streams[i].stream_id, stream_id); 
-                streams[i].stream_id = stream_id;
-            }
-            streams[i].last_activity = time(NULL);
-            pthread_mutex_unlock(&streams_mutex);
+// Unregister a stream: out of the address index first, then out of
+// streams, which frees it once no reader can still hold it. A handshake
+// waiting to replace it gets the address.
+static void remove_stream(stream_state_t *stream) {
+    pthread_mutex_lock(&addr_lock);
+    uint64_t key = atomic_load(&stream->addr_key);
+    if (peer_table_lookup(stream_addrs, key) == stream) {
+        peer_table_remove(stream_addrs, key);
+        stream_state_t *next = find_successor(stream);
+        if (next) peer_table_insert(stream_addrs, key, next);
+    }
+    pthread_mutex_unlock(&addr_lock);
+    peer_table_remove(streams, stream->cid);
+}
+
+// Log the congestion control and path MTU state of each of a stream's
+// paths, and the loss rate FEC measured
+static void report_stream(stream_state_t *stream) {
+    pthread_spin_lock(&stream->tx_lock);
+    for (unsigned i = 0; i < stream->mp.count; i++) {
+        const mp_path_t *path = &stream->mp.paths[i];
+        if (path->state == MP_PATH_UNUSED) continue;
+        // The first path keeps the log lines it had before there were others
+        char name[32] = "";
+        if (stream->mp.count > 1) snprintf(name, sizeof(name), " path %u (%s, %s)", i, log_addr(&path->addr), mp_path_state_name(path->state));
+        const recovery_t *r = &path->recovery;
+        log_info("Stream %d%s congestion (%s): srtt %.2f ms, min RTT %.2f ms, cwnd %llu bytes, %llu in flight, %llu sent, %llu lost, pacing %.1f Mbit/s\n",
+            stream->stream_id, name, r->cc.ops->name, r->smoothed_rtt_ns / 1e6, r->min_rtt_ns / 1e6, (unsigned long long)r->cc.cwnd,
+            (unsigned long long)r->bytes_in_flight, (unsigned long long)r->sent_packets, (unsigned long long)r->lost_packets,
+            r->cc.pacing_rate * 8 / 1e6);
+        const pmtud_t *p = &path->pmtud;
+        log_info("Stream %d%s MTU: %zu bytes (%s, up to %zu), %llu probes sent, %llu lost\n", stream->stream_id, *name ? name : " path", p->plpmtu,
+            p->state == PMTUD_COMPLETE ? "confirmed" : "searching", p->max, (unsigned long long)p->probes_sent,
+            (unsigned long long)p->probes_lost);
+    }
+    pthread_spin_unlock(&stream->tx_lock);
+    pthread_spin_lock(&stream->rx_lock);
+    if (stream->fec_rx) {
+        log_info("Stream %d FEC: %.2f%% of the client's packets lost on the way\n", stream->stream_id, fec_rx_loss(stream->fec_rx) * 100);
+    }
+    pthread_spin_unlock(&stream->rx_lock);
+}
+
+static bool min_tun_datagram(uint64_t key, void *value, void *arg) {
+    stream_state_t *stream = value;
+    size_t *min = arg;
+    size_t datagram = atomic_load(&stream->tun_datagram);
+    if (datagram && (*min == 0 || datagram < *min)) *min = datagram;
+    return true;
+}
+
+// Set the TUN MTU for the client with the smallest confirmed path MTU,
+// or for the base PLPMTU while none is confirmed. Caller holds
+// peer_table_read_lock.
+static void update_tun_mtu(void) {
+    const tun_t *tun = &workers[0].tun;
+    if (!tun_is_device(tun)) return;
+    size_t min = 0;
+    peer_table_foreach(streams, min_tun_datagram, &min);
+    size_t mtu = pmtud_tun_mtu((min ? min : PMTUD_BASE) - fec_overhead());
+    pthread_mutex_lock(&tun_mtu_lock);
+    if (mtu != tun_mtu) {
+        if (tun_set_mtu(tun, mtu) != 0) {
+            log_error("Setting the MTU of %s to %zu: %s\n", tun->name, mtu, strerror(errno));
+        } else {
+            log_info("%s MTU set to %zu for a path MTU of %zu\n", tun->name, mtu, min ? min : PMTUD_BASE);
+        }
+        tun_mtu = mtu;
+    }
+    pthread_mutex_unlock(&tun_mtu_lock);
+}
+
+// Periodic report of every worker (timer on worker 0), which also frees
+// what removed streams left retired
+static void report_workers(void *arg) {
+    peer_table_reclaim(stream_addrs);
+    peer_table_reclaim(streams);
+
+    for (int i = 0; i < num_workers; i++) {
+        worker_t *w = &workers[i];
+        log_info("Worker %d batching: socket packets per wakeup avg %.1f, sendmmsg avg %.1f, TUN packets per wakeup avg %.1f, %llu wakeups\n", w->id,
+            batch_stats_average(&w->metrics.rx_batch), batch_stats_average(&w->metrics.tx_batch), batch_stats_average(&w->metrics.tun_batch),
+            (unsigned long long)event_loop_wakeups(w->loop));
+        log_info("Worker %d offload: GSO %llu super-buffers (avg %.1f segments), GRO %llu super-buffers (avg %.1f segments)\n", w->id,
+            (unsigned long long)metric_get(&w->metrics.tx_batch.super_buffers), batch_stats_segments(&w->metrics.tx_batch),
+            (unsigned long long)metric_get(&w->metrics.rx_batch.super_buffers), batch_stats_segments(&w->metrics.rx_batch));
+        if (tun_offload) {
+            log_info("Worker %d TUN offload: %llu super-packets read (avg %.1f segments), %llu merged writes (avg %.1f segments)\n", w->id,
+                (unsigned long long)metric_get(&w->metrics.tun_batch.super_buffers), batch_stats_segments(&w->metrics.tun_batch),
+                (unsigned long long)metric_get(&w->metrics.tun_write_batch.super_buffers), batch_stats_segments(&w->metrics.tun_write_batch));
+        }
+        uint64_t packets = metric_get(&w->metrics.rx_batch.packets) + metric_get(&w->metrics.tun_batch.packets);
+        log_info("Worker %d payload copies: %llu for %llu packets\n", w->id,
+            (unsigned long long)event_loop_pool(w->loop)->copies, (unsigned long long)packets);
+        uint64_t full = metric_get(&w->handshakes_full), resumed = metric_get(&w->handshakes_resumed);
+        uint64_t handshakes = full + resumed, cpu_ns = metric_get(&w->handshake_cpu_ns);
+        log_info("Worker %d handshakes: %llu full, %llu resumed, %llu 0-RTT packets, %.0f us CPU each (%.0f per second per core)\n", w->id,
+            (unsigned long long)full, (unsigned long long)resumed, (unsigned long long)metric_get(&w->zero_rtt_packets),
+            handshakes ? cpu_ns / 1e3 / handshakes : 0.0, cpu_ns ? 1e9 * handshakes / cpu_ns : 0.0);
+        log_info("Worker %d coalescing: %.2f packets per datagram (%llu datagrams), %.1f us average added latency, %llu packets dropped queueing, %llu by CoDel\n", w->id,
+            coalesce_frames_per_datagram(&w->coalesce.stats), (unsigned long long)metric_get(&w->coalesce.stats.datagrams),
+            coalesce_average_hold_us(&w->coalesce.stats), (unsigned long long)metric_get(&w->coalesce.stats.dropped),
+            (unsigned long long)metric_get(&w->coalesce.stats.aqm_dropped));
+        const hdrcomp_stats_t *h = &w->hc_stats;
+        log_info("Worker %d header compression: %.1f bytes saved per TCP ACK (%llu), %.1f per TCP data packet (%llu), %.1f per UDP packet (%llu), %llu not compressible, %llu full headers, %llu asked for\n", w->id,
+            hdrcomp_saved_per_packet(h, HDRCOMP_TCP_ACK), (unsigned long long)metric_get(&h->packets[HDRCOMP_TCP_ACK]),
+            hdrcomp_saved_per_packet(h, HDRCOMP_TCP_DATA), (unsigned long long)metric_get(&h->packets[HDRCOMP_TCP_DATA]),
+            hdrcomp_saved_per_packet(h, HDRCOMP_UDP), (unsigned long long)metric_get(&h->packets[HDRCOMP_UDP]),
+            (unsigned long long)metric_get(&h->packets[HDRCOMP_PLAIN]), (unsigned long long)metric_get(&h->full),
+            (unsigned long long)metric_get(&h->resyncs));
+        if (fec_enabled) {
+            const fec_stats_t *f = &w->fec_stats;
+            log_info("Worker %d FEC: %llu packets sent in groups, %llu repairs sent, %llu received, %llu lost packets rebuilt\n", w->id,
+                (unsigned long long)metric_get(&f->sources), (unsigned long long)metric_get(&f->repairs_sent),
+                (unsigned long long)metric_get(&f->repairs_received), (unsigned long long)metric_get(&f->recovered));
+        }
+    }
+}
+
+// Prometheus output for the metrics socket (-m): the counters of every
+// worker, labelled with its index, then the per-worker extras
+static void render_metrics(FILE *out, void *arg) {
+    const metrics_t *sets[MAX_WORKERS];
+    const char *labels[MAX_WORKERS];
+    char names[MAX_WORKERS][16];
+    for (int i = 0; i < num_workers; i++) {
+        sets[i] = &workers[i].metrics;
+        snprintf(names[i], sizeof(names[i]), "worker=\"%d\"", i);
+        labels[i] = names[i];
+    }
+    metrics_render(out, sets, labels, num_workers);
+
+    metrics_family(out, "tunnel_coalesced_datagrams_total", "counter", "Datagrams sealed from coalesced TUN packets");
+    for (int i = 0; i < num_workers; i++) metrics_sample(out, "tunnel_coalesced_datagrams_total", labels[i], metric_get(&workers[i].coalesce.stats.datagrams));
+    metrics_family(out, "tunnel_coalesced_frames_total", "counter", "TUN packets carried in those datagrams");
+    for (int i = 0; i < num_workers; i++) metrics_sample(out, "tunnel_coalesced_frames_total", labels[i], metric_get(&workers[i].coalesce.stats.frames));
+    metrics_family(out, "tunnel_coalesce_dropped_total", "counter", "TUN packets dropped for a full coalescing queue");
+    for (int i = 0; i < num_workers; i++) metrics_sample(out, "tunnel_coalesce_dropped_total", labels[i], metric_get(&workers[i].coalesce.stats.dropped));
+    metrics_family(out, "tunnel_coalesce_codel_dropped_total", "counter", "TUN packets dropped by CoDel for waiting too long");
+    for (int i = 0; i < num_workers; i++) metrics_sample(out, "tunnel_coalesce_codel_dropped_total", labels[i], metric_get(&workers[i].coalesce.stats.aqm_dropped));
+    const hdrcomp_stats_t *hc_sets[MAX_WORKERS];
+    for (int i = 0; i < num_workers; i++) hc_sets[i] = &workers[i].hc_stats;
+    hdrcomp_render(out, hc_sets, labels, num_workers);
+    const fec_stats_t *fec_sets[MAX_WORKERS];
+    for (int i = 0; i < num_workers; i++) fec_sets[i] = &workers[i].fec_stats;
+    fec_render(out, fec_sets, labels, num_workers);
+    const mp_reorder_stats_t *reorder_sets[MAX_WORKERS];
+    for (int i = 0; i < num_workers; i++) reorder_sets[i] = &workers[i].reorder_stats;
+    mp_reorder_render(out, reorder_sets, labels, num_workers);
+    metrics_family(out, "tunnel_handshakes_total", "counter", "Completed handshakes, by kind");
+    for (int i = 0; i < num_workers; i++) {
+        char kind[48];
+        snprintf(kind, sizeof(kind), "%s,kind=\"full\"", labels[i]);
+        metrics_sample(out, "tunnel_handshakes_total", kind, metric_get(&workers[i].handshakes_full));
+        snprintf(kind, sizeof(kind), "%s,kind=\"resumed\"", labels[i]);
+        metrics_sample(out, "tunnel_handshakes_total", kind, metric_get(&workers[i].handshakes_resumed));
+    }
+    metrics_family(out, "tunnel_zero_rtt_packets_total", "counter", "0-RTT packets accepted");
+    for (int i = 0; i < num_workers; i++) metrics_sample(out, "tunnel_zero_rtt_packets_total", labels[i], metric_get(&workers[i].zero_rtt_packets));
+}
+
+// Encrypt the frames of one datagram for a stream in place as packet
+// pn: the cleartext header goes into the headroom and the AEAD tag into
+// the tailroom.
+void seal_for_stream(ptls_aead_context_t *encrypt_aead, pktbuf_t *pkt, uint64_t pn, size_t pn_len) {
+    uint8_t *plain = pkt->data;
+    size_t total_len = pkt->len;
+
+    // Cleartext header with the packet number truncated to what the
+    // client needs, given what it has acknowledged
+    uint8_t *hdr = pktbuf_push(pkt, packet_header_length(0, pn_len));
+    size_t hdr_len = packet_encode_header(hdr, 0, pn, pn_len);
+
+    // Encrypt packet, authenticating the header as associated data
+    pkt->len = hdr_len + ptls_aead_encrypt(encrypt_aead, plain, plain, total_len, pn, hdr, hdr_len);
+}
+
+// Route one TUN packet to the client owning its inner destination and
+// add it as a frame to the datagram being built for that client
+void route_tun_packet(worker_t *w, pktbuf_t *pkt) {
+    const uint8_t *packet = pkt->data;
+    size_t len = pkt->len;
+    int family;
+    const uint8_t *dst;
+    if (route_packet_addr(packet, len, true, &family, &dst) != 0) {
+        log_limited(LOG_LEVEL_WARN, "Dropping non-IP packet from TUN\n");
+        metrics_drop(&w->metrics, METRICS_DROP_MALFORMED);
+        return;
+    }
+
+    const route_entry_t *r = route_lookup(routes, family, dst);
+    if (!r) {
+        char text[INET6_ADDRSTRLEN];
+        inet_ntop(family, dst, text, sizeof(text));
+        log_limited(LOG_LEVEL_WARN, "No route to inner destination %s\n", text);
+        metrics_drop(&w->metrics, METRICS_DROP_NO_ROUTE);
+        return;
+    }
+
+    stream_state_t *stream = peer_table_lookup(streams, r->peer_key);
+    if (!stream || stream->peer_id != r->peer_id) {
+        // Owner expired; drop the stale learned route so it can be re-learned,
+        // unless another worker already gave the address to a new owner
+        if (r->learned) {
+            route_remove_if(routes, family, dst, family == AF_INET6 ? 128 : 32, r);
+        }
+        log_limited(LOG_LEVEL_WARN, "Route points at an expired stream, dropping packet\n");
+        metrics_drop(&w->metrics, METRICS_DROP_NO_ROUTE);
+        return;
+    }
+    if (!atomic_load_explicit(&stream->keys_ready, memory_order_acquire)) {
+        log_limited(LOG_LEVEL_WARN, "Stream %d has no session keys yet, dropping packet\n", stream->stream_id);
+        metrics_drop(&w->metrics, METRICS_DROP_NO_SESSION);
+        return;
+    }
+    if (!stream_aead(w, stream, true)) {
+        log_limited(LOG_LEVEL_ERROR, "Failed to create AEAD context for stream %d\n", stream->stream_id);
+        metrics_drop(&w->metrics, METRICS_DROP_NO_SESSION);
+        return;
+    }
+
+    // As a datagram, or compressed: the client's stream IDs name its own
+    // flows, which are not ours to echo. Any worker may read packets for
+    // the client, so the compressor is used under tx_lock.
+    int type = FRAME_DATAGRAM;
+    uint32_t id = 0;
+    uint8_t context;
+    pthread_spin_lock(&stream->tx_lock);
+    int compressed = hdrcomp_compress(&stream->hc_tx, pkt, frame_header_length(type, id, pkt->len), &context, &w->hc_stats);
+    pthread_spin_unlock(&stream->tx_lock);
+    if (compressed) {
+        type = compressed;
+        id = context;
+    }
+
+    if (coalesce_add(&w->coalesce, r->peer_key, stream->peer_id, type, id, pkt, atomic_load(&stream->plpmtu) - fec_overhead(), event_clock_ns()) != 0) {
+        log_limited(LOG_LEVEL_WARN, "No packet buffer for stream %d, dropping packet\n", stream->stream_id);
+        metrics_drop(&w->metrics, METRICS_DROP_NO_BUFFER);
+        if (compressed) {
+            pthread_spin_lock(&stream->tx_lock);
+            hdrcomp_on_dropped(&stream->hc_tx, context);
+            pthread_spin_unlock(&stream->tx_lock);
+        }
+    }
+}
+
+// Note when pmtud or the paths next need a look (see probe_path), which
+// includes when the packets in flight time out. Caller holds tx_lock.
+static void schedule_probe(stream_state_t *stream) {
+    uint64_t due = mp_next_due(&stream->mp);
+    if (!due && mp_mtu_confirmed(&stream->mp)) due = UINT64_MAX;
+    atomic_store(&stream->probe_ns, due);
+}
+
+// Seal the datagrams queued since the last flush in one pass, timing
+// the average per datagram. Their streams' AEAD contexts have to be
+// alive, so this runs inside data_plane_enter.
+static void seal_datagrams(worker_t *w) {
+    if (w->nseals == 0) return;
+    uint64_t start_ns = event_clock_ns();
+    crypto_seal_batch(w->seals, w->nseals);
+    metrics_observe(&w->metrics.stages[METRICS_STAGE_CRYPT], (event_clock_ns() - start_ns) / w->nseals);
+    w->nseals = 0;
+}
+
+// Send what the batch holds. A flush is one syscall for many packets,
+// so every one is timed.
+static void flush_datagrams(worker_t *w) {
+    seal_datagrams(w);
+    uint64_t start_ns = event_clock_ns();
+    if (dgram_batch_flush(w->sock, &w->tx, &w->metrics.tx_batch) < 0) {
+        log_limited(LOG_LEVEL_ERROR, "sendmmsg: %s\n", strerror(errno));
+    }
+    metrics_observe(&w->metrics.stages[METRICS_STAGE_SEND], event_clock_ns() - start_ns);
+}
+
+// Queue the frames of one datagram for a stream as packet pn, making
+// room in the send batch first. The cleartext header goes into the
+// headroom now; the frames are encrypted in place, with the AEAD tag
+// in the tailroom, with the rest of the batch when it is flushed.
+// Packets to a client carry no connection ID, as it has one session.
+static void queue_datagram(worker_t *w, ptls_aead_context_t *aead, pktbuf_t *pkt, uint64_t pn, size_t pn_len, const struct sockaddr_in *addr) {
+    if (w->tx.count == w->tx.capacity) flush_datagrams(w);
+    uint8_t *plain = pkt->data;
+    size_t plain_len = pkt->len;
+    uint8_t *hdr = pktbuf_push(pkt, packet_header_length(0, pn_len));
+    size_t hdr_len = packet_encode_header(hdr, 0, pn, pn_len);
+    w->seals[w->nseals++] = (crypto_seal_t){ aead, plain, plain_len, pn, hdr, hdr_len };
+    pkt->len = hdr_len + plain_len + aead->algo->tag_size;
+    metric_add(&w->metrics.tx_packets, 1);
+    metric_add(&w->metrics.tx_bytes, pkt->len);
+    dgram_batch_queue(&w->tx, pkt, addr);
+}
+
+// The most that an ACK, requests for full headers, our loss rate and the
+// connection ID may add to a datagram with room to spare. It is set aside
+// before a path is picked, so the window and pacer approve the datagram
+// as it goes out. Under rx_lock.
+static size_t extras_reserve(stream_state_t *stream, size_t room) {
+    size_t n = (ack_state_due(&stream->ack) ? FRAME_ACK_MAX : 0) + FRAME_HC_RESYNC_LEN * HDRCOMP_CONTEXTS +
+               (stream->fec_rx ? FRAME_FEC_LEN : 0) +
+               (atomic_load_explicit(&stream->cid_confirmed, memory_order_relaxed) ? 0 : FRAME_TOKEN_MAX);
+    return n < room ? n : room;
+}
+
+// The client's connection ID as a NEW_CONNECTION_ID frame, if there is
+// room and it does not use it yet. Returns the bytes written.
+static size_t take_cid_frame(stream_state_t *stream, uint8_t *out, size_t room) {
+    if (room < FRAME_TOKEN_MAX || atomic_load_explicit(&stream->cid_confirmed, memory_order_relaxed)) return 0;
+    uint8_t cid[FRAME_TOKEN_LEN];
+    for (size_t i = 0; i < FRAME_TOKEN_LEN; i++) {
+        cid[i] = (uint8_t)(stream->cid >> (8 * (FRAME_TOKEN_LEN - 1 - i)));
+    }
+    return frame_encode_token(out, FRAME_NEW_CONNECTION_ID, cid);
+}
+
+// Repair packet of a stream's FEC group, numbered under tx_lock and
+// queued once it is released
+typedef struct {
+    pktbuf_t *pkt;
+    uint64_t pn;
+    size_t pn_len;
+} repair_t;
+
+// Write, number and record on path the repairs of the stream's open FEC
+// group, and close it. They count as in flight, but go out whatever the
+// congestion window says: a window full of sources must not hold back
+// what rebuilds them. Caller holds tx_lock. Returns how many were taken.
+static size_t take_repairs(worker_t *w, stream_state_t *stream, mp_path_t *path, size_t tag_len, uint64_t now_ns, repair_t *out) {
+    fec_tx_t *fec = stream->fec_tx;
+    unsigned count = fec_tx_repairs(fec);
+    size_t n = 0;
+    for (unsigned row = 0; row < count; row++) {
+        pktbuf_t *pkt = pktbuf_alloc(event_loop_pool(w->loop));
+        if (!pkt) break;
+        pkt->len = fec_tx_repair(fec, row, pkt->data, pktbuf_tailroom(pkt) - tag_len, &w->fec_stats);
+        if (pkt->len == 0) {
+            pktbuf_put(pkt);
+            break;
+        }
+        uint64_t pn = stream->outgoing_packet_number++;
+        size_t pn_len = mp_pn_length(&stream->mp, pn);
+        mp_on_sent(path, pn, packet_header_length(0, pn_len) + pkt->len + tag_len, now_ns, true);
+        out[n++] = (repair_t){ pkt, pn, pn_len };
+    }
+    fec_tx_close(fec);
+    return n;
+}
+
+static void queue_repairs(worker_t *w, ptls_aead_context_t *aead, repair_t *repairs, size_t n, const struct sockaddr_in *to) {
+    for (size_t i = 0; i < n; i++) {
+        queue_datagram(w, aead, repairs[i].pkt, repairs[i].pn, repairs[i].pn_len, to);
+        pktbuf_put(repairs[i].pkt);
+    }
+}
+
+// Seal the frames coalesced for one client and queue the datagram on the
+// path the scheduler picks, if one's congestion window and pacer allow
+// it. An ACK for the client,
+// requests for full headers, our loss rate and its connection ID until
+// it uses it ride along if there is room. With FEC on, the datagram
+// joins a group, whose repairs follow once it is full or (see
+// send_pending_repairs) has been open long enough. Runs inside
+// data_plane_enter, and looks the stream up again since it may have
+// expired while the frames waited.
+static coalesce_result_t send_coalesced(void *arg, coalesce_slot_t *slot, coalesce_datagram_t *d, uint64_t now_ns, uint64_t *retry_ns) {
+    worker_t *w = arg;
+    pktbuf_t *pkt = d->pkt;
+    stream_state_t *stream = peer_table_lookup(streams, slot->key);
+    if (!stream || stream->peer_id != slot->peer_id) {
+        log_limited(LOG_LEVEL_WARN, "Stream expired with %zu packets queued, dropping them\n", d->frames);
+        metric_add(&w->metrics.drops[METRICS_DROP_EXPIRED], d->frames);
+        return COALESCE_DROPPED;
+    }
+    ptls_aead_context_t *aead = stream_aead(w, stream, true);
+    if (!aead) {
+        return COALESCE_DROPPED;
+    }
+
+    pthread_spin_lock(&stream->tx_lock);
+    size_t tag_len = aead->algo->tag_size;
+    // A source leaves room for its FEC_SOURCE frame and its repairs
+    size_t max_payload = mp_mtu(&stream->mp) - PACKET_HEADER_MAX - tag_len;
+    size_t fill = stream->fec_tx ? max_payload - FEC_OVERHEAD : max_payload;
+    size_t room = pktbuf_tailroom(pkt) - tag_len;
+    if (pkt->len + room > fill) {
+        room = pkt->len < fill ? fill - pkt->len : 0;
+    }
+    pthread_spin_lock(&stream->rx_lock);
+    room = extras_reserve(stream, room);
+    size_t frames = stream->fec_tx ? FRAME_FEC_SOURCE_LEN : 0;
+    mp_path_t *path = mp_select(&stream->mp, PACKET_HEADER_MAX + pkt->len + room + frames + tag_len, now_ns, retry_ns);
+    if (!path) {
+        pthread_spin_unlock(&stream->rx_lock);
+        pthread_spin_unlock(&stream->tx_lock);
+        return COALESCE_BLOCKED;
+    }
+    size_t extra = ack_state_take(&stream->ack, &stream->replay, now_ns, pkt->data + pkt->len, room);
+    extra += hdrcomp_take_resync(&stream->hc_rx, pkt->data + pkt->len + extra, room - extra);
+    if (stream->fec_rx) extra += fec_rx_take_report(stream->fec_rx, now_ns, pkt->data + pkt->len + extra, room - extra);
+    pthread_spin_unlock(&stream->rx_lock);
+    pkt->len += extra;
+    pkt->len += take_cid_frame(stream, pkt->data + pkt->len, room - extra);
+    uint64_t pn = stream->outgoing_packet_number++;
+    size_t pn_len = mp_pn_length(&stream->mp, pn);
+    bool source = stream->fec_tx && fec_tx_source(stream->fec_tx, pkt, pn, max_payload, now_ns, &w->fec_stats);
+    mp_on_sent(path, pn, packet_header_length(0, pn_len) + pkt->len + tag_len, now_ns, true);
+    repair_t repairs[FEC_MAX_REPAIRS];
+    size_t nrepairs = 0;
+    bool list = false;
+    if (source) {
+        uint64_t due = fec_tx_due(stream->fec_tx, mp_rtt(&stream->mp));
+        if (due <= now_ns) {
+            nrepairs = take_repairs(w, stream, path, tag_len, now_ns, repairs);
+        } else if (!stream->repairs_queued) {
+            list = stream->repairs_queued = true;
+        }
+    }
+    schedule_probe(stream);
+    struct sockaddr_in to = path->addr;
+    pthread_spin_unlock(&stream->tx_lock);
+
+    // On sampled datagrams, time how long their frames waited since the
+    // TUN read (on average)
+    if (metrics_timed(&w->metrics)) {
+        metrics_observe(&w->metrics.stages[METRICS_STAGE_TUN_READ], event_clock_ns() - d->arrival_sum_ns / d->frames);
+    }
+    queue_datagram(w, aead, pkt, pn, pn_len, &to);
+    queue_repairs(w, aead, repairs, nrepairs, &to);
+    if (list) {
+        if (w->npending_repairs < MAX_PENDING_REPAIRS) {
+            w->pending_repairs[w->npending_repairs].key = stream->cid;
+            w->pending_repairs[w->npending_repairs++].peer_id = stream->peer_id;
+        } else {
+            pthread_spin_lock(&stream->tx_lock);
+            stream->repairs_queued = false;
+            pthread_spin_unlock(&stream->tx_lock);
+        }
+    }
+    return COALESCE_SENT;
+}
+
+// Send a packet carrying only an ACK frame (and requests for full
+// headers, our loss rate, and the connection ID, see take_cid_frame) to
+// a client, on the path it last asked for one on. It is not acknowledged
+// itself, so it is neither tracked nor held back by the congestion
+// window. Returns false if no buffer was free.
+static bool send_ack(worker_t *w, stream_state_t *stream, uint64_t now_ns) {
+    ptls_aead_context_t *aead = stream_aead(w, stream, true);
+    pktbuf_t *pkt = pktbuf_alloc(event_loop_pool(w->loop));
+    if (!aead || !pkt) {
+        if (pkt) pktbuf_put(pkt);
+        return false;
+    }
+
+    uint64_t pn = 0;
+    size_t pn_len = 0;
+    pthread_spin_lock(&stream->tx_lock);
+    pthread_spin_lock(&stream->rx_lock);
+    pkt->len = ack_state_take(&stream->ack, &stream->replay, now_ns, pkt->data, FRAME_ACK_MAX);
+    pkt->len += hdrcomp_take_resync(&stream->hc_rx, pkt->data + pkt->len, FRAME_HC_RESYNC_LEN * HDRCOMP_CONTEXTS);
+    if (stream->fec_rx) pkt->len += fec_rx_take_report(stream->fec_rx, now_ns, pkt->data + pkt->len, FRAME_FEC_LEN);
+    stream->ack_queued = false;
+    unsigned ack_path = stream->ack_path;
+    pthread_spin_unlock(&stream->rx_lock);
+    pkt->len += take_cid_frame(stream, pkt->data + pkt->len, FRAME_TOKEN_MAX);
+    mp_path_t *path = mp_ack_path(&stream->mp, ack_path);
+    if (pkt->len > 0) {
+        pn = stream->outgoing_packet_number++;
+        pn_len = mp_pn_length(&stream->mp, pn);
+        mp_on_sent(path, pn, packet_header_length(0, pn_len) + pkt->len + aead->algo->tag_size, now_ns, false);
+    }
+    struct sockaddr_in to = path->addr;
+    pthread_spin_unlock(&stream->tx_lock);
+
+    if (pkt->len > 0) {
+        queue_datagram(w, aead, pkt, pn, pn_len, &to);
+    }
+    pktbuf_put(pkt);
+    return true;
+}
+
+// Follow a stream's path MTUs after pmtud ran or a path came or went:
+// each congestion controller's packet size, the datagram limit for its
+// frames (what every path in use carries) and its say in the TUN MTU,
+// which is raised once the searches complete but lowered at once when a
+// path shrinks. Caller holds tx_lock. Returns true if the TUN MTU needs
+// another look.
+static bool path_mtu_changed(stream_state_t *stream) {
+    for (unsigned i = 0; i < stream->mp.count; i++) {
+        mp_path_t *path = &stream->mp.paths[i];
+        if (path->state != MP_PATH_UNUSED) path->recovery.cc.mss = path->pmtud.plpmtu;
+    }
+    size_t mtu = mp_mtu(&stream->mp);
+    atomic_store(&stream->plpmtu, mtu);
+    schedule_probe(stream);
+
+    size_t vote = atomic_load(&stream->tun_datagram), next = vote;
+    if (mp_mtu_confirmed(&stream->mp) || mtu < vote) next = mtu;
+    if (next == vote) return false;
+    atomic_store(&stream->tun_datagram, next);
+    return true;
+}
+
+// Look after a client's paths: take those that failed out of use, and
+// send what is due on each, a path MTU probe (a PING frame padded out to
+// the size under test) or a bare PING on a path that is not in use or
+// idle. Packets go straight to the socket rather than into the batch, so
+// that a size the local interface refuses (EMSGSIZE) fails alone;
+// tx_lock stays held so that no other worker starts a probe meanwhile.
+// Caller is inside data_plane_enter.
+static void probe_path(worker_t *w, stream_state_t *stream, uint64_t now_ns) {
+    ptls_aead_context_t *aead = stream_aead(w, stream, true);
+    if (!aead) return;
+
+    pthread_spin_lock(&stream->tx_lock);
+    unsigned down = mp_check(&stream->mp, now_ns);
+    unsigned pings = mp_pings_due(&stream->mp, now_ns);
+    for (unsigned i = 0; i < stream->mp.count; i++) {
+        mp_path_t *path = &stream->mp.paths[i];
+        size_t size = path->state == MP_PATH_ACTIVE ? pmtud_probe_size(&path->pmtud, &path->recovery, now_ns) : 0;
+        if (!size && !(pings & 1u << i)) continue;
+        pktbuf_t *pkt = pktbuf_alloc(event_loop_pool(w->loop));
+        if (!pkt) break;
+        uint64_t pn = stream->outgoing_packet_number++;
+        size_t pn_len = mp_pn_length(&stream->mp, pn);
+        if (size) {
+            pkt->len = size - packet_header_length(0, pn_len) - aead->algo->tag_size;
+            memset(pkt->data, FRAME_PADDING, pkt->len);
+        } else {
+            pkt->len = 1;
+        }
+        pkt->data[0] = FRAME_PING;
+        // A probe may be lost to its size alone; a PING is a packet like any
+        mp_on_sent(path, pn, packet_header_length(0, pn_len) + pkt->len + aead->algo->tag_size, now_ns, !size);
+        bool refused = false;
+        seal_for_stream(aead, pkt, pn, pn_len);
+        if (sendto(w->sock, pkt->data, pkt->len, 0, (struct sockaddr *)&path->addr, sizeof(path->addr)) < 0) {
+            refused = errno == EMSGSIZE;
+        } else {
+            metric_add(&w->metrics.tx_packets, 1);
+            metric_add(&w->metrics.tx_bytes, pkt->len);
+        }
+        if (size) pmtud_on_probe_sent(&path->pmtud, pn, !refused, now_ns);
+        pktbuf_put(pkt);
+    }
+    bool changed = path_mtu_changed(stream);
+    unsigned active = mp_active(&stream->mp);
+    pthread_spin_unlock(&stream->tx_lock);
+    for (unsigned i = 0; i < MP_MAX_PATHS; i++) {
+        if (down & 1u << i) log_info("Stream %d path %u failed, %u left in use\n", stream->stream_id, i, active);
+    }
+    if (changed) update_tun_mtu();
+}
+
+// Send the ACKs that are due, unless data took them along already.
+// Returns when the next one is due, 0 if none is pending. Caller is
+// inside data_plane_enter.
+static uint64_t send_pending_acks(worker_t *w, uint64_t now_ns) {
+    uint64_t next = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < w->npending_acks; i++) {
+        stream_state_t *stream = peer_table_lookup(streams, w->pending_acks[i].key);
+        if (!stream || stream->peer_id != w->pending_acks[i].peer_id) continue;
+
+        pthread_spin_lock(&stream->rx_lock);
+        uint64_t due = ack_state_due(&stream->ack);
+        if (due == 0) stream->ack_queued = false;
+        pthread_spin_unlock(&stream->rx_lock);
+        if (due == 0 || (due <= now_ns && send_ack(w, stream, now_ns))) continue;
+
+        w->pending_acks[kept++] = w->pending_acks[i];
+        if (next == 0 || due < next) next = due;
+    }
+    w->npending_acks = kept;
+    return next;
+}
+
+// Send the repairs of the FEC groups this worker opened that have been
+// open long enough, though not full. Returns when the next are due, 0 if
+// no group is open. Caller is inside data_plane_enter.
+static uint64_t send_pending_repairs(worker_t *w, uint64_t now_ns) {
+    uint64_t next = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < w->npending_repairs; i++) {
+        stream_state_t *stream = peer_table_lookup(streams, w->pending_repairs[i].key);
+        if (!stream || stream->peer_id != w->pending_repairs[i].peer_id) continue;
+        ptls_aead_context_t *aead = stream_aead(w, stream, true);
+
+        repair_t repairs[FEC_MAX_REPAIRS];
+        size_t n = 0;
+        pthread_spin_lock(&stream->tx_lock);
+        uint64_t due = stream->fec_tx ? fec_tx_due(stream->fec_tx, mp_rtt(&stream->mp)) : 0;
+        mp_path_t *path = mp_fastest(&stream->mp);
+        if (due != 0 && due <= now_ns) {
+            if (aead) n = take_repairs(w, stream, path, aead->algo->tag_size, now_ns, repairs);
+            else fec_tx_close(stream->fec_tx);
+            due = 0;
+        }
+        if (due == 0) stream->repairs_queued = false;
+        struct sockaddr_in to = path->addr;
+        pthread_spin_unlock(&stream->tx_lock);
+        queue_repairs(w, aead, repairs, n, &to);
+        if (due == 0) continue;
+
+        w->pending_repairs[kept++] = w->pending_repairs[i];
+        if (next == 0 || due < next) next = due;
+    }
+    w->npending_repairs = kept;
+    return next;
+}
+
+// A stream's timer: expire the stream once it has been idle too long,
+// report on it every REPORT_INTERVAL, and probe its path when pmtud or
+// the packets in flight need a look while the client is quiet (packets
+// from the client take care of that otherwise). Rearmed for whichever
+// comes first; activity only moves the expiry, which is checked here.
+static void on_stream_timer(void *arg) {
+    stream_timer_t *t = arg;
+    worker_t *w = t->worker;
+    uint64_t now_ms = event_loop_now_ms(w->loop);
+    data_plane_enter();
+    stream_state_t *stream = peer_table_lookup(streams, t->cid);
+    if (!stream || stream->peer_id != t->peer_id) {
+        data_plane_exit();
+        free(t);
+        return;
+    }
+
+    bool established = atomic_load(&stream->established);
+    uint64_t expires_ms = atomic_load_explicit(&stream->last_activity, memory_order_relaxed) +
+        (uint64_t)(established ? STREAM_TIMEOUT : HANDSHAKE_TIMEOUT) * 1000;
+    if (now_ms >= expires_ms) {
+        log_info("Cleaning up inactive stream %d from %s\n", stream->stream_id, log_addr(&stream->client_addr));
+        // The TUN MTU may go up once the client that held it down has gone
+        bool voted = atomic_load(&stream->tun_datagram) != 0;
+        remove_stream(stream);
+        if (voted) update_tun_mtu();
+        data_plane_exit();
+        free(t);
+        return;
+    }
+    if (now_ms >= t->report_ms) {
+        if (established) report_stream(stream);
+        t->report_ms = now_ms + REPORT_INTERVAL * 1000;
+    }
+    uint64_t now_ns = event_clock_ns();
+    if (established && now_ns >= atomic_load(&stream->probe_ns)) probe_path(w, stream, now_ns);
+    uint64_t due = expires_ms < t->report_ms ? expires_ms : t->report_ms;
+    uint64_t probe_ns = atomic_load(&stream->probe_ns);
+    if (established && probe_ns > now_ns && probe_ns / 1000000 + 1 < due) due = probe_ns / 1000000 + 1;
+    data_plane_exit();
+    event_timer_arm(w->loop, &t->timer, due);
+}
+
+// Start the timer of a stream this worker registered
+static int watch_stream(worker_t *w, stream_state_t *stream) {
+    stream_timer_t *t = malloc(sizeof(*t));
+    if (!t) {
+        log_errno("Allocating stream timer");
+        return -1;
+    }
+    t->worker = w;
+    t->cid = stream->cid;
+    t->peer_id = stream->peer_id;
+    uint64_t now_ms = event_loop_now_ms(w->loop);
+    t->report_ms = now_ms + REPORT_INTERVAL * 1000;
+    event_timer_init(&t->timer, on_stream_timer, t);
+    event_timer_arm(w->loop, &t->timer, now_ms + HANDSHAKE_TIMEOUT * 1000);
+    return 0;
+}
+
+// Whether a packet from a client on one of its paths came from somewhere
+// other than where that path is known to lead (or the path is new)
+static bool path_moved(stream_state_t *stream, unsigned path, const struct sockaddr_in *addr) {
+    if (path == 0) return peer_key_from_addr(addr) != atomic_load(&stream->addr_key);
+    pthread_spin_lock(&stream->tx_lock);
+    bool moved = !mp_path_open_at(&stream->mp, path) || peer_key_from_addr(&stream->mp.paths[path].addr) != peer_key_from_addr(addr);
+    pthread_spin_unlock(&stream->tx_lock);
+    return moved;
+}
+
+// A packet under a client's connection ID came from another address on
+// one of its paths: the client may have roamed or been rebound by a NAT,
+// opened the path, or someone may be replaying its packets from
+// elsewhere. Send a PATH_CHALLENGE there and nothing else until it is
+// answered (see migrate_stream and validate_path), again at most once a
+// round trip while packets keep coming. Caller is inside
+// data_plane_enter.
+static void challenge_path(worker_t *w, stream_state_t *stream, unsigned path, const struct sockaddr_in *addr, uint64_t now_ns) {
+    ptls_aead_context_t *aead = stream_aead(w, stream, true);
+    pktbuf_t *pkt = aead ? pktbuf_alloc(event_loop_pool(w->loop)) : NULL;
+    if (!pkt) return;
+
+    pthread_spin_lock(&stream->tx_lock);
+    path_challenge_t *c = &stream->challenges[path];
+    bool same = c->sent_ns && peer_key_from_addr(&c->addr) == peer_key_from_addr(addr);
+    uint64_t retry_ns = mp_rtt(&stream->mp);
+    if (retry_ns < PATH_CHALLENGE_MIN_MS * 1000000ULL) retry_ns = PATH_CHALLENGE_MIN_MS * 1000000ULL;
+    bool send = !same || now_ns - c->sent_ns >= retry_ns;
+    uint64_t pn = 0;
+    size_t pn_len = 0;
+    if (send) {
+        if (!same) {
+            c->addr = *addr;
+            ptls_openssl_random_bytes(c->data, sizeof(c->data));
+        }
+        c->sent_ns = now_ns;
+        pkt->len = frame_encode_token(pkt->data, FRAME_PATH_CHALLENGE, c->data);
+        pn = stream->outgoing_packet_number++;
+        pn_len = mp_pn_length(&stream->mp, pn);
+        mp_on_sent(&stream->mp.paths[mp_path_open_at(&stream->mp, path) ? path : 0], pn,
+            packet_header_length(0, pn_len) + pkt->len + aead->algo->tag_size, now_ns, false);
+    }
+    pthread_spin_unlock(&stream->tx_lock);
+
+    if (send) {
+        if (!same) {
+            log_info("Stream %d seen at %s on path %u, validating it\n", stream->stream_id, log_addr(addr), path);
+        }
+        queue_datagram(w, aead, pkt, pn, pn_len, addr);
+    }
+    pktbuf_put(pkt);
+}
+
+// Whether response answers the challenge sent to addr on a path, which
+// is then settled. Caller holds tx_lock.
+static bool challenge_answered(stream_state_t *stream, unsigned path, const struct sockaddr_in *addr, const uint8_t *response) {
+    path_challenge_t *c = &stream->challenges[path];
+    bool valid = c->sent_ns && peer_key_from_addr(&c->addr) == peer_key_from_addr(addr) &&
+        memcmp(c->data, response, FRAME_TOKEN_LEN) == 0;
+    if (valid) c->sent_ns = 0;
+    return valid;
+}
+
+// The client answered a challenge from the address it went to on its
+// first path: move the session there. The connection ID, routes, keys
+// and packet numbers all stay; only the address index and where
+// datagrams go change. Loss recovery and the path MTU start over when
+// the client's IP address changed, but not for a new port alone (NAT
+// rebinding), where the path is the same. Caller is inside
+// data_plane_enter.
+static void migrate_stream(stream_state_t *stream, const struct sockaddr_in *addr, const uint8_t *response) {
+    pthread_mutex_lock(&addr_lock);
+    pthread_spin_lock(&stream->tx_lock);
+    bool valid = challenge_answered(stream, 0, addr, response);
+    struct sockaddr_in old = stream->client_addr;
+    bool new_host = valid && old.sin_addr.s_addr != addr->sin_addr.s_addr;
+    bool mtu_changed = false;
+    if (valid) {
+        stream->client_addr = *addr;
+        stream->mp.paths[0].addr = *addr;
+        atomic_store(&stream->addr_key, peer_key_from_addr(addr));
+    }
+    if (new_host) {
+        mp_path_reset(&stream->mp, 0, max_datagram);
+        bool voted = atomic_exchange(&stream->tun_datagram, 0) != 0;
+        mtu_changed = path_mtu_changed(stream) || voted;
+    }
+    pthread_spin_unlock(&stream->tx_lock);
+
+    // Another session may hold the new address; this one is still found
+    // by its connection ID then
+    uint64_t old_key = peer_key_from_addr(&old);
+    if (valid && peer_table_lookup(stream_addrs, old_key) == stream &&
+        peer_table_migrate(stream_addrs, old_key, peer_key_from_addr(addr)) != 0) {
+        peer_table_remove(stream_addrs, old_key);
+    }
+    pthread_mutex_unlock(&addr_lock);
+
+    if (valid) {
+        log_info("Stream %d moved from %s to %s%s\n", stream->stream_id, log_addr(&old), log_addr(addr),
+            new_host ? ", congestion state and path MTU reset" : "");
+    }
+    if (mtu_changed) update_tun_mtu();
+}
+
+// The client answered a challenge on one of its other paths: send there
+// on that path from now on. A new path starts out being probed, and is
+// used once a PING on it is acknowledged (see mp_on_ack); loss recovery
+// and the path MTU of one start over when it now leads to another host.
+// Caller is inside data_plane_enter.
+static void validate_path(stream_state_t *stream, unsigned path, const struct sockaddr_in *addr, const uint8_t *response) {
+    pthread_spin_lock(&stream->tx_lock);
+    bool valid = challenge_answered(stream, path, addr, response);
+    bool opened = valid && !mp_path_open_at(&stream->mp, path);
+    bool new_host = valid && !opened && stream->mp.paths[path].addr.sin_addr.s_addr != addr->sin_addr.s_addr;
+    int failed = 0;
+    bool mtu_changed = false;
+    if (opened) {
+        failed = mp_path_open(&stream->mp, path, addr, max_datagram);
+        schedule_probe(stream);
+    } else if (valid) {
+        stream->mp.paths[path].addr = *addr;
+    }
+    if (new_host) {
+        mp_path_reset(&stream->mp, path, max_datagram);
+        mtu_changed = path_mtu_changed(stream);
+    }
+    pthread_spin_unlock(&stream->tx_lock);
+
+    if (failed) {
+        log_limited(LOG_LEVEL_ERROR, "Out of memory opening path %u of stream %d\n", path, stream->stream_id);
+    } else if (opened) {
+        log_info("Stream %d opened path %u at %s\n", stream->stream_id, path, log_addr(addr));
+    } else if (valid) {
+        log_info("Stream %d path %u moved to %s%s\n", stream->stream_id, path, log_addr(addr),
+            new_host ? ", congestion state and path MTU reset" : "");
+    }
+    if (mtu_changed) update_tun_mtu();
+}
+
+// Rebuild the IP packet of a HC frame from the client into a buffer of
+// its own. Returns it, or NULL if it was dropped (a full header is then
+// asked for).
+static pktbuf_t *decompress_frame(worker_t *w, stream_state_t *stream, const frame_t *frame) {
+    pktbuf_t *out = pktbuf_alloc(event_loop_pool(w->loop));
+    if (!out) {
+        metrics_drop(&w->metrics, METRICS_DROP_NO_BUFFER);
+        return NULL;
+    }
+    pthread_spin_lock(&stream->rx_lock);
+    out->len = hdrcomp_decompress(&stream->hc_rx, frame->context, frame->data, frame->len, out->data, pktbuf_tailroom(out));
+    pthread_spin_unlock(&stream->rx_lock);
+    if (out->len == 0) {
+        log_limited(LOG_LEVEL_WARN, "Compressed packet from stream %d on unknown context %02x\n", stream->stream_id, frame->context);
+        metrics_drop(&w->metrics, METRICS_DROP_CONTEXT);
+        pktbuf_put(out);
+        return NULL;
+    }
+    return out;
+}
+
+// Write the IP packet of a data frame (STREAM, DATAGRAM, HC or HC_FULL)
+// from a client to TUN. pkt is the buffer the frame sits in.
+static void deliver_frame(worker_t *w, stream_state_t *stream, pktbuf_t *pkt, const frame_t *frame, struct sockaddr_in *client) {
+    // The frame's IP packet, where it was decrypted, or rebuilt into a
+    // buffer of its own from a compressed header
+    pktbuf_t *inner = pkt;
+    pkt->data = frame->data;
+    pkt->len = frame->len;
+    if (frame->type == FRAME_HC) {
+        inner = decompress_frame(w, stream, frame);
+        if (!inner) return;
+    } else if (frame->type == FRAME_HC_FULL) {
+        pthread_spin_lock(&stream->rx_lock);
+        int set_up = hdrcomp_full(&stream->hc_rx, frame->context, frame->data, frame->len);
+        pthread_spin_unlock(&stream->rx_lock);
+        if (set_up != 0) {
+            log_limited(LOG_LEVEL_WARN, "Malformed full header from client %s\n", log_addr(client));
+            metrics_drop(&w->metrics, METRICS_DROP_MALFORMED);
             return;
         }
     }
-    
-    // If not found, create a new stream
-    for (int i = 0; i < MAX_STREAMS; i++) {
-        if (!streams[i].active) {
-            streams[i].stream_id = stream_id;
-            memcpy(&streams[i].client_addr, client_addr, sizeof(struct sockaddr_in));
-            streams[i].addr_len = addr_len;
-            streams[i].active = true;
-            streams[i].last_activity = time(NULL);
-            streams[i].expected_packet_number = 1000;  // Starting value for incoming packets
-            streams[i].outgoing_packet_number = 2000;  // Starting value for outgoing packets
-            printf("Registered new stream ID %d for client %s:%d\n", stream_id, inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
-            pthread_mutex_unlock(&streams_mutex);
+
+    // Only accept inner sources this client owns, learning its address
+    if (!check_inner_source(stream, inner->data, inner->len)) {
+        log_limited(LOG_LEVEL_WARN, "Dropping packet with disallowed inner source from stream %d\n", stream->stream_id);
+        metrics_drop(&w->metrics, METRICS_DROP_SOURCE);
+    } else {
+        log_debug("Received packet from %s (stream %d, %zu bytes payload)\n", log_addr(client), frame->stream_id, inner->len);
+        event_write(w->loop, w->tun.write_fd, inner);
+        metric_add(&w->metrics.tun_tx_packets, 1);
+        metric_add(&w->metrics.tun_tx_bytes, inner->len);
+    }
+    if (inner != pkt) pktbuf_put(inner);
+}
+
+// Deliver the data frames of a client's payload that comes later than
+// its packet did (rebuilt by FEC, or held for reordering) to TUN. Its
+// other frames were about the past by now. Returns true if it had any.
+static bool deliver_data(worker_t *w, stream_state_t *stream, pktbuf_t *pkt, struct sockaddr_in *client) {
+    uint8_t *payload = pkt->data;
+    size_t len = pkt->len;
+    bool delivered = false;
+    size_t off = 0;
+    frame_t frame;
+    while (frame_next(payload, len, &off, &frame) > 0) {
+        if (frame.type == FRAME_STREAM || frame.type == FRAME_DATAGRAM || frame.type == FRAME_HC || frame.type == FRAME_HC_FULL) {
+            deliver_frame(w, stream, pkt, &frame, client);
+            delivered = true;
+        }
+    }
+    return delivered;
+}
+
+// Deliver the packets FEC rebuilt from a client's repairs as if they had
+// arrived: into the replay window, which drops those that did in the
+// end and has the others acknowledged, and their data frames to TUN.
+// Returns true if any were delivered.
+static bool deliver_rebuilt(worker_t *w, stream_state_t *stream, struct sockaddr_in *client) {
+    bool delivered = false;
+    for (;;) {
+        pktbuf_t *pkt = pktbuf_alloc(event_loop_pool(w->loop));
+        if (!pkt) {
+            metrics_drop(&w->metrics, METRICS_DROP_NO_BUFFER);
+            return delivered;
+        }
+        uint64_t pn;
+        pthread_spin_lock(&stream->rx_lock);
+        size_t len = fec_rx_take(stream->fec_rx, &pn, pkt->data, pktbuf_tailroom(pkt));
+        bool accepted = len > 0 && replay_update(&stream->replay, pn);
+        pthread_spin_unlock(&stream->rx_lock);
+        if (len == 0) {
+            pktbuf_put(pkt);
+            return delivered;
+        }
+        if (accepted) {
+            metric_add(&w->fec_stats.recovered, 1);
+            pkt->len = len;
+            if (deliver_data(w, stream, pkt, client)) delivered = true;
+        }
+        pktbuf_put(pkt);
+    }
+}
+
+// Deliver what a client's reorder buffer lets go by now. Returns true if
+// anything was delivered.
+static bool deliver_reordered(worker_t *w, stream_state_t *stream, struct sockaddr_in *client, uint64_t now_ns) {
+    bool delivered = false;
+    for (;;) {
+        pktbuf_t *pkt = pktbuf_alloc(event_loop_pool(w->loop));
+        if (!pkt) {
+            metrics_drop(&w->metrics, METRICS_DROP_NO_BUFFER);
+            return delivered;
+        }
+        uint64_t pn;
+        pthread_spin_lock(&stream->rx_lock);
+        size_t len = mp_reorder_pop(stream->reorder, now_ns, &pn, pkt->data, pktbuf_tailroom(pkt), &w->reorder_stats);
+        pthread_spin_unlock(&stream->rx_lock);
+        if (len == 0) {
+            pktbuf_put(pkt);
+            return delivered;
+        }
+        pkt->len = len;
+        if (deliver_data(w, stream, pkt, client)) delivered = true;
+        pktbuf_put(pkt);
+    }
+}
+
+// Keep a client whose reorder buffer holds packets on this worker's
+// list, so that they go once their gap is given up on even if nothing
+// else arrives (see deliver_pending_reorders)
+static void queue_reorder(worker_t *w, stream_state_t *stream) {
+    pthread_spin_lock(&stream->rx_lock);
+    bool list = mp_reorder_due(stream->reorder) != 0 && !stream->reorder_queued;
+    if (list) stream->reorder_queued = true;
+    pthread_spin_unlock(&stream->rx_lock);
+    if (!list) return;
+    if (w->npending_reorders < MAX_PENDING_REORDERS) {
+        w->pending_reorders[w->npending_reorders].key = stream->cid;
+        w->pending_reorders[w->npending_reorders++].peer_id = stream->peer_id;
+    } else {
+        pthread_spin_lock(&stream->rx_lock);
+        stream->reorder_queued = false;
+        pthread_spin_unlock(&stream->rx_lock);
+    }
+}
+
+// Deliver the held packets of the clients on this worker's list whose
+// gaps were waited for long enough. Returns when the next are due, 0 if
+// none are held. Caller is inside data_plane_enter.
+static uint64_t deliver_pending_reorders(worker_t *w, uint64_t now_ns) {
+    uint64_t next = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < w->npending_reorders; i++) {
+        stream_state_t *stream = peer_table_lookup(streams, w->pending_reorders[i].key);
+        if (!stream || stream->peer_id != w->pending_reorders[i].peer_id) continue;
+
+        pthread_spin_lock(&stream->rx_lock);
+        uint64_t due = mp_reorder_due(stream->reorder);
+        pthread_spin_unlock(&stream->rx_lock);
+        if (due != 0 && due <= now_ns) {
+            pthread_spin_lock(&stream->tx_lock);
+            struct sockaddr_in client = stream->client_addr;
+            pthread_spin_unlock(&stream->tx_lock);
+            deliver_reordered(w, stream, &client, now_ns);
+            pthread_spin_lock(&stream->rx_lock);
+            due = mp_reorder_due(stream->reorder);
+            pthread_spin_unlock(&stream->rx_lock);
+        }
+        if (due == 0) {
+            pthread_spin_lock(&stream->rx_lock);
+            stream->reorder_queued = false;
+            pthread_spin_unlock(&stream->rx_lock);
+            continue;
+        }
+
+        w->pending_reorders[kept++] = w->pending_reorders[i];
+        if (next == 0 || due < next) next = due;
+    }
+    w->npending_reorders = kept;
+    return next;
+}
+
+// The client's FEC frame. The first one sets FEC up for the session, if
+// it is on here: we take the client's repairs and report our loss rate,
+// which has it send them, and send repairs by its reports.
+static void fec_on_report(stream_state_t *stream, const frame_t *frame) {
+    pthread_spin_lock(&stream->tx_lock);
+    bool set_up = stream->fec_tx != NULL;
+    pthread_spin_unlock(&stream->tx_lock);
+    if (!set_up) {
+        fec_tx_t *tx = fec_tx_new(max_datagram);
+        fec_rx_t *rx = fec_rx_new(max_datagram);
+        if (!tx || !rx) {
+            log_limited(LOG_LEVEL_ERROR, "Out of memory setting up FEC for stream %d\n", stream->stream_id);
+            fec_tx_free(tx);
+            fec_rx_free(rx);
             return;
         }
+        pthread_spin_lock(&stream->tx_lock);
+        pthread_spin_lock(&stream->rx_lock);
+        if (!stream->fec_tx) {
+            stream->fec_tx = tx;
+            stream->fec_rx = rx;
+            tx = NULL;
+            rx = NULL;
+        }
+        pthread_spin_unlock(&stream->rx_lock);
+        pthread_spin_unlock(&stream->tx_lock);
+        fec_tx_free(tx);
+        fec_rx_free(rx);
+        log_info("FEC on for stream %d\n", stream->stream_id);
     }
-    fprintf(stderr, "No available slots for new stream\n");
-    pthread_mutex_unlock(&streams_mutex);
+    pthread_spin_lock(&stream->tx_lock);
+    fec_tx_on_report(stream->fec_tx, frame);
+    pthread_spin_unlock(&stream->tx_lock);
 }
 
-// Clean inactive streams periodically
-void* cleanup_thread(void *arg) {
-    while (1) {
-        sleep(60);  // Check every minute
-        time_t now = time(NULL);
-        pthread_mutex_lock(&streams_mutex);
-        for (int i = 0; i < MAX_STREAMS; i++) {
-            if (streams[i].active && (now - streams[i].last_activity) > 300) {  // 5 minutes timeout
-                printf("Cleaning up inactive stream %d from %s:%d\n", streams[i].stream_id, inet_ntoa(streams[i].client_addr.sin_addr), ntohs(streams[i].client_addr.sin_port));
-                streams[i].active = false;
+// Authenticate, replay-check and deliver one datagram from a client. It
+// is decrypted in place and each frame's IP packet written to TUN from
+// where it sits, or from its own buffer if its header was compressed.
+// Caller is inside data_plane_enter.
+static void handle_client_packet(worker_t *w, pktbuf_t *pkt, struct sockaddr_in *client, socklen_t clen) {
+    uint8_t *buf = pkt->data;
+    size_t len = pkt->len;
+    metrics_t *m = &w->metrics;
+    metric_add(&m->rx_packets, 1);
+    metric_add(&m->rx_bytes, len);
+    uint64_t start_ns = metrics_timed(m) ? event_clock_ns() : 0;    // 0: not timed
+
+    // Tunnel packets are only accepted once a handshake has begun. They
+    // name their session by connection ID, or by where they come from
+    // until the client has one.
+    uint64_t cid = packet_cid(buf, len);
+    stream_state_t *stream = cid ? peer_table_lookup(streams, cid) : find_stream_by_addr(client);
+    // 0-RTT from a client that restarted belongs to its new handshake
+    if (stream && !cid && (buf[0] & PACKET_LONG_HEADER)) {
+        stream_state_t *next = find_successor(stream);
+        if (next) stream = next;
+    }
+    if (!stream) {
+        log_limited(LOG_LEVEL_WARN, "Packet from client %s without a session\n", log_addr(client));
+        metrics_drop(m, METRICS_DROP_NO_SESSION);
+        return;
+    }
+
+    // Reconstruct the full packet number against what this peer sent last
+    packet_header_t hdr;
+    pthread_spin_lock(&stream->rx_lock);
+    int decoded = packet_decode_header(buf, len, stream->expected_packet_number, &hdr);
+    bool fresh = decoded == 0 && replay_check(&stream->replay, hdr.packet_number);
+    pthread_spin_unlock(&stream->rx_lock);
+    if (decoded != 0) {
+        log_limited(LOG_LEVEL_WARN, "Malformed header from client %s\n", log_addr(client));
+        metrics_drop(m, METRICS_DROP_MALFORMED);
+        return;
+    }
+
+    // Drop replays before spending an AEAD call on them
+    if (!fresh) {
+        log_limited(LOG_LEVEL_WARN, "Replayed or stale packet %llu from client %s\n", (unsigned long long)hdr.packet_number, log_addr(client));
+        metrics_drop(m, METRICS_DROP_REPLAY);
+        return;
+    }
+
+    // 0-RTT packets use the early key, the rest this worker's copy of the
+    // session key. Our replies may use that once our flight is out, but
+    // the client's only count once it has authenticated, with the
+    // handshake complete (0-RTT needs a ticket issued to a client that did).
+    uint8_t *decrypted = buf + hdr.header_len;
+    size_t dec_len = SIZE_MAX;
+    uint64_t crypt_ns = start_ns ? event_clock_ns() : 0;
+    if (hdr.zero_rtt) {
+        pthread_mutex_lock(&stream->hs_lock);
+        if (stream->early_aead) {
+            dec_len = ptls_aead_decrypt(stream->early_aead, decrypted, buf + hdr.header_len, len - hdr.header_len, hdr.packet_number, buf, hdr.header_len);
+        }
+        pthread_mutex_unlock(&stream->hs_lock);
+        if (dec_len != SIZE_MAX) metric_add(&w->zero_rtt_packets, 1);
+    } else if (atomic_load_explicit(&stream->keys_ready, memory_order_acquire) && atomic_load(&stream->established)) {
+        ptls_aead_context_t *aead = stream_aead(w, stream, false);
+        if (aead) {
+            dec_len = ptls_aead_decrypt(aead, decrypted, buf + hdr.header_len, len - hdr.header_len, hdr.packet_number, buf, hdr.header_len);
+        }
+    }
+
+    if (start_ns) metrics_observe(&m->stages[METRICS_STAGE_CRYPT], event_clock_ns() - crypt_ns);
+
+    if (dec_len == SIZE_MAX) {
+        log_limited(LOG_LEVEL_WARN, "Decryption failed for client %s\n", log_addr(client));
+        metrics_drop(m, METRICS_DROP_DECRYPT);
+        return;
+    }
+
+    // Record the packet number now that it authenticated
+    pthread_spin_lock(&stream->rx_lock);
+    bool accepted = replay_update(&stream->replay, hdr.packet_number);
+    bool largest = accepted && hdr.packet_number >= stream->expected_packet_number;
+    if (largest) {
+        stream->expected_packet_number = hdr.packet_number + 1;
+    }
+    bool rebuilt = accepted && stream->fec_rx && fec_rx_on_packet(stream->fec_rx, hdr.packet_number, decrypted, dec_len);
+    pthread_spin_unlock(&stream->rx_lock);
+    if (!accepted) {
+        log_limited(LOG_LEVEL_WARN, "Duplicate packet %llu on stream %d\n", (unsigned long long)hdr.packet_number, stream->stream_id);
+        metrics_drop(m, METRICS_DROP_REPLAY);
+        return;
+    }
+    atomic_store_explicit(&stream->last_activity, event_loop_now_ms(w->loop), memory_order_relaxed);
+
+    // The client has its connection ID once it uses it. Under the ID, a
+    // packet may come from a new address, or on another of the client's
+    // paths; its frames are taken (it authenticated), but replies go to
+    // the old one until the client proves it is at the new one.
+    if (hdr.cid && !atomic_load_explicit(&stream->cid_confirmed, memory_order_relaxed)) {
+        atomic_store(&stream->cid_confirmed, true);
+    }
+    unsigned path = hdr.cid ? mp_packet_path(decrypted, dec_len) : 0;
+    bool moved = hdr.cid && path_moved(stream, path, client);
+
+    // Once the client uses more than one path, its data frames go through
+    // a reorder buffer; a packet it holds is delivered from there
+    uint64_t now_ns = event_clock_ns();
+    if (path > 0 && !stream->reorder) {
+        mp_reorder_t *r = mp_reorder_new(max_datagram);
+        pthread_spin_lock(&stream->rx_lock);
+        if (!stream->reorder) {
+            stream->reorder = r;
+            r = NULL;
+        }
+        pthread_spin_unlock(&stream->rx_lock);
+        mp_reorder_free(r);
+    }
+    bool reorder = stream->reorder != NULL, held = false;
+    if (reorder) {
+        pthread_spin_lock(&stream->rx_lock);
+        held = mp_reorder_hold(stream->reorder, path, hdr.packet_number, decrypted, dec_len, now_ns, &w->reorder_stats);
+        pthread_spin_unlock(&stream->rx_lock);
+    }
+
+    bool ack_eliciting = false, acked = false;
+    size_t off = 0;
+    frame_t frame;
+    int more;
+    while ((more = frame_next(decrypted, dec_len, &off, &frame)) > 0) {
+        // Acknowledgements of what we sent feed loss recovery, and may
+        // let datagrams held back by the congestion window go
+        if (frame.type == FRAME_ACK) {
+            ack_frame_t ack;
+            if (frame_decode_ack(&frame, &ack) != 0) {
+                log_limited(LOG_LEVEL_WARN, "Invalid ACK frame from client %s\n", log_addr(client));
+                metrics_drop(m, METRICS_DROP_MALFORMED);
+                continue;
             }
+            bool confirmed = false, mtu_changed = false;
+            pthread_spin_lock(&stream->tx_lock);
+            unsigned up = mp_on_ack(&stream->mp, &ack, now_ns, &confirmed);
+            if (confirmed) {
+                atomic_store(&stream->probe_ns, 0);    // confirmed: next size
+            }
+            if (up) mtu_changed = path_mtu_changed(stream);
+            pthread_spin_unlock(&stream->tx_lock);
+            for (unsigned i = 0; i < MP_MAX_PATHS; i++) {
+                if (up & 1u << i) log_info("Stream %d path %u in use\n", stream->stream_id, i);
+            }
+            if (mtu_changed) update_tun_mtu();
+            coalesce_retry(&w->coalesce, stream->cid);
+            acked = true;
+            continue;
+        }
+        // Answer to a path challenge; the others only go to clients
+        if (frame.type == FRAME_PATH_RESPONSE) {
+            if (moved && path == 0) migrate_stream(stream, client, frame.data);
+            else if (moved) validate_path(stream, path, client, frame.data);
+            continue;
+        }
+        if (frame.type == FRAME_NEW_CONNECTION_ID || frame.type == FRAME_PATH_CHALLENGE || frame.type == FRAME_MP_PATH) {
+            continue;
+        }
+        // Path MTU probe: only asks for an acknowledgement
+        if (frame.type == FRAME_PING) {
+            ack_eliciting = true;
+            continue;
+        }
+        // The client could not rebuild our packets on a context
+        if (frame.type == FRAME_HC_RESYNC) {
+            pthread_spin_lock(&stream->tx_lock);
+            hdrcomp_on_resync(&stream->hc_tx, frame.context, &w->hc_stats);
+            pthread_spin_unlock(&stream->tx_lock);
+            continue;
+        }
+        // The client's loss rate; a source's tag was taken in above
+        if (frame.type == FRAME_FEC) {
+            if (fec_enabled) fec_on_report(stream, &frame);
+            continue;
         }
-        pthread_mutex_unlock(&streams_mutex);
+        if (frame.type == FRAME_FEC_SOURCE) {
+            continue;
+        }
+        ack_eliciting = true;
+        if (frame.type == FRAME_REPAIR) {
+            pthread_spin_lock(&stream->rx_lock);
+            if (stream->fec_rx && fec_rx_on_repair(stream->fec_rx, &frame, &w->fec_stats)) rebuilt = true;
+            pthread_spin_unlock(&stream->rx_lock);
+            continue;
+        }
+
+        if (!held) deliver_frame(w, stream, pkt, &frame, client);
+    }
+    if (more < 0) {
+        log_limited(LOG_LEVEL_WARN, "Malformed frame from client %s\n", log_addr(client));
+        metrics_drop(m, METRICS_DROP_MALFORMED);
+    }
+    if (rebuilt && deliver_rebuilt(w, stream, client)) ack_eliciting = true;
+    if (reorder && !held) {
+        deliver_reordered(w, stream, client, now_ns);
+        queue_reorder(w, stream);
+    } else if (held) {
+        queue_reorder(w, stream);
+    }
+    if (start_ns) metrics_observe(&m->stages[METRICS_STAGE_RECV_TO_TUN], event_clock_ns() - start_ns);
+
+    // Only the newest packets from a new address start a migration, not
+    // ones that were merely reordered around it; on the other paths,
+    // which carry the older packets by design, any may
+    if (moved && (largest || path > 0) && path_moved(stream, path, client)) {
+        challenge_path(w, stream, path, client, now_ns);
+    }
+
+    // Owe the client an ACK; it goes out with the next datagram to it or
+    // on its own at the end of a wakeup, once due
+    pthread_spin_lock(&stream->rx_lock);
+    ack_state_on_received(&stream->ack, ack_eliciting, largest, now_ns);
+    if (ack_eliciting) stream->ack_path = path;
+    bool queue = ack_eliciting && !stream->ack_queued;
+    if (queue) stream->ack_queued = true;
+    pthread_spin_unlock(&stream->rx_lock);
+    if (queue) {
+        if (w->npending_acks < MAX_PENDING_ACKS) {
+            w->pending_acks[w->npending_acks].key = stream->cid;
+            w->pending_acks[w->npending_acks++].peer_id = stream->peer_id;
+        } else {
+            send_ack(w, stream, now_ns);
+        }
+    }
+
+    // Probe the path while the client is talking: when a probe is due,
+    // and on every ACK, which may confirm one or show a black hole
+    if (atomic_load(&stream->established) && (acked || now_ns >= atomic_load(&stream->probe_ns))) {
+        probe_path(w, stream, now_ns);
     }
-    return NULL;
 }
 
-int main() {
-    // Initialize all streams as inactive
-    memset(streams, 0, sizeof(streams));
+// A handshake from the address of an established session completed: the
+// client proved who it is, so it restarted, and its new session takes
+// the address over from the old one. Caller is inside data_plane_enter.
+static void replace_session(stream_state_t *stream) {
+    pthread_mutex_lock(&addr_lock);
+    uint64_t key = atomic_load(&stream->addr_key);
+    stream_state_t *old = peer_table_lookup(streams, stream->replaces_cid);
+    stream_state_t *holder = peer_table_lookup(stream_addrs, key);
+    if (old && holder == old) {
+        peer_table_remove(stream_addrs, key);
+        holder = NULL;
+    } else {
+        old = NULL;    // gone, or moved on to another address
+    }
+    if (!holder) peer_table_insert(stream_addrs, key, stream);
+    pthread_mutex_unlock(&addr_lock);
 
-    // Open and configure TUN device as tun0
-    char tun_device[IFNAMSIZ] = "tun0";
-    int tun_fd = open("/dev/net/tun", O_RDWR);
-    if (tun_fd < 0) { perror("Opening /dev/net/tun"); return 1; }
+    if (old) {
+        log_info("Stream %d of client %s replaced by a new session\n", old->stream_id, log_addr(&stream->client_addr));
+        bool voted = atomic_load(&old->tun_datagram) != 0;
+        remove_stream(old);
+        if (voted) update_tun_mtu();
+    }
+}
 
-    
-    struct ifreq ifr = {0};
-    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
-    strncpy(ifr.ifr_name, tun_device, IFNAMSIZ);
-    if (ioctl(tun_fd, TUNSETIFF, &ifr) < 0) {
-        perror("ioctl(TUNSETIFF)"); close(tun_fd); return 1;
+// Whether data, a first chunk of client handshake, starts another
+// handshake than the stream's
+static bool handshake_chunk_is_new(stream_state_t *stream, const uint8_t *data, size_t len) {
+    pthread_mutex_lock(&stream->hs_lock);
+    bool fresh = handshake_is_new(&stream->hs, data, len);
+    pthread_mutex_unlock(&stream->hs_lock);
+    return fresh;
+}
+
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Feed one chunk of a client's handshake and answer it. Handshakes are
+// rare next to tunnel packets, so they are answered straight from the
+// socket instead of going through the send batch. Caller is inside
+// data_plane_enter.
+static void handle_handshake_packet(worker_t *w, pktbuf_t *pkt, struct sockaddr_in *client, socklen_t clen) {
+    uint32_t offset;
+    const uint8_t *data;
+    size_t len;
+    if (handshake_parse(pkt->data, pkt->len, &offset, &data, &len) != 0 || packet_type(pkt->data[0]) != PACKET_INITIAL) {
+        log_limited(LOG_LEVEL_WARN, "Unexpected handshake packet from client %s\n", log_addr(client));
+        metrics_drop(&w->metrics, METRICS_DROP_MALFORMED);
+        return;
+    }
+    // Unpadded, it would let a forged source get more back than it sent
+    if (pkt->len < HANDSHAKE_MIN_INITIAL) {
+        log_limited(LOG_LEVEL_WARN, "Short INITIAL (%zu bytes) from client %s\n", pkt->len, log_addr(client));
+        metrics_drop(&w->metrics, METRICS_DROP_MALFORMED);
+        return;
+    }
+
+    // A client that restarted on the same address begins a new session.
+    // Anyone can send an INITIAL from any address, so an established
+    // session there stays until the new handshake completes; meanwhile
+    // that runs in a stream of its own, which gets the rest of it.
+    stream_state_t *stream = find_stream_by_addr(client);
+    stream_state_t *session = NULL;
+    if (stream && atomic_load(&stream->established)) {
+        stream_state_t *next = find_successor(stream);
+        if (offset == 0 ? handshake_chunk_is_new(stream, data, len) : next != NULL) {
+            session = stream;
+            stream = next;
+        }
+    }
+    if (stream && offset == 0 && handshake_chunk_is_new(stream, data, len)) {
+        log_info("New handshake from client %s replaces its unfinished one\n", log_addr(client));
+        remove_stream(stream);
+        stream = NULL;
+    }
+    if (!stream) {
+        if (offset != 0) return;    // the start of this handshake was lost or expired
+        stream = register_stream(w->id, client, clen, session);
+        if (!stream) return;
+    }
+
+    uint64_t cpu_start = thread_cpu_ns();
+    pthread_mutex_lock(&stream->hs_lock);
+    handshake_t *hs = &stream->hs;
+    bool was_complete = hs->complete;
+    bool repeated;
+    handshake_on_datagram(hs, pkt->len);
+    if (handshake_input(hs, offset, data, len, &repeated) != 0) {
+        pthread_mutex_unlock(&stream->hs_lock);
+        log_limited(LOG_LEVEL_WARN, "Handshake with client %s failed\n", log_addr(client));
+        remove_stream(stream);
+        return;
+    }
+    atomic_store_explicit(&stream->last_activity, event_loop_now_ms(w->loop), memory_order_relaxed);
+
+    // Send what TLS produced; a repeated chunk means our flight was lost,
+    // unless it was held back for the client's address. Once complete, a
+    // repeat means DONE or part of the flight (the ticket, say) was lost,
+    // so both go again.
+    if (!was_complete || repeated) {
+        handshake_send(hs, w->sock, client, PACKET_HANDSHAKE, repeated && !handshake_send_blocked(hs));
     }
-    printf("TUN device %s opened\n", tun_device);
 
-    // Initialize socket
+    // Session keys exist once our flight is out, so replies can go to
+    // the client as soon as it has processed it
+    if (!atomic_load(&stream->keys_ready) && handshake_export(hs, HANDSHAKE_LABEL_SERVER, false, &stream->tx_secret) == 0 &&
+        handshake_export(hs, HANDSHAKE_LABEL_CLIENT, false, &stream->rx_secret) == 0) {
+        atomic_store_explicit(&stream->keys_ready, true, memory_order_release);
+    }
+    if (!stream->early_aead && !hs->complete) {
+        tunnel_secret_t early;
+        if (handshake_export(hs, HANDSHAKE_LABEL_EARLY, true, &early) == 0) {
+            stream->early_aead = tunnel_secret_aead(&early, false);
+            ptls_clear_memory(&early, sizeof(early));
+        }
+    }
+
+    if (hs->complete && !was_complete) {
+        metric_add(hs->resumed ? &w->handshakes_resumed : &w->handshakes_full, 1);
+        const ptls_cipher_suite_t *suite = stream->tx_secret.suite;
+        log_info("Handshake with client %s complete (%s) in %.2f ms, %s (%s)\n", log_addr(client),
+            hs->resumed ? "resumed" : "full", (hs->completed_ns - hs->started_ns) / 1e6,
+            suite ? suite->name : "no keys", suite ? crypto_engine_name(crypto_aead(suite)) : "-");
+        if (!atomic_load(&stream->keys_ready)) {
+            log_error("No session keys for client %s\n", log_addr(client));
+        }
+        if (stream->early_aead) {
+            ptls_aead_free(stream->early_aead);
+            stream->early_aead = NULL;
+        }
+        handshake_finish(hs);
+        atomic_store(&stream->established, true);
+    }
+    if (hs->complete && (repeated || !was_complete)) {
+        handshake_send_done(hs, w->sock, client);
+    }
+    bool completed = hs->complete && !was_complete;
+    pthread_mutex_unlock(&stream->hs_lock);
+    metric_add(&w->handshake_cpu_ns, thread_cpu_ns() - cpu_start);
+
+    // Only now does the client get its subnets, or the address of the
+    // session it replaces
+    if (completed) {
+        install_static_routes(stream);
+        if (stream->replaces_cid) replace_session(stream);
+    }
+}
+
+// Bind one UDP socket of the (optionally SO_REUSEPORT) listening group
+int open_udp_socket(bool reuseport) {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) { log_errno("socket"); return -1; }
+
+    int one = 1;
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        log_errno("setsockopt(SO_REUSEPORT)"); close(sock); return -1;
+    }
+
     struct sockaddr_in addr = {0};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(PORT);
-
-    // Bind socket
     if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind failed");
-        close(sock);
-        close(tun_fd);
-        return 1;
+        log_errno("bind failed"); close(sock); return -1;
     }
-    
-    printf("Server listening on port %d\n", PORT);
 
-    // Initialize the picotls AEAD contexts
-    ptls_cipher_suite_t *suite = ptls_openssl_cipher_suites[0];
-    ptls_aead_context_t *decrypt_aead = ptls_aead_new(suite->aead, suite->hash, 0, key, "key-label");
-    ptls_aead_context_t *encrypt_aead = ptls_aead_new(suite->aead, suite->hash, 1, key, "key-label");
+    // Datagrams are never fragmented; probes find what gets through
+    if (pmtud_socket_init(sock) < 0) {
+        log_errno("setsockopt(IP_MTU_DISCOVER)");
+    }
+    return sock;
+}
+
+// Steer each datagram to the socket of the worker pinned to the CPU that
+// received it, instead of the default 4-tuple hash (-s)
+int attach_reuseport_cbpf(int sock, int nworkers) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)nworkers },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
 
-    if (!decrypt_aead || !encrypt_aead) {
-        fprintf(stderr, "Failed to initialize AEAD contexts\n");
-        close(sock);
-        close(tun_fd);
-        return 1;
+// Steer each tunnel packet to the socket of the worker named in the
+// first byte of its connection ID, so that a client stays with the
+// worker that registered it whatever address it sends from. Handshakes
+// and packets without a connection ID get an index past the group, for
+// which the kernel falls back to the 4-tuple hash. The filter sees the
+// UDP payload; worker i owns the i-th socket bound.
+int attach_reuseport_cid_cbpf(int sock, int nworkers) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_B | BPF_ABS, 0, 0, 0 },
+        { BPF_JMP | BPF_JSET | BPF_K, 4, 0, PACKET_LONG_HEADER },
+        { BPF_JMP | BPF_JSET | BPF_K, 0, 3, PACKET_CID_BIT },
+        { BPF_LD | BPF_B | BPF_ABS, 0, 0, 1 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)nworkers },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+        { BPF_RET | BPF_K, 0, 0, UINT32_MAX },
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+// Event loop callbacks of one worker: its socket and its TUN queue only
+static void on_client_datagram(void *arg, pktbuf_t *pkt, struct sockaddr_in *from) {
+    worker_t *w = arg;
+    if (pkt->len > 0 && packet_is_handshake(pkt->data[0])) {
+        handle_handshake_packet(w, pkt, from, sizeof(*from));
+        return;
     }
-    
-    // Start the cleanup thread
-    pthread_t cleanup_tid;
-    if (pthread_create(&cleanup_tid, NULL, cleanup_thread, NULL) != 0) {
-        perror("Creating cleanup thread");
-    } else {
-        pthread_detach(cleanup_tid);
+    handle_client_packet(w, pkt, from, sizeof(*from));
+}
+
+static void on_tun_packet(void *arg, pktbuf_t *pkt, struct sockaddr_in *from) {
+    worker_t *w = arg;
+    metric_add(&w->metrics.tun_rx_packets, 1);
+    metric_add(&w->metrics.tun_rx_bytes, pkt->len);
+    if (pkt->len < 20) {
+        log_limited(LOG_LEVEL_WARN, "Packet too short for IP\n");
+        metrics_drop(&w->metrics, METRICS_DROP_MALFORMED);
+        return;
     }
 
-    // Keep server open indefinetly 
-    while (1) {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(sock, &fds);
-        FD_SET(tun_fd, &fds);
-        
-        int max_fd = (sock > tun_fd) ? sock : tun_fd;
-        
-        if (select(max_fd + 1, &fds, NULL, NULL, NULL) < 0) {
-            perror("select");
-            continue;
-        }
-        // Handle packet from client
-        if (FD_ISSET(sock, &fds)) {
-            struct sockaddr_in client;
-            socklen_t clen = sizeof(client);
-            uint8_t buf[BUFFER_SIZE], decrypted[BUFFER_SIZE];
-            int len = recvfrom(sock, buf, BUFFER_SIZE, 0, (struct sockaddr *)&client, &clen);
+    // Datagrams are sealed and queued as they fill up, the rest when
+    // the wakeup ends or their deadline passes
+    route_tun_packet(w, pkt);
+}
 
-            if (len <= 0) {
-                perror("recvfrom");
-                continue;
-            }
+// Each wakeup runs inside one data plane read section and ends by
+// sealing the datagrams that are due, adding the ACKs that are due and
+// sending whatever was queued
+static void worker_round_begin(void *arg) {
+    data_plane_enter();
+}
 
-            // Try initial decryption using a shared packet number (before registering stream)
-            uint64_t temp_packet_number = 1000;
-            size_t dec_len = ptls_aead_decrypt(decrypt_aead, decrypted, buf, len, temp_packet_number, NULL, 0);
+static void worker_round_end(void *arg);
 
-            if (dec_len == SIZE_MAX) {
-                fprintf(stderr, "Initial decryption failed for client %s:%d\n", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
-                continue;
-            }
+// Coalescing, pacing or ACK deadline with no packets arriving: a round
+// of its own
+static void on_send_deadline(void *arg) {
+    worker_round_begin(arg);
+    worker_round_end(arg);
+}
 
-            if (dec_len < 2 * sizeof(int)) {
-                fprintf(stderr, "Decrypted packet too short\n");
-                continue;
-            }
+static void worker_round_end(void *arg) {
+    worker_t *w = arg;
+    uint64_t now_ns = event_clock_ns();
+    coalesce_flush(&w->coalesce, now_ns);
+    uint64_t ack_due = send_pending_acks(w, now_ns);
+    uint64_t repair_due = send_pending_repairs(w, now_ns);
+    uint64_t reorder_due = deliver_pending_reorders(w, now_ns);
+    seal_datagrams(w);
+    data_plane_exit();
+    if (w->tx.count > 0) flush_datagrams(w);
+    uint64_t due = coalesce_next_deadline(&w->coalesce);
+    if (ack_due && (due == 0 || ack_due < due)) due = ack_due;
+    if (repair_due && (due == 0 || repair_due < due)) due = repair_due;
+    if (reorder_due && (due == 0 || reorder_due < due)) due = reorder_due;
+    event_set_deadline(w->loop, due, on_send_deadline, w);
+}
 
-            // Extract stream ID and payload length
-            int stream_id, payload_len;
-            memcpy(&stream_id, decrypted, sizeof(int));
-            memcpy(&payload_len, decrypted + sizeof(int), sizeof(int));
+void* worker_main(void *arg) {
+    worker_t *w = arg;
 
-            // Check for payload length
-            if (payload_len < 0 || payload_len > dec_len - 2 * sizeof(int)) {
-                fprintf(stderr, "Invalid payload length: %d\n", payload_len);
-                continue;
-            }
+    // Pin worker i to CPU i so CBPF steering and TUN queue selection line up
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers > 1 && ncpus > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->id % ncpus, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
 
-            // Register the stream using the known stream_id
-            register_stream(stream_id, &client, clen);
-            stream_state_t *stream = find_stream_by_addr(&client);
-            if (!stream) {
-                fprintf(stderr, "Failed to register new stream after decryption\n");
-                continue;
-            }
+    event_loop_run(w->loop);
+    log_error("Worker %d event loop stopped\n", w->id);
+    return NULL;
+}
 
-            // Increment expected packet number and refresh activity time
-            stream->expected_packet_number = temp_packet_number + 1;
-            stream->last_activity = time(NULL);
-            
-            printf("Received packet from %s:%d (stream %d, %d bytes payload)\n", 
-            inet_ntoa(client.sin_addr), ntohs(client.sin_port), stream_id, payload_len);
-
-            // Write the decrypted payload to the TUN device
-            ssize_t written = write(tun_fd, decrypted + 2 * sizeof(int), payload_len);
-            if (written != payload_len) {
-                perror("Writing to TUN");
+int main(int argc, char *argv[]) {
+    // Peer table capacity and per-client subnets are runtime settings
+    size_t max_streams = DEFAULT_MAX_STREAMS;
+    size_t batch_size = DEFAULT_BATCH_SIZE;
+    bool udp_offload = true;
+    bool cpu_steering = false;
+    event_backend_t backend = EVENT_BACKEND_AUTO;
+    const char *allowed_ips_file = NULL;
+    const char *cert_file = NULL;
+    const char *key_file = NULL;
+    const char *client_ca_file = NULL;
+    size_t link_mtu = PMTUD_DEFAULT_MTU;
+    crypto_cipher_t cipher = CRYPTO_CIPHER_AUTO;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:a:b:gw:se:C:k:V:F:K:OM:L:m:T:A:XS:")) != -1) {
+        switch (opt) {
+        case 'c':
+            max_streams = strtoul(optarg, NULL, 10);
+            if (max_streams == 0) {
+                fprintf(stderr, "Invalid stream capacity: %s\n", optarg);
+                return 1;
             }
-        }
-        // Handle packet packet back to client through TUN device
-        if (FD_ISSET(tun_fd, &fds)) {
-            uint8_t buffer[BUFFER_SIZE], encrypted[BUFFER_SIZE];
-            ssize_t len = read(tun_fd, buffer, BUFFER_SIZE);
-            
-            if (len <= 0) {
-                perror("Reading from TUN");
-                continue;
+            break;
+        case 'a':
+            allowed_ips_file = optarg;
+            break;
+        case 'b':
+            batch_size = strtoul(optarg, NULL, 10);
+            if (batch_size == 0 || batch_size > MAX_BATCH_SIZE) {
+                fprintf(stderr, "Batch size must be between 1 and %d\n", MAX_BATCH_SIZE);
+                return 1;
             }
-            
-            if (len < 20) {
-                fprintf(stderr, "Packet too short for IP\n");
-                continue;
+            break;
+        case 'g':
+            udp_offload = false;
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            if (num_workers == 0) {
+                // One per CPU, as far as the tables have reader slots
+                long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+                num_workers = ncpus > MAX_WORKERS ? MAX_WORKERS : ncpus;
+            }
+            if (num_workers < 1 || num_workers > MAX_WORKERS) {
+                fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_WORKERS);
+                return 1;
+            }
+            break;
+        case 's':
+            cpu_steering = true;
+            break;
+        case 'e':
+            if (event_backend_parse(optarg, &backend) != 0) {
+                fprintf(stderr, "Unknown event backend: %s (use auto, epoll or io_uring)\n", optarg);
+                return 1;
             }
-            
-            pthread_mutex_lock(&streams_mutex);
-            for (int i = 0; i < MAX_STREAMS; i++) {
-                if (!streams[i].active) continue;
-                
-                // Prepare packet header (stream_id + payload_length)
-                uint8_t packet[BUFFER_SIZE];
-                int stream_id = streams[i].stream_id;
-                int payload_len = len;
-                
-                memcpy(packet, &stream_id, sizeof(int));
-                memcpy(packet + sizeof(int), &payload_len, sizeof(int));
-                memcpy(packet + 2 * sizeof(int), buffer, len);
-                
-                size_t total_len = 2 * sizeof(int) + len;
-                // Encrypt packet
-                size_t enc_len = ptls_aead_encrypt(encrypt_aead, encrypted, packet, total_len, streams[i].outgoing_packet_number++, NULL, 0);
-                
-                if (enc_len == SIZE_MAX) {
-                    fprintf(stderr, "Encryption failed for stream %d\n", stream_id);
-                    continue;
-                }
-
-                // Reply to specific stream
-                ssize_t sent = sendto(sock, encrypted, enc_len, 0, (struct sockaddr *)&streams[i].client_addr, streams[i].addr_len);
-                
-                if (sent != enc_len) {
-                    perror("sendto");
-                } else {
-                    printf("Sent packet to %s:%d (stream %d, %d bytes)\n", inet_ntoa(streams[i].client_addr.sin_addr), ntohs(streams[i].client_addr.sin_port), stream_id, (int)len);
-                }
+            break;
+        case 'C':
+            cert_file = optarg;
+            break;
+        case 'k':
+            key_file = optarg;
+            break;
+        case 'V':
+            client_ca_file = optarg;
+            break;
+        case 'F':
+            coalesce_deadline_ns = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'K':
+            congestion = congestion_find(optarg);
+            if (!congestion) {
+                fprintf(stderr, "Unknown congestion controller: %s (use newreno or bbr)\n", optarg);
+                return 1;
             }
-            pthread_mutex_unlock(&streams_mutex);
+            break;
+        case 'O':
+            tun_offload = true;
+            break;
+        case 'M':
+            link_mtu = strtoul(optarg, NULL, 10);
+            if (link_mtu < PMTUD_MIN_MTU || link_mtu > PMTUD_MAX_MTU) {
+                fprintf(stderr, "Link MTU must be between %d and %d\n", PMTUD_MIN_MTU, PMTUD_MAX_MTU);
+                return 1;
+            }
+            break;
+        case 'L':
+            if (log_level_parse(optarg, &log_level) != 0) {
+                fprintf(stderr, "Unknown log level: %s (use error, warn, info or debug)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            metrics_path = optarg;
+            break;
+        case 'T':
+            tun_spec = optarg;
+            break;
+        case 'A':
+            if (crypto_cipher_parse(optarg, &cipher) != 0) {
+                fprintf(stderr, "Unknown cipher: %s (use auto, aes128gcm, aes256gcm or chacha20)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'X':
+            fec_enabled = true;
+            break;
+        case 'S':
+            if (mp_scheduler_parse(optarg, &scheduler) != 0) {
+                fprintf(stderr, "Unknown scheduler: %s (use minrtt or wrr)\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s -C cert.pem -k key.pem -V clients_ca.pem [-c max_streams] [-a allowed_ips_file] [-b batch_size] [-g] [-w workers] [-s] [-e backend] [-F flush_usec] [-K newreno|bbr] [-O] [-M mtu] [-L level] [-m metrics_socket] [-T tun_backend] [-A cipher] [-X] [-S minrtt|wrr]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!cert_file || !key_file) {
+        fprintf(stderr, "The server needs a certificate and its private key (-C cert.pem -k key.pem)\n");
+        return 1;
+    }
+    if (!client_ca_file) {
+        fprintf(stderr, "The server needs the certificates that clients are verified against (-V clients_ca.pem)\n");
+        return 1;
+    }
+    crypto_set_cipher(cipher);
+    if (handshake_server_config(&tls_config, cert_file, key_file, client_ca_file) != 0) {
+        return 1;
+    }
+    streams = peer_table_new(max_streams, free_stream);
+    stream_addrs = peer_table_new(max_streams, NULL);
+    routes = route_table_new();
+    workers = calloc(num_workers, sizeof(*workers));
+    if (!streams || !stream_addrs || !routes || !workers) {
+        log_error("Failed to allocate stream tables\n");
+        return 1;
+    }
+    if (allowed_ips_file && load_allowed_ips(allowed_ips_file) != 0) {
+        return 1;
+    }
+    max_datagram = link_mtu - PMTUD_UDP_OVERHEAD;
+
+    // Each worker gets a queue of tun0 and a socket in the reuseport group.
+    // More than one worker needs tun0 created with "multi_queue". Other
+    // backends are shared by the workers, or opened once per worker
+    // (pcap).
+    bool multi = num_workers > 1;
+    for (int i = 0; i < num_workers; i++) {
+        worker_t *w = &workers[i];
+        w->id = i;
+        if (tun_open(&w->tun, tun_spec, multi, tun_offload) != 0) return 1;
+        bool uso = false;
+        if (tun_offload && vnet_enable(w->tun.read_fd, &uso) != 0) return 1;
+        if (tun_offload && i == 0) log_info("TUN offload enabled: TSO%s\n", uso ? " and USO" : " (no USO in this kernel)");
+        w->sock = open_udp_socket(multi);
+        if (w->sock < 0) return 1;
+
+        // Datagram batches for recvmmsg/sendmmsg
+        w->seals = calloc(batch_size, sizeof(*w->seals));
+        if (dgram_batch_init(&w->rx, batch_size, max_datagram) != 0 || dgram_batch_init(&w->tx, batch_size, max_datagram + PACKET_MAX_OVERHEAD) != 0 || !w->seals) {
+            log_error("Failed to allocate packet batches\n");
+            return 1;
+        }
+
+        // UDP segmentation/receive offload, unless disabled with -g
+        if (udp_offload) {
+            bool gso = dgram_batch_enable_gso(&w->tx, w->sock) == 0;
+            bool gro = dgram_batch_enable_gro(&w->rx, w->sock) == 0;
+            if (i == 0) log_info("UDP GSO %s, UDP GRO %s\n", gso ? "enabled" : "unavailable", gro ? "enabled" : "unavailable");
+        }
+
+        // Event loop for this worker's socket and TUN queue. It is run
+        // (and its io_uring bound) on the worker thread.
+        w->loop = event_loop_new(backend, batch_size, max_datagram);
+        if (!w->loop) {
+            log_error("Failed to create event loop\n");
+            return 1;
+        }
+        if (event_add_dgram(w->loop, w->sock, &w->rx, &w->metrics.rx_batch, on_client_datagram, w) != 0 || event_add_tun(w->loop, w->tun.read_fd, &w->metrics.tun_batch, on_tun_packet, w) != 0) {
+            return 1;
+        }
+        if (tun_offload && event_tun_offload(w->loop, max_datagram - PMTUD_TUNNEL_OVERHEAD - fec_overhead(), &w->metrics.tun_write_batch) != 0) {
+            log_error("Failed to allocate TUN offload buffers\n");
+            return 1;
+        }
+        event_set_round(w->loop, worker_round_begin, worker_round_end, w);
+        if (coalesce_init(&w->coalesce, COALESCE_SLOTS, max_datagram, coalesce_deadline_ns, event_loop_pool(w->loop), send_coalesced, w) != 0) {
+            log_error("Failed to allocate coalescing slots\n");
+            return 1;
+        }
+
+        // Streams expire on their own timers; the first worker reports
+        if (i == 0) {
+            event_add_timer(w->loop, REPORT_INTERVAL * 1000, report_workers, NULL);
+            log_info("Event backend: %s\n", event_loop_backend(w->loop));
         }
     }
+    log_info("TUN %s opened with %d queue(s)\n", workers[0].tun.name, num_workers);
+    peer_table_read_lock(streams);
+    update_tun_mtu();
+    peer_table_read_unlock(streams);
+    log_info("Path MTU discovery: %d to %zu byte datagrams\n", PMTUD_BASE, max_datagram);
+    log_info("Server listening on port %d with %d worker(s)\n", PORT, num_workers);
+    log_info("Batched I/O enabled with up to %zu datagrams per syscall\n", batch_size);
+    if (coalesce_deadline_ns > 0) {
+        log_info("Coalescing packets for up to %llu us per datagram\n", (unsigned long long)(coalesce_deadline_ns / 1000));
+    } else {
+        log_info("Coalescing the packets of each wakeup\n");
+    }
+    log_info("Congestion control: %s, paced\n", congestion->name);
+    if (fec_enabled) {
+        log_info("FEC offered to clients that ask for it, %d bytes of each datagram kept for it\n", FEC_OVERHEAD);
+    }
+
+    if (multi) {
+        int attached = cpu_steering ? attach_reuseport_cbpf(workers[0].sock, num_workers) : attach_reuseport_cid_cbpf(workers[0].sock, num_workers);
+        if (attached < 0) {
+            log_errno("SO_ATTACH_REUSEPORT_CBPF, using default reuseport hashing");
+        } else {
+            log_info("Reuseport steering by %s enabled\n", cpu_steering ? "receiving CPU" : "connection ID");
+        }
+    }
+    if (metrics_path) {
+        if (metrics_serve(metrics_path, render_metrics, NULL) != 0) return 1;
+        log_info("Serving metrics on %s\n", metrics_path);
+    }
     
-    ptls_aead_free(encrypt_aead);
-    ptls_aead_free(decrypt_aead);
-    close(sock);
-    close(tun_fd);
+    // Keep server open indefinetly 
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            log_errno("Creating worker thread");
+            return 1;
+        }
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    for (int i = 0; i < num_workers; i++) {
+        worker_t *w = &workers[i];
+        coalesce_free(&w->coalesce);
+        event_loop_free(w->loop);
+        dgram_batch_free(&w->rx);
+        dgram_batch_free(&w->tx);
+        free(w->seals);
+        close(w->sock);
+        tun_close(&w->tun);
+    }
+    free(workers);
+    peer_table_free(stream_addrs);
+    peer_table_free(streams);
+    route_table_free(routes);
+    free(allowed_ips);
+    handshake_config_free(&tls_config);
     
     return 0;
 }
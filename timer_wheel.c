@@ -0,0 +1,157 @@
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) (TIMER_WHEEL_BITS * (level))
+#define WHEEL_SPAN ((uint64_t)1 << LEVEL_SHIFT(TIMER_WHEEL_LEVELS))    // ticks the top level reaches
+
+static void list_init(wheel_timer_t *head) {
+    head->next = head->prev = head;
+}
+
+static void set_occupied(timer_wheel_t *w, unsigned level, unsigned slot, bool occupied) {
+    uint64_t bit = (uint64_t)1 << (slot & 63);
+    if (occupied) {
+        w->occupied[level][slot >> 6] |= bit;
+    } else {
+        w->occupied[level][slot >> 6] &= ~bit;
+    }
+}
+
+// Slots from `from` to the first occupied one of a level, going round,
+// or -1 if it has none
+static int occupied_distance(const timer_wheel_t *w, unsigned level, unsigned from) {
+    for (unsigned i = 0; i <= TIMER_WHEEL_WORDS; i++) {
+        unsigned word = ((from >> 6) + i) % TIMER_WHEEL_WORDS;
+        uint64_t bits = w->occupied[level][word];
+        if (i == 0) bits &= ~(uint64_t)0 << (from & 63);
+        if (i == TIMER_WHEEL_WORDS) bits &= ~(~(uint64_t)0 << (from & 63));    // back round to from
+        if (bits) return (word * 64 + __builtin_ctzll(bits) - from) & SLOT_MASK;
+    }
+    return -1;
+}
+
+static void unlink_timer(timer_wheel_t *w, wheel_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    wheel_timer_t *head = &w->slots[t->level][t->slot];
+    if (head->next == head) set_occupied(w, t->level, t->slot, false);
+    t->next = t->prev = NULL;
+    w->armed--;
+}
+
+// File a timer in the lowest level that reaches its due tick, but no
+// earlier than tick `earliest`
+static void file_timer(timer_wheel_t *w, wheel_timer_t *t, uint64_t earliest) {
+    uint64_t due = t->due > earliest ? t->due : earliest;
+    uint64_t delta = due - w->now;
+    if (delta >= WHEEL_SPAN) {
+        due = w->now + WHEEL_SPAN - 1;    // re-filed when it gets there
+        delta = WHEEL_SPAN - 1;
+    }
+    unsigned level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << LEVEL_SHIFT(level + 1)) level++;
+    unsigned slot = (due >> LEVEL_SHIFT(level)) & SLOT_MASK;
+
+    wheel_timer_t *head = &w->slots[level][slot];
+    t->level = level;
+    t->slot = slot;
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    set_occupied(w, level, slot, true);
+    w->armed++;
+}
+
+void timer_wheel_init(timer_wheel_t *w, uint64_t now) {
+    w->now = now;
+    w->armed = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int word = 0; word < TIMER_WHEEL_WORDS; word++) w->occupied[level][word] = 0;
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) list_init(&w->slots[level][slot]);
+    }
+}
+
+void wheel_timer_init(wheel_timer_t *t, timer_wheel_fn fn, void *arg) {
+    t->next = t->prev = NULL;
+    t->due = 0;
+    t->level = t->slot = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void timer_wheel_arm(timer_wheel_t *w, wheel_timer_t *t, uint64_t due) {
+    if (wheel_timer_armed(t)) unlink_timer(w, t);
+    t->due = due;
+    file_timer(w, t, w->now + 1);
+}
+
+void timer_wheel_cancel(timer_wheel_t *w, wheel_timer_t *t) {
+    if (wheel_timer_armed(t)) unlink_timer(w, t);
+}
+
+uint64_t timer_wheel_next(const timer_wheel_t *w) {
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        // Slots after the current one, in the order the wheel reaches
+        // them; a timer in the current slot of an upper level is a
+        // full turn away, since that slot was cascaded when entered
+        unsigned shift = LEVEL_SHIFT(level);
+        int distance = occupied_distance(w, level, ((w->now >> shift) + 1) & SLOT_MASK);
+        if (distance < 0) continue;
+        uint64_t tick = ((w->now >> shift) + distance + 1) << shift;
+        if (tick < next) next = tick;
+    }
+    return next;
+}
+
+// Enter one tick: bring down the upper-level slots that start here, then
+// fire the level 0 slot
+static unsigned run_tick(timer_wheel_t *w) {
+    uint64_t tick = w->now;
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (tick & (((uint64_t)1 << LEVEL_SHIFT(level)) - 1)) break;
+        wheel_timer_t *head = &w->slots[level][(tick >> LEVEL_SHIFT(level)) & SLOT_MASK];
+        if (head->next == head) continue;
+
+        // Detach the list first: a timer beyond the top level's reach
+        // can land in the slot it came from
+        wheel_timer_t moved;
+        moved.next = head->next;
+        moved.prev = head->prev;
+        moved.next->prev = moved.prev->next = &moved;
+        list_init(head);
+        set_occupied(w, level, (tick >> LEVEL_SHIFT(level)) & SLOT_MASK, false);
+        while (moved.next != &moved) {
+            wheel_timer_t *t = moved.next;
+            moved.next = t->next;
+            t->next->prev = &moved;
+            w->armed--;
+            file_timer(w, t, tick);
+        }
+    }
+
+    unsigned fired = 0;
+    wheel_timer_t *head = &w->slots[0][tick & SLOT_MASK];
+    while (head->next != head) {
+        wheel_timer_t *t = head->next;
+        unlink_timer(w, t);
+        t->fn(t->arg);
+        fired++;
+    }
+    return fired;
+}
+
+unsigned timer_wheel_advance(timer_wheel_t *w, uint64_t now) {
+    unsigned fired = 0;
+    while (w->now < now) {
+        uint64_t next = timer_wheel_next(w);
+        if (next > now) {
+            w->now = now;
+            break;
+        }
+        w->now = next;
+        fired += run_tick(w);
+    }
+    return fired;
+}
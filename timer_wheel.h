@@ -0,0 +1,69 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel with millisecond ticks.
+//
+// Level 0 has one slot per tick for the next TIMER_WHEEL_SLOTS ms, and
+// each level above has slots TIMER_WHEEL_SLOTS times as wide. A timer is
+// filed in the lowest level whose span reaches its due tick and moved
+// down a level (cascaded) when the wheel reaches the start of its slot,
+// so it fires from level 0 on its tick. Timers further out than the top
+// level reaches are filed at its end and re-filed from there.
+//
+// Timers are intrusive list nodes embedded in the caller's state, so
+// arming, re-arming, cancelling and firing are O(1) and never allocate.
+// Occupancy bitmaps let the wheel find its next busy slot without
+// looking at the lists, and skip idle stretches in one step. Wide levels
+// keep cascades small: a timer a minute out comes down from a 256 ms
+// slot, with only the timers due in the same 256 ms. A wheel belongs to
+// one thread.
+
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4    // 256 ms, 65 s, 4.7 h and 50 days per turn
+#define TIMER_WHEEL_WORDS (TIMER_WHEEL_SLOTS / 64)
+
+typedef void (*timer_wheel_fn)(void *arg);
+
+typedef struct wheel_timer {
+    struct wheel_timer *next, *prev;    // NULL while not armed
+    uint64_t due;            // tick it fires on
+    uint8_t level, slot;     // where it is filed
+    timer_wheel_fn fn;
+    void *arg;
+} wheel_timer_t;
+
+typedef struct {
+    uint64_t now;            // last tick processed
+    uint64_t occupied[TIMER_WHEEL_LEVELS][TIMER_WHEEL_WORDS];    // non-empty slots, one bit each
+    wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];    // list heads
+    uint64_t armed;          // timers in the wheel
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t *w, uint64_t now);
+
+// Set up a timer before its first use
+void wheel_timer_init(wheel_timer_t *t, timer_wheel_fn fn, void *arg);
+
+static inline bool wheel_timer_armed(const wheel_timer_t *t) {
+    return t->next != NULL;
+}
+
+// Fire t on tick due, or on the next tick if due has passed. Re-arming
+// an armed timer moves it.
+void timer_wheel_arm(timer_wheel_t *w, wheel_timer_t *t, uint64_t due);
+void timer_wheel_cancel(timer_wheel_t *w, wheel_timer_t *t);
+
+// Process every tick up to now, firing the timers due. A callback may
+// arm or cancel any timer, itself included. Returns the number fired.
+unsigned timer_wheel_advance(timer_wheel_t *w, uint64_t now);
+
+// The next tick with work to do (a timer to fire or a slot to cascade),
+// or UINT64_MAX if no timer is armed
+uint64_t timer_wheel_next(const timer_wheel_t *w);
+
+#endif
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE    // O_DIRECT
+#include "tun.h"
+#include "log.h"
+#include "pcap_file.h"
+#include "pmtud.h"
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define REPLAY_BUF 65536
+#define REPLAY_POLL_MS 100
+
+struct tun_replay {
+    pcap_file_t file;
+    int fd;                  // our end of the socketpair
+    pthread_t thread;
+    _Atomic bool stop;
+    uint64_t sent, received;
+};
+
+static int open_device(tun_t *t, const char *name, bool multi_queue, bool vnet_hdr) {
+    int fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0) {
+        log_errno("Opening /dev/net/tun");
+        return -1;
+    }
+    struct ifreq ifr = {0};
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | (multi_queue ? IFF_MULTI_QUEUE : 0) | (vnet_hdr ? IFF_VNET_HDR : 0);
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        log_errno("ioctl(TUNSETIFF)");
+        close(fd);
+        return -1;
+    }
+    snprintf(t->name, sizeof(t->name), "%s", ifr.ifr_name);
+    t->read_fd = t->write_fd = fd;
+    return 0;
+}
+
+// An inherited descriptor, given as a number
+static int parse_fd(const char *text, const char **end) {
+    char *stop;
+    long fd = strtol(text, &stop, 10);
+    if (stop == text || fd < 0 || fd > 65535 || fcntl((int)fd, F_GETFD) < 0) return -1;
+    *end = stop;
+    return (int)fd;
+}
+
+// Feed the file's packets to the daemon's end and drain what it writes
+static void *replay_main(void *arg) {
+    tun_replay_t *r = arg;
+    uint8_t *buf = malloc(REPLAY_BUF);
+    size_t next = 0;
+    struct pollfd p = { r->fd, POLLIN | POLLOUT, 0 };
+    while (buf && !atomic_load(&r->stop)) {
+        if (poll(&p, 1, REPLAY_POLL_MS) <= 0) continue;
+        if (p.revents & (POLLHUP | POLLERR)) break;
+        while (recv(r->fd, buf, REPLAY_BUF, MSG_DONTWAIT) >= 0) r->received++;
+        for (;;) {
+            const pcap_packet_t *pkt = &r->file.packets[next];
+            if (send(r->fd, pkt->data, pkt->len, MSG_DONTWAIT) < 0) break;
+            r->sent++;
+            if (++next == r->file.count) next = 0;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int open_replay(tun_t *t, const char *path) {
+    tun_replay_t *r = calloc(1, sizeof(*r));
+    if (!r) return -1;
+    if (pcap_file_load(&r->file, path) != 0) {
+        free(r);
+        return -1;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        log_errno("socketpair");
+        pcap_file_free(&r->file);
+        free(r);
+        return -1;
+    }
+    r->fd = sv[1];
+    if (pthread_create(&r->thread, NULL, replay_main, r) != 0) {
+        log_error("Failed to start the pcap replay thread\n");
+        close(sv[0]);
+        close(sv[1]);
+        pcap_file_free(&r->file);
+        free(r);
+        return -1;
+    }
+    log_info("Replaying %zu packets from %s (%zu records skipped)\n", r->file.count, path, r->file.skipped);
+    t->read_fd = t->write_fd = sv[0];
+    t->replay = r;
+    return 0;
+}
+
+int tun_open(tun_t *t, const char *spec, bool multi_queue, bool vnet_hdr) {
+    memset(t, 0, sizeof(*t));
+    t->read_fd = t->write_fd = -1;
+    const char *colon = strchr(spec, ':');
+    size_t kind_len = colon ? (size_t)(colon - spec) : 0;
+    const char *arg = colon ? colon + 1 : spec;
+
+    if (!colon || (kind_len == 3 && strncmp(spec, "tun", 3) == 0)) {
+        t->kind = TUN_DEVICE;
+        return open_device(t, arg, multi_queue, vnet_hdr);
+    }
+    if (vnet_hdr) {
+        log_error("%s: TUN offload needs a tun device\n", spec);
+        return -1;
+    }
+    snprintf(t->name, sizeof(t->name), "%s", spec);
+
+    const char *end;
+    if (kind_len == 6 && strncmp(spec, "socket", 6) == 0) {
+        t->kind = TUN_SOCKET;
+        t->read_fd = t->write_fd = parse_fd(arg, &end);
+        if (t->read_fd >= 0 && *end == '\0') return 0;
+    } else if (kind_len == 4 && strncmp(spec, "pipe", 4) == 0) {
+        t->kind = TUN_PIPE;
+        t->read_fd = parse_fd(arg, &end);
+        if (t->read_fd >= 0 && *end == ',') {
+            t->write_fd = parse_fd(end + 1, &end);
+            if (t->write_fd >= 0 && *end == '\0') {
+                // Without packet mode, writes could run together in the pipe
+                if (!(fcntl(t->write_fd, F_GETFL) & O_DIRECT)) {
+                    log_warn("%s: the write pipe is not in packet mode (O_DIRECT)\n", spec);
+                }
+                return 0;
+            }
+        }
+    } else if (kind_len == 4 && strncmp(spec, "pcap", 4) == 0) {
+        t->kind = TUN_PCAP;
+        return open_replay(t, arg);
+    } else {
+        log_error("Unknown TUN backend: %s (use tun:NAME, socket:FD, pipe:RFD,WFD or pcap:FILE)\n", spec);
+        return -1;
+    }
+    log_error("%s: not an open file descriptor\n", spec);
+    return -1;
+}
+
+void tun_close(tun_t *t) {
+    tun_replay_t *r = t->replay;
+    if (r) {
+        atomic_store(&r->stop, true);
+        pthread_join(r->thread, NULL);
+        log_info("%s: %llu packets replayed, %llu written back\n", t->name, (unsigned long long)r->sent,
+            (unsigned long long)r->received);
+        close(r->fd);
+        pcap_file_free(&r->file);
+        free(r);
+    }
+    if (t->write_fd >= 0 && t->write_fd != t->read_fd) close(t->write_fd);
+    if (t->read_fd >= 0) close(t->read_fd);
+    t->read_fd = t->write_fd = -1;
+    t->replay = NULL;
+}
+
+int tun_set_mtu(const tun_t *t, size_t mtu) {
+    return tun_is_device(t) ? pmtud_set_mtu(t->name, mtu) : 0;
+}
@@ -0,0 +1,59 @@
+#ifndef TUN_H
+#define TUN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Where a daemon's inner IP packets come from and go to. Every backend
+// ends in file descriptors that the event loop reads and writes one
+// packet per call, so the data plane does not know which one it has:
+//
+//  tun     a /dev/net/tun device (the default; needs CAP_NET_ADMIN)
+//  socket  an AF_UNIX SOCK_SEQPACKET socket inherited from the parent
+//          process, e.g. one end of a socketpair held by the loopback
+//          benchmark
+//  pipe    two inherited pipes, one per direction, created in packet
+//          mode (pipe2 with O_DIRECT), which limits packets to PIPE_BUF
+//          (4096) bytes
+//  pcap    the IP packets of a capture file, replayed in a loop as fast
+//          as the daemon reads them by a thread of its own; what the
+//          daemon writes is counted and dropped
+//
+// A backend is named by a spec: "tun0" or "tun:tun0" (an empty name
+// lets the kernel pick one), "socket:FD", "pipe:RFD,WFD" or
+// "pcap:FILE". Only a tun device has an MTU or virtio-net offloads.
+
+typedef enum {
+    TUN_DEVICE,
+    TUN_SOCKET,
+    TUN_PIPE,
+    TUN_PCAP,
+} tun_kind_t;
+
+typedef struct tun_replay tun_replay_t;
+
+typedef struct {
+    tun_kind_t kind;
+    char name[64];           // device name as the kernel has it, else the spec
+    int read_fd;             // packets into the tunnel
+    int write_fd;            // packets out of it; the same fd but for pipes
+    tun_replay_t *replay;    // pcap: the replaying thread
+} tun_t;
+
+// Open a backend. multi_queue and vnet_hdr are for tun devices: one
+// queue of a multi-queue device, with a virtio-net header in front of
+// every packet (see vnet_enable). The other backends refuse vnet_hdr;
+// several workers may share a socket (each read takes a whole packet),
+// and each pcap backend opened replays the file on its own.
+int tun_open(tun_t *t, const char *spec, bool multi_queue, bool vnet_hdr);
+void tun_close(tun_t *t);
+
+static inline bool tun_is_device(const tun_t *t) {
+    return t->kind == TUN_DEVICE;
+}
+
+// Set the MTU of a tun device; nothing to do for the other backends
+int tun_set_mtu(const tun_t *t, size_t mtu);
+
+#endif
@@ -0,0 +1,356 @@
+#include "vnet.h"
+#include <arpa/inet.h>
+#include <linux/if_tun.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "log.h"
+
+// Newer than some installed kernel headers
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20
+#define TUN_F_USO6 0x40
+#endif
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#define VIRTIO_NET_HDR_GSO_UDP_L4 5
+#endif
+
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_CWR 0x80
+#define MAX_HEADERS 256    // IP header with extensions, plus TCP header
+
+int vnet_enable(int tun_fd, bool *uso) {
+    int size = VNET_HDR_LEN;
+    if (ioctl(tun_fd, TUNSETVNETHDRSZ, &size) < 0) {
+        log_errno("ioctl(TUNSETVNETHDRSZ)");
+        return -1;
+    }
+    unsigned offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+    *uso = ioctl(tun_fd, TUNSETOFFLOAD, offloads | TUN_F_USO4 | TUN_F_USO6) == 0;
+    if (!*uso && ioctl(tun_fd, TUNSETOFFLOAD, offloads) < 0) {
+        log_errno("ioctl(TUNSETOFFLOAD)");
+        return -1;
+    }
+    return 0;
+}
+
+// ---- checksums ----
+
+// Ones' complement sum of len bytes. Summing in host order and storing
+// the result the same way gives the right bytes on the wire.
+static uint64_t csum_add(uint64_t sum, const uint8_t *p, size_t len) {
+    while (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        sum += w;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        sum += w;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        uint16_t w = 0;
+        memcpy(&w, p, 1);
+        sum += w;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint64_t sum) {
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+// Pseudo-header of a transport checksum
+static uint64_t pseudo_sum(const uint8_t *ip, uint8_t proto, size_t l4_len) {
+    bool v4 = ip[0] >> 4 == 4;
+    uint64_t sum = v4 ? csum_add(0, ip + 12, 8) : csum_add(0, ip + 8, 32);
+    return sum + htons(proto) + htons((uint16_t)l4_len);
+}
+
+static void put_csum(uint8_t *field, uint16_t csum) {
+    memcpy(field, &csum, 2);
+}
+
+static void ipv4_set_csum(uint8_t *ip) {
+    size_t ihl = (ip[0] & 0x0f) * 4;
+    put_csum(ip + 10, 0);
+    put_csum(ip + 10, (uint16_t)~csum_fold(csum_add(0, ip, ihl)));
+}
+
+// Set the IP length fields for a packet of len bytes
+static void ip_set_length(uint8_t *ip, size_t len) {
+    if (ip[0] >> 4 == 4) {
+        ip[2] = (uint8_t)(len >> 8);
+        ip[3] = (uint8_t)len;
+    } else {
+        ip[4] = (uint8_t)((len - 40) >> 8);
+        ip[5] = (uint8_t)(len - 40);
+    }
+}
+
+// ---- segmentation ----
+
+int vnet_segment(uint8_t *buf, size_t len, size_t max_len, vnet_emit_fn emit, void *arg) {
+    struct virtio_net_hdr h;
+    if (len < VNET_HDR_LEN) return -1;
+    memcpy(&h, buf, sizeof(h));
+    uint8_t *ip = buf + VNET_HDR_LEN;
+    size_t ip_len = len - VNET_HDR_LEN;
+    if (ip_len < 20) return -1;
+    bool v4 = ip[0] >> 4 == 4;
+
+    uint8_t gso_type = h.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    if (gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+        // The kernel left the checksum to us: it holds the pseudo-header sum
+        if (h.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            if ((size_t)h.csum_start + h.csum_offset + 2 > ip_len) return -1;
+            uint16_t csum = ~csum_fold(csum_add(0, ip + h.csum_start, ip_len - h.csum_start));
+            put_csum(ip + h.csum_start + h.csum_offset, csum);
+        }
+        pktbuf_t pkt = pktbuf_view(ip, ip_len);
+        emit(arg, &pkt);
+        return 1;
+    }
+
+    bool tcp = gso_type == VIRTIO_NET_HDR_GSO_TCPV4 || gso_type == VIRTIO_NET_HDR_GSO_TCPV6;
+    if (!tcp && gso_type != VIRTIO_NET_HDR_GSO_UDP_L4) return -1;
+    size_t l3_len = h.csum_start;
+    if (l3_len < 20 || l3_len + (tcp ? 20 : 8) > ip_len) return -1;
+    size_t hdr_len = l3_len + (tcp ? (ip[l3_len + 12] >> 4) * 4 : 8);
+    if (hdr_len > ip_len || hdr_len > MAX_HEADERS || h.gso_size == 0) return -1;
+
+    // Cut at the size the sender asked for, or smaller if that would not
+    // fit in a tunnel datagram
+    size_t seg = h.gso_size;
+    if (hdr_len + seg > max_len && max_len > hdr_len) seg = max_len - hdr_len;
+
+    // Each segment's headers are copied in front of its payload, over the
+    // tail of the previous segment, which has been emitted by then
+    uint8_t tmpl[MAX_HEADERS];
+    memcpy(tmpl, ip, hdr_len);
+    uint8_t *l4 = tmpl + l3_len;
+    uint32_t seq = (uint32_t)l4[4] << 24 | (uint32_t)l4[5] << 16 | (uint32_t)l4[6] << 8 | l4[7];
+    uint16_t id = (uint16_t)(tmpl[4] << 8 | tmpl[5]);
+    uint8_t flags = tcp ? l4[13] : 0;
+
+    size_t payload = ip_len - hdr_len;
+    int n = 0;
+    for (size_t off = 0; off < payload; off += seg, n++) {
+        size_t chunk = payload - off < seg ? payload - off : seg;
+        bool last = off + chunk == payload;
+        uint8_t *p = ip + off;
+        if (off > 0) memcpy(p, tmpl, hdr_len);
+
+        size_t seg_len = hdr_len + chunk;
+        ip_set_length(p, seg_len);
+        if (v4) {
+            p[4] = (uint8_t)((id + n) >> 8);
+            p[5] = (uint8_t)(id + n);
+            ipv4_set_csum(p);
+        }
+        uint8_t *th = p + l3_len;
+        size_t l4_len = seg_len - l3_len;
+        uint8_t *csum_field;
+        if (tcp) {
+            uint32_t s = seq + (uint32_t)off;
+            th[4] = (uint8_t)(s >> 24);
+            th[5] = (uint8_t)(s >> 16);
+            th[6] = (uint8_t)(s >> 8);
+            th[7] = (uint8_t)s;
+            th[13] = flags;
+            if (!last) th[13] &= ~(TCP_FIN | TCP_PSH);
+            if (off > 0) th[13] &= ~TCP_CWR;
+            csum_field = th + 16;
+        } else {
+            th[4] = (uint8_t)(l4_len >> 8);
+            th[5] = (uint8_t)l4_len;
+            csum_field = th + 6;
+        }
+        put_csum(csum_field, 0);
+        uint16_t csum = ~csum_fold(csum_add(pseudo_sum(p, tcp ? IPPROTO_TCP : IPPROTO_UDP, l4_len), th, l4_len));
+        if (!tcp && csum == 0) csum = 0xffff;
+        put_csum(csum_field, csum);
+
+        pktbuf_t pkt = pktbuf_view(p, seg_len);
+        emit(arg, &pkt);
+    }
+    return n;
+}
+
+// ---- receive coalescing ----
+
+typedef struct {
+    size_t l3_len;
+    size_t hdr_len;
+    size_t payload;
+    uint8_t flags;
+} tcp_info_t;
+
+// Recognise an unfragmented TCP segment
+static bool parse_tcp(const uint8_t *ip, size_t len, tcp_info_t *t) {
+    if (len < 40) return false;
+    if (ip[0] >> 4 == 4) {
+        t->l3_len = (ip[0] & 0x0f) * 4;
+        if (t->l3_len < 20 || (size_t)(ip[2] << 8 | ip[3]) != len || ip[9] != IPPROTO_TCP) return false;
+        if ((ip[6] & 0x3f) || ip[7]) return false;    // a fragment
+    } else if (ip[0] >> 4 == 6) {
+        t->l3_len = 40;
+        if ((size_t)(ip[4] << 8 | ip[5]) + 40 != len || ip[6] != IPPROTO_TCP) return false;
+    } else {
+        return false;
+    }
+    if (t->l3_len + 20 > len) return false;
+    const uint8_t *th = ip + t->l3_len;
+    t->hdr_len = t->l3_len + (th[12] >> 4) * 4;
+    if (t->hdr_len < t->l3_len + 20 || t->hdr_len > len) return false;
+    t->payload = len - t->hdr_len;
+    t->flags = th[13];
+    return true;
+}
+
+// Same addresses and ports
+static bool same_flow(const uint8_t *a, const uint8_t *b, size_t l3_len) {
+    if (a[0] >> 4 != b[0] >> 4) return false;
+    bool v4 = a[0] >> 4 == 4;
+    if (v4 ? memcmp(a + 12, b + 12, 8) != 0 : memcmp(a + 8, b + 8, 32) != 0) return false;
+    return memcmp(a + l3_len, b + l3_len, 4) == 0;
+}
+
+// The next segment of what f holds, with nothing in its headers that
+// merging would lose
+static bool can_merge(const vnet_gro_flow_t *f, const uint8_t *ip, const tcp_info_t *t) {
+    const uint8_t *held = f->pkt->data;
+    if (t->hdr_len != f->hdr_len || t->l3_len != f->l3_len || t->payload == 0 || t->payload > f->seg_size) return false;
+    if ((t->flags & ~TCP_PSH) != TCP_ACK) return false;
+    if (f->pkt->len + t->payload > VNET_MAX_PACKET || pktbuf_tailroom(f->pkt) < t->payload) return false;
+    if (ip[0] >> 4 == 4) {
+        if (ip[1] != held[1] || (ip[6] & 0x40) != (held[6] & 0x40) || ip[8] != held[8]) return false;
+    } else {
+        if (memcmp(ip, held, 4) != 0 || ip[7] != held[7]) return false;
+    }
+    const uint8_t *th = ip + t->l3_len, *hth = held + f->l3_len;
+    uint32_t seq = (uint32_t)th[4] << 24 | (uint32_t)th[5] << 16 | (uint32_t)th[6] << 8 | th[7];
+    return seq == f->next_seq && memcmp(th + 8, hth + 8, 4) == 0 && memcmp(th + 14, hth + 14, 2) == 0 &&
+           memcmp(th + 18, hth + 18, t->hdr_len - t->l3_len - 18) == 0;
+}
+
+int vnet_gro_init(vnet_gro_t *g, size_t buffers, vnet_write_fn write, void *arg) {
+    memset(g, 0, sizeof(*g));
+    g->write = write;
+    g->arg = arg;
+    return pktbuf_pool_init(&g->pool, buffers, PKTBUF_HEADROOM + VNET_MAX_PACKET + PKTBUF_TAILROOM);
+}
+
+void vnet_gro_free(vnet_gro_t *g) {
+    for (int i = 0; i < VNET_GRO_FLOWS; i++) {
+        if (g->flows[i].pkt) pktbuf_put(g->flows[i].pkt);
+    }
+    pktbuf_pool_free(&g->pool);
+}
+
+static void write_plain(vnet_gro_t *g, pktbuf_t *pkt) {
+    static const struct virtio_net_hdr none;
+    g->write(g->arg, &none, pkt);
+}
+
+// Write what a flow holds, as a GSO packet the kernel segments again if
+// it forwards it. A single segment goes out as it came.
+static void flush_flow(vnet_gro_t *g, vnet_gro_flow_t *f) {
+    pktbuf_t *pkt = f->pkt;
+    struct virtio_net_hdr h = {0};
+    f->pkt = NULL;
+    if (f->segments > 1) {
+        uint8_t *ip = pkt->data;
+        bool v4 = ip[0] >> 4 == 4;
+        ip_set_length(ip, pkt->len);
+        if (v4) ipv4_set_csum(ip);
+
+        // The kernel completes the checksum from the pseudo-header sum
+        size_t l4_len = pkt->len - f->l3_len;
+        put_csum(ip + f->l3_len + 16, csum_fold(pseudo_sum(ip, IPPROTO_TCP, l4_len)));
+        h.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        h.csum_start = f->l3_len;
+        h.csum_offset = 16;
+        h.gso_type = v4 ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+        h.gso_size = f->seg_size;
+        h.hdr_len = f->hdr_len;
+    }
+    g->write(g->arg, &h, pkt);
+    pktbuf_put(pkt);
+}
+
+void vnet_gro_add(vnet_gro_t *g, pktbuf_t *pkt) {
+    tcp_info_t t;
+    if (!parse_tcp(pkt->data, pkt->len, &t)) {
+        write_plain(g, pkt);
+        return;
+    }
+
+    vnet_gro_flow_t *f = NULL, *free_flow = NULL;
+    for (int i = 0; i < VNET_GRO_FLOWS; i++) {
+        vnet_gro_flow_t *c = &g->flows[i];
+        if (!c->pkt) {
+            if (!free_flow) free_flow = c;
+        } else if (c->l3_len == t.l3_len && same_flow(c->pkt->data, pkt->data, t.l3_len)) {
+            f = c;
+            break;
+        }
+    }
+
+    if (f && can_merge(f, pkt->data, &t)) {
+        memcpy(f->pkt->data + f->pkt->len, pkt->data + t.hdr_len, t.payload);
+        f->pkt->len += t.payload;
+        f->pkt->data[f->l3_len + 13] |= t.flags & TCP_PSH;
+        f->next_seq += (uint32_t)t.payload;
+        f->segments++;
+        // A short or pushed segment ends the burst, and a full-sized one
+        // may not fit
+        if ((t.flags & TCP_PSH) || t.payload < f->seg_size || f->pkt->len + f->seg_size > VNET_MAX_PACKET) {
+            flush_flow(g, f);
+        }
+        return;
+    }
+    // Keep the flow's segments in order
+    if (f) {
+        flush_flow(g, f);
+        free_flow = f;
+    }
+
+    // Only plain full segments start a merge
+    pktbuf_t *held = NULL;
+    if (t.flags == TCP_ACK && t.payload > 0) {
+        if (!free_flow) {
+            free_flow = &g->flows[g->next_evict++ % VNET_GRO_FLOWS];
+            flush_flow(g, free_flow);
+        }
+        held = pktbuf_alloc(&g->pool);
+    }
+    if (!held) {
+        write_plain(g, pkt);
+        return;
+    }
+    memcpy(held->data, pkt->data, pkt->len);
+    held->len = pkt->len;
+    const uint8_t *th = pkt->data + t.l3_len;
+    free_flow->pkt = held;
+    free_flow->l3_len = t.l3_len;
+    free_flow->hdr_len = t.hdr_len;
+    free_flow->seg_size = t.payload;
+    free_flow->next_seq = ((uint32_t)th[4] << 24 | (uint32_t)th[5] << 16 | (uint32_t)th[6] << 8 | th[7]) + (uint32_t)t.payload;
+    free_flow->segments = 1;
+}
+
+void vnet_gro_flush(vnet_gro_t *g) {
+    for (int i = 0; i < VNET_GRO_FLOWS; i++) {
+        if (g->flows[i].pkt) flush_flow(g, &g->flows[i]);
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef VNET_H
+#define VNET_H
+
+#include <linux/virtio_net.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pktbuf.h"
+
+// TUN offloads through the virtio-net header (IFF_VNET_HDR).
+//
+// With TSO/USO turned on (TUNSETOFFLOAD), the kernel stops segmenting
+// TCP and UDP for the TUN device and hands us super-packets of up to
+// 64 KB, each behind a struct virtio_net_hdr saying how to cut it up.
+// vnet_segment does that cut in userspace, into packets small enough for
+// one tunnel datagram each, and fills in the checksums the kernel left
+// out.
+//
+// In the other direction every write needs the header too. vnet_gro_t
+// merges consecutive TCP segments of a flow written in the same wakeup
+// back into one super-packet (like GRO on a NIC), so the kernel
+// processes one large packet instead of dozens of small ones.
+//
+// The header is in host byte order (legacy virtio), as TUN uses unless
+// told otherwise.
+
+#define VNET_HDR_LEN sizeof(struct virtio_net_hdr)
+#define VNET_MAX_PACKET 65535                  // IP packet
+#define VNET_READ_SIZE (VNET_HDR_LEN + VNET_MAX_PACKET)
+#define VNET_GRO_FLOWS 8                       // flows merged at once
+
+// Set the header size and turn on checksum, TSO and (if the kernel has
+// it) USO offload on a TUN fd opened with IFF_VNET_HDR. *uso tells
+// whether USO was accepted. Returns -1 if the header cannot be used.
+int vnet_enable(int tun_fd, bool *uso);
+
+// One packet cut from a super-packet: a view into the read buffer, valid
+// until the callback returns
+typedef void (*vnet_emit_fn)(void *arg, pktbuf_t *pkt);
+
+// Split what a read from the TUN fd returned (header and packet) into
+// packets of at most max_len bytes and emit them in order. Segments are
+// built in place, so buf is overwritten. Returns the number of packets
+// emitted, or -1 if the header does not describe the packet.
+int vnet_segment(uint8_t *buf, size_t len, size_t max_len, vnet_emit_fn emit, void *arg);
+
+// Write one packet with its header to the TUN fd
+typedef void (*vnet_write_fn)(void *arg, const struct virtio_net_hdr *hdr, pktbuf_t *pkt);
+
+typedef struct {
+    pktbuf_t *pkt;               // merged packet so far, NULL if the slot is free
+    size_t l3_len;               // IP header
+    size_t hdr_len;              // IP and TCP headers
+    size_t seg_size;             // payload of each segment but the last
+    uint32_t next_seq;
+    unsigned segments;
+} vnet_gro_flow_t;
+
+typedef struct {
+    vnet_gro_flow_t flows[VNET_GRO_FLOWS];
+    unsigned next_evict;
+    pktbuf_pool_t pool;          // buffers for merged packets
+    vnet_write_fn write;
+    void *arg;
+} vnet_gro_t;
+
+// buffers is how many merged packets may exist at once, including those
+// still being written
+int vnet_gro_init(vnet_gro_t *g, size_t buffers, vnet_write_fn write, void *arg);
+void vnet_gro_free(vnet_gro_t *g);
+
+// Write pkt, or keep a copy of it to merge with the flow's next segments.
+// Packets that cannot be merged are written right away, after anything
+// held for the same flow.
+void vnet_gro_add(vnet_gro_t *g, pktbuf_t *pkt);
+
+// Write everything held (at the end of each wakeup)
+void vnet_gro_flush(vnet_gro_t *g);
+
+#endif